@@ -0,0 +1,821 @@
+//======================================================//
+// Name: modbusBench.c
+// Purpose: Loopback benchmark for the modbus driver. Runs
+// a simulated Modbus TCP server in-process and drives
+// the client API against it
+//======================================================//
+/*
+Build it with the driver sources and libCom, e.g.
+	gcc -O2 -pthread -I.. -I$(EPICS_BASE)/include -I$(EPICS_BASE)/include/os/Linux \
+		-I$(EPICS_BASE)/include/compiler/gcc modbusBench.c ../drvModbus*.c -L$(EPICS_BASE)/lib/linux-x86_64 -lCom
+Devices always talk to port 502, so every simulated device gets its own loopback address (127.0.1.1 and up,
+see -a) instead of its own port. Binding port 502 needs root, or CAP_NET_BIND_SERVICE.
+
+Options:
+	-t seconds	length of each run (default 2)
+	-l us		response latency of the server (default 0)
+	-j us		extra random latency, 0 to us (default 0)
+	-e rate		fraction of requests answered with an exception (default 0)
+	-u units	unit IDs per simulated device (default 1)
+	-d list		device counts to run with (default 1,16,64)
+	-w list		requests in flight per device (default 1,8,32). For async, cut down so the units of a
+			device fit in its window of at most MODBUS_MAX_INFLIGHT. The depth column shows what ran
+	-b list		registers (or coils) per request (default 1,16,125)
+	-o list		operations: hr (modbus_ReadHoldingRegisters), coils (modbus_ReadCoils),
+			wsr (modbus_WriteSingleRegister), async (modbus_SubmitRequest reads) (default hr,async)
+	-a addr		first loopback address to listen on (default 127.0.1.1)
+	-n engines	engine threads the devices are spread over, see modbus_SetEngineThreads (default 1)
+	-p list		CPUs to pin the engine threads to, one per engine (default unpinned)
+	-i		do engine I/O through io_uring, see modbus_SetEngineBackend (default epoll)
+
+Each line of output is one run: transactions/sec, client-side latency percentiles, and heap allocations per
+transaction. Allocations are counted by wrapping malloc, which needs glibc.
+*/
+#define _GNU_SOURCE
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* EPICS includes */
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
+
+#define BENCH_MAX_DEVICES 256
+#define BENCH_MAX_LIST 16
+#define BENCH_MAX_THREADS 512
+#define BENCH_DELAYED 65536
+#define BENCH_BUCKETS 256
+
+//======================================================//
+// ALLOCATION COUNTING
+//======================================================//
+
+static int g_Allocs = 0;
+
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t n);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t n);
+
+void* malloc(size_t n)
+{
+	epicsAtomicIncrIntT(&g_Allocs);
+	return __libc_malloc(n);
+}
+
+void* calloc(size_t n, size_t size)
+{
+	epicsAtomicIncrIntT(&g_Allocs);
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t n)
+{
+	epicsAtomicIncrIntT(&g_Allocs);
+	return __libc_realloc(p, n);
+}
+#endif
+
+//======================================================//
+// LATENCY HISTOGRAM. Same bucketing as modbus_stats_t,
+// in ns instead of us so loopback times still resolve
+//======================================================//
+
+typedef struct
+{
+	epicsUInt64 count;
+	epicsUInt64 buckets[BENCH_BUCKETS];
+} bench_hist_t;
+
+static int bench_Bucket(epicsUInt64 ns)
+{
+	if(ns < 8)
+		return (int)ns;
+	int msb = 63 - __builtin_clzll(ns);
+	int bucket = (msb - 2) * 8 + (int)((ns >> (msb - 3)) & 7);
+	return bucket < BENCH_BUCKETS ? bucket : BENCH_BUCKETS - 1;
+}
+
+static double bench_BucketStart(int bucket)
+{
+	if(bucket < 8)
+		return bucket;
+	return (double)((uint64_t)(8 + bucket % 8) << (bucket / 8 - 1));
+}
+
+static void bench_Record(bench_hist_t* hist, epicsUInt64 ns)
+{
+	hist->count++;
+	hist->buckets[bench_Bucket(ns)]++;
+}
+
+static void bench_Merge(bench_hist_t* pOut, const bench_hist_t* pIn)
+{
+	pOut->count += pIn->count;
+	for(int i = 0; i < BENCH_BUCKETS; i++)
+		pOut->buckets[i] += pIn->buckets[i];
+}
+
+/* Returns the percentile in us */
+static double bench_Percentile(const bench_hist_t* hist, double pct)
+{
+	if(hist->count == 0)
+		return 0;
+	epicsUInt64 rank = (epicsUInt64)(pct / 100.0 * hist->count + 0.999999);
+	epicsUInt64 seen = 0;
+	for(int b = 0; b < BENCH_BUCKETS; b++)
+	{
+		seen += hist->buckets[b];
+		if(seen >= rank)
+			return (bench_BucketStart(b) + bench_BucketStart(b + 1)) / 2 / 1e3;
+	}
+	return bench_BucketStart(BENCH_BUCKETS) / 1e3;
+}
+
+//======================================================//
+// SIMULATED SERVER. One thread, every connection on one
+// epoll. Delayed responses wait in a heap by due time
+//======================================================//
+
+typedef struct
+{
+	int fd;
+	size_t rx_len;
+	uint8_t rx[4096];
+	size_t tx_len;
+	uint8_t tx[65536];
+} bench_sconn_t;
+
+typedef struct
+{
+	epicsUInt64 due;
+	bench_sconn_t* conn;
+	uint16_t len;
+	uint8_t data[MODBUS_MAX_ADU];
+} bench_delayed_t;
+
+typedef struct
+{
+	int epfd;
+	int nlisten;
+	int listen_fds[BENCH_MAX_DEVICES];
+	double latency_us;
+	double jitter_us;
+	double exception_rate;
+	unsigned seed;
+	int stop;
+	epicsThreadId thread;
+	epicsEventId exit_event;
+	int ndelayed;
+	bench_delayed_t* delayed[BENCH_DELAYED];
+	bench_delayed_t* delayed_free[BENCH_DELAYED];
+	int nfree;
+	int overflowed; /* Warned that the pool ran out */
+} bench_server_t;
+
+static bench_server_t g_Server;
+
+static void bench_HeapUp(bench_server_t* s, int i)
+{
+	bench_delayed_t* d = s->delayed[i];
+	while(i > 0 && s->delayed[(i - 1) / 2]->due > d->due)
+	{
+		s->delayed[i] = s->delayed[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->delayed[i] = d;
+}
+
+static void bench_HeapDown(bench_server_t* s, int i)
+{
+	bench_delayed_t* d = s->delayed[i];
+	while(1)
+	{
+		int child = 2 * i + 1;
+		if(child >= s->ndelayed)
+			break;
+		if(child + 1 < s->ndelayed && s->delayed[child + 1]->due < s->delayed[child]->due)
+			child++;
+		if(d->due <= s->delayed[child]->due)
+			break;
+		s->delayed[i] = s->delayed[child];
+		i = child;
+	}
+	s->delayed[i] = d;
+}
+
+/* Sends what's buffered for a connection. Whatever doesn't fit waits for EPOLLOUT */
+static void bench_ServerFlush(bench_server_t* s, bench_sconn_t* c)
+{
+	while(c->tx_len > 0)
+	{
+		ssize_t n = send(c->fd, c->tx, c->tx_len, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		memmove(c->tx, c->tx + n, c->tx_len - n);
+		c->tx_len -= n;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (c->tx_len ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void bench_ServerQueue(bench_sconn_t* c, const uint8_t* pAdu, size_t nLen)
+{
+	if(c->tx_len + nLen > sizeof(c->tx))
+		return;
+	memcpy(c->tx + c->tx_len, pAdu, nLen);
+	c->tx_len += nLen;
+}
+
+/* Builds the response to one request ADU. Registers read back as address + unit, coils as address % 3 == 0 */
+static size_t bench_Respond(bench_server_t* s, const uint8_t* pReq, size_t nReq, uint8_t* pOut)
+{
+	(void)nReq;
+	const uint8_t* pdu = pReq + 7;
+	uint8_t unit = pReq[6];
+	uint8_t fc = pdu[0];
+	uint16_t addr = (pdu[1] << 8) | pdu[2];
+	uint16_t count = (pdu[3] << 8) | pdu[4];
+	uint8_t* r = pOut + 7;
+	size_t len;
+
+	if(s->exception_rate > 0 && rand_r(&s->seed) < s->exception_rate * RAND_MAX)
+	{
+		r[0] = fc | MB_ERRCODE_OFFSET;
+		r[1] = MODBUS_ERR_DEVICE_BUSY;
+		len = 2;
+	}
+	else if(fc == MB_RD_HOL_REG_CODE || fc == MB_RD_INP_REG_CODE)
+	{
+		if(count > MODBUS_MAX_READ_REGS)
+			count = MODBUS_MAX_READ_REGS;
+		r[0] = fc;
+		r[1] = (uint8_t)(count * 2);
+		for(int i = 0; i < count; i++)
+		{
+			uint16_t v = (uint16_t)(addr + i + unit);
+			r[2 + 2 * i] = v >> 8;
+			r[3 + 2 * i] = v & 0xFF;
+		}
+		len = 2 + count * 2;
+	}
+	else if(fc == MB_RD_COILS_CODE || fc == MB_RD_DISC_INPUTS_CODE)
+	{
+		if(count > MODBUS_MAX_READ_BITS)
+			count = MODBUS_MAX_READ_BITS;
+		r[0] = fc;
+		r[1] = (uint8_t)((count + 7) / 8);
+		memset(r + 2, 0, r[1]);
+		for(int i = 0; i < count; i++)
+			if((addr + i) % 3 == 0)
+				r[2 + i / 8] |= 1 << (i % 8);
+		len = 2 + r[1];
+	}
+	else if(fc == MB_WR_SIN_REG_CODE || fc == MB_WR_SIN_COIL_CODE || fc == MB_WR_MULT_REG_CODE ||
+		fc == MB_WR_MUL_COIL_CODE)
+	{
+		memcpy(r, pdu, 5);
+		len = 5;
+	}
+	else
+	{
+		r[0] = fc | MB_ERRCODE_OFFSET;
+		r[1] = MODBUS_ERR_ILLEGAL_FUNCTION;
+		len = 2;
+	}
+	memcpy(pOut, pReq, 4);
+	pOut[4] = (len + 1) >> 8;
+	pOut[5] = (len + 1) & 0xFF;
+	pOut[6] = unit;
+	return len + 7;
+}
+
+static void bench_ServerRead(bench_server_t* s, bench_sconn_t* c)
+{
+	while(1)
+	{
+		ssize_t n = recv(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if(n <= 0)
+		{
+			epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+			close(c->fd);
+			c->fd = -1;
+			return;
+		}
+		c->rx_len += n;
+
+		size_t off = 0;
+		while(c->rx_len - off >= 7)
+		{
+			size_t len = ((c->rx[off + 4] << 8) | c->rx[off + 5]) + 6;
+			if(c->rx_len - off < len)
+				break;
+			uint8_t out[MODBUS_MAX_ADU];
+			size_t outLen = bench_Respond(s, c->rx + off, len, out);
+			off += len;
+			double delay = s->latency_us;
+			if(s->jitter_us > 0)
+				delay += s->jitter_us * rand_r(&s->seed) / RAND_MAX;
+			if(delay > 0 && s->nfree == 0 && !s->overflowed)
+			{
+				s->overflowed = 1;
+				fprintf(stderr, "Warning: more than %d responses waiting, the rest go out without latency\n", BENCH_DELAYED);
+			}
+			if(delay <= 0 || s->nfree == 0)
+			{
+				bench_ServerQueue(c, out, outLen);
+				continue;
+			}
+			bench_delayed_t* d = s->delayed_free[--s->nfree];
+			d->due = epicsMonotonicGet() + (epicsUInt64)(delay * 1e3);
+			d->conn = c;
+			d->len = (uint16_t)outLen;
+			memcpy(d->data, out, outLen);
+			s->delayed[s->ndelayed] = d;
+			bench_HeapUp(s, s->ndelayed++);
+		}
+		memmove(c->rx, c->rx + off, c->rx_len - off);
+		c->rx_len -= off;
+	}
+	bench_ServerFlush(s, c);
+}
+
+/* Sends every delayed response that's due. Returns ms until the next one, -1 if there's none */
+static int bench_ServerDue(bench_server_t* s)
+{
+	epicsUInt64 now = epicsMonotonicGet();
+	while(s->ndelayed > 0 && s->delayed[0]->due <= now)
+	{
+		bench_delayed_t* d = s->delayed[0];
+		s->delayed[0] = s->delayed[--s->ndelayed];
+		if(s->ndelayed)
+			bench_HeapDown(s, 0);
+		if(d->conn->fd >= 0)
+		{
+			bench_ServerQueue(d->conn, d->data, d->len);
+			bench_ServerFlush(s, d->conn);
+		}
+		s->delayed_free[s->nfree++] = d;
+	}
+	if(s->ndelayed == 0)
+		return 100;
+	/* Round down, then spin on the last ms, as epoll can't sleep for less */
+	return (int)((s->delayed[0]->due - now) / 1000000);
+}
+
+static void bench_ServerThread(void* pArg)
+{
+	bench_server_t* s = pArg;
+	struct epoll_event events[256];
+	while(!epicsAtomicGetIntT(&s->stop))
+	{
+		int n = epoll_wait(s->epfd, events, 256, bench_ServerDue(s));
+		for(int i = 0; i < n; i++)
+		{
+			void* ptr = events[i].data.ptr;
+			if((uintptr_t)ptr < BENCH_MAX_DEVICES)
+			{
+				int fd = accept(s->listen_fds[(uintptr_t)ptr], NULL, NULL);
+				if(fd < 0)
+					continue;
+				bench_sconn_t* c = calloc(1, sizeof(bench_sconn_t));
+				c->fd = fd;
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				int flag = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+				struct epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+				continue;
+			}
+			bench_sconn_t* c = ptr;
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				bench_ServerRead(s, c);
+			if(c->fd >= 0 && (events[i].events & EPOLLOUT))
+				bench_ServerFlush(s, c);
+		}
+	}
+	epicsEventSignal(s->exit_event);
+}
+
+/* Listens on nDevices loopback addresses, starting at base. Returns 0 if OK */
+static int bench_StartServer(bench_server_t* s, struct in_addr base, int nDevices)
+{
+	s->epfd = epoll_create1(0);
+	s->seed = 1;
+	for(int i = 0; i < BENCH_DELAYED / 4; i++)
+		s->delayed_free[s->nfree++] = malloc(sizeof(bench_delayed_t));
+	for(int i = 0; i < nDevices; i++)
+	{
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(MODBUS_PORT);
+		addr.sin_addr.s_addr = htonl(ntohl(base.s_addr) + i);
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int yes = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0)
+		{
+			perror("Failed to listen for the simulated devices");
+			close(fd);
+			return -1;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		s->listen_fds[s->nlisten] = fd;
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = (void*)(uintptr_t)s->nlisten++;
+		epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+	s->exit_event = epicsEventMustCreate(epicsEventEmpty);
+	s->thread = epicsThreadCreate("benchServer", epicsThreadPriorityHigh,
+		epicsThreadGetStackSize(epicsThreadStackMedium), bench_ServerThread, s);
+	return s->thread ? 0 : -1;
+}
+
+//======================================================//
+// CLIENT DRIVERS
+//======================================================//
+
+typedef enum { BENCH_HR, BENCH_COILS, BENCH_WSR, BENCH_ASYNC } bench_op_t;
+
+typedef struct
+{
+	bench_op_t op;
+	int block;
+	int ndevices;
+	int units; /* Devices in a row that share a gateway */
+	int depth; /* Requests actually kept in flight per device, see bench_Run */
+	modbus_device_t** devices;
+	epicsUInt64 end;
+	int stop;
+	int errors;
+	int rejected; /* Async resubmits turned away by a full window */
+	int allocs; /* Made while the run was going, not counting its own setup */
+} bench_run_t;
+
+typedef struct
+{
+	bench_run_t* run;
+	int index; /* Keeps threads on the same device off each other's addresses, so reads don't merge */
+	modbus_device_t* device;
+	bench_hist_t hist;
+	epicsUInt64 done;
+	epicsEventId exit_event;
+} bench_worker_t;
+
+static void bench_SyncThread(void* pArg)
+{
+	bench_worker_t* w = pArg;
+	bench_run_t* run = w->run;
+	uint16_t regs[MODBUS_MAX_READ_REGS];
+	uint8_t coils[MODBUS_MAX_READ_BITS / 8 + 1];
+	uint16_t addr = (uint16_t)(w->index * 256);
+	while(!epicsAtomicGetIntT(&run->stop))
+	{
+		epicsUInt64 start = epicsMonotonicGet();
+		int status;
+		if(run->op == BENCH_HR)
+		{
+			uint16_t n;
+			status = modbus_ReadHoldingRegisters(w->device, addr, (uint16_t)run->block, regs, &n);
+		}
+		else if(run->op == BENCH_COILS)
+		{
+			uint8_t n;
+			status = modbus_ReadCoils(w->device, addr, (uint16_t)run->block, coils, &n);
+		}
+		else
+			status = modbus_WriteSingleRegister(w->device, addr, (uint16_t)w->done);
+		epicsUInt64 now = epicsMonotonicGet();
+		if(status != 0)
+			epicsAtomicIncrIntT(&run->errors);
+		bench_Record(&w->hist, now - start);
+		w->done++;
+		if(now >= run->end)
+			break;
+	}
+	epicsEventSignal(w->exit_event);
+}
+
+/* One request kept in flight on a device. Resubmits itself from the completion until the run ends */
+typedef struct
+{
+	bench_run_t* run;
+	bench_worker_t* worker; /* Shared by every slot on the device. Only the engine thread touches it */
+	modbus_device_t* device;
+	uint8_t pdu[5];
+	epicsUInt64 start;
+	int* outstanding;
+} bench_slot_t;
+
+static void bench_AsyncCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+{
+	(void)pPdu;
+	(void)nLen;
+	bench_slot_t* slot = pUser;
+	epicsUInt64 now = epicsMonotonicGet();
+	if(status != 0)
+		epicsAtomicIncrIntT(&slot->run->errors);
+	bench_Record(&slot->worker->hist, now - slot->start);
+	slot->worker->done++;
+	if(now < slot->run->end)
+	{
+		slot->start = now;
+		if(modbus_SubmitRequest(slot->device, slot->pdu, sizeof(slot->pdu), bench_AsyncCompletion, slot) >= 0)
+			return;
+		epicsAtomicIncrIntT(&slot->run->rejected);
+	}
+	epicsAtomicDecrIntT(slot->outstanding);
+}
+
+/* Does one run. Returns the transaction count, and fills in the latency histogram */
+static epicsUInt64 bench_Run(bench_run_t* run, int depth, double seconds, bench_hist_t* pHist)
+{
+	int nWorkers = run->op == BENCH_ASYNC ? run->ndevices : run->ndevices * depth;
+	if(nWorkers > BENCH_MAX_THREADS)
+		nWorkers = BENCH_MAX_THREADS;
+	bench_worker_t* workers = calloc(nWorkers, sizeof(bench_worker_t));
+	bench_slot_t* slots = NULL;
+	int outstanding = 0;
+	int window = depth < MODBUS_MAX_INFLIGHT ? depth : MODBUS_MAX_INFLIGHT;
+	for(int i = 0; i < run->ndevices; i++)
+		modbus_SetWindow(run->devices[i], window);
+	/* Units behind a gateway share its connection's window. Any more slots than fit in it would have their */
+	/* resubmits turned away, since the engine thread can't wait for room */
+	run->depth = depth;
+	if(run->op == BENCH_ASYNC)
+	{
+		run->depth = window / run->units;
+		if(run->depth < 1)
+			run->depth = 1;
+	}
+
+	run->end = epicsMonotonicGet() + (epicsUInt64)(seconds * 1e9);
+	run->stop = 0;
+	for(int i = 0; i < nWorkers; i++)
+	{
+		workers[i].run = run;
+		workers[i].index = i / run->ndevices;
+		workers[i].device = run->devices[i % run->ndevices];
+		workers[i].exit_event = epicsEventMustCreate(epicsEventEmpty);
+	}
+	if(run->op == BENCH_ASYNC)
+	{
+		slots = calloc(run->ndevices * run->depth, sizeof(bench_slot_t));
+		outstanding = run->ndevices * run->depth;
+		for(int i = 0; i < run->ndevices * run->depth; i++)
+		{
+			bench_slot_t* slot = &slots[i];
+			slot->run = run;
+			slot->worker = &workers[i % run->ndevices];
+			slot->device = run->devices[i % run->ndevices];
+			slot->outstanding = &outstanding;
+			uint16_t addr = (uint16_t)((i / run->ndevices) * 256);
+			slot->pdu[0] = MB_RD_HOL_REG_CODE;
+			slot->pdu[1] = addr >> 8;
+			slot->pdu[2] = addr & 0xFF;
+			slot->pdu[3] = 0;
+			slot->pdu[4] = (uint8_t)run->block;
+			slot->start = epicsMonotonicGet();
+			if(modbus_SubmitRequest(slot->device, slot->pdu, sizeof(slot->pdu), bench_AsyncCompletion, slot) < 0)
+				epicsAtomicDecrIntT(&outstanding);
+		}
+		int allocs = epicsAtomicGetIntT(&g_Allocs);
+		while(epicsAtomicGetIntT(&outstanding) > 0)
+			epicsThreadSleep(0.01);
+		run->allocs = epicsAtomicGetIntT(&g_Allocs) - allocs;
+	}
+	else
+	{
+		for(int i = 0; i < nWorkers; i++)
+			epicsThreadCreate("benchClient", epicsThreadPriorityMedium, epicsThreadGetStackSize(epicsThreadStackMedium),
+				bench_SyncThread, &workers[i]);
+		int allocs = epicsAtomicGetIntT(&g_Allocs);
+		for(int i = 0; i < nWorkers; i++)
+			epicsEventMustWait(workers[i].exit_event);
+		run->allocs = epicsAtomicGetIntT(&g_Allocs) - allocs;
+	}
+	epicsAtomicSetIntT(&run->stop, 1);
+
+	epicsUInt64 total = 0;
+	memset(pHist, 0, sizeof(bench_hist_t));
+	for(int i = 0; i < nWorkers; i++)
+	{
+		total += workers[i].done;
+		bench_Merge(pHist, &workers[i].hist);
+		epicsEventDestroy(workers[i].exit_event);
+	}
+	free(slots);
+	free(workers);
+	return total;
+}
+
+//======================================================//
+// MAIN
+//======================================================//
+
+static int bench_ParseList(const char* pArg, int* pOut)
+{
+	int n = 0;
+	char* copy = strdup(pArg);
+	for(char* tok = strtok(copy, ","); tok && n < BENCH_MAX_LIST; tok = strtok(NULL, ","))
+		pOut[n++] = atoi(tok);
+	free(copy);
+	return n;
+}
+
+static const char* bench_OpName(bench_op_t op)
+{
+	switch(op)
+	{
+		case BENCH_HR: return "hr";
+		case BENCH_COILS: return "coils";
+		case BENCH_WSR: return "wsr";
+		default: return "async";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	double seconds = 2;
+	int units = 1;
+	int devs[BENCH_MAX_LIST] = {1, 16, 64}, nDevs = 3;
+	int depths[BENCH_MAX_LIST] = {1, 8, 32}, nDepths = 3;
+	int blocks[BENCH_MAX_LIST] = {1, 16, 125}, nBlocks = 3;
+	bench_op_t ops[BENCH_MAX_LIST] = {BENCH_HR, BENCH_ASYNC};
+	int nOps = 2;
+	int engines = 1;
+	int cpus[BENCH_MAX_LIST], nCpus = 0;
+	int backend = MODBUS_BACKEND_POLL;
+	struct in_addr base;
+	inet_aton("127.0.1.1", &base);
+
+	int c;
+	while((c = getopt(argc, argv, "t:l:j:e:u:d:w:b:o:a:n:p:i")) != -1)
+	{
+		switch(c)
+		{
+			case 't': seconds = atof(optarg); break;
+			case 'l': g_Server.latency_us = atof(optarg); break;
+			case 'j': g_Server.jitter_us = atof(optarg); break;
+			case 'e': g_Server.exception_rate = atof(optarg); break;
+			case 'u': units = atoi(optarg); break;
+			case 'd': nDevs = bench_ParseList(optarg, devs); break;
+			case 'w': nDepths = bench_ParseList(optarg, depths); break;
+			case 'b': nBlocks = bench_ParseList(optarg, blocks); break;
+			case 'n': engines = atoi(optarg); break;
+			case 'p': nCpus = bench_ParseList(optarg, cpus); break;
+			case 'i': backend = MODBUS_BACKEND_URING; break;
+			case 'a':
+				if(!inet_aton(optarg, &base))
+				{
+					fprintf(stderr, "Bad address %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'o':
+			{
+				nOps = 0;
+				char* copy = strdup(optarg);
+				for(char* tok = strtok(copy, ","); tok && nOps < BENCH_MAX_LIST; tok = strtok(NULL, ","))
+				{
+					if(!strcmp(tok, "hr")) ops[nOps++] = BENCH_HR;
+					else if(!strcmp(tok, "coils")) ops[nOps++] = BENCH_COILS;
+					else if(!strcmp(tok, "wsr")) ops[nOps++] = BENCH_WSR;
+					else if(!strcmp(tok, "async")) ops[nOps++] = BENCH_ASYNC;
+					else fprintf(stderr, "Unknown operation %s\n", tok);
+				}
+				free(copy);
+				break;
+			}
+			default:
+				fprintf(stderr, "usage: %s [-t s] [-l us] [-j us] [-e rate] [-u units] [-d list] [-w list] "
+					"[-b list] [-o hr,coils,wsr,async] [-a addr] [-n engines] [-p cpus] [-i]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	int maxDevs = 0;
+	for(int i = 0; i < nDevs; i++)
+	{
+		if(devs[i] < 1 || devs[i] * units > BENCH_MAX_DEVICES)
+		{
+			fprintf(stderr, "Device count %d (times %d units) is out of range\n", devs[i], units);
+			return 1;
+		}
+		if(devs[i] > maxDevs)
+			maxDevs = devs[i];
+	}
+
+	if(nCpus && nCpus != engines)
+	{
+		fprintf(stderr, "Need one CPU per engine\n");
+		return 1;
+	}
+	if(modbus_SetEngineThreads(engines, nCpus ? cpus : NULL) != 0)
+	{
+		fprintf(stderr, "Engine count %d is out of range\n", engines);
+		return 1;
+	}
+	if(modbus_SetEngineBackend(backend) != 0)
+	{
+		fprintf(stderr, "io_uring isn't built in\n");
+		return 1;
+	}
+	modbus_Init();
+	if(bench_StartServer(&g_Server, base, maxDevs) != 0)
+		return 1;
+
+	/* Every unit of every simulated device, gateway by gateway */
+	modbus_device_t* all[BENCH_MAX_DEVICES];
+	for(int i = 0; i < maxDevs; i++)
+	{
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(ntohl(base.s_addr) + i);
+		for(int u = 0; u < units; u++)
+		{
+			all[i * units + u] = modbus_CreateUnit(&addr, (uint8_t)(units == 1 ? MODBUS_DEFAULT_UNIT : u + 1));
+			if(!all[i * units + u])
+			{
+				fprintf(stderr, "Failed to create device %d unit %d\n", i, u);
+				return 1;
+			}
+		}
+	}
+
+	printf("latency %.0f us, jitter %.0f us, exceptions %.3f, %d unit(s) per device, %.1f s per run\n",
+		g_Server.latency_us, g_Server.jitter_us, g_Server.exception_rate, units, seconds);
+	printf("%-6s %5s %5s %5s %12s %10s %10s %10s %10s %8s\n", "op", "devs", "depth", "block", "tx/s", "p50 us",
+		"p99 us", "p999 us", "allocs/tx", "errors");
+	for(int o = 0; o < nOps; o++)
+	for(int d = 0; d < nDevs; d++)
+	for(int w = 0; w < nDepths; w++)
+	for(int b = 0; b < nBlocks; b++)
+	{
+		bench_op_t op = ops[o];
+		/* Writes are a single register whatever the block size */
+		if(op == BENCH_WSR && b > 0)
+			continue;
+		int block = blocks[b];
+		if(block < 1 || block > (op == BENCH_COILS ? 255 : MODBUS_MAX_READ_REGS))
+			continue;
+
+		bench_run_t run;
+		memset(&run, 0, sizeof(run));
+		run.op = op;
+		run.block = block;
+		run.ndevices = devs[d] * units;
+		run.units = units;
+		run.devices = all;
+
+		/* Short warm up, so connections are open and pools are primed before counting */
+		bench_hist_t hist;
+		bench_Run(&run, depths[w], 0.1, &hist);
+		run.errors = 0;
+		run.rejected = 0;
+		epicsUInt64 start = epicsMonotonicGet();
+		epicsUInt64 total = bench_Run(&run, depths[w], seconds, &hist);
+		double elapsed = (epicsMonotonicGet() - start) / 1e9;
+		double perTx = total ? (double)run.allocs / total : 0;
+		printf("%-6s %5d %5d %5d %12.0f %10.1f %10.1f %10.1f %10.4f %8d\n", bench_OpName(op), run.ndevices,
+			run.depth, op == BENCH_WSR ? 1 : block, total / elapsed, bench_Percentile(&hist, 50),
+			bench_Percentile(&hist, 99), bench_Percentile(&hist, 99.9), perTx, run.errors);
+		if(run.rejected)
+			fprintf(stderr, "Warning: %d resubmits were turned away by a full window\n", run.rejected);
+		fflush(stdout);
+	}
+
+	for(int i = 0; i < maxDevs * units; i++)
+		modbus_DestroyDevice(all[i]);
+	epicsAtomicSetIntT(&g_Server.stop, 1);
+	epicsEventMustWait(g_Server.exit_event);
+	return 0;
+}
@@ -0,0 +1,400 @@
+//======================================================//
+// Name: modbusMicro.c
+// Purpose: Microbenchmarks for the per-packet CPU cost of
+// the driver: framing, MBAP parsing, register swaps, coil
+// unpacking, change masks and typed decode
+//======================================================//
+/*
+Build it with the driver sources and libCom, e.g.
+	gcc -O2 -pthread -I.. -I$(EPICS_BASE)/include -I$(EPICS_BASE)/include/os/Linux \
+		-I$(EPICS_BASE)/include/compiler/gcc modbusMicro.c ../drvModbus*.c -L$(EPICS_BASE)/lib/linux-x86_64 -lCom
+
+Options:
+	-t seconds	time spent on each kernel (default 0.5)
+	-g GHz		clock to turn ns into cycles with. Only needed where there's no cycle counter to read
+	-s file		save the results, to compare later runs against
+	-c file		compare against results saved with -s. Exits with 1 if any kernel got slower
+	-r percent	how much slower than the saved results a kernel can get before -c fails (default 10)
+
+Each line of output is one kernel: ns per call, the bytes each call handles, and bytes per cycle.
+On x86, cycles are TSC ticks, which only match core cycles when the clock isn't boosting or throttling.
+Each kernel is timed several times and the fastest one is reported, since that's the least disturbed.
+*/
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* EPICS includes */
+#include <epicsTime.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICRO_HAVE_TSC
+#endif
+
+#define MICRO_REPEATS 5
+#define MICRO_MAX_KERNELS 16
+#define MICRO_FLOAT_FIELDS 62
+
+/* Keeps the compiler from dropping work whose result is never looked at */
+#define MICRO_USE(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+typedef struct
+{
+	const char* pName;
+	size_t nBytes; /* Bytes each call handles */
+	void (*fn)(size_t nIters);
+} micro_kernel_t;
+
+typedef struct
+{
+	char name[32];
+	double ns;
+} micro_result_t;
+
+/* Inputs, set up once by micro_Setup */
+static uint8_t g_Pdu[MODBUS_MAX_PDU];
+static uint8_t g_Adu[MODBUS_MAX_PDU + sizeof(modbus_mbap_header_t)];
+static uint8_t g_Wire[2 * MODBUS_MAX_READ_REGS];
+static uint16_t g_Regs[MODBUS_MAX_READ_REGS];
+static uint16_t g_Scan[MODBUS_MAX_READ_REGS]; /* g_Regs with a few of them changed */
+static epicsUInt32 g_Mask[(MODBUS_MAX_READ_REGS + 31) / 32];
+static uint8_t g_Packed[MODBUS_MAX_READ_BITS / 8];
+static uint8_t g_Coils[MODBUS_MAX_READ_BITS];
+static double g_Values[MICRO_FLOAT_FIELDS];
+static modbus_conn_t* g_Conn;
+static size_t g_RingFrames; /* Read responses laid end to end in g_Conn's receive ring */
+static size_t g_RingFill;
+static modbus_layout_t* g_LayoutAbcd;
+static modbus_layout_t* g_LayoutCdab;
+
+//======================================================//
+// KERNELS
+//======================================================//
+
+/* A read request, the most common thing sent */
+static void micro_ConstructRead(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		size_t len = sizeof(g_Adu);
+		modbus_ConstructPacket(g_Pdu, 5, g_Adu, &len, (uint16_t)i, 1);
+		MICRO_USE(g_Adu);
+	}
+}
+
+/* A full-size write */
+static void micro_ConstructWrite(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		size_t len = sizeof(g_Adu);
+		modbus_ConstructPacket(g_Pdu, MODBUS_MAX_PDU, g_Adu, &len, (uint16_t)i, 1);
+		MICRO_USE(g_Adu);
+	}
+}
+
+/* Finding each 125 register response in the receive ring */
+static void micro_ParseMbap(size_t nIters)
+{
+	modbus_rxring_t* ring = &g_Conn->rx;
+	for(size_t i = 0; i < nIters; i++)
+	{
+		if(ring->head == ring->tail)
+			ring->tail = 0;
+		const uint8_t* pAdu;
+		size_t len;
+		modbus_buf_t* buf;
+		if(modbus_RingPeekFrame(g_Conn, &pAdu, &len, &buf) != 1)
+			abort();
+		MICRO_USE(pAdu);
+		ring->tail += len;
+	}
+}
+
+static void micro_SwapRegs(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		modbus_RegistersFromWire(g_Wire, g_Regs, MODBUS_MAX_READ_REGS);
+		MICRO_USE(g_Regs);
+	}
+}
+
+static void micro_UnpackCoils(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		modbus_UnpackCoils(g_Packed, g_Coils, MODBUS_MAX_READ_BITS);
+		MICRO_USE(g_Coils);
+	}
+}
+
+/* Comparing one scan of a segment with the last */
+static void micro_DiffRegs(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		modbus_DiffRegisters(g_Regs, g_Scan, MODBUS_MAX_READ_REGS, g_Mask);
+		MICRO_USE(g_Mask);
+	}
+}
+
+static void micro_DecodeAbcd(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		modbus_DecodeWire(g_LayoutAbcd, g_Wire, 2 * MICRO_FLOAT_FIELDS, g_Values);
+		MICRO_USE(g_Values);
+	}
+}
+
+static void micro_DecodeCdab(size_t nIters)
+{
+	for(size_t i = 0; i < nIters; i++)
+	{
+		modbus_DecodeWire(g_LayoutCdab, g_Wire, 2 * MICRO_FLOAT_FIELDS, g_Values);
+		MICRO_USE(g_Values);
+	}
+}
+
+static const micro_kernel_t g_Kernels[] = {
+	{"construct-read", 5 + sizeof(modbus_mbap_header_t), micro_ConstructRead},
+	{"construct-write", MODBUS_MAX_PDU + sizeof(modbus_mbap_header_t), micro_ConstructWrite},
+	{"mbap-parse", 2 + 2 * MODBUS_MAX_READ_REGS + sizeof(modbus_mbap_header_t), micro_ParseMbap},
+	{"swap-125", 2 * MODBUS_MAX_READ_REGS, micro_SwapRegs},
+	{"unpack-2000", MODBUS_MAX_READ_BITS / 8, micro_UnpackCoils},
+	{"diff-125", 2 * MODBUS_MAX_READ_REGS, micro_DiffRegs},
+	{"float32-abcd", 4 * MICRO_FLOAT_FIELDS, micro_DecodeAbcd},
+	{"float32-cdab", 4 * MICRO_FLOAT_FIELDS, micro_DecodeCdab},
+};
+#define MICRO_NUM_KERNELS (int)(sizeof(g_Kernels) / sizeof(g_Kernels[0]))
+
+//======================================================//
+// SETUP
+//======================================================//
+
+static modbus_layout_t* micro_FloatLayout(uint8_t order)
+{
+	modbus_field_t fields[MICRO_FLOAT_FIELDS];
+	for(int i = 0; i < MICRO_FLOAT_FIELDS; i++)
+	{
+		fields[i].type = MODBUS_TYPE_FLOAT32;
+		fields[i].order = order;
+		fields[i].offset = 2 * i;
+		fields[i].scale = 0;
+	}
+	return modbus_CompileLayout(fields, MICRO_FLOAT_FIELDS);
+}
+
+static int micro_Setup(void)
+{
+	srand(1);
+	for(size_t i = 0; i < sizeof(g_Pdu); i++)
+		g_Pdu[i] = rand();
+	g_Pdu[0] = MB_RD_HOL_REG_CODE;
+	/* Floats that decode to ordinary numbers, not NaNs and denormals */
+	for(int i = 0; i < MODBUS_MAX_READ_REGS; i++)
+	{
+		float f = (float)(rand() % 100000) / 7.0f;
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		uint16_t reg = i % 2 ? bits & 0xFFFF : bits >> 16;
+		g_Wire[2 * i] = reg >> 8;
+		g_Wire[2 * i + 1] = reg & 0xFF;
+	}
+	for(size_t i = 0; i < sizeof(g_Packed); i++)
+		g_Packed[i] = rand();
+	modbus_RegistersFromWire(g_Wire, g_Regs, MODBUS_MAX_READ_REGS);
+	memcpy(g_Scan, g_Regs, sizeof(g_Scan));
+	for(int i = 3; i < MODBUS_MAX_READ_REGS; i += 10)
+		g_Scan[i]++;
+
+	g_LayoutAbcd = micro_FloatLayout(MODBUS_ORDER_ABCD);
+	g_LayoutCdab = micro_FloatLayout(MODBUS_ORDER_CDAB);
+	if(!g_LayoutAbcd || !g_LayoutCdab)
+		return -1;
+
+	/* Fill the ring with as many responses as fit without wrapping. Frames that wrap get copied out, */
+	/* which is rare enough on a real connection that it would only skew the number */
+	struct sockaddr_in none;
+	memset(&none, 0, sizeof(none));
+	g_Conn = malloc(sizeof(modbus_conn_t));
+	if(!g_Conn)
+		return -1;
+	modbus_InitConnection(g_Conn, &none);
+	uint8_t pdu[2 + 2 * MODBUS_MAX_READ_REGS];
+	pdu[0] = MB_RD_HOL_REG_CODE;
+	pdu[1] = 2 * MODBUS_MAX_READ_REGS;
+	memcpy(pdu + 2, g_Wire, 2 * MODBUS_MAX_READ_REGS);
+	size_t frame = sizeof(modbus_mbap_header_t) + sizeof(pdu);
+	g_RingFrames = MODBUS_RX_RING_SIZE / frame;
+	for(size_t i = 0; i < g_RingFrames; i++)
+	{
+		size_t len = frame;
+		modbus_ConstructPacket(pdu, sizeof(pdu), g_Conn->rx.data + i * frame, &len, (uint16_t)i, 1);
+	}
+	g_RingFill = g_RingFrames * frame;
+	g_Conn->rx.head = g_RingFill;
+	return 0;
+}
+
+//======================================================//
+// TIMING
+//======================================================//
+
+static epicsUInt64 micro_Cycles(void)
+{
+#ifdef MICRO_HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Runs a kernel for about seconds. Returns the fastest ns per call seen, and its cycles per call in *pCycles */
+static double micro_Time(const micro_kernel_t* kernel, double seconds, double* pCycles)
+{
+	/* Find a batch size that takes about a millisecond */
+	size_t nIters = 1;
+	for(;;)
+	{
+		epicsUInt64 start = epicsMonotonicGet();
+		kernel->fn(nIters);
+		if(epicsMonotonicGet() - start > 1000000 || nIters >= ((size_t)1 << 40))
+			break;
+		nIters *= 2;
+	}
+
+	double best = -1;
+	double bestCycles = 0;
+	for(int r = 0; r < MICRO_REPEATS; r++)
+	{
+		epicsUInt64 ns = 0;
+		epicsUInt64 cycles = 0;
+		size_t total = 0;
+		epicsUInt64 stop = epicsMonotonicGet() + (epicsUInt64)(seconds / MICRO_REPEATS * 1e9);
+		/* At least one batch, however short the time, so there's something to divide by */
+		do
+		{
+			epicsUInt64 start = epicsMonotonicGet();
+			epicsUInt64 c = micro_Cycles();
+			kernel->fn(nIters);
+			cycles += micro_Cycles() - c;
+			ns += epicsMonotonicGet() - start;
+			total += nIters;
+		} while(epicsMonotonicGet() < stop);
+		double perCall = (double)ns / total;
+		if(best < 0 || perCall < best)
+		{
+			best = perCall;
+			bestCycles = (double)cycles / total;
+		}
+	}
+	*pCycles = bestCycles;
+	return best;
+}
+
+/* Reads results saved with -s. Returns the number read */
+static int micro_Load(const char* pFile, micro_result_t* pOut)
+{
+	FILE* fp = fopen(pFile, "r");
+	if(!fp)
+	{
+		fprintf(stderr, "Can't open %s\n", pFile);
+		return -1;
+	}
+	int n = 0;
+	while(n < MICRO_MAX_KERNELS && fscanf(fp, "%31s %lf", pOut[n].name, &pOut[n].ns) == 2)
+		n++;
+	fclose(fp);
+	return n;
+}
+
+int main(int argc, char** argv)
+{
+	double seconds = 0.5;
+	double ghz = 0;
+	double tolerance = 10;
+	const char* pSave = NULL;
+	const char* pCompare = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "t:g:s:c:r:")) != -1)
+	{
+		switch(opt)
+		{
+			case 't': seconds = atof(optarg); break;
+			case 'g': ghz = atof(optarg); break;
+			case 's': pSave = optarg; break;
+			case 'c': pCompare = optarg; break;
+			case 'r': tolerance = atof(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-t seconds] [-g GHz] [-s file] [-c file] [-r percent]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(seconds <= 0)
+	{
+		fprintf(stderr, "Time per kernel must be more than 0\n");
+		return 2;
+	}
+
+	micro_result_t saved[MICRO_MAX_KERNELS];
+	int nSaved = 0;
+	if(pCompare && (nSaved = micro_Load(pCompare, saved)) < 0)
+		return 2;
+	if(micro_Setup() != 0)
+	{
+		fprintf(stderr, "Setup failed\n");
+		return 2;
+	}
+
+	FILE* fpSave = NULL;
+	if(pSave && !(fpSave = fopen(pSave, "w")))
+	{
+		fprintf(stderr, "Can't open %s\n", pSave);
+		return 2;
+	}
+
+	int failed = 0;
+	printf("%-16s %10s %8s %10s %12s\n", "kernel", "ns/op", "bytes", "bytes/cyc", "vs saved");
+	for(int k = 0; k < MICRO_NUM_KERNELS; k++)
+	{
+		const micro_kernel_t* kernel = &g_Kernels[k];
+		double cycles;
+		double ns = micro_Time(kernel, seconds, &cycles);
+		if(ghz > 0)
+			cycles = ns * ghz;
+
+		char perCycle[16] = "-";
+		if(cycles > 0)
+			snprintf(perCycle, sizeof(perCycle), "%.2f", kernel->nBytes / cycles);
+		char versus[32] = "";
+		for(int i = 0; i < nSaved; i++)
+		{
+			if(strcmp(saved[i].name, kernel->pName) != 0)
+				continue;
+			double change = (ns / saved[i].ns - 1) * 100;
+			int slower = change > tolerance;
+			failed |= slower;
+			snprintf(versus, sizeof(versus), "%+.1f%%%s", change, slower ? " SLOWER" : "");
+		}
+		printf("%-16s %10.2f %8zu %10s %12s\n", kernel->pName, ns, kernel->nBytes, perCycle, versus);
+		if(fpSave)
+			fprintf(fpSave, "%s %.3f\n", kernel->pName, ns);
+	}
+	if(fpSave)
+		fclose(fpSave);
+
+	modbus_DestroyLayout(g_LayoutAbcd);
+	modbus_DestroyLayout(g_LayoutCdab);
+	modbus_DestroyConnection(g_Conn);
+	free(g_Conn);
+	return failed;
+}
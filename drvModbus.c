@@ -4,7 +4,7 @@
 // Authors: Jeremy L.
 // Date Created: June 14, 2019
 //======================================================//
-#include "drvModbus.h"
+#include "drvModbusInt.h"
 
 
 /* Standard includes */
@@ -22,36 +22,19 @@
 #include <epicsString.h>
 #include <epicsPrint.h>
 #include <epicsMutex.h>
+#include <epicsEvent.h>
 #include <epicsTypes.h>
 #include <epicsAssert.h>
 #include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
 
-/* Some util macros */
-#if defined(__VERBOSE) || defined(__DEBUG)
-#define __LOG_ERROR(str) epicsPrintf("%s:%u %s\n", __FILE__,__LINE__,str)
-#define LOG_ERROR(str) __LOG_ERROR(str)
-#define LOG_ERROR_FORMATTED(str, ...) {char s[512]; sprintf(s,str, __VA_ARGS__); __LOG_ERROR(s); }
-#define PRINT_LOG(str) epicsPrintf("%s:%u %s\n", __FILE__, __LINE__, str)
-#define PRINT_LOG_FORMATTED(str, ...) {char s[512]; sprintf(s,str,__VA_ARGS__); PRINT_LOG(s); }
-#else
-#define LOG_ERROR(str)
-#define LOG_ERROR_FORMATTED(str,...)
-#define PRINT_LOG(str)
-#define PRINT_LOG_FORMATTED)
-#endif
+/* Set once modbus_Init has been called */
+static int g_ModbusInitialized = 0;
 
-#define BIG_TO_LITTLE_ENDIAN(_short) _short = (((_short) >> 8) & 0x00FF) | (((_short) << 8) & 0xFF00)
-#define LITTLE_TO_BIG_ENDIAN(_short) _short = (((_short) << 8) & 0xFF00) | (((_short) >> 8) & 0x00FF)
-
-#define CHECK_RESULT(x, str) if(x) { LOG_ERROR(str); }
-#define CHECK_RESULT_FORMATTED(x, str, ...) if(x) { LOG_ERROR_FORATTED(str, __VA_ARGS__); } 
-
-#define MALLOC_MUST_SUCCEED(var, size) { var = malloc(size); assert(var != NULL); if(!var) return -1; }
-#define CALLOC_MUST_SUCCEED(var, num, size) { var = calloc(num, size); assert(var != NULL); if(!var) return -1; }
-
-/* This is going to be the socket we use to actually do comms on modbus */
-SOCKET g_ModbusSocket = -1;
-extern epicsMutexId g_Mutex = NULL;
+/* Per-thread event that synchronous calls wait on, see modbus_Transact */
+static epicsThreadOnceId g_SyncOnce = EPICS_THREAD_ONCE_INIT;
+static epicsThreadPrivateId g_SyncEvent;
 
 //======================================================//
 // Name: modbus_Init
@@ -59,27 +42,21 @@ extern epicsMutexId g_Mutex = NULL;
 //======================================================//
 void modbus_Init()
 {
-	
-	SOCKET sock = epicsSocketCreate(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if(sock < 0)
+	if(g_ModbusInitialized)
+		return;
+	if(!osiSockAttach())
 	{
-		char errbuf[128];
-		epicsSocketConvertErrnoToString(errbuf, 127);
-		errbuf[127] = '\0'; /* Might need this, idk */
-		epicsPrintf("%s:%u Failed to create socket for Modbus driver: %s\n", __FILE__, __LINE__, errbuf);
+		epicsPrintf("%s:%u Failed to attach to the socket library for Modbus driver.\n", __FILE__, __LINE__);
 		return;
 	}
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(struct sockaddr_in));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(MODBUS_PORT);
-	int result = bind(sock, &addr, sizeof(struct sockaddr_in));
-	if(result < 0)
+	modbus_InitKernels();
+	if(!modbus_DefaultEngine())
 	{
-		epicsPrintf("%s:%u Failed to bind socket for Modbus driver.\n", __FILE__, __LINE__);
+		epicsPrintf("%s:%u Failed to start the I/O engine for Modbus driver.\n", __FILE__, __LINE__);
+		osiSockRelease();
 		return;
 	}
-	g_ModbusSocket = sock;
+	g_ModbusInitialized = 1;
 	epicsPrintf("Initialized Modbus driver.\n");
 }
 
@@ -88,300 +65,1136 @@ void modbus_Init()
 // Purpose: Initialize a device
 //======================================================//
 modbus_device_t* modbus_CreateDevice(const struct sockaddr_in* ip)
+{
+	return modbus_CreateUnit(ip, MODBUS_DEFAULT_UNIT);
+}
+
+//======================================================//
+// Name: modbus_CreateUnit
+// Purpose: Initialize a device behind a gateway
+//======================================================//
+modbus_device_t* modbus_CreateUnit(const struct sockaddr_in* ip, uint8_t unit)
 {
 	modbus_device_t* device = malloc(sizeof(modbus_device_t));
-	device->addr = *ip;
-	device->addr.sin_port = htons(MODBUS_PORT);
-	device->addr.sin_family = AF_INET;
-	device->mutex = epicsMutexCreate();
-	if(!device)
+	if(device)
+	{
+		device->addr = *ip;
+		device->addr.sin_port = htons(MODBUS_PORT);
+		device->addr.sin_family = AF_INET;
+		/* Only used if the gateway is new. Hashed on the address so every unit behind it agrees */
+		modbus_engine_t* engine = modbus_PickEngine(&device->addr.sin_addr, sizeof(device->addr.sin_addr));
+		device->gateway = engine ? modbus_AcquireGateway(&device->addr, engine) : NULL;
+		if(device->gateway && modbus_AddUnit(device->gateway, unit) != 0)
+		{
+			modbus_ReleaseGateway(device->gateway);
+			device->gateway = NULL;
+		}
+	}
+	if(!device || !device->gateway)
 	{
 		char buf[64];
-		ipAddrToDottedIP(&ip, buf, 64);
+		ipAddrToDottedIP(ip, buf, 64);
 		LOG_ERROR_FORMATTED("Failed to create device at IP %s", buf);
+		free(device);
 		return NULL;
 	}
+	device->unit_id = unit;
+	device->image = NULL;
+	/* Connections are opened by the engine once there's something to send */
+	device->conn = modbus_HomeConnection(device->gateway);
 	return device;
 }
 
 //======================================================//
-// Name: modbus_Init
+// Name: modbus_DestroyDevice
 // Purpose: Destroy a device
 //======================================================//
 void modbus_DestroyDevice(modbus_device_t* device)
 {
 	if(device)
 	{
-		epicsMutexDestroy(device->mutex);
+		/* The last device at the gateway closes the sockets and fails anything still outstanding */
+		modbus_ReleaseGateway(device->gateway);
+		modbus_DestroyImage(device->image);
+		free(device);
 	}
 }
 
 //======================================================//
 // Name: modbus_Shutdown
-// Purpose: Shutdown the modbus driver. Mainly to terminate
-// the sockets
+// Purpose: Shutdown the modbus driver. Devices own their
+// sockets, so those are closed by modbus_DestroyDevice
 //======================================================//
 void modbus_Shutdown()
 {
-	if(g_ModbusSocket >= 0)
+	if(g_ModbusInitialized)
 	{
-		epicsSocketDestroy(g_ModbusSocket);
+		osiSockRelease();
+		g_ModbusInitialized = 0;
 		epicsPrintf("%s:%u Unloaded Modbus driver.\n", __FILE__, __LINE__);
 		return;
 	}
 	else
 	{
-		epicsPrintf("%s:%u Socket was invalid while unloading Modbus driver. This could be a sign of a problem.\n", __FILE__, __LINE__);
+		epicsPrintf("%s:%u Modbus driver was not initialized while unloading. This could be a sign of a problem.\n", __FILE__, __LINE__);
 		return;
 	}
 }
 
+//======================================================//
+// Name: modbus_SetWindow
+// Purpose: Set the pipelining depth of a device
+//======================================================//
+int modbus_SetWindow(modbus_device_t* device, int window)
+{
+	if(!device || window < 1 || window > MODBUS_MAX_INFLIGHT)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_gateway_t* gateway = device->gateway;
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	for(int i = 0; i < nConns; i++)
+	{
+		epicsMutexMustLock(gateway->conns[i]->tx_lock);
+		gateway->conns[i]->adapt = 0;
+		epicsAtomicSetIntT(&gateway->conns[i]->window, window);
+		epicsMutexUnlock(gateway->conns[i]->tx_lock);
+		/* A bigger window may let blocked submitters through */
+		modbus_WakeWaiters(gateway->conns[i]);
+	}
+	return 0;
+}
+
 //======================================================//
 // MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
 // PROVIDED
 //======================================================//
 
-void modbus_ConnectDevice(modbus_device_t* device)
+/* Fills the pool's free list */
+void modbus_InitPool(modbus_bufpool_t* pool)
 {
-	if(device == NULL)
+	pool->lock = epicsSpinMustCreate();
+	pool->free = NULL;
+	for(int i = 0; i < MODBUS_POOL_BUFFERS; i++)
 	{
-		epicsPrintf("%s:%u Device passed to modbus_ConnectDevice is NULL!\n", __FILE__, __LINE__);
-		return;
+		pool->bufs[i].pooled = 1;
+		pool->bufs[i].next = pool->free;
+		pool->free = &pool->bufs[i];
 	}
-	if(g_ModbusSocket < 0)
+}
+
+void modbus_DestroyPool(modbus_bufpool_t* pool)
+{
+	epicsSpinDestroy(pool->lock);
+}
+
+/* Takes a MODBUS_MAX_ADU sized buffer out of the pool */
+/* If the pool is empty this falls back to malloc, so it only returns NULL if that fails too */
+modbus_buf_t* modbus_GetBuffer(modbus_bufpool_t* pool)
+{
+	epicsSpinLock(pool->lock);
+	modbus_buf_t* buf = pool->free;
+	if(buf)
+		pool->free = buf->next;
+	epicsSpinUnlock(pool->lock);
+	if(!buf)
 	{
-		LOG_ERROR("Modbus socket is not open!");
-		epicsPrintf("%s:%u Modbus socket is not open!\n", __FILE__, __LINE__);
-		return;
+		buf = malloc(sizeof(modbus_buf_t));
+		if(!buf)
+			return NULL;
+		buf->pooled = 0;
 	}
+	return buf;
+}
 
-	if(epicsMutexLock(device->mutex) != epicsMutexLockOK)
+/* Gives a buffer from modbus_GetBuffer back */
+void modbus_ReleaseBuffer(modbus_bufpool_t* pool, modbus_buf_t* buf)
+{
+	if(!buf)
+		return;
+	if(!buf->pooled)
 	{
-		LOG_ERROR("Error while locking the device mutex!");
+		free(buf);
 		return;
 	}
+	epicsSpinLock(pool->lock);
+	buf->next = pool->free;
+	pool->free = buf;
+	epicsSpinUnlock(pool->lock);
+}
+
+/* Finds a free slot in the in-flight table for a request that's already counted in conn->inflight */
+/* The ID is taken from a per-connection counter, skipping any whose slot is still busy. */
+/* Since a slot holds one request, no two outstanding requests can share an ID. */
+static modbus_txn_t* modbus_TakeSlot(modbus_conn_t* conn)
+{
+	/* Having reserved room in the window, a free slot must turn up, as window <= MODBUS_MAX_INFLIGHT */
+	while(1)
+	{
+		uint16_t tID = (uint16_t)epicsAtomicIncrIntT(&conn->next_id);
+		modbus_txn_t* txn = &conn->txns[tID & (MODBUS_MAX_INFLIGHT - 1)];
+		if(epicsAtomicCmpAndSwapIntT(&txn->busy, MODBUS_TXN_FREE, MODBUS_TXN_CLAIMED) == MODBUS_TXN_FREE)
+		{
+			txn->trans_id = tID;
+			return txn;
+		}
+	}
 }
 
-void modbus_DisconnectDevice(modbus_device_t* device)
+/* Claims a free slot in the in-flight table and gives it a transaction ID */
+/* This is lock-free, so it's safe to call from any thread */
+/* Returns NULL if the window is full */
+modbus_txn_t* modbus_AllocTransaction(modbus_conn_t* conn)
 {
-#if 0
-	if(shutdown(g_ModbusSocket, SHUT_RDWR) < 0)
+	if(epicsAtomicIncrIntT(&conn->inflight) > epicsAtomicGetIntT(&conn->window))
 	{
-		/* Report error only if we have some type of error that is unrecoverable */
-		if(errno == ENOTCONN)
-			/* Not connected anyways, so just whatever */
-			goto SHUTDOWN;
-		
-		char buf[128];
-		buf[127] = '\0';
-		epicsSocketConvertErrorToString(buf, 127, errno);
-		LOG_ERROR_FORMATTED("Unable to shutdown socket connection properly: %s", buf);
-		/* NOTE: mutex will remain locked because we have an issue */
+		epicsAtomicDecrIntT(&conn->inflight);
+		return NULL;
+	}
+	return modbus_TakeSlot(conn);
+}
+
+/* Takes the thread that's waited longest for a slot off the queue, and wakes it. Called with tx_lock held */
+static void modbus_SignalWaiter(modbus_conn_t* conn, int granted)
+{
+	modbus_waiter_t* waiter = conn->waitq;
+	conn->waitq = waiter->next;
+	if(!conn->waitq)
+		conn->waitq_tail = NULL;
+	epicsAtomicDecrIntT(&conn->waiters);
+	waiter->granted = granted;
+	/* The waiter is gone as soon as it's signalled */
+	epicsEventSignal(waiter->event);
+}
+
+/* Same as modbus_AllocTransaction, but blocks until the window has room */
+/* Waiters get slots in the order they started waiting. Each freed slot is handed straight to the one at */
+/* the front, so a thread that wasn't waiting can't take it first */
+/* Returns NULL if called from the engine thread with the window full, since waiting there would never end */
+modbus_txn_t* modbus_ClaimTransaction(modbus_conn_t* conn)
+{
+	modbus_txn_t* txn = modbus_AllocTransaction(conn);
+	if(txn)
+		return txn;
+	if(modbus_OnEngineThread(conn))
+	{
+		LOG_ERROR("Window is full, and the engine thread can't wait for room.");
+		return NULL;
+	}
+
+	modbus_waiter_t waiter;
+	waiter.event = modbus_ThreadEvent();
+	waiter.granted = 0;
+	while(1)
+	{
+		epicsMutexMustLock(conn->tx_lock);
+		/* Count ourselves before checking again, so a slot freed in between is handed to us */
+		epicsAtomicIncrIntT(&conn->waiters);
+		txn = modbus_AllocTransaction(conn);
+		if(txn)
+		{
+			epicsAtomicDecrIntT(&conn->waiters);
+			epicsMutexUnlock(conn->tx_lock);
+			return txn;
+		}
+		if(waiter.granted < 0)
+		{
+			/* Woken by a change to the window, but there's still no room. We keep our place at the front */
+			waiter.next = conn->waitq;
+			conn->waitq = &waiter;
+			if(!conn->waitq_tail)
+				conn->waitq_tail = &waiter;
+		}
+		else
+		{
+			waiter.next = NULL;
+			if(conn->waitq_tail)
+				conn->waitq_tail->next = &waiter;
+			else
+				conn->waitq = &waiter;
+			conn->waitq_tail = &waiter;
+		}
+		epicsMutexUnlock(conn->tx_lock);
+		epicsEventMustWait(waiter.event);
+		/* The slot that woke us is still counted in conn->inflight, on our behalf now */
+		if(waiter.granted > 0)
+			return modbus_TakeSlot(conn);
+	}
+}
+
+/* Wakes every thread waiting for a slot. They each check the window again. Used when the window changes */
+void modbus_WakeWaiters(modbus_conn_t* conn)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	while(conn->waitq)
+		modbus_SignalWaiter(conn, -1);
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Gives the room in the window a request has just finished with to the thread at the front of the queue */
+/* Returns 0 if there's nobody to give it to, or the window has shrunk to less than is in flight */
+static int modbus_HandOffSlot(modbus_conn_t* conn)
+{
+	if(epicsAtomicGetIntT(&conn->waiters) == 0)
+		return 0;
+	int result = 0;
+	epicsMutexMustLock(conn->tx_lock);
+	if(conn->waitq && epicsAtomicGetIntT(&conn->inflight) <= epicsAtomicGetIntT(&conn->window))
+	{
+		modbus_SignalWaiter(conn, 1);
+		result = 1;
+	}
+	epicsMutexUnlock(conn->tx_lock);
+	return result;
+}
+
+/* Wakes everyone in modbus_WaitAll, if nothing is outstanding on the connection any more */
+static void modbus_CheckIdle(modbus_conn_t* conn)
+{
+	if(epicsAtomicGetIntT(&conn->idlers) == 0 || epicsAtomicGetIntT(&conn->inflight) != 0 ||
+		epicsAtomicGetIntT(&conn->completing) != 0)
 		return;
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_waiter_t* waiter = conn->idleq;
+	conn->idleq = NULL;
+	epicsAtomicSetIntT(&conn->idlers, 0);
+	while(waiter)
+	{
+		modbus_waiter_t* next = waiter->next;
+		epicsEventSignal(waiter->event);
+		waiter = next;
 	}
-#endif
-SHUTDOWN:
-	epicsMutexUnlock(device->mutex);
+	epicsMutexUnlock(conn->tx_lock);
+}
 
+/* Returns a slot to the in-flight table, and hands its room in the window to whoever has waited longest for it */
+void modbus_FreeTransaction(modbus_conn_t* conn, modbus_txn_t* txn)
+{
+	modbus_ReleaseBuffer(&conn->pool, txn->frame);
+	txn->frame = NULL;
+	txn->next = NULL;
+	txn->callback = NULL;
+	txn->pUser = NULL;
+	modbus_CancelDeadline(conn, txn);
+	epicsAtomicSetIntT(&txn->busy, MODBUS_TXN_FREE);
+	if(!modbus_HandOffSlot(conn))
+		epicsAtomicDecrIntT(&conn->inflight);
+	modbus_CheckIdle(conn);
+}
+
+/* Marks the end of nCount callbacks, counted in conn->completing before their slots were freed */
+void modbus_FinishCompletions(modbus_conn_t* conn, int nCount)
+{
+	epicsAtomicAddIntT(&conn->completing, -nCount);
+	modbus_CheckIdle(conn);
 }
 
-/* Assumes device is already connected, and mutex is locked */
-/* Returns -1 on error, or the number of bytes on reset */
-ssize_t modbus_RecvBlock(modbus_device_t* pDevice, char* pBuf, size_t nLen)
+/* Fills in everything about a request but its frame, and gets it a buffer to build the frame in */
+/* Returns the buffer, or NULL if there isn't one */
+static modbus_buf_t* modbus_InitTransaction(modbus_conn_t* conn, modbus_txn_t* txn, uint8_t unit, uint8_t func,
+	modbus_completion_t callback, void* pUser, double timeout)
 {
-	if(!pDevice)
+	txn->unit = unit;
+	txn->func = func;
+	txn->resp_len = 0;
+	txn->callback = callback;
+	txn->pUser = pUser;
+	if(timeout == 0)
+		timeout = conn->timeout;
+	/* Serial lines start the clock once the frame is on the wire, so until then this is just the timeout */
+	if(conn->rtu)
+		txn->deadline = timeout > 0 ? (epicsUInt64)(timeout * 1e9) : 0;
+	else
+		txn->deadline = timeout > 0 ? epicsMonotonicGet() + (epicsUInt64)(timeout * 1e9) : 0;
+	txn->frame = modbus_GetBuffer(&conn->pool);
+	return txn->frame;
+}
+
+/* Copies a request into a pool buffer, MBAP header and all, ready to be queued */
+/* timeout is in seconds, 0 for the connection's timeout, or less than 0 for none */
+/* Returns 0 if OK, -1 on error. On error the slot is freed */
+int modbus_PrepareTransaction(modbus_conn_t* conn, modbus_txn_t* txn, uint8_t unit, const void* pPdu, size_t nLen,
+	modbus_completion_t callback, void* pUser, double timeout)
+{
+	int result = -1;
+	txn->len = MODBUS_MAX_ADU;
+	if(modbus_InitTransaction(conn, txn, unit, nLen ? *(const uint8_t*)pPdu : 0, callback, pUser, timeout))
 	{
-		LOG_ERROR("Invalid device.");
+		if(conn->rtu)
+			result = modbus_ConstructRtuFrame(pPdu, nLen, txn->frame->data, &txn->len, unit);
+		else
+			result = modbus_ConstructPacket(pPdu, nLen, txn->frame->data, &txn->len, txn->trans_id, unit);
+	}
+	if(result != 0)
+	{
+		modbus_FreeTransaction(conn, txn);
 		return -1;
 	}
-	if(!pBuf)
+	return 0;
+}
+
+/* Same as modbus_PrepareTransaction, for a request framed by modbus_PrepareRequest. Only the transaction ID */
+/* needs filling in */
+int modbus_PrepareFrame(modbus_conn_t* conn, modbus_txn_t* txn, const modbus_prepared_t* req, modbus_completion_t callback,
+	void* pUser, double timeout)
+{
+	uint8_t unit = req->rtu ? req->adu[0] : req->adu[sizeof(modbus_mbap_header_t) - 1];
+	if(req->rtu != (conn->rtu != 0) || !modbus_InitTransaction(conn, txn, unit, req->func, callback, pUser, timeout))
 	{
-		LOG_ERROR("Parameter was NULL.");
+		modbus_FreeTransaction(conn, txn);
 		return -1;
 	}
-	struct sockaddr_in addr;
-	ssize_t len;
-	do
+	memcpy(txn->frame->data, req->adu, req->len);
+	txn->len = req->len;
+	txn->resp_len = req->resp_len;
+	if(!conn->rtu)
 	{
-		memset(&addr, 0, sizeof(struct sockaddr_in));
-		if((len = recvfrom(g_ModbusSocket, pBuf, nLen, MSG_WAITALL, &addr, sizeof(struct sockaddr_in))) < 0)
-		{
-			if(errno == ENOTCONN)
-				LOG_ERROR("While connecting to device: the socket is not connected!");
-			else if(errno == ETIMEDOUT)
-				LOG_ERROR("While receiving block from device: timed out while waiting on device!");
-			else
-			{
-				char buf[128];
-				buf[127] = '\0';
-				epicsSocketConvertErrorToString(buf, 127, errno);
-				LOG_ERROR_FORMATTED("While receiving block from device: %s", buf);
-			}
-			return -1;
-		}
-	} while(memcmp(&addr, &pDevice->addr, sizeof(struct sockaddr_in)) != 0);
+		txn->frame->data[0] = txn->trans_id >> 8;
+		txn->frame->data[1] = txn->trans_id & 0xFF;
+	}
+	return 0;
+}
 
-	return (int)len;
+/* Length of the normal response to a request PDU, or 0 if it takes more than the request to know */
+static uint16_t modbus_ResponseLength(const uint8_t* pPdu, size_t nLen)
+{
+	if(nLen < 5)
+		return 0;
+	uint16_t count = (pPdu[3] << 8) | pPdu[4];
+	switch(pPdu[0])
+	{
+		case MB_RD_COILS_CODE:
+		case MB_RD_DISC_INPUTS_CODE:
+			return nLen == 5 ? 2 + (count + 7) / 8 : 0;
+		case MB_RD_HOL_REG_CODE:
+		case MB_RD_INP_REG_CODE:
+			return nLen == 5 ? 2 + 2 * count : 0;
+		case MB_WR_SIN_COIL_CODE:
+		case MB_WR_SIN_REG_CODE:
+		case MB_WR_MUL_COIL_CODE:
+		case MB_WR_MULT_REG_CODE:
+			return 5;
+		case MB_MSK_WRT_REG_CODE:
+			return 7;
+		case MB_RW_MULT_REG_CODE:
+			/* count is the number of registers read */
+			return 2 + 2 * count;
+		default:
+			return 0;
+	}
 }
 
-/* Returns -1 on error, or the num of bytes sent */
-ssize_t modbus_SendBlock(char* pBuf, size_t nLen, struct sockaddr_in dest)
+/* Completes every queued request with status (which is negative), and empties the send queues */
+/* Only called from the engine thread. Slots still being filled in by their submitters are left alone */
+void modbus_FailInflight(modbus_conn_t* conn, int status)
 {
-	if(pBuf == NULL)
+	modbus_completion_t callbacks[MODBUS_MAX_INFLIGHT];
+	void* users[MODBUS_MAX_INFLIGHT];
+	int n = 0;
+
+	epicsMutexMustLock(conn->tx_lock);
+	for(int i = 0; i < MODBUS_MAX_INFLIGHT; i++)
 	{
-		LOG_ERROR("Parameter was NULL.");
+		modbus_txn_t* txn = &conn->txns[i];
+		if(epicsAtomicGetIntT(&txn->busy) != MODBUS_TXN_QUEUED)
+			continue;
+		callbacks[n] = txn->callback;
+		users[n++] = txn->pUser;
+		modbus_StatFailed(conn, txn, status);
+		epicsAtomicIncrIntT(&conn->completing);
+		modbus_FreeTransaction(conn, txn);
+	}
+	if(n)
+		modbus_AdaptFailed(conn, NULL, status);
+	conn->pending_head = conn->pending_tail = NULL;
+	conn->sendq_head = conn->sendq_tail = NULL;
+	conn->send_offset = 0;
+	conn->wire = NULL;
+	epicsMutexUnlock(conn->tx_lock);
+
+	/* Outside the lock, so the callbacks can submit again */
+	for(int i = 0; i < n; i++)
+		if(callbacks[i])
+			callbacks[i](users[i], status, NULL, 0);
+	if(n)
+		modbus_FinishCompletions(conn, n);
+}
+
+/* Completes one queued request with status (which is negative). Only called from the engine thread */
+void modbus_FailTransaction(modbus_conn_t* conn, modbus_txn_t* txn, int status)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_completion_t callback = txn->callback;
+	void* pUser = txn->pUser;
+	modbus_AdaptFailed(conn, txn, status);
+	modbus_StatFailed(conn, txn, status);
+	epicsAtomicIncrIntT(&conn->completing);
+	modbus_FreeTransaction(conn, txn);
+	epicsMutexUnlock(conn->tx_lock);
+	if(callback)
+		callback(pUser, status, NULL, 0);
+	modbus_FinishCompletions(conn, 1);
+}
+
+/* Looks for a complete ADU at the read position of the receive ring, using the MBAP length to find its end */
+/* The ADU is handed out in place. If it wraps around the end of the ring, it's copied into *ppBuf (from the pool) */
+/* Returns 1 if there's a complete ADU, 0 if more bytes are needed, or -1 if the stream doesn't look like modbus */
+int modbus_RingPeekFrame(modbus_conn_t* conn, const uint8_t** ppAdu, size_t* pLen, modbus_buf_t** ppBuf)
+{
+	modbus_rxring_t* ring = &conn->rx;
+	size_t avail = ring->head - ring->tail;
+	*ppBuf = NULL;
+	if(avail < sizeof(modbus_mbap_header_t))
+		return 0;
+
+	/* Header bytes may straddle the wrap, so pick them out one at a time */
+	uint8_t hdr[sizeof(modbus_mbap_header_t)];
+	for(size_t i = 0; i < sizeof(modbus_mbap_header_t); i++)
+		hdr[i] = ring->data[(ring->tail + i) & (MODBUS_RX_RING_SIZE - 1)];
+	uint16_t protocol = (hdr[2] << 8) | hdr[3];
+	size_t len = (hdr[4] << 8) | hdr[5]; /* len counts the unit id too */
+	if(protocol != 0 || len < 2 || len - 1 > MODBUS_MAX_PDU)
+	{
+		LOG_ERROR_FORMATTED("Received a packet with an invalid length of %u", (unsigned)len);
 		return -1;
 	}
-	ssize_t len = 0;
-	if((len = sendto(g_ModbusSocket, pBuf, nLen, 0, &dest, sizeof(struct sockaddr_in))) < 0)
+	len += 6;
+	if(avail < len)
+		return 0;
+
+	size_t start = ring->tail & (MODBUS_RX_RING_SIZE - 1);
+	*pLen = len;
+	if(start + len <= MODBUS_RX_RING_SIZE)
 	{
-		if(errno == ENOTCONN)
-			LOG_ERROR("While sending data to device: the socket was not connected.");
-		else
-		{
-			char buf[128];
-			buf[127] = '\0';
-			epicsSocketConvertErrorToString(buf, 127, errno);
-			LOG_ERROR_FORMATTED("While receiving block from device: %s", buf);
-		}
+		*ppAdu = ring->data + start;
+		return 1;
 	}
-	return len;
+
+	modbus_buf_t* buf = modbus_GetBuffer(&conn->pool);
+	if(!buf)
+		return -1;
+	size_t first = MODBUS_RX_RING_SIZE - start;
+	memcpy(buf->data, ring->data + start, first);
+	memcpy(buf->data + first, ring->data, len - first);
+	*ppAdu = buf->data;
+	*ppBuf = buf;
+	return 1;
+}
+
+/* Fills in the MBAP header for a PDU of nLen bytes */
+/* transactionID should come from modbus_AllocTransaction */
+void modbus_ConstructHeader(modbus_mbap_header_t* pHeader, size_t nLen, uint16_t transactionID, uint8_t unit)
+{
+	pHeader->protocol_id = 0;
+	pHeader->trans_id = htons(transactionID);
+	pHeader->unit_id = unit;
+	pHeader->len = htons(nLen + 1); /* +1 because it includes the size of the unit_id field. */
 }
 
 /* This should construct a modbus packet, do CRC checks, etc */
 /* pOutBuf is the location to copy the data into */
-/* pOutLen is the length of the bytes copied */
-int modbus_ConstructPacket(void* pBuf, size_t nLen, void* pOutBuf, size_t* pOutLen, uint16_t* transactionID)
+/* pOutLen is the size of pOutBuf going in, and the length of the bytes copied coming out */
+/* transactionID should come from modbus_AllocTransaction */
+int modbus_ConstructPacket(const void* pBuf, size_t nLen, void* pOutBuf, size_t* pOutLen, uint16_t transactionID,
+	uint8_t unit)
 {
-	//pOutBuf = malloc(sizeof(modbus_mbap_header_t) + nLen);
 	if(!pOutBuf || !pBuf)
 	{
 		LOG_ERROR("Failure when creating packet, memory failed to allocate.");
 		return -1;
 	}
-	if(pOutLen < (sizeof(modbus_mbap_header_t) + nLen))
+	if(*pOutLen < (sizeof(modbus_mbap_header_t) + nLen))
 		return -1;
-	
+
 	modbus_mbap_header_t header;
-	memset(&header, 0, sizeof(modbus_mbap_header_t));
-	header.protocol_id = 0;
-	header.trans_id = rand() % 65535; /* we can just generate a random transaction id */
-	header.unit_id = 255;
-	header.len = nLen + 1; /* +1 because it includes the size of the unit_id field. */
-	*transactionID = header.trans_id;
+	modbus_ConstructHeader(&header, nLen, transactionID, unit);
 	memcpy(pOutBuf, &header, sizeof(modbus_mbap_header_t));
-	memcpy((pOutBuf+sizeof(modbus_mbap_header_t)), pBuf, nLen);
+	memcpy(((uint8_t*)pOutBuf+sizeof(modbus_mbap_header_t)), pBuf, nLen);
 	*pOutLen = sizeof(modbus_mbap_header_t) + nLen;
 	return 0;
 }
 
-/* Send a modbus packet built around the provided data */
-/* when OK, returns transaction ID, when failure, returns -1 */
-int modbus_SendPacket(modbus_device_t* device, void* pData, size_t nLen)
+/* Returns the outstanding request with the transaction ID, or NULL */
+/* Only requests that have been fully sent can have a response */
+modbus_txn_t* modbus_FindTransaction(modbus_conn_t* conn, uint16_t tID)
+{
+	modbus_txn_t* txn = &conn->txns[tID & (MODBUS_MAX_INFLIGHT - 1)];
+	if(epicsAtomicGetIntT(&txn->busy) == MODBUS_TXN_QUEUED && txn->trans_id == tID && !txn->frame)
+		return txn;
+	return NULL;
+}
+
+/* Hands an ADU from the receive ring to the matching outstanding request */
+/* Only called from the engine thread */
+/* Returns 1 if a request was completed, 0 if the packet didn't match anything */
+int modbus_DispatchFrame(modbus_conn_t* conn, const uint8_t* pAdu, size_t nLen)
+{
+	uint16_t tID = (pAdu[0] << 8) | pAdu[1];
+	return modbus_DispatchPdu(conn, tID, pAdu + sizeof(modbus_mbap_header_t), nLen - sizeof(modbus_mbap_header_t), nLen);
+}
+
+/* Hands the PDU of a frame at the read position of the receive ring to the request with transaction ID tID */
+/* nFrame is the length of the whole frame in the ring. Only called from the engine thread */
+/* Returns 1 if a request was completed, 0 if the packet didn't match anything */
+int modbus_DispatchPdu(modbus_conn_t* conn, uint16_t tID, const uint8_t* pdu, size_t len, size_t nFrame)
+{
+	modbus_rxring_t* ring = &conn->rx;
+
+	/* Step past the frame now, but hold on to its bytes until the callback is done with them */
+	ring->tail += nFrame;
+
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_txn_t* txn = modbus_FindTransaction(conn, tID);
+	modbus_completion_t callback = NULL;
+	void* pUser = NULL;
+	uint16_t expect = 0;
+	uint8_t func = 0;
+	if(txn)
+	{
+		modbus_StatResponse(conn, txn, pdu, len);
+		modbus_AdaptResponse(conn, txn, pdu, len);
+		expect = txn->resp_len;
+		func = txn->func;
+		/* Free the slot first so the callback can submit again */
+		callback = txn->callback;
+		pUser = txn->pUser;
+		epicsAtomicIncrIntT(&conn->completing);
+		modbus_FreeTransaction(conn, txn);
+	}
+	epicsMutexUnlock(conn->tx_lock);
+	if(!txn)
+	{
+		LOG_ERROR_FORMATTED("Discarding response with unknown transaction ID %u", tID);
+		conn->stats.unmatched++;
+		if(ring->hold == 0)
+			ring->reclaim = ring->tail;
+		return 0;
+	}
+
+	int status = 0;
+	if(pdu[0] & MB_ERRCODE_OFFSET)
+	{
+		/* An exception code of 0 isn't one the device could mean, so don't let it pass for success */
+		if(pdu[0] == (func | MB_ERRCODE_OFFSET) && len == 2)
+			status = pdu[1] ? pdu[1] : -1;
+		else
+		{
+			LOG_ERROR_FORMATTED("Response to transaction ID %u is a malformed exception", tID);
+			status = -1;
+		}
+	}
+	else if(expect && (pdu[0] != func || len != expect))
+	{
+		LOG_ERROR_FORMATTED("Response to transaction ID %u has the wrong length", tID);
+		status = -1;
+	}
+	ring->hold++;
+	if(callback)
+		callback(pUser, status, status < 0 ? NULL : pdu, status < 0 ? 0 : len);
+	modbus_FinishCompletions(conn, 1);
+	if(--ring->hold == 0)
+		ring->reclaim = ring->tail;
+	return 1;
+}
+
+/* Handles the next complete frame in the receive ring, if there is one */
+/* Returns 1 if a request was completed, 0 if the frame didn't match anything, */
+/* 2 if there's no complete frame yet, or -1 on error */
+int modbus_NextFrame(modbus_conn_t* conn)
+{
+	if(conn->rtu)
+		return modbus_NextRtuFrame(conn);
+	const uint8_t* pAdu;
+	size_t len;
+	modbus_buf_t* buf;
+	int result = modbus_RingPeekFrame(conn, &pAdu, &len, &buf);
+	if(result < 0)
+	{
+		modbus_CloseConnection(conn);
+		return -1;
+	}
+	if(result == 0)
+		return 2;
+	result = modbus_DispatchFrame(conn, pAdu, len);
+	modbus_ReleaseBuffer(&conn->pool, buf);
+	return result;
+}
+
+/* Used by modbus_Transact to wait on its own response */
+typedef struct
+{
+	int status;
+	void* pOut;
+	size_t nLen;
+	epicsEventId event;
+} modbus_sync_t;
+
+void modbus_SyncCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+{
+	modbus_sync_t* sync = pUser;
+	sync->status = status;
+	if(pPdu)
+	{
+		if(nLen > sync->nLen)
+			nLen = sync->nLen;
+		memcpy(sync->pOut, pPdu, nLen);
+		sync->nLen = nLen;
+	}
+	epicsEventSignal(sync->event);
+}
+
+static void modbus_InitSyncEvent(void* pArg)
+{
+	(void)pArg;
+	g_SyncEvent = epicsThreadPrivateCreate();
+}
+
+/* Returns the calling thread's event for synchronous calls, creating it the first time */
+epicsEventId modbus_ThreadEvent()
+{
+	epicsThreadOnce(&g_SyncOnce, modbus_InitSyncEvent, NULL);
+	epicsEventId event = epicsThreadPrivateGet(g_SyncEvent);
+	if(!event)
+	{
+		event = epicsEventMustCreate(epicsEventEmpty);
+		epicsThreadPrivateSet(g_SyncEvent, event);
+	}
+	return event;
+}
+
+/* Queues a request on the engine and blocks until its response shows up, or the device's timeout runs out */
+/* The response PDU is copied into pOutData, truncated to nLen */
+/* Returns length of recved data, MODBUS_STATUS_TIMEOUT, or -1 */
+int modbus_Transact(modbus_device_t* pDevice, const void* pData, size_t nLen, void* pOutData, size_t nOutLen)
+{
+	modbus_conn_t* conn = modbus_PickConnection(pDevice);
+	if(modbus_OnEngineThread(conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
+		return -1;
+	}
+
+	modbus_sync_t sync;
+	sync.status = -1;
+	sync.pOut = pOutData;
+	sync.nLen = nOutLen;
+	sync.event = modbus_ThreadEvent();
+
+	modbus_txn_t* txn = modbus_ClaimTransaction(conn);
+	if(!txn || modbus_PrepareTransaction(conn, txn, pDevice->unit_id, pData, nLen, modbus_SyncCompletion, &sync, 0) != 0)
+		return -1;
+	modbus_QueueTransaction(conn, txn);
+	/* The engine completes it one way or another by the deadline */
+	epicsEventMustWait(sync.event);
+	if(sync.status < 0)
+		return sync.status;
+	return sync.nLen;
+}
+
+/* Sends as many of the requests waiting in modbus_SubmitQueued as the window has room for, in order */
+/* Only called from the engine thread */
+void modbus_FlushQueued(modbus_conn_t* conn)
+{
+	modbus_txn_t* txns[MODBUS_MAX_INFLIGHT];
+	int n = 0;
+	modbus_queued_t* failed = NULL;
+	epicsMutexMustLock(conn->tx_lock);
+	while(conn->queued_head && n < MODBUS_MAX_INFLIGHT)
+	{
+		modbus_txn_t* txn = modbus_AllocTransaction(conn);
+		if(!txn)
+			break;
+		modbus_queued_t* req = conn->queued_head;
+		conn->queued_head = req->next;
+		if(!conn->queued_head)
+			conn->queued_tail = NULL;
+		if(modbus_PrepareTransaction(conn, txn, req->unit, req->pPdu, req->nLen, req->callback, req->pUser, req->timeout) != 0)
+		{
+			req->next = failed;
+			failed = req;
+			continue;
+		}
+		txns[n++] = txn;
+	}
+	epicsMutexUnlock(conn->tx_lock);
+	if(n)
+		modbus_AppendPending(conn, txns, n);
+	/* The request is the caller's again once its callback runs, so get next first */
+	while(failed)
+	{
+		modbus_queued_t* next = failed->next;
+		if(failed->callback)
+			failed->callback(failed->pUser, -1, NULL, 0);
+		failed = next;
+	}
+}
+
+/* Completes every request waiting in modbus_SubmitQueued with status */
+void modbus_FailQueued(modbus_conn_t* conn, int status)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_queued_t* req = conn->queued_head;
+	conn->queued_head = conn->queued_tail = NULL;
+	epicsMutexUnlock(conn->tx_lock);
+	while(req)
+	{
+		modbus_queued_t* next = req->next;
+		if(req->callback)
+			req->callback(req->pUser, status, NULL, 0);
+		req = next;
+	}
+}
+
+//======================================================//
+// Name: modbus_SetTimeout
+// Purpose: Set how long the device has to answer
+//======================================================//
+int modbus_SetTimeout(modbus_device_t* device, double timeout)
 {
 	if(!device)
 	{
-		LOG_ERROR("Invalid device.");
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
 	}
+	modbus_gateway_t* gateway = device->gateway;
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	for(int i = 0; i < nConns; i++)
+	{
+		epicsMutexMustLock(gateway->conns[i]->tx_lock);
+		gateway->conns[i]->timeout = timeout;
+		epicsMutexUnlock(gateway->conns[i]->tx_lock);
+	}
+	return 0;
+}
 
-	size_t outLen = sizeof(modbus_mbap_header_t) + nLen + 1;
-	uint16_t tID = 0;
-	void* pBuf = malloc(outLen);
-	if(modbus_ConstructPacket(pData, nLen, pBuf, &outLen, &tID) != 0)
+//======================================================//
+// Name: modbus_SubmitRequest
+// Purpose: Send a request without waiting on the response
+//======================================================//
+int modbus_SubmitRequest(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_completion_t callback, void* pUser)
+{
+	return modbus_SubmitRequestTimeout(device, pPdu, nLen, callback, pUser, 0);
+}
+
+//======================================================//
+// Name: modbus_SubmitRequestTimeout
+// Purpose: Send a request with its own timeout
+//======================================================//
+int modbus_SubmitRequestTimeout(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_completion_t callback,
+	void* pUser, double timeout)
+{
+	if(!device || !pPdu || nLen == 0 || nLen > MODBUS_MAX_PDU)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_conn_t* conn = modbus_PickConnection(device);
+	modbus_txn_t* txn = modbus_ClaimTransaction(conn);
+	if(!txn)
 		return -1;
-	modbus_SendBlock(pBuf, outLen, device->addr);
-	free(pBuf);
+	uint16_t tID = txn->trans_id;
+	if(modbus_PrepareTransaction(conn, txn, device->unit_id, pPdu, nLen, callback, pUser, timeout) != 0)
+		return -1;
+	/* The response may show up as soon as it's queued, so don't touch txn after this */
+	modbus_QueueTransaction(conn, txn);
 	return tID;
 }
 
-/* Receive a modbus packet, and take the PDU out of it and return it */
-/* tID is the transaction ID. This should be received from modbus_SendPacket */
-/* TODO: Need to add some type of proper timeout code! */
-/* Returns length of recved data or -1 */
-int modbus_RecvPacket(modbus_device_t* pDevice, void* pOutData, size_t nLen, uint16_t tID)
+//======================================================//
+// Name: modbus_SubmitBatch
+// Purpose: Send several requests at once without waiting
+// on the responses
+//======================================================//
+int modbus_SubmitBatch(modbus_device_t* device, const modbus_request_t* pReqs, int nReqs)
 {
-	modbus_mbap_header_t* header;
-	ssize_t len = modbus_RecvBlock(pDevice, pOutData, nLen);
-	header = (modbus_mbap_header_t*)pOutData; /* Cast first bytes to the header */
-	if(header->trans_id == tID)
+	if(!device || !pReqs || nReqs < 1)
 	{
-		memcpy(pOutData, (pOutData+sizeof(modbus_mbap_header_t)), len-sizeof(modbus_mbap_header_t));
-		return len;
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	for(int i = 0; i < nReqs; i++)
+	{
+		if(!pReqs[i].pPdu || pReqs[i].nLen == 0 || pReqs[i].nLen > MODBUS_MAX_PDU)
+		{
+			LOG_ERROR("Invalid parameter passed.");
+			return -1;
+		}
 	}
-	return -1;
-}
 
+	/* Queue as much as the window has room for in one go, so the engine can write it all at once. */
+	/* Only block for room once nothing is left to hand over. The whole batch goes on one connection, */
+	/* so it's sent in order */
+	modbus_conn_t* conn = modbus_PickConnection(device);
+	modbus_txn_t* txns[MODBUS_MAX_INFLIGHT];
+	int submitted = 0;
+	while(submitted < nReqs)
+	{
+		int n = 0;
+		while(submitted + n < nReqs && n < MODBUS_MAX_INFLIGHT)
+		{
+			modbus_txn_t* txn = n == 0 ? modbus_ClaimTransaction(conn) : modbus_AllocTransaction(conn);
+			if(!txn)
+				break;
+			const modbus_request_t* req = &pReqs[submitted + n];
+			if(modbus_PrepareTransaction(conn, txn, device->unit_id, req->pPdu, req->nLen, req->callback, req->pUser,
+				req->timeout) != 0)
+				break;
+			txns[n++] = txn;
+		}
+		if(n == 0)
+			break;
+		modbus_QueueTransactions(conn, txns, n);
+		submitted += n;
+	}
+	return submitted > 0 ? submitted : -1;
+}
 
 //======================================================//
-// Name: modbus_ReadCoils
-// Purpose: Reads coils from the device
-// Notes:
-// 		- ncoils must be less than 0x7D0
-//		- device musn't be null
+// Name: modbus_SubmitQueued
+// Purpose: Send a request, or leave it for the engine if
+// the window is full
 //======================================================//
-/* Request */
-struct modbus_ReadCoils_req
+int modbus_SubmitQueued(modbus_device_t* device, modbus_queued_t* req)
 {
-	uint8_t function_code;
-	uint16_t addr;
-	uint16_t ncoils;
-};
+	if(!device || !req || !req->pPdu || req->nLen == 0 || req->nLen > MODBUS_MAX_PDU)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_conn_t* conn = device->conn;
+	if(!conn->engine)
+		return -1;
+	req->unit = device->unit_id;
+	req->next = NULL;
 
-int modbus_ReadCoils(modbus_device_t* device, uint16_t addr, uint16_t ncoils, uint8_t* pOutBuf, uint8_t* nOutCoils)
+	/* Go straight out if nothing's waiting ahead of us, and there's room */
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_txn_t* txn = conn->queued_head ? NULL : modbus_AllocTransaction(conn);
+	if(!txn)
+	{
+		if(conn->queued_tail)
+			conn->queued_tail->next = req;
+		else
+			conn->queued_head = req;
+		conn->queued_tail = req;
+	}
+	epicsMutexUnlock(conn->tx_lock);
+	if(!txn)
+	{
+		modbus_EngineNotify(conn);
+		return 0;
+	}
+	if(modbus_PrepareTransaction(conn, txn, req->unit, req->pPdu, req->nLen, req->callback, req->pUser, req->timeout) != 0)
+		return -1;
+	modbus_QueueTransaction(conn, txn);
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_PrepareRequest
+// Purpose: Frame a request once, to send it any number
+// of times
+//======================================================//
+int modbus_PrepareRequest(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_prepared_t* pOut)
 {
-	if(!device)
+	if(!device || !pPdu || !pOut || nLen == 0 || nLen > MODBUS_MAX_PDU)
 	{
-		LOG_ERROR("Device was invalid.");
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_conn_t* conn = device->conn;
+	size_t len = sizeof(pOut->adu);
+	int result;
+	if(conn->rtu)
+		result = modbus_ConstructRtuFrame(pPdu, nLen, pOut->adu, &len, device->unit_id);
+	else
+		result = modbus_ConstructPacket(pPdu, nLen, pOut->adu, &len, 0, device->unit_id);
+	if(result != 0)
+	{
+		LOG_ERROR("Request doesn't fit in a frame.");
 		return -1;
 	}
+	pOut->len = (uint16_t)len;
+	pOut->resp_len = modbus_ResponseLength(pPdu, nLen);
+	pOut->rtu = conn->rtu != 0;
+	pOut->func = *(const uint8_t*)pPdu;
+	return 0;
+}
 
-	if(!pOutBuf || !nOutCoils)
+//======================================================//
+// Name: modbus_SubmitPrepared
+// Purpose: Send a prepared request without waiting on
+// the response
+//======================================================//
+int modbus_SubmitPrepared(modbus_device_t* device, const modbus_prepared_t* req, modbus_completion_t callback,
+	void* pUser, double timeout)
+{
+	if(!device || !req || req->len == 0 || req->len > MODBUS_MAX_ADU)
 	{
-		LOG_ERROR("Invalid parameter was passed.");
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
 	}
+	modbus_conn_t* conn = modbus_PickConnection(device);
+	modbus_txn_t* txn = modbus_ClaimTransaction(conn);
+	if(!txn)
+		return -1;
+	uint16_t tID = txn->trans_id;
+	if(modbus_PrepareFrame(conn, txn, req, callback, pUser, timeout) != 0)
+		return -1;
+	/* The response may show up as soon as it's queued, so don't touch txn after this */
+	modbus_QueueTransaction(conn, txn);
+	return tID;
+}
 
-	if(ncoils > 0x7D0)
+//======================================================//
+// Name: modbus_TransactPrepared
+// Purpose: Send a prepared request and wait for the
+// response
+//======================================================//
+int modbus_TransactPrepared(modbus_device_t* device, const modbus_prepared_t* req, void* pOut, size_t* pOutLen)
+{
+	if(!device || !req || !pOut || !pOutLen || req->len == 0 || req->len > MODBUS_MAX_ADU)
 	{
-		LOG_ERROR("Unable to read more than 0x7D0 coils");
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_conn_t* conn = modbus_PickConnection(device);
+	if(modbus_OnEngineThread(conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
 		return -1;
 	}
-	
-	struct modbus_ReadCoils_req packet;
-	packet.function_code = MB_RD_COILS_CODE;
-	packet.ncoils = LITTLE_TO_BIG_ENDIAN(ncoils);
-	packet.addr = LITTLE_TO_BIG_ENDIAN(addr);
-	
-	modbus_ConnectDevice(device);
 
-	int tID = modbus_SendPacket(device, &packet, sizeof(struct modbus_ReadCoils_req));
+	modbus_sync_t sync;
+	sync.status = -1;
+	sync.pOut = pOut;
+	sync.nLen = *pOutLen;
+	sync.event = modbus_ThreadEvent();
+	*pOutLen = 0;
+
+	modbus_txn_t* txn = modbus_ClaimTransaction(conn);
+	if(!txn || modbus_PrepareFrame(conn, txn, req, modbus_SyncCompletion, &sync, 0) != 0)
+		return -1;
+	modbus_QueueTransaction(conn, txn);
+	/* The engine completes it one way or another by the deadline */
+	epicsEventMustWait(sync.event);
+	if(sync.status >= 0)
+		*pOutLen = sync.nLen;
+	return sync.status;
+}
 
-	/* We know about how large the return packet should be */
-	size_t len = ncoils + 2;
-	void* pBuf;
-	MALLOC_MUST_SUCCEED(pBuf, len);
-	if(modbus_RecvPacket(device, pBuf, len, tID) > -1)
+//======================================================//
+// Name: modbus_WaitAll
+// Purpose: Complete everything that's outstanding
+//======================================================//
+int modbus_WaitAll(modbus_device_t* device)
+{
+	if(!device)
 	{
-		if(*(uint8_t*)pBuf == 0x81)
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(modbus_OnEngineThread(device->conn))
+	{
+		LOG_ERROR("modbus_WaitAll can't be called from the engine thread.");
+		return -1;
+	}
+	modbus_waiter_t waiter;
+	waiter.event = modbus_ThreadEvent();
+	waiter.granted = 0;
+	/* Every connection to the gateway in turn. One that's gone idle doesn't matter once we've moved on */
+	int nConns = epicsAtomicGetIntT(&device->gateway->nconns);
+	for(int i = 0; i < nConns; i++)
+	{
+		modbus_conn_t* conn = device->gateway->conns[i];
+		while(1)
 		{
-			LOG_ERROR("Modbus error while reading coils.");
-			return *(uint8_t*)pBuf+1;
+			epicsMutexMustLock(conn->tx_lock);
+			/* Count ourselves before checking, so a completion in between still wakes us */
+			/* Callbacks still running count as outstanding */
+			epicsAtomicIncrIntT(&conn->idlers);
+			if(epicsAtomicGetIntT(&conn->inflight) == 0 && epicsAtomicGetIntT(&conn->completing) == 0)
+			{
+				epicsAtomicDecrIntT(&conn->idlers);
+				epicsMutexUnlock(conn->tx_lock);
+				break;
+			}
+			waiter.next = conn->idleq;
+			conn->idleq = &waiter;
+			epicsMutexUnlock(conn->tx_lock);
+			epicsEventMustWait(waiter.event);
 		}
-		nOutCoils = *((char*)(pBuf) + 1); /* Second byte is n coils */
-		memcpy(pOutBuf, (pBuf+2), len-2);
 	}
-	else
+	return 0;
+}
+
+/* Checks a response PDU from modbus_Transact against the function code of the request */
+/* Returns 0 if OK, the modbus exception code if the device sent one back, or -1 if it's malformed */
+int modbus_CheckResponse(const uint8_t* pPdu, int nLen, uint8_t func, int nMinLen)
+{
+	if(nLen < 2)
+		return -1;
+	if(pPdu[0] == (func | MB_ERRCODE_OFFSET))
+		return pPdu[1];
+	if(pPdu[0] != func || nLen < nMinLen)
+		return -1;
+	return 0;
+}
+
+/* Sends a request and checks the response */
+/* Nothing is locked while waiting, so any number of threads can have requests out on the device at once. */
+/* The engine matches each response to its caller by transaction ID */
+/* pResp needs room for MODBUS_MAX_PDU bytes. It's on the caller's stack rather than from the pool, since it's held */
+/* the whole time the caller waits for a slot. On success, it holds the response PDU */
+/* Returns the same as modbus_CheckResponse, or MODBUS_STATUS_TIMEOUT */
+int modbus_Request(modbus_device_t* device, const void* pReq, size_t nReqLen, uint8_t* pResp, int nMinLen)
+{
+	int len = modbus_Transact(device, pReq, nReqLen, pResp, MODBUS_MAX_PDU);
+	if(len < 0)
 	{
 		char buf[64];
 		ipAddrToDottedIP(&device->addr, buf, 64);
-		LOG_ERROR_FORMATTED("Failed to write to device at ip %s", buf);
+		LOG_ERROR_FORMATTED("Failed to communicate with device at ip %s", buf);
+		return len;
+	}
+	return modbus_CheckResponse(pResp, len, ((const uint8_t*)pReq)[0], nMinLen);
+}
+
+//======================================================//
+// Name: modbus_ReadCoils
+// Purpose: Reads coils from the device
+// Notes:
+// 		- ncoils must be less than 0x7D0
+//		- device musn't be null
+//======================================================//
+int modbus_ReadCoils(modbus_device_t* device, uint16_t addr, uint16_t ncoils, uint8_t* pOutBuf, uint8_t* nOutCoils)
+{
+	if(!device)
+	{
+		LOG_ERROR("Device was invalid.");
 		return -1;
 	}
 
-	modbus_DisconnectDevice(device);
-	free(pBuf);
-	return 0;
+	if(!pOutBuf || !nOutCoils)
+	{
+		LOG_ERROR("Invalid parameter was passed.");
+		return -1;
+	}
+
+	if(ncoils == 0 || ncoils > 0x7D0)
+	{
+		LOG_ERROR("Unable to read more than 0x7D0 coils");
+		return -1;
+	}
+
+	/* Goes through the coalescer, so reads of neighbouring coils from other threads share a request */
+	int result = modbus_ReadSync(device, MB_RD_COILS_CODE, addr, ncoils, pOutBuf);
+	if(result > 0)
+		LOG_ERROR("Modbus error while reading coils.");
+	if(result == 0)
+		*nOutCoils = (ncoils + 7) / 8;
+	return result;
 }
 
 //======================================================//
@@ -396,162 +1209,318 @@ struct modbus_WriteSingleRegister_req
 	uint8_t code;
 	uint16_t addr;
 	uint16_t value;
-};
+} __attribute__((packed));
 
 int modbus_WriteSingleRegister(modbus_device_t* device, uint16_t addr, uint16_t value)
 {
 	if(device == NULL)
 	{
 		LOG_ERROR("Invalid parameter passed.");
-		return;
+		return -1;
 	}
 
 	/* Construct the packet */
 	struct modbus_WriteSingleRegister_req packet;
 	memset(&packet, 0, sizeof(struct modbus_WriteSingleRegister_req));
 	/* Make sure this gets converted to big endian representation, as modbus is 100% big endian */
-	packet.addr = LITTLE_TO_BIG_ENDIAN(addr);
-	packet.value = LITTLE_TO_BIG_ENDIAN(value);
+	packet.addr = htons(addr);
+	packet.value = htons(value);
 	packet.code = MB_WR_SIN_REG_CODE;
 
-	/* Now connect device */
-	modbus_ConnectDevice(device);
-	int tID = modbus_SendPacket(device, &packet, sizeof(struct modbus_WriteSingleRegister_req));
-
-	/* Create new packet for response */
-	struct modbus_WriteSingleRegister_req res_packet;
-	memset(&res_packet, 0, sizeof(struct modbus_WriteSingleRegister_req));
-	int bytes = modbus_RecvPacket(device, &res_packet, sizeof(struct modbus_WriteSingleRegister_req), tID);
+	/* The response echoes the request */
+	uint8_t resp[MODBUS_MAX_PDU];
+	int result = modbus_Request(device, &packet, sizeof(struct modbus_WriteSingleRegister_req), resp, sizeof(struct modbus_WriteSingleRegister_req));
 
 	/* verify writing */
 	/* NOTE: the values we just received are already in big-endian format */
-	if(packet.value != res_packet.value || packet.addr != res_packet.addr)
+	if(result == 0 && memcmp(resp, &packet, sizeof(struct modbus_WriteSingleRegister_req)) != 0)
 	{
 		char buf[64];
 		ipAddrToDottedIP(&device->addr, buf, 64);
 		LOG_ERROR_FORMATTED("Failed to write register in target device at %s. Different values were returned.", buf);
-		return -1;
+		result = -1;
 	}
-	modbus_DisconnectDevice(device);
-	return 0;
+	return result;
 }
 
 //======================================================//
-// Name: modbus_ReadDiscreteInputs
-// Purpose: Read up to 2000 discrete inputs
+// Name: modbus_WriteMultipleRegisters
+// Purpose: Write up to 123 registers in one request
 // Notes:
-// 		- idk
+//		-	values are in host order, and swapped here
 //======================================================//
-struct modbus_ReadDiscreteInputs_req
+struct modbus_WriteMultiple_req
 {
 	uint8_t code;
 	uint16_t addr;
-	uint16_t coils;
-};
+	uint16_t count;
+	uint8_t nbytes;
+} __attribute__((packed));
 
-int modbus_ReadDiscreteInputs(modbus_device_t* device, uint16_t addr, uint16_t ncoils, uint8_t* pOutBuf, uint8_t* nOutCoils)
+/* Response to a write multiple request. It's the start of the request */
+struct modbus_WriteMultiple_resp
 {
-	if(!device)
+	uint8_t code;
+	uint16_t addr;
+	uint16_t count;
+} __attribute__((packed));
+
+int modbus_WriteMultipleRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, const uint16_t* pValues)
+{
+	if(!device || !pValues || nregs == 0 || nregs > MODBUS_MAX_WRITE_REGS || (uint32_t)addr + nregs > 0x10000)
 	{
-		LOG_ERROR("The device was invalid.");
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
 	}
 
-	if(!pOutBuf || !nOutCoils)
+	uint8_t pdu[sizeof(struct modbus_WriteMultiple_req) + 2 * MODBUS_MAX_WRITE_REGS];
+	struct modbus_WriteMultiple_req* packet = (struct modbus_WriteMultiple_req*)pdu;
+	packet->code = MB_WR_MULT_REG_CODE;
+	packet->addr = htons(addr);
+	packet->count = htons(nregs);
+	packet->nbytes = (uint8_t)(2 * nregs);
+	modbus_RegistersToWire(pValues, pdu + sizeof(struct modbus_WriteMultiple_req), nregs);
+
+	uint8_t resp[MODBUS_MAX_PDU];
+	int result = modbus_Request(device, pdu, sizeof(struct modbus_WriteMultiple_req) + 2 * nregs, resp,
+		sizeof(struct modbus_WriteMultiple_resp));
+	if(result == 0 && memcmp(resp, pdu, sizeof(struct modbus_WriteMultiple_resp)) != 0)
 	{
-		LOG_ERROR("Invalid parameter was passed.");
+		char buf[64];
+		ipAddrToDottedIP(&device->addr, buf, 64);
+		LOG_ERROR_FORMATTED("Failed to write registers in target device at %s. Different range was returned.", buf);
+		result = -1;
+	}
+	return result;
+}
+
+//======================================================//
+// Name: modbus_WriteMultipleCoils
+// Purpose: Write up to 1968 coils in one request
+// Notes:
+//		-	values are packed 8 to a byte, LSB first
+//======================================================//
+int modbus_WriteMultipleCoils(modbus_device_t* device, uint16_t addr, uint16_t ncoils, const uint8_t* pValues)
+{
+	if(!device || !pValues || ncoils == 0 || ncoils > MODBUS_MAX_WRITE_BITS || (uint32_t)addr + ncoils > 0x10000)
+	{
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
 	}
 
-	/* Connect device and begin with sending input */
-	modbus_ConnectDevice(device);
-	struct modbus_ReadDiscreteInputs_req packet;
-	packet.code = MB_RD_DISC_INPUTS_CODE;
-	packet.addr = LITTLE_TO_BIG_ENDIAN(addr);
-	packet.coils = LITTLE_TO_BIG_ENDIAN(ncoils);
-	int tID = modbus_SendPacket(device, &packet, sizeof(struct modbus_ReadDiscreteInputs_req));
+	uint8_t pdu[sizeof(struct modbus_WriteMultiple_req) + (MODBUS_MAX_WRITE_BITS + 7) / 8];
+	struct modbus_WriteMultiple_req* packet = (struct modbus_WriteMultiple_req*)pdu;
+	int nbytes = (ncoils + 7) / 8;
+	packet->code = MB_WR_MUL_COIL_CODE;
+	packet->addr = htons(addr);
+	packet->count = htons(ncoils);
+	packet->nbytes = (uint8_t)nbytes;
+	uint8_t* pData = pdu + sizeof(struct modbus_WriteMultiple_req);
+	memcpy(pData, pValues, nbytes);
+	/* The bits past the last coil are supposed to be zero */
+	if(ncoils % 8)
+		pData[nbytes - 1] &= (1 << (ncoils % 8)) - 1;
 
-	if(tID < 0)
-		return -1;
+	uint8_t resp[MODBUS_MAX_PDU];
+	int result = modbus_Request(device, pdu, sizeof(struct modbus_WriteMultiple_req) + nbytes, resp,
+		sizeof(struct modbus_WriteMultiple_resp));
+	if(result == 0 && memcmp(resp, pdu, sizeof(struct modbus_WriteMultiple_resp)) != 0)
+	{
+		char buf[64];
+		ipAddrToDottedIP(&device->addr, buf, 64);
+		LOG_ERROR_FORMATTED("Failed to write coils in target device at %s. Different range was returned.", buf);
+		result = -1;
+	}
+	return result;
+}
 
-	/* 2 bytes describe what we have returned */
-	size_t len = ncoils + 2;
-	void* pBuf;
-	MALLOC_MUST_SUCCEED(pBuf, len);
-	len = modbus_RecvPacket(device, pBuf, len, tID);
-	if(len < 0)
+//======================================================//
+// Name: modbus_ReadWriteMultipleRegisters
+// Purpose: Write up to 121 registers and read up to 125
+// in one request
+//======================================================//
+struct modbus_ReadWriteMultiple_req
+{
+	uint8_t code;
+	uint16_t rd_addr;
+	uint16_t rd_count;
+	uint16_t wr_addr;
+	uint16_t wr_count;
+	uint8_t nbytes;
+} __attribute__((packed));
+
+int modbus_ReadWriteMultipleRegisters(modbus_device_t* device, uint16_t rdAddr, uint16_t nRdRegs, uint16_t* pOutBuf,
+	uint16_t wrAddr, uint16_t nWrRegs, const uint16_t* pValues)
+{
+	if(!device || !pOutBuf || !pValues || nRdRegs == 0 || nRdRegs > MODBUS_MAX_READ_REGS ||
+		(uint32_t)rdAddr + nRdRegs > 0x10000 || nWrRegs == 0 || nWrRegs > MODBUS_MAX_RW_WRITE_REGS ||
+		(uint32_t)wrAddr + nWrRegs > 0x10000)
 	{
-		LOG_ERROR("Error while recieving data.");
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
 	}
-	uint8_t code = (uint8_t)((char*)pBuf); /* This will tell us if we have errors */
-	modbus_DisconnectDevice(device);
 
-	/* This means error! */
-	if(code == 0x82)
+	uint8_t pdu[sizeof(struct modbus_ReadWriteMultiple_req) + 2 * MODBUS_MAX_RW_WRITE_REGS];
+	struct modbus_ReadWriteMultiple_req* packet = (struct modbus_ReadWriteMultiple_req*)pdu;
+	packet->code = MB_RW_MULT_REG_CODE;
+	packet->rd_addr = htons(rdAddr);
+	packet->rd_count = htons(nRdRegs);
+	packet->wr_addr = htons(wrAddr);
+	packet->wr_count = htons(nWrRegs);
+	packet->nbytes = (uint8_t)(2 * nWrRegs);
+	modbus_RegistersToWire(pValues, pdu + sizeof(struct modbus_ReadWriteMultiple_req), nWrRegs);
+
+	uint8_t resp[MODBUS_MAX_PDU];
+	int result = modbus_Request(device, pdu, sizeof(struct modbus_ReadWriteMultiple_req) + 2 * nWrRegs, resp, 2 + 2 * nRdRegs);
+	if(result == 0 && resp[1] != 2 * nRdRegs)
 	{
-		LOG_ERROR("A modbus error ocurred while processing the request.");
-		return (uint8_t)((char*)pBuf + 1);
+		LOG_ERROR("Response to read/write multiple registers has the wrong byte count.");
+		result = -1;
 	}
-	nOutCoils = len-2;
-	memcpy(pOutBuf, (pBuf+2), len-2);
-	free(pBuf);
-	return 0;
+	if(result == 0)
+		modbus_RegistersFromWire(resp + 2, pOutBuf, nRdRegs);
+	else if(result > 0)
+		LOG_ERROR("Modbus error while reading/writing registers.");
+	return result;
 }
 
 //======================================================//
-// Name: modbus_ReadHoldingRegisters
-// Purpose: Read up to 16 registers
-// Notes:
-//		-	items in the output buffer are endian corrected
+// Name: modbus_MaskWriteRegister
+// Purpose: Set and clear bits of a register in one go
 //======================================================//
-struct modbus_ReadHoldingRegisters_req
+struct modbus_MaskWriteRegister_req
 {
 	uint8_t code;
 	uint16_t addr;
-	uint16_t count;
-};
+	uint16_t and_mask;
+	uint16_t or_mask;
+} __attribute__((packed));
 
-int modbus_ReadHoldingRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, uint16_t* pOutBuf, uint16_t* nOutRegs)
+int modbus_MaskWriteRegister(modbus_device_t* device, uint16_t addr, uint16_t andMask, uint16_t orMask)
 {
 	if(!device)
 	{
-		LOG_ERROR("Invalid device.");
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
 	}
 
-	struct modbus_ReadHoldingRegisters_req packet;
-	packet.code = MB_RD_HOL_REG_CODE;
-	packet.addr = LITTLE_TO_BIG_ENDIAN(addr);
-	packet.count = LITTLE_TO_BIG_ENDIAN(nregs);
-	modbus_ConnectDevice(device);
-	int tID = modbus_SendPacket(device, &packet, sizeof(struct modbus_ReadHoldingRegisters_req));
-	if(tID < 0)
+	struct modbus_MaskWriteRegister_req packet;
+	packet.code = MB_MSK_WRT_REG_CODE;
+	packet.addr = htons(addr);
+	packet.and_mask = htons(andMask);
+	packet.or_mask = htons(orMask);
+
+	/* The response echoes the request */
+	uint8_t resp[MODBUS_MAX_PDU];
+	int result = modbus_Request(device, &packet, sizeof(packet), resp, sizeof(packet));
+	if(result == 0 && memcmp(resp, &packet, sizeof(packet)) != 0)
+	{
+		char buf[64];
+		ipAddrToDottedIP(&device->addr, buf, 64);
+		LOG_ERROR_FORMATTED("Failed to mask register in target device at %s. Different values were returned.", buf);
+		result = -1;
+	}
+	return result;
+}
+
+//======================================================//
+// Name: modbus_ReadFifoQueue
+// Purpose: Read a FIFO queue of up to 31 registers
+//======================================================//
+int modbus_ReadFifoQueue(modbus_device_t* device, uint16_t addr, uint16_t* pOutBuf, uint16_t* pOutCount)
+{
+	if(!device || !pOutBuf || !pOutCount)
+	{
+		LOG_ERROR("Invalid parameter passed.");
 		return -1;
-	size_t len = (2*nregs) + 2;
-	void* pBuf;
-	MALLOC_MUST_SUCCEED(pBuf, len);
-	len = modbus_RecvPacket(device, pBuf, len, tID);
-	modbus_DisconnectDevice(device);
+	}
 
-	if(len < 0)
+	uint8_t pdu[3];
+	pdu[0] = MB_RD_FIFO_QUEUE_CODE;
+	pdu[1] = addr >> 8;
+	pdu[2] = addr & 0xFF;
+
+	uint8_t resp[MODBUS_MAX_PDU];
+	/* Function code, a two byte byte count, then the FIFO count and the registers. The length isn't known */
+	/* up front, so it has to be checked against what came back */
+	int len = modbus_Transact(device, pdu, sizeof(pdu), resp, MODBUS_MAX_PDU);
+	int result = len < 0 ? len : modbus_CheckResponse(resp, len, MB_RD_FIFO_QUEUE_CODE, 5);
+	uint16_t count = 0;
+	if(result == 0)
+	{
+		uint16_t nBytes = (resp[1] << 8) | resp[2];
+		count = (resp[3] << 8) | resp[4];
+		if(count > MODBUS_MAX_FIFO_REGS || nBytes != 2 + 2 * count || len != 5 + 2 * count)
+		{
+			LOG_ERROR("Response to read FIFO queue is malformed.");
+			result = -1;
+		}
+	}
+	if(result == 0)
+	{
+		modbus_RegistersFromWire(resp + 5, pOutBuf, count);
+		*pOutCount = count;
+	}
+	else if(result > 0)
+		LOG_ERROR("Modbus error while reading FIFO queue.");
+	return result;
+}
+
+//======================================================//
+// Name: modbus_ReadDiscreteInputs
+// Purpose: Read up to 2000 discrete inputs
+// Notes:
+// 		- idk
+//======================================================//
+int modbus_ReadDiscreteInputs(modbus_device_t* device, uint16_t addr, uint16_t ncoils, uint8_t* pOutBuf, uint8_t* nOutCoils)
+{
+	if(!device)
+	{
+		LOG_ERROR("The device was invalid.");
 		return -1;
-	
-	uint8_t code = *(uint8_t*)pBuf;
-	if(*(uint8_t*)pBuf == 0x83)
+	}
+
+	if(!pOutBuf || !nOutCoils || ncoils == 0 || ncoils > 0x7D0)
 	{
-		LOG_ERROR("An error occurred while reading holding registers.");
-		return *(uint8_t*)pBuf+1;
+		LOG_ERROR("Invalid parameter was passed.");
+		return -1;
 	}
 
-	/* we need to swap all the bytes around */
-	for(int i = 2; i < len; i += 2)
-		((uint16_t*)(pBuf))[i] = BIG_TO_LITTLE_ENDIAN(((uint16_t*)pBuf)[i]);
+	int result = modbus_ReadSync(device, MB_RD_DISC_INPUTS_CODE, addr, ncoils, pOutBuf);
+	if(result > 0)
+		LOG_ERROR("A modbus error ocurred while processing the request.");
+	if(result == 0)
+		*nOutCoils = (ncoils + 7) / 8;
+	return result;
+}
 
-	memcpy(pOutBuf, (pBuf+2), len-2);
-	*nOutRegs = *((uint8_t*)pBuf+1) / 2;
-	free(pBuf);
-	return 0;
+//======================================================//
+// Name: modbus_ReadHoldingRegisters
+// Purpose: Read up to 125 registers
+// Notes:
+//		-	items in the output buffer are endian corrected
+//======================================================//
+int modbus_ReadHoldingRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, uint16_t* pOutBuf, uint16_t* nOutRegs)
+{
+	if(!device)
+	{
+		LOG_ERROR("Invalid device.");
+		return -1;
+	}
+
+	if(!pOutBuf || !nOutRegs || nregs == 0 || nregs > 0x7D)
+	{
+		LOG_ERROR("Invalid parameter was passed.");
+		return -1;
+	}
+
+	/* The coalescer hands the registers back already swapped */
+	int result = modbus_ReadSync(device, MB_RD_HOL_REG_CODE, addr, nregs, pOutBuf);
+	if(result > 0)
+		LOG_ERROR("An error occurred while reading holding registers.");
+	if(result == 0)
+		*nOutRegs = nregs;
+	return result;
 }
 
 //======================================================//
@@ -560,12 +1529,6 @@ int modbus_ReadHoldingRegisters(modbus_device_t* device, uint16_t addr, uint16_t
 // Notes:
 //		-	items in the output buffer are endian corrected
 //======================================================//
-struct modbus_ReadInputRegisters_req
-{
-	uint8_t code;
-	uint16_t addr;
-	uint16_t count;
-};
 int modbus_ReadInputRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, uint16_t* pOutBuf, uint8_t* pOutRegs)
 {
 	if(!device)
@@ -574,34 +1537,20 @@ int modbus_ReadInputRegisters(modbus_device_t* device, uint16_t addr, uint16_t n
 		return -1;
 	}
 
-	struct modbus_ReadInputRegisters_req packet;
-	packet.code = MB_RD_INP_REG_CODE;
-	packet.addr = LITTLE_TO_BIG_ENDIAN(addr);
-	packet.count = LITTLE_TO_BIG_ENDIAN(nregs);
-	modbus_ConnectDevice(device);
-	int tID = modbus_SendPacket(device, &packet, sizeof(struct modbus_ReadInputRegisters_req));
-	if(tID < 0)
+	if(!pOutBuf || !pOutRegs || nregs == 0 || nregs > 0x7D)
+	{
+		LOG_ERROR("Invalid parameter was passed.");
 		return -1;
+	}
 
-	size_t len = nregs * 2 + 2;
-	void* pBuf;
-	MALLOC_MUST_SUCCEED(pBuf, len);
-	len = modbus_RecvPacket(device, pBuf, len, tID);
-	if(len < 0)
-		return -1;
-	if(*(uint8_t*)pBuf == 0x84)
+	int result = modbus_ReadSync(device, MB_RD_INP_REG_CODE, addr, nregs, pOutBuf);
+	if(result > 0)
 	{
 		char buf[64];
 		ipAddrToA(&device->addr, buf, 64);
 		LOG_ERROR_FORMATTED("An error ocurred while reading from the device at %s", buf);
-		return *((uint8_t*)pBuf+1);
 	}
-
-	for(int i = 2; i < len; i += 2)
-		((uint8_t*)pBuf)[i] = BIG_TO_LITTLE_ENDIAN(((uint8_t*)pBuf)[i]);
-
-	pOutRegs = (*(uint8_t*)(pBuf+1) / 2);
-	memcpy(pOutBuf, (pBuf+2), len-2);
-	free(pBuf);
-	return 0;
-}
\ No newline at end of file
+	if(result == 0)
+		*pOutRegs = nregs;
+	return result;
+}
@@ -4,4 +4,64 @@
 // Authors: Jeremy L.
 // Date Created: June 18, 2019
 //======================================================//
-#include "drvModbus.hh"
\ No newline at end of file
+#include "drvModbus.hh"
+#include "drvModbusInt.h"
+
+namespace modbus
+{
+namespace detail
+{
+
+//======================================================//
+// Name: Transact
+// Purpose: Queue a request and wait for its completion,
+// which parses the response in place
+//======================================================//
+int Transact(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_completion_t callback, SyncOp* op)
+{
+	modbus_conn_t* conn = modbus_PickConnection(device);
+	if(modbus_OnEngineThread(conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
+		return -1;
+	}
+	op->status = -1;
+	op->event = modbus_ThreadEvent();
+
+	modbus_txn_t* txn = modbus_ClaimTransaction(conn);
+	if(!txn || modbus_PrepareTransaction(conn, txn, device->unit_id, pPdu, nLen, callback, op, 0) != 0)
+		return -1;
+	modbus_QueueTransaction(conn, txn);
+	/* The engine completes it one way or another by the deadline */
+	epicsEventMustWait(op->event);
+	return op->status;
+}
+
+//======================================================//
+// Name: TransactPrepared
+// Purpose: Same as Transact, for a request from
+// modbus_PrepareRequest or PrepareRead
+//======================================================//
+int TransactPrepared(modbus_device_t* device, const modbus_prepared_t& req, modbus_completion_t callback, SyncOp* op)
+{
+	if(req.len == 0 || req.len > MODBUS_MAX_ADU)
+		return -1;
+	modbus_conn_t* conn = modbus_PickConnection(device);
+	if(modbus_OnEngineThread(conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
+		return -1;
+	}
+	op->status = -1;
+	op->event = modbus_ThreadEvent();
+
+	modbus_txn_t* txn = modbus_ClaimTransaction(conn);
+	if(!txn || modbus_PrepareFrame(conn, txn, &req, callback, op, 0) != 0)
+		return -1;
+	modbus_QueueTransaction(conn, txn);
+	epicsEventMustWait(op->event);
+	return op->status;
+}
+
+}
+}
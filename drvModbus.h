@@ -20,6 +20,10 @@ extern "C" {
 /* EPICS includes */
 #include <osiSock.h>
 #include <epicsMutex.h>
+#include <epicsSpin.h>
+#include <epicsEvent.h>
+#include <epicsTypes.h>
+#include <epicsTime.h>
 
 /* Offset of the fn error code and the actual function code in modbus_excpt_pdu_t */
 #define MB_ERRCODE_OFFSET 0x80
@@ -33,7 +37,7 @@ extern "C" {
 #define MB_RD_HOL_REG_CODE		0x03
 #define MB_WR_SIN_REG_CODE		0x06
 #define MB_WR_MULT_REG_CODE		0x10
-#define MB_RW_MULT_REG_CODE		0x23
+#define MB_RW_MULT_REG_CODE		0x17
 #define MB_MSK_WRT_REG_CODE		0x16
 #define MB_RD_FIFO_QUEUE_CODE	0x18
 #define MB_RD_FILE_REC_CODE		0x14
@@ -58,6 +62,86 @@ extern "C" {
 /* Socket that modbus should use */
 #define MODBUS_PORT 502
 
+/* Unit ID of devices made with modbus_CreateDevice. Plain TCP devices ignore it, see modbus_CreateUnit */
+#define MODBUS_DEFAULT_UNIT 255
+
+/* Max number of parallel connections to one gateway, see modbus_SetGatewayConnections */
+#define MODBUS_MAX_GATEWAY_CONNS 8
+
+/* Largest possible modbus TCP frame, and the largest PDU that fits in it */
+#define MODBUS_MAX_ADU 260
+#define MODBUS_MAX_PDU 253
+
+/* Largest possible modbus RTU frame: unit ID, PDU and CRC */
+#define MODBUS_RTU_MAX_ADU 256
+
+/* Max length of a serial port name, see modbus_CreateRtuUnit */
+#define MODBUS_MAX_PORT_NAME 64
+
+/* Hard limit on the number of outstanding requests per connection. Must be a power of 2 */
+/* Transaction IDs map onto the in-flight table as trans_id % MODBUS_MAX_INFLIGHT */
+#define MODBUS_MAX_INFLIGHT 32
+/* Default number of outstanding requests per connection. See modbus_SetWindow */
+#define MODBUS_DEFAULT_WINDOW 8
+
+/* Default time a device has to answer a request, in seconds. See modbus_SetTimeout */
+#define MODBUS_DEFAULT_TIMEOUT 1.0
+
+/* Status a request completes with if the device didn't answer in time */
+#define MODBUS_STATUS_TIMEOUT -2
+
+/* How long a connect gets before it's given up on, in seconds. See modbus_ConnectDevices */
+#define MODBUS_DEFAULT_CONNECT_TIMEOUT 2.0
+/* After a failed connect, the device isn't tried again for a while. The wait starts at the min and doubles with */
+/* every failure in a row, up to the max. In seconds */
+#define MODBUS_CONNECT_BACKOFF_MIN 0.1
+#define MODBUS_CONNECT_BACKOFF_MAX 30.0
+
+/* Protocol limits on the size of a single read */
+#define MODBUS_MAX_READ_REGS 125
+#define MODBUS_MAX_READ_BITS 2000
+
+/* Protocol limits on the size of a single write */
+#define MODBUS_MAX_WRITE_REGS 123
+#define MODBUS_MAX_WRITE_BITS 1968
+/* Registers written by a read/write multiple registers request (0x17) */
+#define MODBUS_MAX_RW_WRITE_REGS 121
+/* Registers in a FIFO queue (0x18) */
+#define MODBUS_MAX_FIFO_REGS 31
+/* Registers of a file in one read (0x14) or write (0x15) file record request. Records are numbered 0 to 9999 */
+/* A read is held to 121 by the 0xF5 cap on the response's data length (2 + 2 * 121 bytes) */
+#define MODBUS_MAX_FILE_READ_REGS 121
+#define MODBUS_MAX_FILE_WRITE_REGS 122
+#define MODBUS_MAX_FILE_RECORDS 10000
+/* File record requests a file transfer keeps outstanding at once */
+#define MODBUS_FILE_DEPTH 8
+
+/* Most engines modbus_SetEngineThreads can start */
+#define MODBUS_MAX_ENGINES 64
+
+/* How engines do their I/O, see modbus_SetEngineBackend */
+#define MODBUS_BACKEND_POLL 0 /* Readiness through epoll on Linux, poll() elsewhere */
+#define MODBUS_BACKEND_URING 1 /* Submissions and completions through io_uring. Linux only */
+
+/* Most ranges modbus_ReadCached will add to a device's image, see modbus_SetCacheSize */
+#define MODBUS_MAX_CACHE_RANGES 256
+
+/* Adaptive window tuning, see modbus_SetAdaptiveWindow */
+#define MODBUS_ADAPT_BACKOFF 0.5 /* Cut on a timeout, a busy device or gateway, or a dropped connection */
+#define MODBUS_ADAPT_EASE 0.85 /* Cut when requests queue up in the device instead of running side by side */
+#define MODBUS_ADAPT_LATENCY_FACTOR 2 /* Round trips this many times the lowest one mean requests are queuing */
+#define MODBUS_ADAPT_LATENCY_SLACK 0.002 /* Seconds on top of that, so jitter on fast links isn't taken for queuing */
+#define MODBUS_ADAPT_RTT_EPOCH 10.0 /* Seconds the lowest round trip is remembered for */
+
+/* Default number of unrequested registers (or coils) a merged read may span between two reads */
+/* See modbus_SetCoalesceGap */
+#define MODBUS_DEFAULT_COALESCE_GAP 0
+
+/* Function codes with their own latency histogram, see modbus_stats_t. The rest share slot 0 */
+#define MODBUS_STAT_FUNCS 11
+/* Buckets of a latency histogram. 8 per power of two of microseconds, up to about 4 minutes */
+#define MODBUS_STAT_BUCKETS 208
+
 typedef struct
 {
 	uint16_t trans_id;
@@ -80,22 +164,852 @@ typedef struct
 	uint8_t err_code;
 } __attribute__((packed)) modbus_excpt_pdu_t;
 
+/*
+Called when a transaction completes.
+	-	status is 0 if OK, the modbus exception code if the device rejected the request,
+		MODBUS_STATUS_TIMEOUT if the device didn't answer in time, or -1 on error
+	-	pPdu is the response PDU (function code first). It's NULL if status is negative, and only valid during the call
+*/
+typedef void (*modbus_completion_t)(void* pUser, int status, const uint8_t* pPdu, size_t nLen);
+
+/*
+Called when a read from modbus_ReadAsync completes.
+	-	status is the same as for modbus_completion_t
+	-	For register reads, pData is nCount registers in host order. For coils and discrete inputs,
+		it's nCount bits packed 8 to a byte, LSB first. It's NULL unless status is 0, and only valid during the call
+*/
+typedef void (*modbus_read_cb)(void* pUser, int status, const void* pData, uint16_t nCount);
+
+/* Called when a write from modbus_WriteRegisterAsync completes. status is the same as for modbus_completion_t */
+typedef void (*modbus_write_cb)(void* pUser, int status);
+
+/*
+Called with each piece of a file read by modbus_ReadFile, as it arrives.
+	-	record is the record pRegs starts at. Pieces can arrive out of order
+	-	pRegs is nRegs registers in host order, only valid during the call
+*/
+typedef void (*modbus_file_sink)(void* pUser, uint16_t record, const uint16_t* pRegs, uint16_t nRegs);
+
+/* Called once a file transfer is done. status is 0 if all of it made it, otherwise the status of the first piece */
+/* that didn't, the same as for modbus_completion_t */
+typedef void (*modbus_file_cb)(void* pUser, int status);
+
+/* Request for modbus_SubmitBatch */
+typedef struct
+{
+	const void* pPdu; /* Function code first. Multi-byte fields must already be big-endian */
+	size_t nLen;
+	modbus_completion_t callback;
+	void* pUser;
+	double timeout; /* Seconds. 0 to use the device's timeout */
+} modbus_request_t;
+
+/* Request for modbus_SubmitQueued. Owned by the caller, and can't be touched until callback is called */
+typedef struct modbus_queued
+{
+	const void* pPdu; /* Has to stay around until callback is called */
+	size_t nLen;
+	modbus_completion_t callback;
+	void* pUser;
+	double timeout; /* Seconds. 0 to use the device's timeout */
+	uint8_t unit; /* Filled in by modbus_SubmitQueued */
+	struct modbus_queued* next;
+} modbus_queued_t;
+
+/*
+Request framed once by modbus_PrepareRequest, to be sent any number of times with modbus_SubmitPrepared.
+Only the transaction ID is patched in when it goes out. Plain data, so it can be copied around freely,
+or built at compile time with modbus::PrepareRead in the C++ wrapper
+*/
+typedef struct
+{
+	uint8_t adu[MODBUS_MAX_ADU]; /* MBAP header and PDU. For serial lines, the whole RTU frame, CRC included */
+	uint16_t len; /* Bytes of adu in use */
+	uint16_t resp_len; /* Length of the PDU of a normal response, or 0 if it can't be known up front */
+	uint8_t rtu; /* Framed for a serial line, so there's no transaction ID to patch */
+	uint8_t func;
+} modbus_prepared_t;
+
+/*
+Counters for a connection or a unit ID, or summed over a gateway's connections by modbus_GetGatewayStats.
+Only the engine thread writes them, so they're plain counters, and sums taken while requests are
+running may be a little behind
+*/
+typedef struct
+{
+	epicsUInt64 requests; /* Sent */
+	epicsUInt64 responses; /* Including exceptions */
+	epicsUInt64 timeouts;
+	epicsUInt64 errors; /* Failed without a response some other way, e.g. the connection dropped */
+	epicsUInt64 unmatched; /* Responses that didn't belong to any outstanding request */
+	epicsUInt64 exceptions[16]; /* Exception responses by code. Slot 0 counts codes above 15 */
+	epicsUInt64 connects; /* Times the socket (or serial port) was opened */
+	epicsUInt64 bytes_out;
+	epicsUInt64 bytes_in;
+	int inflight; /* Outstanding right now. Only filled in by modbus_GetStats */
+	int peak_inflight;
+	/* Round trip times of responses, from the last byte of the request going out to the response */
+	/* coming in. [modbus_StatFunc(func)][bucket], see modbus_StatsPercentile */
+	epicsUInt32 latency[MODBUS_STAT_FUNCS][MODBUS_STAT_BUCKETS];
+} modbus_stats_t;
+
+/* I/O engine, see modbus_CreateEngine */
+typedef struct modbus_engine modbus_engine_t;
+
+/* Connections to one IP, shared by every device behind it */
+typedef struct modbus_gateway modbus_gateway_t;
+
+/* Scan list, see modbus_CreateScanList */
+typedef struct modbus_scanlist modbus_scanlist_t;
+
+/* Latest scanned values of a device, see modbus_ReadImage */
+typedef struct modbus_image modbus_image_t;
+
+/* Change notifications for a range of an image, see modbus_Subscribe */
+typedef struct modbus_subscription modbus_subscription_t;
+
+/*
+Types of values for modbus_field_t. 32-bit values span 2 registers, 64-bit ones span 4
+*/
+#define MODBUS_TYPE_UINT16	0
+#define MODBUS_TYPE_INT16	1
+#define MODBUS_TYPE_UINT32	2
+#define MODBUS_TYPE_INT32	3
+#define MODBUS_TYPE_FLOAT32	4
+#define MODBUS_TYPE_UINT64	5
+#define MODBUS_TYPE_INT64	6
+#define MODBUS_TYPE_FLOAT64	7
+
+/*
+Order of the bytes of a value in the registers it spans, as they come over the wire. A is the most significant byte.
+Devices disagree on this, so check the manual
+*/
+#define MODBUS_ORDER_ABCD	0 /* Big-endian, most significant register first */
+#define MODBUS_ORDER_CDAB	1 /* Least significant register first. The usual "word swapped" float */
+#define MODBUS_ORDER_BADC	2 /* Registers in order, but the bytes in each one swapped */
+#define MODBUS_ORDER_DCBA	3 /* Little-endian */
+
+/* One value in a block of registers, see modbus_CompileLayout */
+typedef struct
+{
+	uint8_t type; /* MODBUS_TYPE_* */
+	uint8_t order; /* MODBUS_ORDER_* */
+	uint16_t offset; /* Register the value starts at, counted from the start of the block */
+	double scale; /* The value is multiplied by this. 0 is the same as 1 */
+} modbus_field_t;
+
+/* Compiled list of fields, see modbus_CompileLayout */
+typedef struct modbus_layout modbus_layout_t;
+
+/* Flags for modbus_Subscribe */
+#define MODBUS_SUB_SIGNED 0x1 /* Registers hold signed values, for working out whether they've moved past their deadband */
+
+/*
+Called when points in a subscribed range change.
+	-	status is the same as for modbus_read_cb. Errors are only passed on when they start,
+		or turn into a different error
+	-	addr and count are the subscribed range
+	-	pValues holds every point in the range, in the same layout as modbus_read_cb's pData. It's NULL unless
+		status is 0, and only valid during the call
+	-	Bit i of pChanged (LSB first, 32 to a word) is set if point addr + i has changed since it was last
+		passed on. On the first call, every bit is set
+*/
+typedef void (*modbus_change_cb)(void* pUser, int status, uint16_t addr, uint16_t count, const void* pValues,
+	const epicsUInt32* pChanged);
+
 /* Simple device connected via modbus tcp */
+/* Every device at the same IP (a gateway, and the units behind it) shares one pool of TCP connections, */
+/* driven by an I/O engine. A socket is opened when the first request is queued on it and kept open */
+/* between calls. If an I/O error occurs, the socket is closed and will be reopened for the next request */
+/* There's no per-device lock. Threads calling into the same device only contend on the brief */
+/* enqueue of their transaction, see modbus_SetWindow */
+typedef struct modbus_device modbus_device_t;
+
+/* Piece of a file transfer. One per request outstanding */
 typedef struct
 {
-	epicsMutexId mutex;
-	struct sockaddr_in addr;
-} modbus_device_t;
+	struct modbus_file_xfer* xfer;
+	modbus_queued_t req;
+	uint16_t record;
+	uint16_t count;
+	uint8_t pdu[MODBUS_MAX_PDU];
+} modbus_file_slot_t;
 
-/* Create a device with the specified IP */
+/* A file transfer from modbus_ReadFileAsync or modbus_WriteFileAsync. Owned by the caller, and can't be touched */
+/* until done is called. Filled in by the functions that start it */
+typedef struct modbus_file_xfer
+{
+	modbus_device_t* device;
+	uint8_t func;
+	uint16_t file;
+	uint16_t next; /* Record the next piece starts at */
+	uint32_t remaining; /* Registers not requested yet */
+	uint16_t first; /* Record the transfer started at */
+	const uint16_t* pValues; /* What's being written */
+	modbus_file_sink sink;
+	modbus_file_cb done;
+	void* pUser;
+	int outstanding;
+	int status;
+	modbus_file_slot_t slots[MODBUS_FILE_DEPTH];
+} modbus_file_xfer_t;
+
+/* Create a device with the specified IP. Same as modbus_CreateUnit with MODBUS_DEFAULT_UNIT */
 modbus_device_t* modbus_CreateDevice(const struct sockaddr_in* ip);
 
-/* Destroy a device */
+/*
+Name: modbus_CreateUnit
+Desc: Create a device behind a gateway, e.g. one of the serial units on a TCP to RTU gateway
+Params:
+	-	ip: the address of the gateway
+	-	unit: the unit ID of the device, put in the MBAP header of every request to it
+Notes:
+	-	Returns NULL on error
+	-	Every device at the same address shares the gateway's connections, so the window, timeout and
+		coalesce gap set on any of them apply to all of them
+	-	Reads are only ever merged with reads of the same unit
+*/
+modbus_device_t* modbus_CreateUnit(const struct sockaddr_in* ip, uint8_t unit);
+
+/*
+Name: modbus_SetGatewayConnections
+Desc: Set how many TCP connections are opened to the device's gateway
+Params:
+	-	device: any device at the gateway
+	-	nConns: 1 to MODBUS_MAX_GATEWAY_CONNS
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	The count can only go up. Only set it above 1 if the gateway can handle requests on several
+		connections at once
+	-	Each request goes out on the connection with the fewest outstanding. Queued reads and writes of a
+		device stay on one connection, so they can still be merged and ordered
+	-	The window (see modbus_SetWindow) applies to each connection
+	-	Serial lines only ever have one connection, see modbus_CreateRtuUnit
+*/
+int modbus_SetGatewayConnections(modbus_device_t* device, int nConns);
+
+/*
+Name: modbus_CreateRtuUnit
+Desc: Create a device on a Modbus RTU serial line (e.g. RS-485)
+Params:
+	-	pPort: the serial port, e.g. /dev/ttyS0
+	-	baud: bits per second
+	-	parity: 'E' (even, the Modbus default), 'O' (odd) or 'N' (none, with 2 stop bits)
+	-	unit: the address of the device on the line, 1 to 247
+Notes:
+	-	Returns NULL on error, e.g. if the baud rate isn't supported, or the port is already open with
+		different settings
+	-	Every device on the same port shares the line, so the window, timeout and coalesce gap set on any of
+		them apply to all of them. The port is opened when the first request is queued on it
+	-	Requests go on the bus one at a time, each as soon as the previous one has been answered and the line
+		has been quiet for 3.5 characters (1.75 ms above 19200 baud). The window is the number of requests
+		waiting their turn, so keep it above 1 to have the next request ready the moment the bus is free
+	-	The timeout starts once a request is on the wire, so time spent waiting for the bus doesn't count
+	-	Only on POSIX systems
+*/
+modbus_device_t* modbus_CreateRtuUnit(const char* pPort, int baud, char parity, uint8_t unit);
+
+/*
+Destroy a device
+	-	If other devices share its gateway, its own requests must be complete first
+*/
 void modbus_DestroyDevice(modbus_device_t* device);
 
 /* Init the modbus stuff */
 void modbus_Init();
 
+/* Shutdown the modbus driver */
+void modbus_Shutdown();
+
+/*
+Name: modbus_CreateEngine
+Desc: Create an I/O engine. An engine is a thread that does all socket I/O for the devices attached to it
+Params:
+	-	pName: name of the engine thread
+Notes:
+	-	Returns NULL on error
+	-	Uses epoll on Linux, and poll() elsewhere, unless modbus_SetEngineBackend says otherwise
+	-	Devices are attached to one of the default engines (see modbus_SetEngineThreads) when they're created.
+		A single engine can drive thousands of devices, make more of them to spread the load over more threads
+*/
+modbus_engine_t* modbus_CreateEngine(const char* pName);
+
+/*
+Name: modbus_DestroyEngine
+Desc: Stop an engine's thread and free it
+Notes:
+	-	Devices attached to the engine must be destroyed first
+*/
+void modbus_DestroyEngine(modbus_engine_t* engine);
+
+/*
+Name: modbus_SetEngineThreads
+Desc: Spread new devices over several engines, each with its own thread, instead of just the default one
+Params:
+	-	nThreads: the number of engines, 1 (the default) to MODBUS_MAX_ENGINES
+	-	pCpus: NULL, or nThreads CPU numbers to pin each engine's thread to. -1 leaves that one unpinned
+Notes:
+	-	Returns 0 if OK, or -1 on error, including if the engines have already been started
+	-	Has to be called before modbus_Init, since that starts them
+	-	Each new gateway (or serial line) goes on the engine its address (or port name) hashes to. All the
+		units and connections behind it stay on that engine, so engines never share a connection, and
+		requests only contend with other requests to the same gateway
+	-	Any thread can submit to any engine. Submitters hand connections to an engine without locking
+	-	Pinning is only supported on Linux. Elsewhere the threads run unpinned
+*/
+int modbus_SetEngineThreads(int nThreads, const int* pCpus);
+
+/*
+Name: modbus_SetEngineBackend
+Desc: Choose how engines created from now on do their I/O
+Params:
+	-	backend: MODBUS_BACKEND_POLL (the default) or MODBUS_BACKEND_URING
+Notes:
+	-	Returns 0 if OK, or -1 if the backend isn't known or wasn't built in
+	-	Call it before modbus_Init for the default engines to pick it up
+	-	With MODBUS_BACKEND_URING, each engine submits every send it has ready in one system call per loop,
+		and receives into buffers registered with the kernel without asking whether there's anything to read.
+		Serial lines on the engine are still polled, just through the ring
+	-	An engine falls back to epoll if the kernel can't do what it needs (multishot receives and provided
+		buffer rings, 6.0 or later), or io_uring is turned off. The fallback is printed
+	-	Built in on Linux when the kernel headers have it. Define MODBUS_NO_IO_URING to leave it out
+*/
+int modbus_SetEngineBackend(int backend);
+
+/* Returns the engine new devices are attached to if there's only one, otherwise the first of them */
+/* They're started the first time this is called */
+modbus_engine_t* modbus_DefaultEngine();
+
+/*
+Name: modbus_AttachDevice
+Desc: Move a device over to a different engine
+Notes:
+	-	Returns 0 if OK, or -1 if the device has requests outstanding, an open connection, or one waiting to be
+		tried again (see modbus_ConnectDevices)
+	-	Moves every device at the same gateway, since they share its connections
+*/
+int modbus_AttachDevice(modbus_engine_t* engine, modbus_device_t* device);
+
+/*
+Name: modbus_SetWindow
+Desc: Set the max number of requests that can be outstanding on the device at once
+Params:
+	-	device: the target device
+	-	window: 1 to MODBUS_MAX_INFLIGHT
+Notes:
+	-	Returns 0 if OK, -1 if window is out of range
+	-	Lowering the window doesn't affect requests that are already outstanding
+*/
+int modbus_SetWindow(modbus_device_t* device, int window);
+
+/*
+Name: modbus_ConnectDevices
+Desc: Connect to many devices at once, and keep them connected
+Params:
+	-	pDevices: the devices. Ones sharing a gateway are only connected once
+	-	nDevices: how many there are
+	-	timeout: how long each connect gets before it's given up on, in seconds
+Notes:
+	-	Returns how many of the devices are connected, or -1 on error
+	-	Every connect is started at once, and none of them block, so this returns within about timeout
+		however many devices don't answer
+	-	Devices that couldn't be reached are tried again in the background, MODBUS_CONNECT_BACKOFF_MIN after
+		the first failure and twice as long after each one in a row, up to MODBUS_CONNECT_BACKOFF_MAX. Until
+		then their requests fail straight away instead of waiting out their timeout. All devices back off
+		like this, it's just that the others only try again once there's a request for them
+	-	Serial lines are skipped, since opening a port never waits on the other end. They don't count as connected
+*/
+int modbus_ConnectDevices(modbus_device_t** pDevices, int nDevices, double timeout);
+
+/*
+Name: modbus_SetTimeout
+Desc: Set how long the device has to answer each request
+Params:
+	-	device: the target device
+	-	timeout: in seconds. 0 or less means requests wait forever
+Notes:
+	-	Returns 0 if OK, -1 on error
+	-	A request that times out completes with MODBUS_STATUS_TIMEOUT. The connection is
+		then closed, since a late answer can't be told apart from the answer to a later request.
+		Everything else outstanding on it completes with MODBUS_STATUS_TIMEOUT too
+	-	Only affects requests submitted afterwards
+*/
+int modbus_SetTimeout(modbus_device_t* device, double timeout);
+
+/*
+Name: modbus_SetAdaptiveWindow
+Desc: Let the window of a device's gateway find its own size, somewhere between minWindow and maxWindow
+Params:
+	-	device: any device at the gateway
+	-	minWindow: the smallest the window can get, at least 1
+	-	maxWindow: the largest it can get, at most MODBUS_MAX_INFLIGHT
+Notes:
+	-	Returns 0 if OK, or -1 on error, including for serial lines, which only have one request on the wire anyway
+	-	The window grows by one for each window's worth of responses, as long as it's full enough to matter.
+		It's cut in half on a timeout, a dropped connection, or a MODBUS_ERR_DEVICE_BUSY or
+		MODBUS_ERR_GATEWAY_UNRESP exception, and by a bit when round trips climb past
+		MODBUS_ADAPT_LATENCY_FACTOR times the lowest one seen, which means the device is queuing them
+	-	It's cut at most once per round trip, since everything already outstanding was sent with the old window
+	-	Each connection to the gateway adapts on its own. modbus_SetWindow goes back to a fixed window
+*/
+int modbus_SetAdaptiveWindow(modbus_device_t* device, int minWindow, int maxWindow);
+
+/*
+Name: modbus_SubmitRequest
+Desc: Send a request PDU to the device without waiting for the response
+Params:
+	-	device: the target device
+	-	pPdu: the request PDU, function code first. Multi-byte fields must already be big-endian
+	-	nLen: the length of the PDU, at most MODBUS_MAX_PDU
+	-	callback: called from the device's engine thread when the response arrives
+	-	pUser: passed to callback
+Notes:
+	-	Returns the transaction ID if OK, or -1 on error
+	-	If the window is full, this blocks until a slot frees up
+	-	Responses are matched by transaction ID, so they may complete out of order
+	-	callback runs on the engine thread, so it must not block. It may submit more requests as long as
+		the window has room
+	-	pPdu is copied before this returns, so it doesn't need to stay around
+	-	The device's timeout applies, see modbus_SetTimeout
+*/
+int modbus_SubmitRequest(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_completion_t callback, void* pUser);
+
+/*
+Name: modbus_SubmitRequestTimeout
+Desc: Same as modbus_SubmitRequest, with a timeout for just this request
+Params:
+	-	timeout: in seconds. 0 to use the device's timeout, less than 0 to wait forever
+*/
+int modbus_SubmitRequestTimeout(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_completion_t callback,
+	void* pUser, double timeout);
+
+/*
+Name: modbus_SubmitBatch
+Desc: Send several requests without waiting for the responses
+Params:
+	-	device: the target device
+	-	pReqs: the requests, see modbus_SubmitRequest for what each field means
+	-	nReqs: the number of requests
+Notes:
+	-	Returns the number of requests submitted, or -1 if none were
+	-	Requests are sent in order. Everything the engine hasn't sent yet goes out in a single syscall
+	-	If the window is full, this blocks until there's room for more
+*/
+int modbus_SubmitBatch(modbus_device_t* device, const modbus_request_t* pReqs, int nReqs);
+
+/*
+Name: modbus_SubmitQueued
+Desc: Send a request without ever blocking, even if the window is full
+Params:
+	-	device: the target device
+	-	req: the request. See modbus_SubmitRequest for what each field means. next is used by the queue
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	If the window is full, req waits on the device and goes out from the engine thread once there's room.
+		Requests queued this way go out in order
+	-	Nothing is copied until the request goes out, so req and its PDU have to stay around until callback is called
+	-	Safe to call from the engine thread, e.g. from a completion callback
+*/
+int modbus_SubmitQueued(modbus_device_t* device, modbus_queued_t* req);
+
+/*
+Name: modbus_PrepareRequest
+Desc: Frame a request once, for a request sent over and over, e.g. a fixed poll
+Params:
+	-	device: the device it will be sent to. The framing depends on its unit ID, and whether it's on a serial line
+	-	pPdu: the request PDU, function code first. Multi-byte fields must already be big-endian
+	-	nLen: the length of the PDU, at most MODBUS_MAX_PDU
+	-	pOut: gets the framed request
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	The length of the response is worked out from the request where the function code allows it.
+		Responses that don't have that length complete with status -1, so callbacks don't have to check it
+	-	pOut can be sent to any device with the same unit ID and transport
+*/
+int modbus_PrepareRequest(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_prepared_t* pOut);
+
+/*
+Name: modbus_SubmitPrepared
+Desc: Same as modbus_SubmitRequestTimeout, for a request from modbus_PrepareRequest
+Notes:
+	-	Returns the transaction ID if OK, or -1 on error, including if req was framed for a different transport
+	-	req is copied before this returns
+*/
+int modbus_SubmitPrepared(modbus_device_t* device, const modbus_prepared_t* req, modbus_completion_t callback,
+	void* pUser, double timeout);
+
+/*
+Name: modbus_TransactPrepared
+Desc: Send a request from modbus_PrepareRequest, and wait for the response
+Params:
+	-	device: the target device
+	-	req: the request
+	-	pOut: gets the response PDU
+	-	pOutLen: the size of pOut going in, and the length of the response coming out. Longer responses are truncated
+Notes:
+	-	Returns 0 if OK, the modbus exception code if the device rejected the request, MODBUS_STATUS_TIMEOUT,
+		or -1 on error
+	-	Can't be called from the engine thread
+*/
+int modbus_TransactPrepared(modbus_device_t* device, const modbus_prepared_t* req, void* pOut, size_t* pOutLen);
+
+/*
+Name: modbus_WaitAll
+Desc: Wait for every outstanding request on the device to complete
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	On a connection error, all outstanding requests are completed with status -1
+	-	Waits for the requests of every device at the same gateway, since they share its connections
+*/
+int modbus_WaitAll(modbus_device_t* device);
+
+
+/*
+Name: modbus_GetStats
+Desc: Get the counters and latency histograms of a device
+Params:
+	-	device: the device
+	-	pOut: filled in with the device's stats
+Notes:
+	-	Returns 0 if OK, -1 on error
+	-	requests, responses, timeouts, errors, exceptions, bytes_out and latency only count the device's own
+		requests. The rest (connects, unmatched, bytes_in, inflight, peak_inflight) are the gateway's, same as
+		modbus_GetGatewayStats, since they belong to connections every unit behind it shares
+	-	Devices with the same unit ID at the same gateway (or serial line) are the same device as far as this
+		is concerned. Counters run from when the first of them was created
+	-	Always on. Each request costs a few increments on the engine thread, and nothing on the caller's
+*/
+int modbus_GetStats(modbus_device_t* device, modbus_stats_t* pOut);
+
+/*
+Name: modbus_GetGatewayStats
+Desc: Get the counters and latency histograms of the connections to a device's gateway
+Params:
+	-	device: any device at the gateway
+	-	pOut: filled in with the sums over every connection, for every unit behind it
+Notes:
+	-	Returns 0 if OK, -1 on error
+	-	Counters run from when the gateway was first used
+*/
+int modbus_GetGatewayStats(modbus_device_t* device, modbus_stats_t* pOut);
+
+/*
+Name: modbus_StatsPercentile
+Desc: Get a percentile of the round trip times of a function code
+Params:
+	-	pStats: from modbus_GetStats or modbus_GetGatewayStats
+	-	func: the function code, or 0 for every function code together
+	-	pct: the percentile, 0 to 100
+Notes:
+	-	Returns the time in seconds, or -1 if there were no responses to go by
+	-	Buckets are 1/8 of a power of two wide, so the result is within about 6% of the real time
+*/
+double modbus_StatsPercentile(const modbus_stats_t* pStats, uint8_t func, double pct);
+
+/* Returns the slot of modbus_stats_t::latency a function code's round trip times go in */
+int modbus_StatFunc(uint8_t func);
+
+/*
+Name: modbus_Report
+Desc: Print the stats of every gateway (and serial line) in use
+Params:
+	-	level: 0 for one line per gateway, 1 to add a line per unit ID and per function code, 2 to add
+		exception counts
+Notes:
+	-	Available in the IOC shell as modbusReport, once the IOC's dbd includes modbusSupport.dbd
+		(registrar(modbusRegister))
+	-	Sort the output on the p99 column to find the slowest gateways, and the unit lines under one to find
+		the slowest devices behind it
+*/
+void modbus_Report(int level);
+
+/*
+Name: modbus_SetCoalesceGap
+Desc: Set how far apart two reads on the device can be and still be merged into one request
+Params:
+	-	device: the target device
+	-	gap: the number of unrequested registers (or coils) allowed between them. Less than 0 turns merging off
+Notes:
+	-	Returns 0 if OK, -1 on error
+	-	Merged reads that the device rejects with MODBUS_ERR_ILLEGAL_ADDR are retried one by one,
+		so a gap covering unmapped addresses costs a round trip but doesn't break anything
+*/
+int modbus_SetCoalesceGap(modbus_device_t* device, int gap);
+
+/*
+Name: modbus_ReadAsync
+Desc: Queue a read, to be merged with other queued reads of the same kind
+Params:
+	-	device: the target device
+	-	func: MB_RD_COILS_CODE, MB_RD_DISC_INPUTS_CODE, MB_RD_HOL_REG_CODE or MB_RD_INP_REG_CODE
+	-	addr: the first address to read
+	-	count: the number to read, up to MODBUS_MAX_READ_REGS registers or MODBUS_MAX_READ_BITS coils
+	-	callback: called from the engine thread with the values
+	-	pUser: passed to callback
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	Reads with the same function code that overlap, touch, or are within the coalesce gap of each other are
+		sent as a single request, up to the protocol limits. The response is split back up between them
+	-	Everything queued while the engine is busy, or while the window is full, gets merged together
+	-	callback has the same restrictions as the one passed to modbus_SubmitRequest
+*/
+int modbus_ReadAsync(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, modbus_read_cb callback, void* pUser);
+
+/*
+Name: modbus_RegistersFromWire
+Desc: Convert registers from the big-endian wire format to host order, e.g. from a response to modbus_SubmitRequest
+Params:
+	-	pWire: 2 * nRegs bytes, straight from the PDU
+	-	pOut: gets nRegs registers. Can be the same memory as pWire
+	-	nRegs: the number of registers
+Notes:
+	-	Uses AVX2, SSSE3 or NEON when the CPU has them. This is what all the readers in this driver use
+*/
+void modbus_RegistersFromWire(const uint8_t* pWire, uint16_t* pOut, size_t nRegs);
+
+/* The reverse of modbus_RegistersFromWire, for building requests */
+void modbus_RegistersToWire(const uint16_t* pIn, uint8_t* pWire, size_t nRegs);
+
+/*
+Name: modbus_UnpackCoils
+Desc: Expand coils (or discrete inputs) packed 8 to a byte, LSB first, into one byte each
+Params:
+	-	pPacked: (nCoils + 7) / 8 bytes, as returned by modbus_ReadCoils
+	-	pOut: gets nCoils bytes, each 0 or 1
+	-	nCoils: the number of coils
+Notes:
+	-	Uses AVX2, SSSE3 or NEON when the CPU has them
+*/
+void modbus_UnpackCoils(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils);
+
+/*
+Name: modbus_PackCoils
+Desc: The reverse of modbus_UnpackCoils. Packs one byte per coil (any non-zero value is on) into 8 to a byte
+Params:
+	-	pIn: nCoils bytes
+	-	pPacked: gets (nCoils + 7) / 8 bytes. Unused bits of the last byte are cleared
+	-	nCoils: the number of coils
+*/
+void modbus_PackCoils(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils);
+
+/*
+Name: modbus_CompileLayout
+Desc: Compile a list of the values in a block of registers, so blocks can be decoded in a single pass
+Params:
+	-	pFields: the fields. They can overlap, and don't need to be in order
+	-	nFields: the number of fields
+Notes:
+	-	Returns NULL on error, including if a field doesn't fit in MODBUS_MAX_READ_REGS registers
+	-	Where each byte of each value comes from is worked out here, so decoding is just a gather per field
+	-	The C++ wrapper has modbus::Layout, which does the same thing at compile time
+*/
+modbus_layout_t* modbus_CompileLayout(const modbus_field_t* pFields, int nFields);
+
+/* Free a layout from modbus_CompileLayout */
+void modbus_DestroyLayout(modbus_layout_t* layout);
+
+/* Returns the number of registers a block needs to hold every field of the layout, or -1 on error */
+int modbus_LayoutSpan(const modbus_layout_t* layout);
+
+/*
+Name: modbus_DecodeWire
+Desc: Decode the fields of a layout straight from big-endian registers, e.g. the payload of a response
+Params:
+	-	layout: the compiled layout
+	-	pWire: the registers, as they came over the wire
+	-	nRegs: the number of registers in pWire
+	-	pOut: gets one value per field, in the order they were passed to modbus_CompileLayout, already scaled
+Notes:
+	-	Returns 0 if OK, or -1 on error, including if nRegs is less than modbus_LayoutSpan
+	-	There's no need to swap the registers first
+*/
+int modbus_DecodeWire(const modbus_layout_t* layout, const uint8_t* pWire, uint16_t nRegs, double* pOut);
+
+/* Same as modbus_DecodeWire, for registers already in host order (from modbus_ReadHoldingRegisters, or the image) */
+int modbus_DecodeRegisters(const modbus_layout_t* layout, const uint16_t* pRegs, uint16_t nRegs, double* pOut);
+
+/*
+Name: modbus_CreateScanList
+Desc: Create an empty scan list. A scan list reads blocks of points at fixed rates, and keeps the latest
+	values of each block in an image that can be read at any time without waiting on the device
+Params:
+	-	pName: name of the list's thread
+Notes:
+	-	Returns NULL on error
+	-	Add blocks with modbus_AddScanBlock, then start it with modbus_StartScanList
+	-	Blocks can be on any number of devices. A single list (and thread) can scan a whole fleet
+*/
+modbus_scanlist_t* modbus_CreateScanList(const char* pName);
+
+/*
+Name: modbus_DestroyScanList
+Desc: Stop a scan list and free it
+Notes:
+	-	Devices being scanned must not be destroyed until the list has been stopped or destroyed
+*/
+void modbus_DestroyScanList(modbus_scanlist_t* list);
+
+/*
+Name: modbus_AddScanBlock
+Desc: Add a block of points to a scan list
+Params:
+	-	list: the target scan list
+	-	device: the device to read the block from
+	-	period: how often to read it, in seconds
+	-	func: MB_RD_COILS_CODE, MB_RD_DISC_INPUTS_CODE, MB_RD_HOL_REG_CODE or MB_RD_INP_REG_CODE
+	-	addr: the first address in the block
+	-	count: the number of points, up to MODBUS_MAX_READ_REGS registers or MODBUS_MAX_READ_BITS coils
+Notes:
+	-	Returns the index of the block, used to read it back with modbus_GetScanBlock, or -1 on error
+	-	Blocks can't be added once the list has been started
+	-	Blocks with the same period are scanned together as a group. When the list starts, the blocks in
+		a group that are within the device's coalesce gap of each other (see modbus_SetCoalesceGap) are
+		merged, and the request for each merged read is built once up front
+	-	The requests in a group are spread evenly over the period, so they don't all go out at once
+*/
+int modbus_AddScanBlock(modbus_scanlist_t* list, modbus_device_t* device, double period, uint8_t func,
+	uint16_t addr, uint16_t count);
+
+/*
+Name: modbus_StartScanList
+Desc: Start the scan list's thread
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	If a read is still outstanding when its block is due again, or the device's window is full, that
+		scan is skipped and counted as an overrun, see modbus_ScanListOverruns
+	-	Merged reads the device rejects with MODBUS_ERR_ILLEGAL_ADDR are split back up into their blocks
+	-	Not thread safe with modbus_StopScanList
+*/
+int modbus_StartScanList(modbus_scanlist_t* list);
+
+/*
+Name: modbus_StopScanList
+Desc: Stop the scan list's thread, and wait for the reads it sent to complete
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	The image keeps the values it had. The list can be started again
+*/
+int modbus_StopScanList(modbus_scanlist_t* list);
+
+/*
+Name: modbus_GetScanBlock
+Desc: Get the latest values of a block from the image
+Params:
+	-	list: the scan list
+	-	block: the index returned by modbus_AddScanBlock
+	-	pOut: gets the values, in the same layout as modbus_read_cb's pData. Needs room for count
+		registers, or (count + 7) / 8 bytes of coils
+	-	pTime: if not NULL, gets the time the values were read at
+Notes:
+	-	Returns the status of the last scan of the block: 0 if OK, otherwise the same as modbus_read_cb.
+		-1 if it hasn't been scanned yet
+	-	pOut and pTime are filled in from the last successful scan, even if the last scan failed.
+		They're left alone if there hasn't been one
+	-	Never waits on the device. The values live in the device's image, see modbus_ReadImage
+*/
+int modbus_GetScanBlock(modbus_scanlist_t* list, int block, void* pOut, epicsTimeStamp* pTime);
+
+/* Returns the number of scans that were skipped since the list was created, or -1 on error */
+int modbus_ScanListOverruns(modbus_scanlist_t* list);
+
+/*
+Name: modbus_ReadImage
+Desc: Take a snapshot of a range of a device's process image
+Params:
+	-	device: the device
+	-	func: the kind of points, MB_RD_COILS_CODE, MB_RD_DISC_INPUTS_CODE, MB_RD_HOL_REG_CODE or MB_RD_INP_REG_CODE
+	-	addr: the first address
+	-	count: the number of points
+	-	pOut: gets the values, in the same layout as modbus_read_cb's pData
+	-	pTime: if not NULL, gets the time the values were read at
+	-	pGeneration: if not NULL, gets the number of times the values of the block the range is in have changed
+Notes:
+	-	Returns the status of the last scan of the block the range is in: 0 if OK, otherwise the same as
+		modbus_read_cb. -1 if the range isn't all in one scan block (see modbus_AddScanBlock), or the block
+		hasn't been scanned yet
+	-	pOut, pTime and pGeneration come from the last successful scan, even if the last scan failed.
+		They're left alone if there hasn't been one
+	-	The image is published with a sequence lock, so this never blocks the I/O engine, and the values
+		always come from a single scan. Safe to call from any thread, as often as needed
+*/
+int modbus_ReadImage(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, void* pOut,
+	epicsTimeStamp* pTime, epicsUInt32* pGeneration);
+
+/* Returns the number of times any value in the device's image has changed. Cheap enough to poll */
+epicsUInt32 modbus_ImageGeneration(modbus_device_t* device);
+
+/*
+Name: modbus_Subscribe
+Desc: Get called back with just the points that changed, each time a range of a device's image is scanned
+Params:
+	-	device: the device
+	-	func: the kind of points, same as for modbus_ReadImage
+	-	addr: the first address
+	-	count: the number of points
+	-	pDeadbands: NULL, or count deadbands for registers. A register only counts as changed once it has
+		moved by more than its deadband since it was last passed on. 0 means any change. Ignored for coils
+	-	flags: MODBUS_SUB_* flags, or 0
+	-	callback: called from the engine thread when something changes
+	-	pUser: passed to callback
+Notes:
+	-	Returns NULL on error, including if the range isn't all in one scan block (see modbus_AddScanBlock)
+	-	Changes are found by comparing each scan against the last one, so callback isn't called at all
+		for scans where nothing moved
+	-	callback has the same restrictions as the one passed to modbus_SubmitRequest, and must not
+		call modbus_Unsubscribe
+*/
+modbus_subscription_t* modbus_Subscribe(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count,
+	const uint16_t* pDeadbands, int flags, modbus_change_cb callback, void* pUser);
+
+/*
+Name: modbus_Unsubscribe
+Desc: Stop a subscription and free it
+Notes:
+	-	Once this returns, the callback isn't running and won't be called again
+	-	Subscriptions still around when their device is destroyed are freed along with it
+*/
+void modbus_Unsubscribe(modbus_subscription_t* sub);
+
+/*
+Name: modbus_SetCacheSize
+Desc: Let modbus_ReadCached keep the ranges it reads in the device's image
+Params:
+	-	device: the device
+	-	nRanges: the most ranges it may add, up to MODBUS_MAX_CACHE_RANGES. 0 (the default) adds none
+Notes:
+	-	Returns 0 if OK, or -1 on error
+	-	Ranges can be read with modbus_ReadImage or subscribed to like scanned ones, except that their
+		subscribers are called back from whichever thread read them
+	-	Once there are nRanges of them, the least recently used one is dropped to make room for the next.
+		Ranges that are subscribed to or being read are never dropped. If none can be, the new range is
+		read without being kept
+	-	Lowering nRanges drops the least recently used ranges until there are no more than nRanges
+*/
+int modbus_SetCacheSize(modbus_device_t* device, int nRanges);
+
+/*
+Name: modbus_ReadCached
+Desc: Read a range from the image if it's recent enough, otherwise from the device
+Params:
+	-	device: the device
+	-	func: the kind of points, same as for modbus_ReadImage
+	-	addr: the first address
+	-	count: the number of points, up to MODBUS_MAX_READ_REGS registers or MODBUS_MAX_READ_BITS coils
+	-	maxAge: how old the values can be, in seconds. 0 always reads from the device
+	-	pOut: gets the values, in the same layout as modbus_read_cb's pData
+	-	pTime: if not NULL, gets the time the values were read at
+Notes:
+	-	Returns 0 if OK, the modbus exception code, MODBUS_STATUS_TIMEOUT, or -1 on error
+	-	Served from the image if a scan block (see modbus_AddScanBlock) or an earlier read (see
+		modbus_SetCacheSize) holds the whole range, and its last read was good and no older than maxAge
+	-	Otherwise the range is read from the device. Threads that ask for a range that's already being read,
+		or part of one, wait for that read instead of sending their own, so a burst of the same read only
+		goes to the device once. They all get its status
+	-	A range kept by an earlier read is read whole, even if only part of it was asked for
+	-	Blocks, so it can't be called from the engine thread
+*/
+int modbus_ReadCached(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, double maxAge, void* pOut,
+	epicsTimeStamp* pTime);
 
 /*
 Name: modbus_ReadCoils
@@ -105,10 +1019,13 @@ Params:
 	-	addr: the address of the first coil
 	-	ncoils: the number of coils to read
 	-	pOutBuf: the output buffer to store the coils in
-	-	nOutCoils: the actual number of coils read
+	-	nOutCoils: the number of bytes of coil data stored
 Notes:
 	-	On error, this will return the error code. If OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
 	-	nCoils needs to be less than 0x7D0 (See modbus docs)
+	-	Coils are packed 8 to a byte, LSB first, so pOutBuf needs room for (ncoils + 7) / 8 bytes
+	-	Merged with reads of neighbouring addresses from other threads, see modbus_ReadAsync
 */
 int modbus_ReadCoils(modbus_device_t* device, uint16_t addr, uint16_t ncoils, uint8_t* pOutBuf, uint8_t* nOutCoils);
 
@@ -120,10 +1037,13 @@ Params:
 	-	addr: the address of the first coil
 	-	ncoils: the number of coils to read
 	-	poOutBuf: the output buffer to store everything into
-	-	nOutCoils: the actual number of output coils
+	-	nOutCoils: the number of bytes of input data stored
 Notes:
 	-	On error, this will return the error code. If OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
 	-	nCoils needs to be less than 0x7D0 (See modbus docs)
+	-	Inputs are packed 8 to a byte, LSB first, so pOutBuf needs room for (ncoils + 7) / 8 bytes
+	-	Merged with reads of neighbouring addresses from other threads, see modbus_ReadAsync
 */
 int modbus_ReadDiscreteInputs(modbus_device_t* device, uint16_t addr, uint16_t ncoils, uint8_t* pOutBuf, uint8_t* nOutCoils);
 
@@ -138,8 +1058,10 @@ Params:
 	-	nOutRegs: actual number of registers saved
 Notes:
 	-	On error, this will return the error code. If OK, it will return 0. -1 means application error, otherwise it's a modbus thing
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
 	-	nregs must be less than 0x7D
 	-	Items in the output buffer are all little-endian (or big-endian, depending on the system), regardless of modbus's endianess
+	-	Merged with reads of neighbouring addresses from other threads, see modbus_ReadAsync
 */
 int modbus_ReadHoldingRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, uint16_t* pOutBuf, uint16_t* nOutRegs);
 
@@ -152,9 +1074,156 @@ Params:
 	-	value: the new value
 Notes:
 	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
 */
 int modbus_WriteSingleRegister(modbus_device_t* device, uint16_t addr, uint16_t value);
 
+/*
+Name: modbus_WriteMultipleRegisters
+Desc: Write to 1 to 123 contiguous registers in one request (function code 0x10)
+Params:
+	-	device: the target device
+	-	addr: the address of the first register
+	-	nregs: the number of registers
+	-	pValues: the new values, in host order
+Notes:
+	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
+*/
+int modbus_WriteMultipleRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, const uint16_t* pValues);
+
+/*
+Name: modbus_WriteMultipleCoils
+Desc: Write to 1 to 1968 contiguous coils in one request (function code 0x0F)
+Params:
+	-	device: the target device
+	-	addr: the address of the first coil
+	-	ncoils: the number of coils
+	-	pValues: the new states, packed 8 to a byte, LSB first, same as modbus_ReadCoils gives them.
+		See modbus_PackCoils
+Notes:
+	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
+*/
+int modbus_WriteMultipleCoils(modbus_device_t* device, uint16_t addr, uint16_t ncoils, const uint8_t* pValues);
+
+/*
+Name: modbus_ReadWriteMultipleRegisters
+Desc: Write some registers, then read some, in one request (function code 0x17)
+Params:
+	-	device: the target device
+	-	rdAddr: the address of the first register to read
+	-	nRdRegs: the number of registers to read, 1 to 125
+	-	pOutBuf: gets the registers read, in host order
+	-	wrAddr: the address of the first register to write
+	-	nWrRegs: the number of registers to write, 1 to 121
+	-	pValues: the new values, in host order
+Notes:
+	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
+	-	The device does the write first, so overlapping registers read back the new values
+*/
+int modbus_ReadWriteMultipleRegisters(modbus_device_t* device, uint16_t rdAddr, uint16_t nRdRegs, uint16_t* pOutBuf,
+	uint16_t wrAddr, uint16_t nWrRegs, const uint16_t* pValues);
+
+/*
+Name: modbus_MaskWriteRegister
+Desc: Change some bits of a register, without touching the rest (function code 0x16)
+Params:
+	-	device: the target device
+	-	addr: the address of the register
+	-	andMask: bits to keep
+	-	orMask: bits to set, out of the ones not kept
+Notes:
+	-	The register ends up as (value & andMask) | (orMask & ~andMask)
+	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
+*/
+int modbus_MaskWriteRegister(modbus_device_t* device, uint16_t addr, uint16_t andMask, uint16_t orMask);
+
+/*
+Name: modbus_ReadFifoQueue
+Desc: Read the contents of a FIFO queue of registers (function code 0x18)
+Params:
+	-	device: the target device
+	-	addr: the address of the FIFO pointer register
+	-	pOutBuf: gets the registers in the queue, in host order. Room for MODBUS_MAX_FIFO_REGS
+	-	pOutCount: gets the number of registers in the queue, 0 to 31
+Notes:
+	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
+	-	Reading the queue doesn't empty it. That's up to the device
+*/
+int modbus_ReadFifoQueue(modbus_device_t* device, uint16_t addr, uint16_t* pOutBuf, uint16_t* pOutCount);
+
+/*
+Name: modbus_ReadFileAsync
+Desc: Read registers of a file (function code 0x14), however many it takes
+Params:
+	-	device: the target device
+	-	xfer: book-keeping for the transfer, provided by the caller
+	-	file: the file number, 1 to 65535
+	-	record: the record to start at, 0 to 9999
+	-	nRegs: the number of registers to read. record + nRegs can be at most MODBUS_MAX_FILE_RECORDS
+	-	sink: called from the engine thread with each piece as it arrives
+	-	done: called once the transfer is over, from the engine thread unless only some of the first pieces
+		could be sent. Can be NULL
+	-	pUser: passed to sink and done
+Notes:
+	-	Returns 0 if started, or -1 on error, in which case neither callback is called
+	-	The file is read MODBUS_MAX_FILE_READ_REGS at a time, with up to MODBUS_FILE_DEPTH requests outstanding
+	-	Once a piece fails, no more are requested, and done gets the status once the rest have completed
+	-	Neither callback can block. done can start another transfer with the same xfer
+	-	Never blocks, so it's safe to call from the engine thread
+*/
+int modbus_ReadFileAsync(modbus_device_t* device, modbus_file_xfer_t* xfer, uint16_t file, uint16_t record, uint32_t nRegs,
+	modbus_file_sink sink, modbus_file_cb done, void* pUser);
+
+/*
+Name: modbus_WriteFileAsync
+Desc: Write registers of a file (function code 0x15), however many it takes
+Params:
+	-	pValues: nRegs registers in host order. Has to stay around until done is called
+	-	The rest are the same as for modbus_ReadFileAsync
+Notes:
+	-	The file is written MODBUS_MAX_FILE_WRITE_REGS at a time. Pieces can land out of order
+*/
+int modbus_WriteFileAsync(modbus_device_t* device, modbus_file_xfer_t* xfer, uint16_t file, uint16_t record,
+	const uint16_t* pValues, uint32_t nRegs, modbus_file_cb done, void* pUser);
+
+/*
+Name: modbus_ReadFile
+Desc: Same as modbus_ReadFileAsync, but waits for the transfer to finish
+Notes:
+	-	Returns 0 if OK, or the status of the first piece that failed
+	-	sink still runs on the engine thread, and can't block
+	-	Can't be called from the engine thread
+*/
+int modbus_ReadFile(modbus_device_t* device, uint16_t file, uint16_t record, uint32_t nRegs, modbus_file_sink sink,
+	void* pUser);
+
+/* Same as modbus_WriteFileAsync, but waits for the transfer to finish. Returns the same as modbus_ReadFile */
+int modbus_WriteFile(modbus_device_t* device, uint16_t file, uint16_t record, const uint16_t* pValues, uint32_t nRegs);
+
+/*
+Name: modbus_WriteRegisterAsync
+Desc: Queue a write to a single register, to be merged with writes to the registers after it
+Params:
+	-	device: the target device
+	-	addr: the address of the register
+	-	value: the new value
+	-	callback: called from the engine thread once the write is done. Can be NULL
+	-	pUser: passed to callback
+Notes:
+	-	Returns 0 if queued, or -1 on error
+	-	Writes queued one after another to consecutive registers (addr, addr + 1, ...) go out as a single
+		write multiple registers request, up to MODBUS_MAX_WRITE_REGS at a time
+	-	Queued writes go to the device in the order they were queued. Only one request from the queue is
+		outstanding at a time, so writes to the same register are never reordered
+	-	If the device rejects a merged write with an illegal function or address, each write is retried on its own
+*/
+int modbus_WriteRegisterAsync(modbus_device_t* device, uint16_t addr, uint16_t value, modbus_write_cb callback, void* pUser);
+
 /*
 Name: modbus_ReadInputRegisters
 Desc: Read from 1 to 125 contiguous input registers
@@ -166,8 +1235,10 @@ Params:
 	-	pOutRegs: the number of registers actually read
 Notes:
 	-	On error, this will return the error code, if OK, it will return 0. -1 means application error, otherwise it's a modbus error
+	-	Returns MODBUS_STATUS_TIMEOUT if the device didn't answer in time, see modbus_SetTimeout
 	-	All values in pOutBuf are corrected for endianness, so they match the host platform.
 	-	nregs must be 0x1-0x7D
+	-	Merged with reads of neighbouring addresses from other threads, see modbus_ReadAsync
 */
 int modbus_ReadInputRegisters(modbus_device_t* device, uint16_t addr, uint16_t nregs, uint16_t* pOutBuf, uint8_t* pOutRegs);
 
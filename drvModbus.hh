@@ -11,16 +11,751 @@
 
 #ifdef __cplusplus
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* ModbusDevice needs C++20, for std::span and coroutines */
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <tuple>
+
+namespace modbus
+{
+
+/* Byte orders of multi-register values, see MODBUS_ORDER_* */
+enum class Order
+{
+	ABCD = MODBUS_ORDER_ABCD,
+	CDAB = MODBUS_ORDER_CDAB,
+	BADC = MODBUS_ORDER_BADC,
+	DCBA = MODBUS_ORDER_DCBA,
+};
+
+namespace detail
+{
+	/* Where byte i (most significant first) of an N byte value in order O is on the wire */
+	template<Order O, int N>
+	constexpr int WireByte(int i)
+	{
+		return O == Order::ABCD ? i :
+			O == Order::CDAB ? (N / 2 - 1 - i / 2) * 2 + i % 2 :
+			O == Order::BADC ? (i / 2) * 2 + 1 - i % 2 :
+			N - 1 - i;
+	}
+
+	/* Unrolled at compile time, so each order is just N loads and shifts */
+	template<Order O, int N, int I = 0>
+	struct Gather
+	{
+		static inline uint64_t Get(const uint8_t* p, uint64_t acc)
+		{
+			return Gather<O, N, I + 1>::Get(p, (acc << 8) | p[WireByte<O, N>(I)]);
+		}
+	};
+
+	template<Order O, int N>
+	struct Gather<O, N, N>
+	{
+		static inline uint64_t Get(const uint8_t*, uint64_t acc) { return acc; }
+	};
+
+	template<int N> struct Raw;
+	template<> struct Raw<2> { typedef uint16_t type; };
+	template<> struct Raw<4> { typedef uint32_t type; };
+	template<> struct Raw<8> { typedef uint64_t type; };
+
+	template<typename... Fields> struct Span;
+	template<> struct Span<> { static const unsigned value = 0; };
+	template<typename F, typename... Rest>
+	struct Span<F, Rest...>
+	{
+		static const unsigned value = F::end > Span<Rest...>::value ? F::end : Span<Rest...>::value;
+	};
+}
+
+/* Decode a T from the registers at pWire, straight off the wire. T can be any 16, 32 or 64-bit type */
+template<typename T, Order O = Order::ABCD>
+inline T Decode(const uint8_t* pWire)
+{
+	static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "Value has to fill whole registers");
+	typedef typename detail::Raw<sizeof(T)>::type raw_t;
+	raw_t raw = (raw_t)detail::Gather<O, sizeof(T)>::Get(pWire, 0);
+	T value;
+	memcpy(&value, &raw, sizeof(T));
+	return value;
+}
+
+/* A T in order O, starting Offset registers into a block. See Layout */
+template<typename T, unsigned Offset, Order O = Order::ABCD>
+struct Field
+{
+	typedef T type;
+	static const unsigned offset = Offset;
+	static const unsigned end = Offset + sizeof(T) / 2;
+	static inline T Get(const uint8_t* pWire) { return Decode<T, O>(pWire + 2 * Offset); }
+};
+
+/*
+Layout of a block of registers, fixed at compile time. Same idea as modbus_CompileLayout, but every
+field's byte order is resolved by the compiler. For instance:
+	typedef modbus::Layout<modbus::Field<float, 0, modbus::Order::CDAB>, modbus::Field<int32_t, 2>> Flow;
+	float rate; int32_t total;
+	Flow::Decode(pWire, nRegs, rate, total);
+*/
+template<typename... Fields>
+struct Layout
+{
+	/* Registers a block needs to hold every field */
+	static const unsigned span = detail::Span<Fields...>::value;
+
+	/* Decodes every field into the matching argument. Returns 0 if OK, -1 if the block is too short */
+	static inline int Decode(const uint8_t* pWire, size_t nRegs, typename Fields::type&... out)
+	{
+		if(nRegs < span)
+			return -1;
+		int expand[] = { 0, ((out = Fields::Get(pWire)), 0)... };
+		(void)expand;
+		return 0;
+	}
+};
+
+/*
+What a request came back with: 0 if OK, the modbus exception code, MODBUS_STATUS_TIMEOUT, or -1 on error.
+Same codes as the C functions
+*/
+class Status
+{
+private:
+	int m_code;
+
+public:
+	constexpr explicit Status(int code = 0) : m_code(code) {}
+
+	constexpr bool Ok() const { return m_code == 0; }
+	constexpr explicit operator bool() const { return m_code == 0; }
+	constexpr int Code() const { return m_code; }
+	constexpr bool Timeout() const { return m_code == MODBUS_STATUS_TIMEOUT; }
+	/* Returns the modbus exception code, or 0 if the device didn't reject the request */
+	constexpr int Exception() const { return m_code > 0 ? m_code : 0; }
+};
+
+/* A value, or the Status of the request that failed to get it. No exceptions are thrown */
+template<typename T>
+class Result
+{
+private:
+	T m_value;
+	Status m_status;
+
+public:
+	Result(const T& value) : m_value(value), m_status(0) {}
+	Result(Status status) : m_value(), m_status(status) {}
+
+	bool HasValue() const { return m_status.Ok(); }
+	explicit operator bool() const { return m_status.Ok(); }
+	Status Error() const { return m_status; }
+	/* Only meaningful if HasValue() */
+	const T& Value() const { return m_value; }
+	const T& operator*() const { return m_value; }
+	const T* operator->() const { return &m_value; }
+	T ValueOr(const T& other) const { return m_status.Ok() ? m_value : other; }
+};
+
+/*
+What each read function code moves, so request sizes and response parsing are fixed at compile time.
+Bits come back one per byte (0 or 1), registers in host order
+*/
+template<uint8_t Func> struct Function;
+
+template<> struct Function<MB_RD_COILS_CODE>
+{
+	typedef uint8_t value_type;
+	static const bool bits = true;
+	static const uint16_t max = MODBUS_MAX_READ_BITS;
+};
+
+template<> struct Function<MB_RD_DISC_INPUTS_CODE>
+{
+	typedef uint8_t value_type;
+	static const bool bits = true;
+	static const uint16_t max = MODBUS_MAX_READ_BITS;
+};
+
+template<> struct Function<MB_RD_HOL_REG_CODE>
+{
+	typedef uint16_t value_type;
+	static const bool bits = false;
+	static const uint16_t max = MODBUS_MAX_READ_REGS;
+};
+
+template<> struct Function<MB_RD_INP_REG_CODE>
+{
+	typedef uint16_t value_type;
+	static const bool bits = false;
+	static const uint16_t max = MODBUS_MAX_READ_REGS;
+};
+
+namespace detail
+{
+	/* Shared by every synchronous request. The completion fills in status and signals event */
+	struct SyncOp
+	{
+		int status;
+		epicsEventId event;
+
+		void Finish(int result)
+		{
+			status = result;
+			epicsEventSignal(event);
+		}
+	};
+
+	/* Queues pPdu on the device with op as the user pointer, and waits for callback to call op->Finish */
+	/* Returns op->status, or -1 if the request couldn't be queued */
+	int Transact(modbus_device_t* device, const void* pPdu, size_t nLen, modbus_completion_t callback, SyncOp* op);
+
+	template<uint8_t Func>
+	inline constexpr size_t PayloadBytes(uint16_t count)
+	{
+		return Function<Func>::bits ? (count + 7) / 8 : count * 2;
+	}
+
+	/* Returns the payload of a read response, or NULL if it isn't the right size */
+	template<uint8_t Func>
+	inline const uint8_t* ReadPayload(const uint8_t* pPdu, size_t nLen, uint16_t count)
+	{
+		const size_t bytes = PayloadBytes<Func>(count);
+		if(nLen != bytes + 2 || pPdu[0] != Func || pPdu[1] != bytes)
+			return nullptr;
+		return pPdu + 2;
+	}
+
+	inline void BuildRequest(uint8_t* pPdu, uint8_t func, uint16_t addr, uint16_t value)
+	{
+		pPdu[0] = func;
+		pPdu[1] = (uint8_t)(addr >> 8);
+		pPdu[2] = (uint8_t)addr;
+		pPdu[3] = (uint8_t)(value >> 8);
+		pPdu[4] = (uint8_t)value;
+	}
+
+	/* Same as modbus_TransactPrepared, with the completion parsing the response like Transact */
+	int TransactPrepared(modbus_device_t* device, const modbus_prepared_t& req, modbus_completion_t callback,
+		SyncOp* op);
+
+	/* Bit at a time, so it can run at compile time. modbus_Crc16 is the one to use at run time */
+	constexpr uint16_t Crc16(const uint8_t* pData, size_t nLen)
+	{
+		uint16_t crc = 0xFFFF;
+		for(size_t i = 0; i < nLen; i++)
+		{
+			crc ^= pData[i];
+			for(int b = 0; b < 8; b++)
+				crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+		return crc;
+	}
+
+	/* Frames a PDU the same way modbus_PrepareRequest does */
+	template<size_t N>
+	constexpr modbus_prepared_t Frame(const uint8_t (&pdu)[N], uint8_t unit, bool rtu, uint16_t respLen)
+	{
+		static_assert(N > 0 && N <= MODBUS_MAX_PDU, "PDU doesn't fit in a frame");
+		modbus_prepared_t req{};
+		size_t len = 0;
+		if(rtu)
+			req.adu[len++] = unit;
+		else
+		{
+			/* The transaction ID (bytes 0 and 1) is patched in when it's sent */
+			req.adu[4] = (uint8_t)((N + 1) >> 8);
+			req.adu[5] = (uint8_t)(N + 1);
+			req.adu[6] = unit;
+			len = sizeof(modbus_mbap_header_t);
+		}
+		for(size_t i = 0; i < N; i++)
+			req.adu[len++] = pdu[i];
+		if(rtu)
+		{
+			uint16_t crc = Crc16(req.adu, len);
+			req.adu[len++] = (uint8_t)crc;
+			req.adu[len++] = (uint8_t)(crc >> 8);
+		}
+		req.len = (uint16_t)len;
+		req.resp_len = respLen;
+		req.rtu = rtu;
+		req.func = pdu[0];
+		return req;
+	}
+
+	/* The PDU of a prepared request */
+	inline const uint8_t* PreparedPdu(const modbus_prepared_t& req)
+	{
+		return req.adu + (req.rtu ? 1 : sizeof(modbus_mbap_header_t));
+	}
+
+	template<uint8_t Func>
+	struct ReadOp : SyncOp
+	{
+		typename Function<Func>::value_type* out;
+		uint16_t count;
+
+		static void Complete(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+		{
+			ReadOp* op = static_cast<ReadOp*>(pUser);
+			if(status == 0)
+			{
+				const uint8_t* pData = ReadPayload<Func>(pPdu, nLen, op->count);
+				if(!pData)
+					status = -1;
+				else if constexpr(Function<Func>::bits)
+					modbus_UnpackCoils(pData, op->out, op->count);
+				else
+					modbus_RegistersFromWire(pData, op->out, op->count);
+			}
+			op->Finish(status);
+		}
+	};
+
+	template<uint8_t Func, typename L, typename... T>
+	struct LayoutOp : SyncOp
+	{
+		std::tuple<T&...> out;
+
+		LayoutOp(T&... values) : out(values...) {}
+
+		static void Complete(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+		{
+			LayoutOp* op = static_cast<LayoutOp*>(pUser);
+			if(status == 0)
+			{
+				const uint8_t* pData = ReadPayload<Func>(pPdu, nLen, L::span);
+				if(!pData)
+					status = -1;
+				else
+					std::apply([pData](T&... values) { L::Decode(pData, L::span, values...); }, op->out);
+			}
+			op->Finish(status);
+		}
+	};
+
+	struct WriteOp : SyncOp
+	{
+		const uint8_t* request;
+
+		/* Single writes echo the request */
+		static void Complete(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+		{
+			WriteOp* op = static_cast<WriteOp*>(pUser);
+			if(status == 0 && (nLen != 5 || memcmp(pPdu, op->request, 5) != 0))
+				status = -1;
+			op->Finish(status);
+		}
+	};
+}
+
+/*
+Requests framed at compile time, for fixed polls. For instance:
+	static constexpr modbus_prepared_t poll = modbus::PrepareRead<MB_RD_HOL_REG_CODE>(MODBUS_DEFAULT_UNIT, 100, 10);
+	std::array<uint16_t, 10> regs;
+	modbus::Status status = device.Read<MB_RD_HOL_REG_CODE>(poll, regs);
+unit has to be the device's unit ID, and rtu whether it's on a serial line. Requests framed for the other
+transport, or with a count the function code doesn't allow, are rejected when they're sent
+*/
+template<uint8_t Func>
+constexpr modbus_prepared_t PrepareRead(uint8_t unit, uint16_t addr, uint16_t count, bool rtu = false)
+{
+	if(count == 0 || count > Function<Func>::max)
+		return modbus_prepared_t{};
+	const uint8_t pdu[5] = {Func, (uint8_t)(addr >> 8), (uint8_t)addr, (uint8_t)(count >> 8), (uint8_t)count};
+	return detail::Frame(pdu, unit, rtu, (uint16_t)(2 + detail::PayloadBytes<Func>(count)));
+}
+
+/* Single coil (MB_WR_SIN_COIL_CODE, any non-zero value turns it on) or register (MB_WR_SIN_REG_CODE) write */
+template<uint8_t Func>
+constexpr modbus_prepared_t PrepareWrite(uint8_t unit, uint16_t addr, uint16_t value, bool rtu = false)
+{
+	static_assert(Func == MB_WR_SIN_COIL_CODE || Func == MB_WR_SIN_REG_CODE, "Not a single write function");
+	if constexpr(Func == MB_WR_SIN_COIL_CODE)
+		value = value ? 0xFF00 : 0;
+	const uint8_t pdu[5] = {Func, (uint8_t)(addr >> 8), (uint8_t)addr, (uint8_t)(value >> 8), (uint8_t)value};
+	return detail::Frame(pdu, unit, rtu, 5);
+}
+
+/*
+Return type for fire-and-forget coroutines built on the awaitables below. It starts running as soon as it's
+called, and frees itself when it returns. For instance:
+	modbus::Task Regulate(modbus::ModbusDevice& device)
+	{
+		uint16_t level;
+		while(co_await device.ReadHoldingRegisters(10, std::span(&level, 1)))
+			co_await device.WriteSingleRegister(11, level > 500 ? 0 : 1);
+	}
+Once the first co_await has suspended, the coroutine runs on the device's engine thread, resumed by the
+response it was waiting on. So it mustn't block, and the synchronous calls can't be used from it
+*/
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() { return Task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* co_await on this reads into the caller's storage, like ModbusDevice::Read. Gives the read's Status */
+/* The read goes through modbus_ReadAsync, so it's merged with whatever nearby reads are queued */
+template<uint8_t Func>
+class ReadAwaitable
+{
+private:
+	typedef typename Function<Func>::value_type value_type;
+
+	modbus_device_t* m_device;
+	uint16_t m_addr;
+	std::span<value_type> m_out;
+	int m_status;
+	std::coroutine_handle<> m_handle;
+
+	static void Complete(void* pUser, int status, const void* pData, uint16_t nCount)
+	{
+		ReadAwaitable* op = static_cast<ReadAwaitable*>(pUser);
+		if(status == 0)
+		{
+			if constexpr(Function<Func>::bits)
+				modbus_UnpackCoils(static_cast<const uint8_t*>(pData), op->m_out.data(), nCount);
+			else
+				memcpy(op->m_out.data(), pData, nCount * sizeof(uint16_t));
+		}
+		op->m_status = status;
+		op->m_handle.resume();
+	}
+
+public:
+	ReadAwaitable(modbus_device_t* device, uint16_t addr, std::span<value_type> out) :
+		m_device(device), m_addr(addr), m_out(out), m_status(-1) {}
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		m_handle = handle;
+		if(!m_device || m_out.empty() || m_out.size() > Function<Func>::max ||
+			modbus_ReadAsync(m_device, Func, m_addr, (uint16_t)m_out.size(), &Complete, this) != 0)
+		{
+			m_status = -1;
+			return false;
+		}
+		/* The engine may have resumed the coroutine already, so nothing can be touched after this */
+		return true;
+	}
+
+	Status await_resume() const { return Status(m_status); }
+};
+
+/* co_await on this reads one value, like ModbusDevice::ReadValue. Gives a Result<T> */
+template<typename T, Order O, uint8_t Func>
+class ValueAwaitable
+{
+private:
+	static_assert(!Function<Func>::bits, "Values are made of registers");
+	static const uint16_t nregs = sizeof(T) / 2;
+
+	modbus_device_t* m_device;
+	uint16_t m_addr;
+	int m_status;
+	uint16_t m_regs[nregs];
+	std::coroutine_handle<> m_handle;
+
+	static void Complete(void* pUser, int status, const void* pData, uint16_t)
+	{
+		ValueAwaitable* op = static_cast<ValueAwaitable*>(pUser);
+		if(status == 0)
+			memcpy(op->m_regs, pData, sizeof(op->m_regs));
+		op->m_status = status;
+		op->m_handle.resume();
+	}
+
+public:
+	ValueAwaitable(modbus_device_t* device, uint16_t addr) : m_device(device), m_addr(addr), m_status(-1) {}
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		m_handle = handle;
+		if(!m_device || modbus_ReadAsync(m_device, Func, m_addr, nregs, &Complete, this) != 0)
+		{
+			m_status = -1;
+			return false;
+		}
+		return true;
+	}
+
+	Result<T> await_resume() const
+	{
+		if(m_status != 0)
+			return Result<T>(Status(m_status));
+		/* The coalescer hands back host order registers, Decode wants them as they were on the wire */
+		uint8_t wire[sizeof(T)];
+		modbus_RegistersToWire(m_regs, wire, nregs);
+		return Result<T>(Decode<T, O>(wire));
+	}
+};
+
+/* co_await on this writes a single coil or register, like ModbusDevice::Write. Gives the write's Status */
+/* It goes through modbus_SubmitQueued, so a full window suspends the coroutine instead of blocking */
+template<uint8_t Func>
+class WriteAwaitable
+{
+private:
+	static_assert(Func == MB_WR_SIN_COIL_CODE || Func == MB_WR_SIN_REG_CODE, "Not a single write function");
+
+	modbus_device_t* m_device;
+	uint8_t m_pdu[5];
+	modbus_queued_t m_req;
+	int m_status;
+	std::coroutine_handle<> m_handle;
+
+	/* Single writes echo the request */
+	static void Complete(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+	{
+		WriteAwaitable* op = static_cast<WriteAwaitable*>(pUser);
+		if(status == 0 && (nLen != sizeof(op->m_pdu) || memcmp(pPdu, op->m_pdu, sizeof(op->m_pdu)) != 0))
+			status = -1;
+		op->m_status = status;
+		op->m_handle.resume();
+	}
+
+public:
+	WriteAwaitable(modbus_device_t* device, uint16_t addr, uint16_t value) : m_device(device), m_status(-1)
+	{
+		if constexpr(Func == MB_WR_SIN_COIL_CODE)
+			value = value ? 0xFF00 : 0;
+		detail::BuildRequest(m_pdu, Func, addr, value);
+	}
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		m_handle = handle;
+		m_req.pPdu = m_pdu;
+		m_req.nLen = sizeof(m_pdu);
+		m_req.callback = &Complete;
+		m_req.pUser = this;
+		m_req.timeout = 0;
+		if(!m_device || modbus_SubmitQueued(m_device, &m_req) != 0)
+		{
+			m_status = -1;
+			return false;
+		}
+		return true;
+	}
+
+	Status await_resume() const { return Status(m_status); }
+};
+
+/*
+Owns a modbus_device_t, and its connection. Move-only, and the size of a pointer.
+Requests block the calling thread like the C functions do, and can't be made from the engine thread.
+Responses are parsed straight into the caller's storage
+*/
 class ModbusDevice
 {
 private:
+	modbus_device_t* m_device;
 
 public:
+	ModbusDevice() : m_device(nullptr) {}
+	explicit ModbusDevice(const struct sockaddr_in& ip) : m_device(modbus_CreateDevice(&ip)) {}
+	/* Takes ownership of a device from modbus_CreateDevice */
+	explicit ModbusDevice(modbus_device_t* device) : m_device(device) {}
+	~ModbusDevice()
+	{
+		if(m_device)
+			modbus_DestroyDevice(m_device);
+	}
 
-	
+	ModbusDevice(const ModbusDevice&) = delete;
+	ModbusDevice& operator=(const ModbusDevice&) = delete;
 
+	ModbusDevice(ModbusDevice&& other) noexcept : m_device(other.m_device) { other.m_device = nullptr; }
+	ModbusDevice& operator=(ModbusDevice&& other) noexcept
+	{
+		if(this != &other)
+		{
+			if(m_device)
+				modbus_DestroyDevice(m_device);
+			m_device = other.m_device;
+			other.m_device = nullptr;
+		}
+		return *this;
+	}
+
+	/* False if the device couldn't be created, or has been moved from */
+	explicit operator bool() const { return m_device != nullptr; }
+	modbus_device_t* Get() const { return m_device; }
+	/* Gives up ownership. The caller has to modbus_DestroyDevice it */
+	modbus_device_t* Release()
+	{
+		modbus_device_t* device = m_device;
+		m_device = nullptr;
+		return device;
+	}
+
+	Status SetWindow(int window) { return Status(modbus_SetWindow(m_device, window)); }
+	Status SetAdaptiveWindow(int minWindow, int maxWindow)
+	{
+		return Status(modbus_SetAdaptiveWindow(m_device, minWindow, maxWindow));
+	}
+	Status SetTimeout(double timeout) { return Status(modbus_SetTimeout(m_device, timeout)); }
+	Status SetCoalesceGap(int gap) { return Status(modbus_SetCoalesceGap(m_device, gap)); }
+	Status SetCacheSize(int nRanges) { return Status(modbus_SetCacheSize(m_device, nRanges)); }
+	Status Attach(modbus_engine_t* engine) { return Status(modbus_AttachDevice(engine, m_device)); }
+
+	/*
+	Read out.size() coils, discrete inputs or registers starting at addr. For instance:
+		std::array<uint16_t, 10> regs;
+		modbus::Status status = device.Read<MB_RD_HOL_REG_CODE>(0, regs);
+	Goes straight to the device; it isn't merged with other reads like modbus_ReadAsync
+	*/
+	template<uint8_t Func>
+	Status Read(uint16_t addr, std::span<typename Function<Func>::value_type> out)
+	{
+		if(!m_device || out.empty() || out.size() > Function<Func>::max)
+			return Status(-1);
+		uint8_t pdu[5];
+		detail::BuildRequest(pdu, Func, addr, (uint16_t)out.size());
+		detail::ReadOp<Func> op;
+		op.out = out.data();
+		op.count = (uint16_t)out.size();
+		return Status(detail::Transact(m_device, pdu, sizeof(pdu), &detail::ReadOp<Func>::Complete, &op));
+	}
+
+	/* Same as Read, with a request from PrepareRead. out has to be the size the request reads */
+	template<uint8_t Func>
+	Status Read(const modbus_prepared_t& req, std::span<typename Function<Func>::value_type> out)
+	{
+		const uint8_t* pPdu = detail::PreparedPdu(req);
+		if(!m_device || req.len == 0 || req.func != Func || out.size() != (size_t)((pPdu[3] << 8) | pPdu[4]))
+			return Status(-1);
+		detail::ReadOp<Func> op;
+		op.out = out.data();
+		op.count = (uint16_t)out.size();
+		return Status(detail::TransactPrepared(m_device, req, &detail::ReadOp<Func>::Complete, &op));
+	}
+
+	/* Same as Read, but served from the image if it's no more than maxAge seconds old, see modbus_ReadCached */
+	template<uint8_t Func>
+	Status ReadCached(uint16_t addr, std::span<typename Function<Func>::value_type> out, double maxAge)
+	{
+		if(!m_device || out.empty() || out.size() > Function<Func>::max)
+			return Status(-1);
+		if constexpr(Function<Func>::bits)
+		{
+			uint8_t packed[(MODBUS_MAX_READ_BITS + 7) / 8];
+			int status = modbus_ReadCached(m_device, Func, addr, (uint16_t)out.size(), maxAge, packed, nullptr);
+			if(status == 0)
+				modbus_UnpackCoils(packed, out.data(), out.size());
+			return Status(status);
+		}
+		else
+			return Status(modbus_ReadCached(m_device, Func, addr, (uint16_t)out.size(), maxAge, out.data(), nullptr));
+	}
+
+	/*
+	Read the block of registers described by a Layout (starting at addr), and decode each field into an argument:
+		float rate; int32_t total;
+		device.ReadLayout<Flow>(100, rate, total);
+	*/
+	template<typename L, uint8_t Func = MB_RD_HOL_REG_CODE, typename... T>
+	Status ReadLayout(uint16_t addr, T&... out)
+	{
+		static_assert(!Function<Func>::bits, "Layouts are made of registers");
+		static_assert(L::span > 0 && L::span <= Function<Func>::max, "Layout doesn't fit in one read");
+		if(!m_device)
+			return Status(-1);
+		uint8_t pdu[5];
+		detail::BuildRequest(pdu, Func, addr, L::span);
+		detail::LayoutOp<Func, L, T...> op(out...);
+		return Status(detail::Transact(m_device, pdu, sizeof(pdu), &detail::LayoutOp<Func, L, T...>::Complete, &op));
+	}
+
+	/* Read one value starting at addr. ReadValue<float, modbus::Order::CDAB>(10) reads registers 10 and 11 */
+	template<typename T, Order O = Order::ABCD, uint8_t Func = MB_RD_HOL_REG_CODE>
+	Result<T> ReadValue(uint16_t addr)
+	{
+		T value;
+		Status status = ReadLayout<Layout<Field<T, 0, O>>, Func>(addr, value);
+		if(!status)
+			return Result<T>(status);
+		return Result<T>(value);
+	}
+
+	/* Awaitable versions of the calls above, see Task. The storage behind out has to last until it's resumed */
+	template<uint8_t Func>
+	ReadAwaitable<Func> ReadAsync(uint16_t addr, std::span<typename Function<Func>::value_type> out)
+	{
+		return ReadAwaitable<Func>(m_device, addr, out);
+	}
+
+	ReadAwaitable<MB_RD_HOL_REG_CODE> ReadHoldingRegisters(uint16_t addr, std::span<uint16_t> out)
+	{
+		return ReadAwaitable<MB_RD_HOL_REG_CODE>(m_device, addr, out);
+	}
+
+	template<typename T, Order O = Order::ABCD, uint8_t Func = MB_RD_HOL_REG_CODE>
+	ValueAwaitable<T, O, Func> ReadValueAsync(uint16_t addr)
+	{
+		return ValueAwaitable<T, O, Func>(m_device, addr);
+	}
+
+	template<uint8_t Func>
+	WriteAwaitable<Func> WriteAsync(uint16_t addr, uint16_t value)
+	{
+		return WriteAwaitable<Func>(m_device, addr, value);
+	}
+
+	WriteAwaitable<MB_WR_SIN_REG_CODE> WriteSingleRegister(uint16_t addr, uint16_t value)
+	{
+		return WriteAwaitable<MB_WR_SIN_REG_CODE>(m_device, addr, value);
+	}
+
+	/* Write a single coil (MB_WR_SIN_COIL_CODE, any non-zero value turns it on) or register (MB_WR_SIN_REG_CODE) */
+	template<uint8_t Func>
+	Status Write(uint16_t addr, uint16_t value)
+	{
+		static_assert(Func == MB_WR_SIN_COIL_CODE || Func == MB_WR_SIN_REG_CODE, "Not a single write function");
+		if(!m_device)
+			return Status(-1);
+		if constexpr(Func == MB_WR_SIN_COIL_CODE)
+			value = value ? 0xFF00 : 0;
+		uint8_t pdu[5];
+		detail::BuildRequest(pdu, Func, addr, value);
+		detail::WriteOp op;
+		op.request = pdu;
+		return Status(detail::Transact(m_device, pdu, sizeof(pdu), &detail::WriteOp::Complete, &op));
+	}
+
+	/* Same as Write, with a request from PrepareWrite */
+	Status Write(const modbus_prepared_t& req)
+	{
+		if(!m_device || req.len == 0 || (req.func != MB_WR_SIN_COIL_CODE && req.func != MB_WR_SIN_REG_CODE))
+			return Status(-1);
+		detail::WriteOp op;
+		op.request = detail::PreparedPdu(req);
+		return Status(detail::TransactPrepared(m_device, req, &detail::WriteOp::Complete, &op));
+	}
 };
 
+}
+
 #endif
 
 #endif //_DRV_MODBUS_HH_
\ No newline at end of file
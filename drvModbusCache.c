@@ -0,0 +1,273 @@
+//======================================================//
+// Name: drvModbusCache.c
+// Purpose: Read-through cache over the process image.
+// Misses for the same range share one read
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* EPICS includes */
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
+
+/* A thread waiting on someone else's read. Lives on the waiting thread's stack */
+typedef struct modbus_flight_waiter
+{
+	uint16_t addr;
+	uint16_t count;
+	void* pOut;
+	int status;
+	epicsTimeStamp time;
+	epicsEventId event;
+	struct modbus_flight_waiter* next;
+} modbus_flight_waiter_t;
+
+/* A read on its way to the device. Lives on the stack of the thread that sent it */
+struct modbus_flight
+{
+	uint8_t func;
+	uint16_t addr;
+	uint16_t count;
+	modbus_flight_waiter_t* waiters;
+	struct modbus_flight* next;
+};
+
+static int modbus_CacheHit(modbus_image_t* image, modbus_segment_t* seg, uint16_t addr, uint16_t count, double maxAge,
+	void* pOut, epicsTimeStamp* pTime);
+static struct modbus_flight* modbus_FindFlight(modbus_image_t* image, uint8_t func, uint16_t addr, uint16_t count);
+static int modbus_EvictCached(modbus_device_t* device, modbus_image_t* image);
+static void modbus_CopyRange(uint8_t func, const void* pData, uint32_t offset, uint16_t count, void* pOut);
+
+//======================================================//
+// Name: modbus_SetCacheSize
+// Purpose: Set how many ranges modbus_ReadCached may keep
+//======================================================//
+int modbus_SetCacheSize(modbus_device_t* device, int nRanges)
+{
+	if(!device || nRanges < 0 || nRanges > MODBUS_MAX_CACHE_RANGES)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_image_t* image = modbus_GetImage(device);
+	if(!image)
+		return -1;
+	/* Taken in this order so eviction can't fail to get sub_lock */
+	epicsMutexMustLock(image->sub_lock);
+	epicsMutexMustLock(image->cache_lock);
+	image->cache_max = nRanges;
+	while(image->cache_segs > nRanges && modbus_EvictCached(device, image) == 0)
+		;
+	epicsMutexUnlock(image->cache_lock);
+	epicsMutexUnlock(image->sub_lock);
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_ReadCached
+// Purpose: Read a range, from the image if it's recent
+// enough
+//======================================================//
+int modbus_ReadCached(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, double maxAge, void* pOut,
+	epicsTimeStamp* pTime)
+{
+	if(!device || !pOut || count == 0 || count > modbus_ReadLimit(func) || maxAge < 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(modbus_OnEngineThread(device->conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
+		return -1;
+	}
+	modbus_image_t* image = modbus_GetImage(device);
+	if(!image)
+		return -1;
+	/* Counted as a reader, so a segment evicted by another thread isn't freed under us */
+	epicsAtomicIncrIntT(&image->readers);
+	modbus_segment_t* seg = modbus_FindSegment(image, func, addr, count);
+	int hit = seg && modbus_CacheHit(image, seg, addr, count, maxAge, pOut, pTime);
+	epicsAtomicDecrIntT(&image->readers);
+	if(hit)
+		return 0;
+
+	epicsMutexMustLock(image->cache_lock);
+	/* A read that just finished has already been published, so look again now nothing can finish under us */
+	/* Nothing's evicted or freed without cache_lock, so there's no need to count ourselves this time */
+	seg = modbus_FindSegment(image, func, addr, count);
+	if(seg && modbus_CacheHit(image, seg, addr, count, maxAge, pOut, pTime))
+	{
+		epicsMutexUnlock(image->cache_lock);
+		return 0;
+	}
+	struct modbus_flight* other = modbus_FindFlight(image, func, addr, count);
+	if(other)
+	{
+		modbus_flight_waiter_t waiter;
+		waiter.addr = addr;
+		waiter.count = count;
+		waiter.pOut = pOut;
+		waiter.status = -1;
+		waiter.event = modbus_ThreadEvent();
+		waiter.next = other->waiters;
+		other->waiters = &waiter;
+		epicsMutexUnlock(image->cache_lock);
+		epicsEventMustWait(waiter.event);
+		if(waiter.status == 0 && pTime)
+			*pTime = waiter.time;
+		return waiter.status;
+	}
+
+	/* Nobody's reading it, so it's up to us. Scanned segments only ever get written by their scan list */
+	struct modbus_flight flight;
+	flight.func = func;
+	flight.addr = addr;
+	flight.count = count;
+	flight.waiters = NULL;
+	modbus_segment_t* keep = NULL;
+	if(seg && seg->cached)
+	{
+		keep = seg;
+		flight.addr = seg->addr;
+		flight.count = seg->count;
+	}
+	else if(!seg && image->cache_max > 0 &&
+		(image->cache_segs < image->cache_max || modbus_EvictCached(device, image) == 0))
+	{
+		keep = modbus_AddSegment(device, func, addr, count);
+		if(keep)
+		{
+			keep->cached = 1;
+			image->cache_segs++;
+		}
+	}
+	if(keep)
+		epicsAtomicSetIntT(&keep->used, epicsAtomicIncrIntT(&image->cache_clock));
+	flight.next = image->flights;
+	image->flights = &flight;
+	epicsMutexUnlock(image->cache_lock);
+
+	/* Room for MODBUS_MAX_READ_REGS registers fits MODBUS_MAX_READ_BITS packed coils too */
+	uint16_t values[MODBUS_MAX_READ_REGS];
+	int status = modbus_ReadSync(device, func, flight.addr, flight.count, values);
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	/* Only the thread with the segment's flight writes to it */
+	if(keep)
+		modbus_WriteSegment(image, keep, status, values, &now);
+
+	epicsMutexMustLock(image->cache_lock);
+	struct modbus_flight** pp = &image->flights;
+	while(*pp != &flight)
+		pp = &(*pp)->next;
+	*pp = flight.next;
+	modbus_flight_waiter_t* waiter = flight.waiters;
+	while(waiter)
+	{
+		/* The waiter returns as soon as it's signalled, taking its node with it */
+		modbus_flight_waiter_t* next = waiter->next;
+		waiter->status = status;
+		waiter->time = now;
+		if(status == 0)
+			modbus_CopyRange(func, values, waiter->addr - flight.addr, waiter->count, waiter->pOut);
+		epicsEventSignal(waiter->event);
+		waiter = next;
+	}
+	epicsMutexUnlock(image->cache_lock);
+
+	if(status == 0)
+	{
+		modbus_CopyRange(func, values, addr - flight.addr, count, pOut);
+		if(pTime)
+			*pTime = now;
+	}
+	return status;
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Returns 1 and fills in pOut and pTime if the segment's last read was good and no older than maxAge */
+static int modbus_CacheHit(modbus_image_t* image, modbus_segment_t* seg, uint16_t addr, uint16_t count, double maxAge,
+	void* pOut, epicsTimeStamp* pTime)
+{
+	epicsTimeStamp time;
+	if(modbus_ReadSegment(seg, addr - seg->addr, count, pOut, &time, NULL) != 0)
+		return 0;
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	/* Negative if the clock was stepped back, in which case the values can't be trusted to be recent */
+	double age = epicsTimeDiffInSeconds(&now, &time);
+	if(age < 0 || age >= maxAge)
+		return 0;
+	if(pTime)
+		*pTime = time;
+	if(seg->cached)
+		epicsAtomicSetIntT(&seg->used, epicsAtomicIncrIntT(&image->cache_clock));
+	return 1;
+}
+
+/* Takes the least recently used cache segment out of the image, skipping any that are subscribed to or being */
+/* read into. cache_lock has to be held. sub_lock is only tried for, since a change callback holding it might */
+/* be waiting on cache_lock */
+/* Returns 0 if one was evicted, or -1 if there was nothing that could be */
+static int modbus_EvictCached(modbus_device_t* device, modbus_image_t* image)
+{
+	if(epicsMutexTryLock(image->sub_lock) != epicsMutexLockOK)
+		return -1;
+	modbus_segtable_t* table = image->table;
+	modbus_segment_t* victim = NULL;
+	unsigned int oldest = 0;
+	int clock = epicsAtomicGetIntT(&image->cache_clock);
+	for(int i = 0; table && i < table->nsegs; i++)
+	{
+		modbus_segment_t* seg = table->segs[i];
+		if(!seg->cached || seg->subs || modbus_FindFlight(image, seg->func, seg->addr, seg->count))
+			continue;
+		/* Unsigned, so it comes out right when the clock wraps around */
+		unsigned int age = (unsigned int)clock - (unsigned int)epicsAtomicGetIntT(&seg->used);
+		if(!victim || age > oldest)
+		{
+			victim = seg;
+			oldest = age;
+		}
+	}
+	if(victim)
+	{
+		modbus_RemoveSegment(device, victim);
+		image->cache_segs--;
+		modbus_ReclaimImage(image);
+	}
+	epicsMutexUnlock(image->sub_lock);
+	return victim ? 0 : -1;
+}
+
+/* Finds a read of func that covers all of addr to addr + count. cache_lock has to be held */
+static struct modbus_flight* modbus_FindFlight(modbus_image_t* image, uint8_t func, uint16_t addr, uint16_t count)
+{
+	for(struct modbus_flight* flight = image->flights; flight; flight = flight->next)
+	{
+		if(flight->func == func && flight->addr <= addr &&
+			(uint32_t)flight->addr + flight->count >= (uint32_t)addr + count)
+			return flight;
+	}
+	return NULL;
+}
+
+/* Copies count values, starting offset values into pData, to pOut. Both are in the modbus_read_cb layout */
+static void modbus_CopyRange(uint8_t func, const void* pData, uint32_t offset, uint16_t count, void* pOut)
+{
+	if(func == MB_RD_COILS_CODE || func == MB_RD_DISC_INPUTS_CODE)
+		modbus_ShiftBits(pData, offset, pOut, count);
+	else
+		memcpy(pOut, (const uint16_t*)pData + offset, count * sizeof(uint16_t));
+}
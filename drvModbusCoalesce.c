@@ -0,0 +1,675 @@
+//======================================================//
+// Name: drvModbusCoalesce.c
+// Purpose: Merges neighbouring reads on a device into
+// single requests, and splits the responses back up.
+// Also merges queued writes to consecutive registers
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* EPICS includes */
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+//======================================================//
+// Name: modbus_SetCoalesceGap
+// Purpose: Set how far apart reads can be and still merge
+//======================================================//
+int modbus_SetCoalesceGap(modbus_device_t* device, int gap)
+{
+	if(!device)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_gateway_t* gateway = device->gateway;
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	for(int i = 0; i < nConns; i++)
+	{
+		epicsMutexMustLock(gateway->conns[i]->tx_lock);
+		gateway->conns[i]->coalesce_gap = gap;
+		epicsMutexUnlock(gateway->conns[i]->tx_lock);
+	}
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_ReadAsync
+// Purpose: Queue a read to be merged with its neighbours
+//======================================================//
+int modbus_ReadAsync(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, modbus_read_cb callback, void* pUser)
+{
+	if(!device || !callback || count == 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	uint32_t limit = modbus_ReadLimit(func);
+	if(limit == 0)
+	{
+		LOG_ERROR("Function code can't be merged.");
+		return -1;
+	}
+	if(count > limit || (uint32_t)addr + count > 0x10000)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+
+	modbus_conn_t* conn = device->conn;
+	if(!conn->engine)
+		return -1;
+
+	/* Taking a node and queueing it are done in one go, so the lock's only taken once */
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_read_t* read = conn->read_free;
+	if(read)
+		conn->read_free = read->next;
+	else
+	{
+		/* Pool is empty, fall back to malloc like modbus_GetBuffer does, though not with the lock held */
+		epicsMutexUnlock(conn->tx_lock);
+		read = malloc(sizeof(modbus_read_t));
+		if(!read)
+			return -1;
+		read->pooled = 0;
+		read->conn = conn;
+		epicsMutexMustLock(conn->tx_lock);
+	}
+	read->func = func;
+	read->unit = device->unit_id;
+	read->solo = 0;
+	read->addr = addr;
+	read->count = count;
+	read->callback = callback;
+	read->pUser = pUser;
+	read->next = NULL;
+	if(conn->reads_tail)
+		conn->reads_tail->next = read;
+	else
+		conn->reads_head = read;
+	conn->reads_tail = read;
+	epicsMutexUnlock(conn->tx_lock);
+	modbus_EngineNotify(conn);
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_WriteRegisterAsync
+// Purpose: Queue a register write to be merged with the
+// writes after it
+//======================================================//
+int modbus_WriteRegisterAsync(modbus_device_t* device, uint16_t addr, uint16_t value, modbus_write_cb callback, void* pUser)
+{
+	if(!device)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_conn_t* conn = device->conn;
+	if(!conn->engine)
+		return -1;
+
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_write_t* write = conn->write_free;
+	if(write)
+		conn->write_free = write->next;
+	epicsMutexUnlock(conn->tx_lock);
+	if(!write)
+	{
+		write = malloc(sizeof(modbus_write_t));
+		if(!write)
+			return -1;
+		write->pooled = 0;
+		write->conn = conn;
+	}
+	write->unit = device->unit_id;
+	write->solo = 0;
+	write->addr = addr;
+	write->value = value;
+	write->callback = callback;
+	write->pUser = pUser;
+	write->next = NULL;
+
+	epicsMutexMustLock(conn->tx_lock);
+	if(conn->writes_tail)
+		conn->writes_tail->next = write;
+	else
+		conn->writes_head = write;
+	conn->writes_tail = write;
+	epicsMutexUnlock(conn->tx_lock);
+	modbus_EngineNotify(conn);
+	return 0;
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Returns the most a single read with function code func can ask for, or 0 if func isn't a read */
+uint32_t modbus_ReadLimit(uint8_t func)
+{
+	switch(func)
+	{
+		case MB_RD_COILS_CODE:
+		case MB_RD_DISC_INPUTS_CODE:
+			return MODBUS_MAX_READ_BITS;
+		case MB_RD_HOL_REG_CODE:
+		case MB_RD_INP_REG_CODE:
+			return MODBUS_MAX_READ_REGS;
+		default:
+			return 0;
+	}
+}
+
+/* Checks the response to a read of count registers (or coils), and points ppData at the values */
+/* Returns 0 if OK, or -1 if it's malformed */
+int modbus_ReadPayload(uint8_t func, uint32_t count, const uint8_t* pPdu, size_t nLen, const uint8_t** ppData)
+{
+	int bits = func == MB_RD_COILS_CODE || func == MB_RD_DISC_INPUTS_CODE;
+	size_t bytes = bits ? (count + 7) / 8 : count * 2;
+	if(nLen != 2 + bytes || pPdu[0] != func || pPdu[1] != bytes)
+		return -1;
+	*ppData = pPdu + 2;
+	return 0;
+}
+
+/* Copies n values, starting offset values into the payload of a read response, to pOut */
+/* pOut gets the same layout modbus_read_cb does */
+void modbus_ExtractRead(uint8_t func, const uint8_t* pData, uint32_t offset, uint16_t n, void* pOut)
+{
+	if(func == MB_RD_COILS_CODE || func == MB_RD_DISC_INPUTS_CODE)
+		modbus_ShiftBits(pData, offset, pOut, n);
+	else
+		modbus_RegistersFromWire(pData + 2 * offset, pOut, n);
+}
+
+/* Fills the connection's free list of read nodes */
+void modbus_InitReads(modbus_conn_t* conn)
+{
+	conn->read_free = NULL;
+	for(int i = 0; i < MODBUS_READ_POOL; i++)
+	{
+		conn->read_nodes[i].pooled = 1;
+		conn->read_nodes[i].conn = conn;
+		conn->read_nodes[i].next = conn->read_free;
+		conn->read_free = &conn->read_nodes[i];
+	}
+}
+
+/* Gives a read node back */
+static void modbus_FreeRead(modbus_conn_t* conn, modbus_read_t* read)
+{
+	if(!read->pooled)
+	{
+		free(read);
+		return;
+	}
+	epicsMutexMustLock(conn->tx_lock);
+	read->next = conn->read_free;
+	conn->read_free = read;
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Puts a list of reads back at the front of the queue, in order */
+static void modbus_RequeueReads(modbus_conn_t* conn, modbus_read_t* list)
+{
+	modbus_read_t* last = list;
+	while(last->next)
+		last = last->next;
+	epicsMutexMustLock(conn->tx_lock);
+	last->next = conn->reads_head;
+	conn->reads_head = list;
+	if(!conn->reads_tail)
+		conn->reads_tail = last;
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Completes a list of reads with an error */
+static void modbus_FailReadList(modbus_conn_t* conn, modbus_read_t* list, int status)
+{
+	while(list)
+	{
+		modbus_read_t* next = list->next;
+		modbus_read_cb callback = list->callback;
+		void* pUser = list->pUser;
+		modbus_FreeRead(conn, list);
+		callback(pUser, status, NULL, 0);
+		list = next;
+	}
+}
+
+/* Completes everything still queued with an error. Only called from the engine thread */
+void modbus_FailReads(modbus_conn_t* conn, int status)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_read_t* list = conn->reads_head;
+	conn->reads_head = conn->reads_tail = NULL;
+	epicsMutexUnlock(conn->tx_lock);
+	modbus_FailReadList(conn, list, status);
+}
+
+/* Orders reads by unit, function code, then address. Stable, so equal reads keep their queue order */
+static int modbus_ReadBefore(const modbus_read_t* a, const modbus_read_t* b)
+{
+	if(a->unit != b->unit)
+		return a->unit < b->unit;
+	if(a->func != b->func)
+		return a->func < b->func;
+	return a->addr <= b->addr;
+}
+
+/* Merge sort, since the queue is a linked list */
+static modbus_read_t* modbus_SortReads(modbus_read_t* list)
+{
+	if(!list || !list->next)
+		return list;
+
+	/* Split it in half */
+	modbus_read_t* slow = list;
+	modbus_read_t* fast = list->next;
+	while(fast && fast->next)
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	modbus_read_t* right = slow->next;
+	slow->next = NULL;
+	modbus_read_t* left = modbus_SortReads(list);
+	right = modbus_SortReads(right);
+
+	modbus_read_t head;
+	modbus_read_t* tail = &head;
+	while(left && right)
+	{
+		if(modbus_ReadBefore(left, right))
+		{
+			tail->next = left;
+			left = left->next;
+		}
+		else
+		{
+			tail->next = right;
+			right = right->next;
+		}
+		tail = tail->next;
+	}
+	tail->next = left ? left : right;
+	return head.next;
+}
+
+/* Sort key of a read, in the same order as modbus_ReadBefore */
+static uint32_t modbus_ReadKey(const modbus_read_t* r)
+{
+	return ((uint32_t)r->unit << 24) | ((uint32_t)r->func << 16) | r->addr;
+}
+
+/* Rotates a sorted list so it starts at the first read at or after key, like an elevator */
+/* Otherwise reads at low units and addresses would always go first, and the rest could wait forever */
+static modbus_read_t* modbus_RotateReads(modbus_read_t* list, uint32_t key)
+{
+	modbus_read_t* prev = NULL;
+	modbus_read_t* r = list;
+	while(r && modbus_ReadKey(r) < key)
+	{
+		prev = r;
+		r = r->next;
+	}
+	if(!prev || !r)
+		return list;
+	prev->next = NULL;
+	modbus_read_t* last = r;
+	while(last->next)
+		last = last->next;
+	last->next = list;
+	return r;
+}
+
+/* Splits the response to a merged read between the reads that went into it */
+/* pUser is the first read of the span, which starts at the lowest address */
+static void modbus_SplitCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+{
+	modbus_read_t* list = pUser;
+	modbus_conn_t* conn = list->conn;
+	uint8_t func = list->func;
+	uint32_t start = list->addr;
+	uint32_t end = start;
+	int nReads = 0;
+	for(modbus_read_t* r = list; r; r = r->next, nReads++)
+		if((uint32_t)r->addr + r->count > end)
+			end = r->addr + r->count;
+	uint32_t count = end - start;
+
+	/* An address in the gap may not exist on the device, so give each read its own request */
+	if(status == MODBUS_ERR_ILLEGAL_ADDR && nReads > 1)
+	{
+		for(modbus_read_t* r = list; r; r = r->next)
+			r->solo = 1;
+		modbus_RequeueReads(conn, list);
+		modbus_EngineNotify(conn);
+		return;
+	}
+
+	const uint8_t* pData = NULL;
+	if(status == 0 && modbus_ReadPayload(func, count, pPdu, nLen, &pData) != 0)
+	{
+		LOG_ERROR("Response to merged read is malformed.");
+		status = -1;
+	}
+	if(status != 0)
+	{
+		modbus_FailReadList(conn, list, status);
+		return;
+	}
+
+	/* MODBUS_MAX_READ_BITS bits take up the same 250 bytes as MODBUS_MAX_READ_REGS registers */
+	uint16_t out[MODBUS_MAX_READ_REGS];
+	while(list)
+	{
+		modbus_read_t* next = list->next;
+		modbus_read_cb callback = list->callback;
+		void* pReadUser = list->pUser;
+		uint32_t offset = list->addr - start;
+		uint16_t n = list->count;
+		modbus_FreeRead(conn, list);
+		modbus_ExtractRead(func, pData, offset, n, out);
+		callback(pReadUser, 0, out, n);
+		list = next;
+	}
+}
+
+/* Turns a span of reads into a request and adds it to pTxns */
+/* Returns 0 if OK, 1 if the window is full, or -1 on error (in which case the reads have been failed) */
+static int modbus_SubmitSpan(modbus_conn_t* conn, modbus_read_t* list, uint32_t start, uint32_t count, modbus_txn_t** pTxn)
+{
+	modbus_txn_t* txn = modbus_AllocTransaction(conn);
+	if(!txn)
+		return 1;
+	uint8_t pdu[5];
+	pdu[0] = list->func;
+	pdu[1] = (start >> 8) & 0xFF;
+	pdu[2] = start & 0xFF;
+	pdu[3] = (count >> 8) & 0xFF;
+	pdu[4] = count & 0xFF;
+	if(modbus_PrepareTransaction(conn, txn, list->unit, pdu, sizeof(pdu), modbus_SplitCompletion, list, 0) != 0)
+	{
+		modbus_FailReadList(conn, list, -1);
+		return -1;
+	}
+	*pTxn = txn;
+	return 0;
+}
+
+/* Merges everything in the read queue into as few requests as possible, and adds those to pending */
+/* Whatever doesn't fit in the window stays queued until something completes */
+/* Only called from the engine thread */
+void modbus_FlushReads(modbus_conn_t* conn)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_read_t* list = conn->reads_head;
+	conn->reads_head = conn->reads_tail = NULL;
+	int gap = conn->coalesce_gap;
+	epicsMutexUnlock(conn->tx_lock);
+	if(!list)
+		return;
+
+	list = modbus_RotateReads(modbus_SortReads(list), conn->read_resume);
+	conn->read_resume = 0;
+	modbus_txn_t* txns[MODBUS_MAX_INFLIGHT];
+	int n = 0;
+	while(list)
+	{
+		/* Grow a span from the first read for as long as the next one is close enough and still fits */
+		modbus_read_t* first = list;
+		modbus_read_t* last = first;
+		uint32_t start = first->addr;
+		uint32_t end = start + first->count;
+		uint32_t limit = modbus_ReadLimit(first->func);
+		while(!first->solo && gap >= 0 && last->next)
+		{
+			modbus_read_t* r = last->next;
+			uint32_t rend = r->addr + r->count;
+			uint32_t newend = rend > end ? rend : end;
+			/* Past the point the list was rotated at, addresses start over */
+			if(r->solo || r->unit != first->unit || r->func != first->func || r->addr < start || r->addr > end + gap ||
+				newend - start > limit)
+				break;
+			end = newend;
+			last = r;
+		}
+		list = last->next;
+		last->next = NULL;
+
+		int result = n < MODBUS_MAX_INFLIGHT ? modbus_SubmitSpan(conn, first, start, end - start, &txns[n]) : 1;
+		if(result == 1)
+		{
+			/* Window is full, try again once something completes */
+			last->next = list;
+			conn->read_resume = modbus_ReadKey(first);
+			modbus_RequeueReads(conn, first);
+			break;
+		}
+		if(result == 0)
+			n++;
+	}
+	if(n)
+		modbus_AppendPending(conn, txns, n);
+}
+
+/* Used by modbus_ReadSync to wait on its read */
+typedef struct
+{
+	int status;
+	void* pOut;
+	int bits;
+	epicsEventId event;
+} modbus_readsync_t;
+
+static void modbus_ReadSyncCompletion(void* pUser, int status, const void* pData, uint16_t nCount)
+{
+	modbus_readsync_t* sync = pUser;
+	sync->status = status;
+	if(status == 0)
+		memcpy(sync->pOut, pData, sync->bits ? (size_t)(nCount + 7) / 8 : nCount * sizeof(uint16_t));
+	epicsEventSignal(sync->event);
+}
+
+/* Queues a read and blocks until it completes. pOut gets the same data modbus_read_cb does */
+/* Returns 0 if OK, the modbus exception code, MODBUS_STATUS_TIMEOUT, or -1 on error */
+int modbus_ReadSync(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, void* pOut)
+{
+	if(modbus_OnEngineThread(device->conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
+		return -1;
+	}
+	modbus_readsync_t sync;
+	sync.status = -1;
+	sync.pOut = pOut;
+	sync.bits = func == MB_RD_COILS_CODE || func == MB_RD_DISC_INPUTS_CODE;
+	sync.event = modbus_ThreadEvent();
+	if(modbus_ReadAsync(device, func, addr, count, modbus_ReadSyncCompletion, &sync) != 0)
+		return -1;
+	epicsEventMustWait(sync.event);
+	return sync.status;
+}
+
+/* Fills the connection's free list of write nodes */
+void modbus_InitWrites(modbus_conn_t* conn)
+{
+	conn->write_free = NULL;
+	for(int i = 0; i < MODBUS_WRITE_POOL; i++)
+	{
+		conn->write_nodes[i].pooled = 1;
+		conn->write_nodes[i].conn = conn;
+		conn->write_nodes[i].next = conn->write_free;
+		conn->write_free = &conn->write_nodes[i];
+	}
+}
+
+/* Gives a write node back */
+static void modbus_FreeWrite(modbus_conn_t* conn, modbus_write_t* write)
+{
+	if(!write->pooled)
+	{
+		free(write);
+		return;
+	}
+	epicsMutexMustLock(conn->tx_lock);
+	write->next = conn->write_free;
+	conn->write_free = write;
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Puts a list of writes back at the front of the queue, in order */
+static void modbus_RequeueWrites(modbus_conn_t* conn, modbus_write_t* list)
+{
+	modbus_write_t* last = list;
+	while(last->next)
+		last = last->next;
+	epicsMutexMustLock(conn->tx_lock);
+	last->next = conn->writes_head;
+	conn->writes_head = list;
+	if(!conn->writes_tail)
+		conn->writes_tail = last;
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Completes a list of writes with status */
+static void modbus_CompleteWrites(modbus_conn_t* conn, modbus_write_t* list, int status)
+{
+	while(list)
+	{
+		modbus_write_t* next = list->next;
+		modbus_write_cb callback = list->callback;
+		void* pUser = list->pUser;
+		modbus_FreeWrite(conn, list);
+		if(callback)
+			callback(pUser, status);
+		list = next;
+	}
+}
+
+/* Fails every queued write, e.g. when the connection is detached */
+void modbus_FailWrites(modbus_conn_t* conn, int status)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_write_t* list = conn->writes_head;
+	conn->writes_head = conn->writes_tail = NULL;
+	epicsMutexUnlock(conn->tx_lock);
+	modbus_CompleteWrites(conn, list, status);
+}
+
+/* Checks the response to a merged write. pUser is the first write, at the lowest address */
+static void modbus_WriteCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+{
+	modbus_write_t* list = pUser;
+	modbus_conn_t* conn = list->conn;
+	int n = 0;
+	for(modbus_write_t* w = list; w; w = w->next)
+		n++;
+	conn->write_busy = 0;
+
+	if(status == 0)
+	{
+		/* Single writes echo the request, multiple writes echo the address and count */
+		uint16_t value = n == 1 ? list->value : (uint16_t)n;
+		uint8_t func = n == 1 ? MB_WR_SIN_REG_CODE : MB_WR_MULT_REG_CODE;
+		if(nLen != 5 || pPdu[0] != func || ((pPdu[1] << 8) | pPdu[2]) != list->addr || ((pPdu[3] << 8) | pPdu[4]) != value)
+		{
+			LOG_ERROR("Response to merged write is malformed.");
+			status = -1;
+		}
+	}
+
+	/* Some devices don't do 0x10, or don't have every register in the run writable through it */
+	if((status == MODBUS_ERR_ILLEGAL_FUNCTION || status == MODBUS_ERR_ILLEGAL_ADDR) && n > 1)
+	{
+		for(modbus_write_t* w = list; w; w = w->next)
+			w->solo = 1;
+		modbus_RequeueWrites(conn, list);
+		modbus_EngineNotify(conn);
+		return;
+	}
+	modbus_CompleteWrites(conn, list, status);
+	if(conn->writes_head)
+		modbus_EngineNotify(conn);
+}
+
+/* Sends the run of writes to consecutive registers at the front of the queue as one request */
+/* The rest waits until it's done, so writes never overtake each other */
+/* Only called from the engine thread */
+void modbus_FlushWrites(modbus_conn_t* conn)
+{
+	if(conn->write_busy)
+		return;
+	epicsMutexMustLock(conn->tx_lock);
+	modbus_write_t* first = conn->writes_head;
+	if(!first)
+	{
+		epicsMutexUnlock(conn->tx_lock);
+		return;
+	}
+	modbus_write_t* last = first;
+	int n = 1;
+	while(!first->solo && last->next && !last->next->solo && last->next->unit == first->unit &&
+		last->next->addr == last->addr + 1 && n < MODBUS_MAX_WRITE_REGS)
+	{
+		last = last->next;
+		n++;
+	}
+	conn->writes_head = last->next;
+	if(!conn->writes_head)
+		conn->writes_tail = NULL;
+	last->next = NULL;
+	epicsMutexUnlock(conn->tx_lock);
+
+	modbus_txn_t* txn = modbus_AllocTransaction(conn);
+	if(!txn)
+	{
+		/* Window is full, try again once something completes */
+		modbus_RequeueWrites(conn, first);
+		return;
+	}
+	uint8_t pdu[6 + 2 * MODBUS_MAX_WRITE_REGS];
+	size_t len;
+	pdu[1] = (first->addr >> 8) & 0xFF;
+	pdu[2] = first->addr & 0xFF;
+	if(n == 1)
+	{
+		pdu[0] = MB_WR_SIN_REG_CODE;
+		pdu[3] = (first->value >> 8) & 0xFF;
+		pdu[4] = first->value & 0xFF;
+		len = 5;
+	}
+	else
+	{
+		pdu[0] = MB_WR_MULT_REG_CODE;
+		pdu[3] = (n >> 8) & 0xFF;
+		pdu[4] = n & 0xFF;
+		pdu[5] = (uint8_t)(2 * n);
+		uint8_t* p = pdu + 6;
+		for(modbus_write_t* w = first; w; w = w->next)
+		{
+			*p++ = (w->value >> 8) & 0xFF;
+			*p++ = w->value & 0xFF;
+		}
+		len = 6 + 2 * n;
+	}
+	if(modbus_PrepareTransaction(conn, txn, first->unit, pdu, len, modbus_WriteCompletion, first, 0) != 0)
+	{
+		modbus_CompleteWrites(conn, first, -1);
+		if(conn->writes_head)
+			modbus_EngineNotify(conn);
+		return;
+	}
+	conn->write_busy = 1;
+	modbus_AppendPending(conn, &txn, 1);
+}
@@ -0,0 +1,241 @@
+//======================================================//
+// Name: drvModbusDecode.c
+// Purpose: Decodes typed values (32 and 64-bit integers,
+// floats) spread across blocks of registers
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* One field of a compiled layout */
+typedef struct
+{
+	uint32_t byte; /* Offset of the field in the wire format */
+	uint8_t nbytes;
+	uint8_t type;
+	uint8_t perm[8]; /* perm[i] is where byte i of the value (most significant first) is, from byte */
+	int index; /* Where the value goes in the output */
+	double scale;
+} modbus_cfield_t;
+
+struct modbus_layout
+{
+	int nfields;
+	uint16_t span; /* Registers a block needs to hold all the fields */
+	modbus_cfield_t fields[];
+};
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Returns the size of a value of the type in bytes, or 0 if there's no such type */
+static int modbus_TypeSize(uint8_t type)
+{
+	switch(type)
+	{
+		case MODBUS_TYPE_UINT16:
+		case MODBUS_TYPE_INT16:
+			return 2;
+		case MODBUS_TYPE_UINT32:
+		case MODBUS_TYPE_INT32:
+		case MODBUS_TYPE_FLOAT32:
+			return 4;
+		case MODBUS_TYPE_UINT64:
+		case MODBUS_TYPE_INT64:
+		case MODBUS_TYPE_FLOAT64:
+			return 8;
+		default:
+			return 0;
+	}
+}
+
+/* Works out where each byte of an nBytes value in the given order sits on the wire */
+static int modbus_BuildPerm(uint8_t order, int nBytes, uint8_t* pPerm)
+{
+	int nRegs = nBytes / 2;
+	for(int i = 0; i < nBytes; i++)
+	{
+		int reg = i / 2;
+		int byte = i % 2;
+		switch(order)
+		{
+			case MODBUS_ORDER_ABCD:
+				break;
+			case MODBUS_ORDER_CDAB:
+				reg = nRegs - 1 - reg;
+				break;
+			case MODBUS_ORDER_BADC:
+				byte = 1 - byte;
+				break;
+			case MODBUS_ORDER_DCBA:
+				reg = nRegs - 1 - reg;
+				byte = 1 - byte;
+				break;
+			default:
+				return -1;
+		}
+		pPerm[i] = (uint8_t)(reg * 2 + byte);
+	}
+	return 0;
+}
+
+static int modbus_CompareFields(const void* pA, const void* pB)
+{
+	const modbus_cfield_t* a = pA;
+	const modbus_cfield_t* b = pB;
+	if(a->byte != b->byte)
+		return a->byte < b->byte ? -1 : 1;
+	return a->index - b->index;
+}
+
+/* Turns the raw bits of a value into a double */
+static double modbus_Convert(uint8_t type, uint64_t raw)
+{
+	switch(type)
+	{
+		case MODBUS_TYPE_UINT16:
+			return (double)(uint16_t)raw;
+		case MODBUS_TYPE_INT16:
+			return (double)(int16_t)raw;
+		case MODBUS_TYPE_UINT32:
+			return (double)(uint32_t)raw;
+		case MODBUS_TYPE_INT32:
+			return (double)(int32_t)raw;
+		case MODBUS_TYPE_FLOAT32:
+		{
+			uint32_t bits = (uint32_t)raw;
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			return f;
+		}
+		case MODBUS_TYPE_UINT64:
+			return (double)raw;
+		case MODBUS_TYPE_INT64:
+			return (double)(int64_t)raw;
+		case MODBUS_TYPE_FLOAT64:
+		{
+			double d;
+			memcpy(&d, &raw, sizeof(d));
+			return d;
+		}
+		default:
+			return 0;
+	}
+}
+
+//======================================================//
+// Name: modbus_CompileLayout
+// Purpose: Turn a list of fields into a layout that can
+// be decoded in one pass
+//======================================================//
+modbus_layout_t* modbus_CompileLayout(const modbus_field_t* pFields, int nFields)
+{
+	if(!pFields || nFields < 1)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return NULL;
+	}
+	modbus_layout_t* layout = malloc(sizeof(modbus_layout_t) + nFields * sizeof(modbus_cfield_t));
+	if(!layout)
+		return NULL;
+	layout->nfields = nFields;
+	layout->span = 0;
+	for(int i = 0; i < nFields; i++)
+	{
+		modbus_cfield_t* f = &layout->fields[i];
+		int size = modbus_TypeSize(pFields[i].type);
+		uint32_t end = pFields[i].offset + size / 2;
+		if(size == 0 || end > MODBUS_MAX_READ_REGS || modbus_BuildPerm(pFields[i].order, size, f->perm) != 0)
+		{
+			LOG_ERROR_FORMATTED("Invalid field %d in layout.", i);
+			free(layout);
+			return NULL;
+		}
+		f->byte = pFields[i].offset * 2;
+		f->nbytes = (uint8_t)size;
+		f->type = pFields[i].type;
+		f->index = i;
+		f->scale = pFields[i].scale != 0 ? pFields[i].scale : 1.0;
+		if(end > layout->span)
+			layout->span = (uint16_t)end;
+	}
+	/* Go through the block front to back */
+	qsort(layout->fields, nFields, sizeof(modbus_cfield_t), modbus_CompareFields);
+	return layout;
+}
+
+//======================================================//
+// Name: modbus_DestroyLayout
+// Purpose: Free a compiled layout
+//======================================================//
+void modbus_DestroyLayout(modbus_layout_t* layout)
+{
+	free(layout);
+}
+
+//======================================================//
+// Name: modbus_LayoutSpan
+// Purpose: Get the number of registers a layout covers
+//======================================================//
+int modbus_LayoutSpan(const modbus_layout_t* layout)
+{
+	return layout ? layout->span : -1;
+}
+
+//======================================================//
+// Name: modbus_DecodeWire
+// Purpose: Decode the fields of a layout straight from
+// the registers of a response
+//======================================================//
+int modbus_DecodeWire(const modbus_layout_t* layout, const uint8_t* pWire, uint16_t nRegs, double* pOut)
+{
+	if(!layout || !pWire || !pOut || nRegs < layout->span)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	for(int i = 0; i < layout->nfields; i++)
+	{
+		const modbus_cfield_t* f = &layout->fields[i];
+		const uint8_t* p = pWire + f->byte;
+		uint64_t raw = 0;
+		for(int b = 0; b < f->nbytes; b++)
+			raw = (raw << 8) | p[f->perm[b]];
+		pOut[f->index] = modbus_Convert(f->type, raw) * f->scale;
+	}
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_DecodeRegisters
+// Purpose: Decode the fields of a layout from registers
+// that are already in host order
+//======================================================//
+int modbus_DecodeRegisters(const modbus_layout_t* layout, const uint16_t* pRegs, uint16_t nRegs, double* pOut)
+{
+	if(!layout || !pRegs || !pOut || nRegs < layout->span)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	for(int i = 0; i < layout->nfields; i++)
+	{
+		const modbus_cfield_t* f = &layout->fields[i];
+		const uint16_t* p = pRegs + f->byte / 2;
+		uint64_t raw = 0;
+		for(int b = 0; b < f->nbytes; b++)
+		{
+			/* Even bytes are the high half of their register on the wire */
+			uint16_t reg = p[f->perm[b] / 2];
+			raw = (raw << 8) | ((f->perm[b] & 1) ? (reg & 0xFF) : (reg >> 8));
+		}
+		pOut[f->index] = modbus_Convert(f->type, raw) * f->scale;
+	}
+	return 0;
+}
@@ -0,0 +1,1882 @@
+//======================================================//
+// Name: drvModbusEngine.c
+// Purpose: Non-blocking I/O engine for the modbus driver.
+// One thread per engine does all the socket work for
+// every device attached to it
+//======================================================//
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For CPU affinity */
+#define _GNU_SOURCE
+#endif
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* EPICS includes */
+#include <osiSock.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsAssert.h>
+#include <epicsTime.h>
+
+#if defined(__linux__)
+#define MODBUS_USE_EPOLL
+#include <sys/epoll.h>
+#include <sched.h>
+#else
+#include <poll.h>
+#endif
+
+/* Events the poller reports */
+#define MODBUS_EV_IN	0x1
+#define MODBUS_EV_OUT	0x2
+#define MODBUS_EV_ERR	0x4
+
+/* Max number of events handled per wakeup */
+#define MODBUS_ENGINE_EVENTS 256
+/* Max number of frames written per sendmsg */
+#define MODBUS_ENGINE_IOV 64
+/* Max number of reads from one socket per wakeup, so a busy device can't starve the rest */
+#define MODBUS_ENGINE_READS 4
+
+#ifdef MODBUS_USE_IO_URING
+/* Submissions the ring holds. It's handed to the kernel whenever it fills up, not just once per loop */
+#define MODBUS_URING_ENTRIES 256
+
+/* What a ring op is for. Its tag is the connection with this in the low bits (0 for ops nobody needs to hear */
+/* back from) */
+#define MODBUS_OP_POLL 1
+#define MODBUS_OP_RECV 2
+#define MODBUS_OP_SEND 3
+#define MODBUS_OP_MASK 3
+#define MODBUS_URING_TAG(conn, op) ((uint64_t)(uintptr_t)(conn) | (op))
+
+/* A connection's sendmsg, kept until the ring says how much of it went out */
+struct modbus_usend
+{
+	struct msghdr msg;
+	struct iovec iov[MODBUS_ENGINE_IOV];
+};
+#endif
+
+typedef struct
+{
+	modbus_conn_t* conn; /* NULL for the wakeup pipe */
+	int events;
+#ifdef MODBUS_USE_IO_URING
+	/* Completions from the ring. op is 0 for plain readiness */
+	int op;
+	int res;
+	unsigned flags;
+#endif
+} modbus_pollev_t;
+
+typedef struct
+{
+#ifdef MODBUS_USE_EPOLL
+	int epfd;
+	struct epoll_event events[MODBUS_ENGINE_EVENTS];
+#ifdef MODBUS_USE_IO_URING
+	int uring; /* Everything goes through ring instead of epfd */
+	modbus_uring_t ring;
+#endif
+#else
+	struct pollfd* fds;
+	modbus_conn_t** conns;
+	int nfds;
+	int cap;
+#endif
+} modbus_poller_t;
+
+struct modbus_engine
+{
+	char name[32];
+	epicsThreadId thread;
+	int cpu; /* The thread is pinned to it, unless it's -1 */
+	/* Connections with work for the engine thread. Any thread pushes onto it without locking, and the */
+	/* engine thread takes it whole */
+	modbus_conn_t* ready;
+	int wake_pending;
+	int wake_fds[2];
+	int stop;
+	epicsEventId exit_event;
+	modbus_poller_t poller;
+	modbus_pollev_t events[MODBUS_ENGINE_EVENTS];
+
+	/* Min-heap of outstanding transactions by deadline, across every connection. Engine thread only */
+	modbus_txn_t** timers;
+	int ntimers;
+	int timers_cap;
+
+	/* Serial lines with a request ready, waiting for the inter-frame gap to pass. Engine thread only */
+	modbus_conn_t* held;
+
+	/* Connections with a connect to time out, or waiting to try again. Engine thread only */
+	modbus_conn_t* dialing;
+};
+
+/* Used by modbus_ConnectDevices to wait until each connection's connect is over */
+struct modbus_warmup
+{
+	int pending;
+	epicsEventId event;
+};
+
+/* See modbus_SetEngineBackend */
+static int g_EngineBackend = MODBUS_BACKEND_POLL;
+
+static epicsThreadOnceId g_DefaultEngineOnce = EPICS_THREAD_ONCE_INIT;
+static modbus_engine_t* g_DefaultEngine = NULL;
+
+/* New gateways are spread over these, see modbus_SetEngineThreads. The first one is the default engine */
+static int g_EngineCount = 1;
+static int g_EngineCpus[MODBUS_MAX_ENGINES] = {-1};
+static int g_EnginesStarted = 0;
+static modbus_engine_t* g_Engines[MODBUS_MAX_ENGINES];
+
+static void modbus_EngineUnhold(modbus_engine_t* engine, modbus_conn_t* conn);
+static void modbus_EngineTimeoutLine(modbus_engine_t* engine, modbus_txn_t* txn);
+static void modbus_EngineDial(modbus_engine_t* engine, modbus_conn_t* conn, epicsUInt64 at);
+static void modbus_EngineUndial(modbus_engine_t* engine, modbus_conn_t* conn);
+static void modbus_EngineBackoff(modbus_conn_t* conn);
+#ifdef MODBUS_USE_IO_URING
+static void modbus_UringCancelAll(modbus_engine_t* engine, modbus_conn_t* conn);
+static void modbus_UringOpened(modbus_engine_t* engine, modbus_conn_t* conn);
+static int modbus_UringFlush(modbus_engine_t* engine, modbus_conn_t* conn);
+static void modbus_EngineComplete(modbus_engine_t* engine, modbus_pollev_t* ev);
+#endif
+
+//======================================================//
+// POLLER. epoll on Linux, poll() everywhere else. An
+// io_uring engine polls through its ring, where the
+// readiness shows up among its other completions
+//======================================================//
+
+#ifdef MODBUS_USE_EPOLL
+
+static uint32_t modbus_EpollMask(int events)
+{
+	uint32_t mask = 0;
+	if(events & MODBUS_EV_IN)
+		mask |= EPOLLIN;
+	if(events & MODBUS_EV_OUT)
+		mask |= EPOLLOUT;
+	return mask;
+}
+
+/* Falls back to epoll if uring is set but the ring can't be had */
+static int modbus_PollerInit(modbus_poller_t* p, int uring)
+{
+#ifdef MODBUS_USE_IO_URING
+	p->uring = 0;
+	if(uring && modbus_UringInit(&p->ring, MODBUS_URING_ENTRIES) == 0)
+	{
+		p->uring = 1;
+		return 0;
+	}
+#endif
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return p->epfd < 0 ? -1 : 0;
+}
+
+static void modbus_PollerDestroy(modbus_poller_t* p)
+{
+#ifdef MODBUS_USE_IO_URING
+	if(p->uring)
+	{
+		modbus_UringDestroy(&p->ring);
+		return;
+	}
+#endif
+	close(p->epfd);
+}
+
+static int modbus_PollerAdd(modbus_poller_t* p, int fd, modbus_conn_t* conn, int events)
+{
+#ifdef MODBUS_USE_IO_URING
+	if(p->uring)
+	{
+		/* Connects only need to be seen finishing once. The wakeup pipe and serial lines are polled for good */
+		int multishot = !conn || conn->rtu;
+		if(modbus_UringPoll(&p->ring, fd, modbus_EpollMask(events), multishot, MODBUS_URING_TAG(conn, MODBUS_OP_POLL)) < 0)
+			return -1;
+		if(conn)
+		{
+			conn->uring_ops++;
+			conn->uring_armed |= 1 << MODBUS_OP_POLL;
+		}
+		return 0;
+	}
+#endif
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = modbus_EpollMask(events);
+	ev.data.ptr = conn;
+	return epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int modbus_PollerModify(modbus_poller_t* p, int fd, modbus_conn_t* conn, int events)
+{
+#ifdef MODBUS_USE_IO_URING
+	if(p->uring)
+		return modbus_UringPollUpdate(&p->ring, modbus_EpollMask(events), MODBUS_URING_TAG(conn, MODBUS_OP_POLL));
+#endif
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = modbus_EpollMask(events);
+	ev.data.ptr = conn;
+	return epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void modbus_PollerRemove(modbus_poller_t* p, int fd, modbus_conn_t* conn)
+{
+#ifdef MODBUS_USE_IO_URING
+	if(p->uring)
+	{
+		/* The poll is done with once its -ECANCELED completion comes back */
+		if(modbus_UringPollRemove(&p->ring, MODBUS_URING_TAG(conn, MODBUS_OP_POLL)) < 0)
+			LOG_ERROR("Failed to remove a poll from the ring.");
+		return;
+	}
+#endif
+	struct epoll_event ev;
+	epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+static int modbus_EpollEvents(uint32_t mask)
+{
+	int events = 0;
+	if(mask & EPOLLIN)
+		events |= MODBUS_EV_IN;
+	if(mask & EPOLLOUT)
+		events |= MODBUS_EV_OUT;
+	if(mask & (EPOLLERR | EPOLLHUP))
+		events |= MODBUS_EV_ERR;
+	return events;
+}
+
+#ifdef MODBUS_USE_IO_URING
+/* Submits everything queued on the ring since last time, waits, and turns what completed into events */
+static int modbus_UringWait(modbus_poller_t* p, modbus_pollev_t* pOut, int nMax, int timeout_ms)
+{
+	if(modbus_UringEnter(&p->ring, timeout_ms) < 0)
+		return -1;
+	int n = 0;
+	struct io_uring_cqe* cqe;
+	while(n < nMax && (cqe = modbus_UringPeek(&p->ring)))
+	{
+		uint64_t tag = cqe->user_data;
+		int op = (int)(tag & MODBUS_OP_MASK);
+		if(op)
+		{
+			pOut[n].conn = (modbus_conn_t*)(uintptr_t)(tag & ~(uint64_t)MODBUS_OP_MASK);
+			pOut[n].op = op;
+			pOut[n].res = cqe->res;
+			pOut[n].flags = cqe->flags;
+			/* Poll completions carry poll(2) bits, which are the same as epoll's */
+			pOut[n].events = op == MODBUS_OP_POLL && cqe->res > 0 ? modbus_EpollEvents(cqe->res) : 0;
+			n++;
+		}
+		modbus_UringAdvance(&p->ring);
+	}
+	return n;
+}
+#endif
+
+/* Returns the number of events put in pOut, or -1 on error */
+static int modbus_PollerWait(modbus_poller_t* p, modbus_pollev_t* pOut, int nMax, int timeout_ms)
+{
+#ifdef MODBUS_USE_IO_URING
+	if(p->uring)
+		return modbus_UringWait(p, pOut, nMax, timeout_ms);
+#endif
+	int n = epoll_wait(p->epfd, p->events, nMax, timeout_ms);
+	for(int i = 0; i < n; i++)
+	{
+		pOut[i].conn = p->events[i].data.ptr;
+		pOut[i].events = modbus_EpollEvents(p->events[i].events);
+#ifdef MODBUS_USE_IO_URING
+		pOut[i].op = 0;
+#endif
+	}
+	return n;
+}
+
+#else
+
+static short modbus_PollMask(int events)
+{
+	short mask = 0;
+	if(events & MODBUS_EV_IN)
+		mask |= POLLIN;
+	if(events & MODBUS_EV_OUT)
+		mask |= POLLOUT;
+	return mask;
+}
+
+static int modbus_PollerInit(modbus_poller_t* p, int uring)
+{
+	p->nfds = 0;
+	p->cap = 64;
+	p->fds = malloc(p->cap * sizeof(struct pollfd));
+	p->conns = malloc(p->cap * sizeof(modbus_conn_t*));
+	return (p->fds && p->conns) ? 0 : -1;
+}
+
+static void modbus_PollerDestroy(modbus_poller_t* p)
+{
+	free(p->fds);
+	free(p->conns);
+}
+
+static int modbus_PollerAdd(modbus_poller_t* p, int fd, modbus_conn_t* conn, int events)
+{
+	if(p->nfds == p->cap)
+	{
+		struct pollfd* fds = realloc(p->fds, 2 * p->cap * sizeof(struct pollfd));
+		if(!fds)
+			return -1;
+		p->fds = fds;
+		modbus_conn_t** conns = realloc(p->conns, 2 * p->cap * sizeof(modbus_conn_t*));
+		if(!conns)
+			return -1;
+		p->conns = conns;
+		p->cap *= 2;
+	}
+	p->fds[p->nfds].fd = fd;
+	p->fds[p->nfds].events = modbus_PollMask(events);
+	p->fds[p->nfds].revents = 0;
+	p->conns[p->nfds] = conn;
+	if(conn)
+		conn->poll_index = p->nfds;
+	p->nfds++;
+	return 0;
+}
+
+static int modbus_PollerModify(modbus_poller_t* p, int fd, modbus_conn_t* conn, int events)
+{
+	p->fds[conn->poll_index].events = modbus_PollMask(events);
+	return 0;
+}
+
+/* Moves the last entry into the hole, so removal is O(1) */
+static void modbus_PollerRemove(modbus_poller_t* p, int fd, modbus_conn_t* conn)
+{
+	int idx = conn->poll_index;
+	int last = --p->nfds;
+	p->fds[idx] = p->fds[last];
+	p->conns[idx] = p->conns[last];
+	if(p->conns[idx])
+		p->conns[idx]->poll_index = idx;
+}
+
+/* Returns the number of events put in pOut, or -1 on error */
+static int modbus_PollerWait(modbus_poller_t* p, modbus_pollev_t* pOut, int nMax, int timeout_ms)
+{
+	int result = poll(p->fds, p->nfds, timeout_ms);
+	if(result <= 0)
+		return result;
+	int n = 0;
+	for(int i = 0; i < p->nfds && n < nMax; i++)
+	{
+		short mask = p->fds[i].revents;
+		if(!mask)
+			continue;
+		pOut[n].conn = p->conns[i];
+		pOut[n].events = 0;
+		if(mask & POLLIN)
+			pOut[n].events |= MODBUS_EV_IN;
+		if(mask & POLLOUT)
+			pOut[n].events |= MODBUS_EV_OUT;
+		if(mask & (POLLERR | POLLHUP | POLLNVAL))
+			pOut[n].events |= MODBUS_EV_ERR;
+		n++;
+	}
+	return n;
+}
+
+#endif
+
+//======================================================//
+// DEADLINES
+//======================================================//
+
+static void modbus_TimerSet(modbus_engine_t* engine, int i, modbus_txn_t* txn)
+{
+	engine->timers[i] = txn;
+	txn->timer_index = i;
+}
+
+static void modbus_TimerUp(modbus_engine_t* engine, int i)
+{
+	modbus_txn_t* txn = engine->timers[i];
+	while(i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if(engine->timers[parent]->deadline <= txn->deadline)
+			break;
+		modbus_TimerSet(engine, i, engine->timers[parent]);
+		i = parent;
+	}
+	modbus_TimerSet(engine, i, txn);
+}
+
+static void modbus_TimerDown(modbus_engine_t* engine, int i)
+{
+	modbus_txn_t* txn = engine->timers[i];
+	while(1)
+	{
+		int child = 2 * i + 1;
+		if(child >= engine->ntimers)
+			break;
+		if(child + 1 < engine->ntimers && engine->timers[child + 1]->deadline < engine->timers[child]->deadline)
+			child++;
+		if(txn->deadline <= engine->timers[child]->deadline)
+			break;
+		modbus_TimerSet(engine, i, engine->timers[child]);
+		i = child;
+	}
+	modbus_TimerSet(engine, i, txn);
+}
+
+/* Starts tracking the deadline of a transaction the engine just picked up */
+static void modbus_ScheduleDeadline(modbus_engine_t* engine, modbus_txn_t* txn)
+{
+	if(!txn->deadline)
+		return;
+	if(engine->ntimers == engine->timers_cap)
+	{
+		int cap = engine->timers_cap ? 2 * engine->timers_cap : 64;
+		modbus_txn_t** timers = realloc(engine->timers, cap * sizeof(modbus_txn_t*));
+		if(!timers)
+		{
+			LOG_ERROR("Out of memory for the deadline heap, request will never time out.");
+			return;
+		}
+		engine->timers = timers;
+		engine->timers_cap = cap;
+	}
+	engine->timers[engine->ntimers] = txn;
+	modbus_TimerUp(engine, engine->ntimers++);
+}
+
+/* Stops tracking a transaction's deadline. Called whenever a slot is freed */
+void modbus_CancelDeadline(modbus_conn_t* conn, modbus_txn_t* txn)
+{
+	int i = txn->timer_index;
+	if(i < 0)
+		return;
+	modbus_engine_t* engine = conn->engine;
+	txn->timer_index = -1;
+	modbus_txn_t* last = engine->timers[--engine->ntimers];
+	if(i == engine->ntimers)
+		return;
+	/* Fill the hole with the last entry, which may need to go either way */
+	engine->timers[i] = last;
+	last->timer_index = i;
+	if(i > 0 && last->deadline < engine->timers[(i - 1) / 2]->deadline)
+		modbus_TimerUp(engine, i);
+	else
+		modbus_TimerDown(engine, i);
+}
+
+/* Returns how long the poller can sleep before the next deadline, in ms (-1 for forever) */
+static int modbus_EngineSleep(modbus_engine_t* engine)
+{
+	if(engine->ntimers == 0 && !engine->held && !engine->dialing)
+		return -1;
+	epicsUInt64 now = epicsMonotonicGet();
+	epicsUInt64 deadline = engine->ntimers ? engine->timers[0]->deadline : ~(epicsUInt64)0;
+	/* Serial lines waiting out their gap wake us too, and so do connects */
+	for(modbus_conn_t* conn = engine->held; conn; conn = conn->held_next)
+		if(conn->quiet_at < deadline)
+			deadline = conn->quiet_at;
+	for(modbus_conn_t* conn = engine->dialing; conn; conn = conn->dial_next)
+		if(conn->dial_at < deadline)
+			deadline = conn->dial_at;
+	if(deadline <= now)
+		return 0;
+	epicsUInt64 ms = (deadline - now + 999999) / 1000000;
+	return ms > 60000 ? 60000 : (int)ms;
+}
+
+/* Gives up on connects that have taken too long, and tries warm connections again once their wait is over */
+static void modbus_EngineExpireDials(modbus_engine_t* engine, epicsUInt64 now)
+{
+	modbus_conn_t** pp = &engine->dialing;
+	while(*pp)
+	{
+		modbus_conn_t* conn = *pp;
+		if(conn->dial_at > now)
+		{
+			pp = &conn->dial_next;
+			continue;
+		}
+		*pp = conn->dial_next;
+		conn->dialing = 0;
+		conn->dial_next = NULL;
+		/* Either of these can put it back on the list, but only at the head, which has already been looked at */
+		if(conn->state == MODBUS_CONN_CONNECTING)
+		{
+			char buf[64];
+			ipAddrToDottedIP(&conn->addr, buf, 64);
+			LOG_ERROR_FORMATTED("Timed out connecting to device at %s", buf);
+			modbus_ResetConnection(conn, MODBUS_STATUS_TIMEOUT);
+		}
+		else
+			modbus_EngineNotify(conn);
+	}
+}
+
+/* Times out every transaction whose deadline has passed */
+/* Its connection is recycled, as a late response can't be told apart from one to a newer request */
+static void modbus_EngineExpire(modbus_engine_t* engine)
+{
+	if(engine->ntimers == 0 && !engine->dialing)
+		return;
+	epicsUInt64 now = epicsMonotonicGet();
+	if(engine->dialing)
+		modbus_EngineExpireDials(engine, now);
+	while(engine->ntimers > 0 && engine->timers[0]->deadline <= now)
+	{
+		modbus_txn_t* txn = engine->timers[0];
+		modbus_conn_t* conn = txn->conn;
+		LOG_ERROR_FORMATTED("Transaction %u timed out.", txn->trans_id);
+		if(conn->rtu)
+		{
+			/* Frames can't overlap on a serial line, so only the one on the wire is lost */
+			modbus_EngineTimeoutLine(engine, txn);
+			continue;
+		}
+		/* Fails everything outstanding on it, which takes them all out of the heap */
+		modbus_ResetConnection(conn, MODBUS_STATUS_TIMEOUT);
+	}
+}
+
+//======================================================//
+// CONNECTIONS
+//======================================================//
+
+/* Sets up a connection to addr. The socket isn't opened until there's something to send */
+void modbus_InitConnection(modbus_conn_t* conn, const struct sockaddr_in* addr)
+{
+	memset(conn, 0, sizeof(modbus_conn_t));
+	conn->sock = INVALID_SOCKET;
+	conn->state = MODBUS_CONN_CLOSED;
+	conn->addr = *addr;
+	conn->window = MODBUS_DEFAULT_WINDOW;
+	conn->detach_event = epicsEventMustCreate(epicsEventEmpty);
+	conn->timeout = MODBUS_DEFAULT_TIMEOUT;
+	conn->connect_timeout = (epicsUInt64)(MODBUS_DEFAULT_CONNECT_TIMEOUT * 1e9);
+	conn->coalesce_gap = MODBUS_DEFAULT_COALESCE_GAP;
+	conn->tx_lock = epicsMutexMustCreate();
+	for(int i = 0; i < MODBUS_MAX_INFLIGHT; i++)
+	{
+		conn->txns[i].conn = conn;
+		conn->txns[i].timer_index = -1;
+	}
+	modbus_InitPool(&conn->pool);
+	modbus_InitReads(conn);
+	modbus_InitWrites(conn);
+}
+
+/* Frees everything modbus_InitConnection made. The connection must be detached from its engine */
+void modbus_DestroyConnection(modbus_conn_t* conn)
+{
+	modbus_DestroyPool(&conn->pool);
+	free(conn->uring_send);
+	epicsMutexDestroy(conn->tx_lock);
+	epicsEventDestroy(conn->detach_event);
+}
+
+/* Closes the socket. Responses to anything outstanding will never show up, so those requests */
+/* complete with status. Only called from the engine thread */
+void modbus_ResetConnection(modbus_conn_t* conn, int status)
+{
+	int connecting = conn->state == MODBUS_CONN_CONNECTING;
+	if(conn->state == MODBUS_CONN_OPEN)
+	{
+		epicsMutexMustLock(conn->tx_lock);
+		conn->connected = 0;
+		epicsMutexUnlock(conn->tx_lock);
+	}
+	if(conn->sock != INVALID_SOCKET)
+	{
+		if(conn->poll_events)
+			modbus_PollerRemove(&conn->engine->poller, conn->sock, conn);
+#ifdef MODBUS_USE_IO_URING
+		/* The ring holds its own reference to the socket, so whatever it has outstanding on it must be stopped */
+		if(conn->uring_armed)
+			modbus_UringCancelAll(conn->engine, conn);
+#endif
+		if(conn->rtu)
+			close(conn->sock);
+		else
+			epicsSocketDestroy(conn->sock);
+		conn->sock = INVALID_SOCKET;
+	}
+	if(conn->held)
+		modbus_EngineUnhold(conn->engine, conn);
+	if(conn->dialing)
+		modbus_EngineUndial(conn->engine, conn);
+	conn->state = MODBUS_CONN_CLOSED;
+	conn->poll_events = 0;
+	/* Whatever's left in the ring belongs to the old stream */
+	conn->rx.head = conn->rx.tail = conn->rx.reclaim = 0;
+	if(connecting)
+		modbus_EngineBackoff(conn);
+	modbus_FailInflight(conn, status);
+	/* Warm connections come back on their own, though not straight away in case the device keeps dropping them */
+	if(conn->warm && !conn->detach)
+	{
+		epicsUInt64 at = epicsMonotonicGet() + (epicsUInt64)(MODBUS_CONNECT_BACKOFF_MIN * 1e9);
+		modbus_EngineDial(conn->engine, conn, conn->retry_at > at ? conn->retry_at : at);
+	}
+	/* Reads held back by a full window can go out now */
+	if((conn->reads_head || conn->writes_head || conn->queued_head) && !conn->detach)
+		modbus_EngineNotify(conn);
+}
+
+/* Closes the socket after an error */
+void modbus_CloseConnection(modbus_conn_t* conn)
+{
+	modbus_ResetConnection(conn, -1);
+}
+
+/* Changes the events the engine waits on for the connection */
+static void modbus_EngineWant(modbus_engine_t* engine, modbus_conn_t* conn, int events)
+{
+	if(events == conn->poll_events)
+		return;
+#ifdef MODBUS_USE_IO_URING
+	/* The ring sends and receives on its own once a socket's connected */
+	if(engine->poller.uring && !conn->rtu)
+		return;
+#endif
+	if(modbus_PollerModify(&engine->poller, conn->sock, conn, events) < 0)
+	{
+		LOG_ERROR("Failed to update the poller.");
+		modbus_CloseConnection(conn);
+		return;
+	}
+	conn->poll_events = events;
+}
+
+/* Puts a connection on the list the engine looks at again at dial_at, or moves it if it's already there */
+static void modbus_EngineDial(modbus_engine_t* engine, modbus_conn_t* conn, epicsUInt64 at)
+{
+	conn->dial_at = at;
+	if(conn->dialing)
+		return;
+	conn->dialing = 1;
+	conn->dial_next = engine->dialing;
+	engine->dialing = conn;
+}
+
+static void modbus_EngineUndial(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	modbus_conn_t** pp = &engine->dialing;
+	while(*pp && *pp != conn)
+		pp = &(*pp)->dial_next;
+	if(*pp)
+		*pp = conn->dial_next;
+	conn->dialing = 0;
+	conn->dial_next = NULL;
+}
+
+/* Lets modbus_ConnectDevices know the connection's connect is over, and whether it worked */
+static void modbus_EngineDialed(modbus_conn_t* conn, int connected)
+{
+	epicsMutexMustLock(conn->tx_lock);
+	conn->connected = connected;
+	struct modbus_warmup* warmup = conn->warmup;
+	conn->warmup = NULL;
+	/* Signalled with the lock held, since the waiter takes every connection's lock before it goes */
+	if(warmup && epicsAtomicDecrIntT(&warmup->pending) == 0)
+		epicsEventSignal(warmup->event);
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Holds off the next connect after a failed one, a little longer each time in a row */
+static void modbus_EngineBackoff(modbus_conn_t* conn)
+{
+	epicsUInt64 max = (epicsUInt64)(MODBUS_CONNECT_BACKOFF_MAX * 1e9);
+	conn->backoff = conn->backoff ? 2 * conn->backoff : (epicsUInt64)(MODBUS_CONNECT_BACKOFF_MIN * 1e9);
+	if(conn->backoff > max)
+		conn->backoff = max;
+	/* Up to a quarter more, so devices that dropped off together don't all come back at once */
+	epicsUInt64 now = epicsMonotonicGet();
+	conn->retry_at = now + conn->backoff + now % (conn->backoff / 4 + 1);
+	modbus_EngineDialed(conn, 0);
+}
+
+static void modbus_EngineConnected(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	if(conn->dialing)
+		modbus_EngineUndial(engine, conn);
+	conn->backoff = 0;
+	conn->retry_at = 0;
+	modbus_EngineDialed(conn, 1);
+}
+
+/* Starts a non-blocking connect. The engine sees it finish when the socket turns writable */
+static void modbus_EngineConnect(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	SOCKET sock = epicsSocketCreate(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sock == INVALID_SOCKET)
+	{
+		char errbuf[128];
+		epicsSocketConvertErrnoToString(errbuf, 127);
+		errbuf[127] = '\0';
+		epicsPrintf("%s:%u Failed to create socket for Modbus device: %s\n", __FILE__, __LINE__, errbuf);
+		modbus_EngineBackoff(conn);
+		modbus_CloseConnection(conn);
+		return;
+	}
+
+	osiSockIoctl_t yes = 1;
+	socket_ioctl(sock, FIONBIO, &yes);
+	/* Requests are tiny, don't let Nagle hold them back */
+	int flag = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+	conn->sock = sock;
+	conn->stats.connects++;
+
+	int events;
+	if(connect(sock, (struct sockaddr*)&conn->addr, sizeof(struct sockaddr_in)) == 0)
+	{
+		conn->state = MODBUS_CONN_OPEN;
+		events = MODBUS_EV_IN | MODBUS_EV_OUT;
+		modbus_EngineConnected(engine, conn);
+	}
+	else if(SOCKERRNO == SOCK_EINPROGRESS || SOCKERRNO == SOCK_EWOULDBLOCK)
+	{
+		conn->state = MODBUS_CONN_CONNECTING;
+		events = MODBUS_EV_OUT;
+		modbus_EngineDial(engine, conn, epicsMonotonicGet() + conn->connect_timeout);
+	}
+	else
+	{
+		char buf[64];
+		ipAddrToDottedIP(&conn->addr, buf, 64);
+		LOG_ERROR_FORMATTED("Failed to connect to device at %s", buf);
+		modbus_EngineBackoff(conn);
+		modbus_CloseConnection(conn);
+		return;
+	}
+
+#ifdef MODBUS_USE_IO_URING
+	if(engine->poller.uring && conn->state == MODBUS_CONN_OPEN)
+	{
+		modbus_UringOpened(engine, conn);
+		return;
+	}
+#endif
+	if(modbus_PollerAdd(&engine->poller, sock, conn, events) < 0)
+	{
+		LOG_ERROR("Failed to add socket to the poller.");
+		modbus_CloseConnection(conn);
+		return;
+	}
+	conn->poll_events = events;
+}
+
+/* Points iov at the frames at the head of the send queue, up to MODBUS_ENGINE_IOV of them */
+/* Returns how many it took */
+static int modbus_EngineGather(modbus_conn_t* conn, struct iovec* iov)
+{
+	int n = 0;
+	for(modbus_txn_t* txn = conn->sendq_head; txn && n < MODBUS_ENGINE_IOV; txn = txn->next, n++)
+	{
+		iov[n].iov_base = txn->frame->data;
+		iov[n].iov_len = txn->len;
+	}
+	iov[0].iov_base = (char*)iov[0].iov_base + conn->send_offset;
+	iov[0].iov_len -= conn->send_offset;
+	return n;
+}
+
+/* Drops every frame that made it out completely. Their slots stay busy until the response shows up */
+static void modbus_EngineSent(modbus_conn_t* conn, size_t bytes)
+{
+	epicsUInt64 now = epicsMonotonicGet();
+	while(bytes > 0)
+	{
+		modbus_txn_t* txn = conn->sendq_head;
+		size_t remain = txn->len - conn->send_offset;
+		if(bytes < remain)
+		{
+			conn->send_offset += bytes;
+			break;
+		}
+		bytes -= remain;
+		conn->send_offset = 0;
+		conn->sendq_head = txn->next;
+		if(!conn->sendq_head)
+			conn->sendq_tail = NULL;
+		txn->next = NULL;
+		modbus_ReleaseBuffer(&conn->pool, txn->frame);
+		txn->frame = NULL;
+		modbus_StatSent(conn, txn, now);
+	}
+}
+
+/* Writes as much of the send queue as the socket will take, batching frames into one sendmsg */
+/* Returns 0 if OK (even if some frames are still waiting for room), -1 if the connection was closed */
+static int modbus_EngineFlush(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+#ifdef MODBUS_USE_IO_URING
+	if(engine->poller.uring)
+		return modbus_UringFlush(engine, conn);
+#endif
+	while(conn->sendq_head)
+	{
+		struct iovec iov[MODBUS_ENGINE_IOV];
+		int n = modbus_EngineGather(conn, iov);
+
+#ifdef _WIN32
+		ssize_t sent = send(conn->sock, iov[0].iov_base, iov[0].iov_len, 0);
+#else
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ssize_t sent = sendmsg(conn->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+		if(sent < 0)
+		{
+			if(SOCKERRNO == SOCK_EINTR)
+				continue;
+			if(SOCKERRNO == SOCK_EWOULDBLOCK || SOCKERRNO == EAGAIN)
+				break;
+			char buf[128];
+			buf[127] = '\0';
+			epicsSocketConvertErrorToString(buf, 127, SOCKERRNO);
+			LOG_ERROR_FORMATTED("While sending block to device: %s", buf);
+			modbus_CloseConnection(conn);
+			return -1;
+		}
+		modbus_EngineSent(conn, sent);
+	}
+
+	/* Only ask about writability while there's something left to write */
+	modbus_EngineWant(engine, conn, conn->sendq_head ? (MODBUS_EV_IN | MODBUS_EV_OUT) : MODBUS_EV_IN);
+	return conn->sock == INVALID_SOCKET ? -1 : 0;
+}
+
+/* Reads whatever the socket has into the free space of the receive ring */
+/* Only called from the engine thread */
+/* Returns -1 on error, or the number of bytes received (0 if nothing was waiting) */
+ssize_t modbus_RecvBlock(modbus_conn_t* conn)
+{
+	if(conn->sock == INVALID_SOCKET)
+	{
+		LOG_ERROR("While receiving block from device: the socket is not connected!");
+		return -1;
+	}
+	modbus_rxring_t* ring = &conn->rx;
+	size_t space = MODBUS_RX_RING_SIZE - (ring->head - ring->reclaim);
+	if(space == 0)
+	{
+		/* Only possible if callbacks are holding on to the whole ring, so there's no way forward */
+		LOG_ERROR("While receiving block from device: receive ring is full!");
+		modbus_CloseConnection(conn);
+		return -1;
+	}
+
+	/* The free space may wrap around the end of the ring */
+	struct iovec iov[2];
+	size_t start = ring->head & (MODBUS_RX_RING_SIZE - 1);
+	size_t first = MODBUS_RX_RING_SIZE - start;
+	if(first > space)
+		first = space;
+	iov[0].iov_base = ring->data + start;
+	iov[0].iov_len = first;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = space - first;
+
+	ssize_t len;
+	do
+	{
+#ifdef _WIN32
+		len = recv(conn->sock, iov[0].iov_base, iov[0].iov_len, 0);
+#else
+		if(conn->rtu)
+			len = readv(conn->sock, iov, iov[1].iov_len ? 2 : 1);
+		else
+		{
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(struct msghdr));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+			len = recvmsg(conn->sock, &msg, MSG_DONTWAIT);
+		}
+#endif
+	} while(len < 0 && SOCKERRNO == SOCK_EINTR);
+
+	if(len < 0 && (SOCKERRNO == SOCK_EWOULDBLOCK || SOCKERRNO == EAGAIN))
+		return 0;
+	/* A serial port with nothing waiting just reads 0 */
+	if(len == 0 && conn->rtu)
+		return 0;
+	if(len <= 0)
+	{
+		if(len == 0)
+			LOG_ERROR("While receiving block from device: connection closed by peer!");
+		else
+		{
+			char buf[128];
+			buf[127] = '\0';
+			epicsSocketConvertErrorToString(buf, 127, SOCKERRNO);
+			LOG_ERROR_FORMATTED("While receiving block from device: %s", buf);
+		}
+		/* The stream is in an unknown state now, so start over with a new connection next time */
+		modbus_CloseConnection(conn);
+		return -1;
+	}
+
+	ring->head += len;
+	conn->rx_at = epicsMonotonicGet();
+	conn->stats.bytes_in += len;
+	return len;
+}
+
+/* Reads what's waiting and completes every request whose response came in */
+static void modbus_EngineRead(modbus_conn_t* conn)
+{
+	for(int i = 0; i < MODBUS_ENGINE_READS; i++)
+	{
+		ssize_t len = modbus_RecvBlock(conn);
+		if(len <= 0)
+			return;
+		int result;
+		while((result = modbus_NextFrame(conn)) == 0 || result == 1)
+			;
+		if(result < 0)
+			return;
+	}
+}
+
+//======================================================//
+// SERIAL LINES. Half-duplex, so one request at a time,
+// with the next one going out as soon as the line allows
+//======================================================//
+
+/* Puts a line on the list of ones waiting out their inter-frame gap */
+static void modbus_EngineHold(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	if(conn->held)
+		return;
+	conn->held = 1;
+	conn->held_next = engine->held;
+	engine->held = conn;
+}
+
+static void modbus_EngineUnhold(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	modbus_conn_t** pp = &engine->held;
+	while(*pp && *pp != conn)
+		pp = &(*pp)->held_next;
+	if(*pp)
+		*pp = conn->held_next;
+	conn->held = 0;
+	conn->held_next = NULL;
+}
+
+/* Opens the serial port. Anything already on the line when it opens is thrown away */
+static void modbus_EngineOpenLine(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	int fd = modbus_OpenLine(conn);
+	if(fd < 0)
+	{
+		modbus_CloseConnection(conn);
+		return;
+	}
+	if(modbus_PollerAdd(&engine->poller, fd, conn, MODBUS_EV_IN) < 0)
+	{
+		LOG_ERROR("Failed to add serial port to the poller.");
+		close(fd);
+		modbus_CloseConnection(conn);
+		return;
+	}
+	conn->sock = fd;
+	conn->stats.connects++;
+	conn->poll_events = MODBUS_EV_IN;
+	conn->state = MODBUS_CONN_OPEN;
+	conn->quiet_at = epicsMonotonicGet() + conn->frame_gap;
+}
+
+/* Puts the request at the head of the send queue on the bus, if the last one is done with */
+/* and the line has been quiet for long enough. Otherwise the line is held until it has */
+static void modbus_EngineKick(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	modbus_txn_t* txn = conn->sendq_head;
+	if(conn->wire || !txn || conn->state != MODBUS_CONN_OPEN)
+		return;
+	epicsUInt64 now = epicsMonotonicGet();
+	if(now < conn->quiet_at)
+	{
+		modbus_EngineHold(engine, conn);
+		return;
+	}
+
+	ssize_t sent;
+	do
+		sent = write(conn->sock, txn->frame->data + conn->send_offset, txn->len - conn->send_offset);
+	while(sent < 0 && errno == EINTR);
+	if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		LOG_ERROR_FORMATTED("While sending frame on serial port %s", conn->port);
+		modbus_CloseConnection(conn);
+		return;
+	}
+	if(sent > 0)
+		conn->send_offset += sent;
+	if(conn->send_offset < txn->len)
+	{
+		modbus_EngineWant(engine, conn, MODBUS_EV_IN | MODBUS_EV_OUT);
+		return;
+	}
+
+	/* All of it is in the UART now. The response can't start until the last character has gone out */
+	conn->sendq_head = txn->next;
+	if(!conn->sendq_head)
+		conn->sendq_tail = NULL;
+	txn->next = NULL;
+	conn->send_offset = 0;
+	if(txn->deadline)
+		txn->deadline += now + conn->char_time * txn->len;
+	modbus_ReleaseBuffer(&conn->pool, txn->frame);
+	txn->frame = NULL;
+	conn->wire = txn;
+	modbus_StatSent(conn, txn, now);
+	modbus_ScheduleDeadline(engine, txn);
+	modbus_EngineWant(engine, conn, MODBUS_EV_IN);
+}
+
+/* Sends on every held line whose gap is over */
+static void modbus_EngineRunHeld(modbus_engine_t* engine)
+{
+	if(!engine->held)
+		return;
+	epicsUInt64 now = epicsMonotonicGet();
+	modbus_conn_t** pp = &engine->held;
+	while(*pp)
+	{
+		modbus_conn_t* conn = *pp;
+		if(conn->quiet_at > now)
+		{
+			pp = &conn->held_next;
+			continue;
+		}
+		*pp = conn->held_next;
+		conn->held = 0;
+		conn->held_next = NULL;
+		modbus_EngineKick(engine, conn);
+	}
+}
+
+/* Fails the request on the wire, and moves on to the next one once the line is quiet */
+static void modbus_EngineTimeoutLine(modbus_engine_t* engine, modbus_txn_t* txn)
+{
+	modbus_conn_t* conn = txn->conn;
+	if(conn->wire == txn)
+		conn->wire = NULL;
+	/* Part of the response may have come in, and the rest may still be on its way */
+	modbus_FlushLine(conn);
+	conn->quiet_at = epicsMonotonicGet() + conn->frame_gap;
+	modbus_FailTransaction(conn, txn, MODBUS_STATUS_TIMEOUT);
+	modbus_EngineKick(engine, conn);
+}
+
+static void modbus_EngineHandleLine(modbus_engine_t* engine, modbus_conn_t* conn, int events)
+{
+	if(events & (MODBUS_EV_IN | MODBUS_EV_ERR))
+	{
+		modbus_EngineRead(conn);
+		if(conn->sock == INVALID_SOCKET)
+			return;
+		if(conn->reads_head || conn->queued_head || (conn->writes_head && !conn->write_busy))
+			modbus_EngineNotify(conn);
+	}
+	/* Either the last response just came in, or the UART has room for the rest of a frame */
+	modbus_EngineKick(engine, conn);
+}
+
+/* Handles what the poller reported for a connection */
+static void modbus_EngineHandle(modbus_engine_t* engine, modbus_conn_t* conn, int events)
+{
+	/* May have been closed by something earlier in the same batch of events */
+	if(conn->sock == INVALID_SOCKET)
+		return;
+
+	if(conn->rtu)
+	{
+		modbus_EngineHandleLine(engine, conn, events);
+		return;
+	}
+
+	if(conn->state == MODBUS_CONN_CONNECTING)
+	{
+		if(!(events & (MODBUS_EV_OUT | MODBUS_EV_ERR)))
+			return;
+		int err = 0;
+		osiSocklen_t len = sizeof(err);
+		if(getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, (char*)&err, &len) < 0 || err != 0)
+		{
+			char buf[64];
+			ipAddrToDottedIP(&conn->addr, buf, 64);
+			LOG_ERROR_FORMATTED("Failed to connect to device at %s", buf);
+			modbus_CloseConnection(conn);
+			return;
+		}
+		conn->state = MODBUS_CONN_OPEN;
+		modbus_EngineConnected(engine, conn);
+#ifdef MODBUS_USE_IO_URING
+		if(engine->poller.uring)
+			modbus_UringOpened(engine, conn);
+#endif
+		modbus_EngineFlush(engine, conn);
+		return;
+	}
+
+	if(events & (MODBUS_EV_IN | MODBUS_EV_ERR))
+	{
+		modbus_EngineRead(conn);
+		if(conn->sock == INVALID_SOCKET)
+			return;
+		/* Reads held back by a full window can go out now */
+		if(conn->reads_head || conn->queued_head || (conn->writes_head && !conn->write_busy))
+			modbus_EngineNotify(conn);
+	}
+	if(events & MODBUS_EV_OUT)
+		modbus_EngineFlush(engine, conn);
+}
+
+/* Picks up newly queued requests and gets them moving */
+static void modbus_EngineService(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	if(conn->detach)
+	{
+		if(conn->uring_detached)
+			return;
+		modbus_CloseConnection(conn);
+		modbus_FailReads(conn, -1);
+		modbus_FailWrites(conn, -1);
+		modbus_FailQueued(conn, -1);
+		/* Completions still to come from the ring point at the connection, see modbus_EngineRetire */
+		if(conn->uring_ops)
+		{
+			conn->uring_detached = 1;
+			return;
+		}
+		epicsEventSignal(conn->detach_event);
+		return;
+	}
+
+	/* Turn queued reads into requests first, so they go out with everything else */
+	modbus_FlushReads(conn);
+	modbus_FlushWrites(conn);
+	modbus_FlushQueued(conn);
+
+	epicsMutexMustLock(conn->tx_lock);
+	if(conn->pending_head)
+	{
+		/* Requests on a serial line start their clocks once they're on the wire */
+		for(modbus_txn_t* txn = conn->pending_head; txn && !conn->rtu; txn = txn->next)
+			modbus_ScheduleDeadline(engine, txn);
+		if(conn->sendq_tail)
+			conn->sendq_tail->next = conn->pending_head;
+		else
+			conn->sendq_head = conn->pending_head;
+		conn->sendq_tail = conn->pending_tail;
+		conn->pending_head = conn->pending_tail = NULL;
+	}
+	epicsMutexUnlock(conn->tx_lock);
+
+	/* Warm connections are opened even with nothing to send, see modbus_ConnectDevices */
+	if(!conn->sendq_head && !conn->warm)
+		return;
+	/* Not until the ring's done with the old socket. The last of it comes back through here */
+	if(conn->state == MODBUS_CONN_CLOSED && conn->uring_ops)
+		return;
+	if(conn->rtu)
+	{
+		if(conn->state == MODBUS_CONN_CLOSED)
+			modbus_EngineOpenLine(engine, conn);
+		if(conn->state == MODBUS_CONN_OPEN)
+			modbus_EngineKick(engine, conn);
+		return;
+	}
+	if(conn->state == MODBUS_CONN_CLOSED)
+	{
+		/* The last connect failed not long ago. Fail what's queued rather than have it wait on another one */
+		if(epicsMonotonicGet() < conn->retry_at)
+		{
+			/* The reset puts a warm connection back on the dial list. Without one, it goes back on here */
+			if(conn->sendq_head)
+				modbus_ResetConnection(conn, -1);
+			else if(conn->warm)
+				modbus_EngineDial(engine, conn, conn->retry_at);
+			modbus_EngineDialed(conn, 0);
+			return;
+		}
+		modbus_EngineConnect(engine, conn);
+	}
+	if(conn->state == MODBUS_CONN_OPEN)
+	{
+		/* Already connected by the time modbus_ConnectDevices asked */
+		if(conn->warm)
+			modbus_EngineDialed(conn, 1);
+		modbus_EngineFlush(engine, conn);
+	}
+}
+
+/* Services every connection on the ready list */
+static void modbus_EngineRunReady(modbus_engine_t* engine)
+{
+	/* Clear the wakeup flag before taking the list, so anything queued after this point wakes us again */
+	epicsAtomicSetIntT(&engine->wake_pending, 0);
+
+	/* Take the whole list at once. Nothing else ever takes from it, so there's no ABA to worry about */
+	modbus_conn_t* list = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&engine->ready);
+	while(list)
+	{
+		modbus_conn_t* seen = epicsAtomicCmpAndSwapPtrT((EpicsAtomicPtrT*)&engine->ready, list, NULL);
+		if(seen == list)
+			break;
+		list = seen;
+	}
+
+	/* It was pushed newest first. Service in the order they were notified in */
+	modbus_conn_t* conn = NULL;
+	while(list)
+	{
+		modbus_conn_t* next = list->ready_next;
+		list->ready_next = conn;
+		conn = list;
+		list = next;
+	}
+	while(conn)
+	{
+		/* Once ready is cleared, other threads can put the connection back on and overwrite ready_next */
+		modbus_conn_t* next = conn->ready_next;
+		conn->ready_next = NULL;
+		epicsAtomicSetIntT(&conn->ready, 0);
+		modbus_EngineService(engine, conn);
+		conn = next;
+	}
+}
+
+/* Empties the wakeup pipe */
+static void modbus_EngineDrainWake(modbus_engine_t* engine)
+{
+	char buf[64];
+	while(read(engine->wake_fds[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+#ifdef MODBUS_USE_IO_URING
+
+//======================================================//
+// IO_URING. Once connected, a socket's sends and receives
+// are handed to the ring instead of waiting until it's
+// ready. Everything queued in a loop is submitted at once
+//======================================================//
+
+/* Receives on the socket until it fails or is cancelled, into buffers the kernel picks from the ring's pool */
+static void modbus_UringArmRecv(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	if(modbus_UringRecv(&engine->poller.ring, conn->sock, MODBUS_URING_TAG(conn, MODBUS_OP_RECV)) < 0)
+	{
+		LOG_ERROR("Failed to queue a receive on the ring.");
+		modbus_CloseConnection(conn);
+		return;
+	}
+	conn->uring_ops++;
+	conn->uring_armed |= 1 << MODBUS_OP_RECV;
+}
+
+/* Hands a newly connected socket over to the ring */
+static void modbus_UringOpened(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	/* The ring never blocks the thread on a socket. A blocking one just has it wait for room instead of failing */
+	osiSockIoctl_t no = 0;
+	socket_ioctl(conn->sock, FIONBIO, &no);
+	modbus_UringArmRecv(engine, conn);
+}
+
+/* Stops everything the ring has outstanding on the connection. Each op still completes, with -ECANCELED */
+static void modbus_UringCancelAll(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	for(int op = MODBUS_OP_RECV; op <= MODBUS_OP_SEND; op++)
+	{
+		if((conn->uring_armed & (1 << op)) && modbus_UringCancel(&engine->poller.ring, MODBUS_URING_TAG(conn, op)) < 0)
+			LOG_ERROR("Failed to cancel an op on the ring.");
+	}
+}
+
+/* Hands the head of the send queue to the ring as one sendmsg. Only one is ever outstanding, so frames go out */
+/* in order, and whatever's queued behind it goes in the next one */
+/* Returns 0 if OK, -1 if the connection was closed */
+static int modbus_UringFlush(modbus_engine_t* engine, modbus_conn_t* conn)
+{
+	if(!conn->sendq_head || (conn->uring_armed & (1 << MODBUS_OP_SEND)))
+		return 0;
+	struct modbus_usend* us = conn->uring_send;
+	if(!us)
+	{
+		us = conn->uring_send = calloc(1, sizeof(struct modbus_usend));
+		if(!us)
+		{
+			LOG_ERROR("Out of memory for the connection's sends.");
+			modbus_CloseConnection(conn);
+			return -1;
+		}
+	}
+	memset(&us->msg, 0, sizeof(struct msghdr));
+	us->msg.msg_iov = us->iov;
+	us->msg.msg_iovlen = modbus_EngineGather(conn, us->iov);
+	if(modbus_UringSendmsg(&engine->poller.ring, conn->sock, &us->msg, MODBUS_URING_TAG(conn, MODBUS_OP_SEND)) < 0)
+	{
+		LOG_ERROR("Failed to queue a send on the ring.");
+		modbus_CloseConnection(conn);
+		return -1;
+	}
+	conn->uring_ops++;
+	conn->uring_armed |= 1 << MODBUS_OP_SEND;
+	return 0;
+}
+
+/* Copies what the ring received into the receive ring, and completes every request whose response is in */
+static void modbus_UringTake(modbus_conn_t* conn, const uint8_t* pData, size_t nLen)
+{
+	modbus_rxring_t* ring = &conn->rx;
+	if(nLen > MODBUS_RX_RING_SIZE - (ring->head - ring->reclaim))
+	{
+		/* The kernel's already taken it off the socket, so there's no leaving the rest for later */
+		LOG_ERROR("While receiving block from device: receive ring is full!");
+		modbus_CloseConnection(conn);
+		return;
+	}
+	size_t start = ring->head & (MODBUS_RX_RING_SIZE - 1);
+	size_t first = MODBUS_RX_RING_SIZE - start;
+	if(first > nLen)
+		first = nLen;
+	memcpy(ring->data + start, pData, first);
+	memcpy(ring->data, pData + first, nLen - first);
+	ring->head += nLen;
+	conn->rx_at = epicsMonotonicGet();
+	conn->stats.bytes_in += nLen;
+
+	int result;
+	while((result = modbus_NextFrame(conn)) == 0 || result == 1)
+		;
+}
+
+static void modbus_UringReceived(modbus_engine_t* engine, modbus_conn_t* conn, modbus_pollev_t* ev)
+{
+	if(!(ev->flags & IORING_CQE_F_MORE))
+		conn->uring_armed &= ~(1 << MODBUS_OP_RECV);
+	if(ev->flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned bid = ev->flags >> IORING_CQE_BUFFER_SHIFT;
+		/* Anything left over from a socket that's been closed belongs to the old stream */
+		if(ev->res > 0 && conn->sock != INVALID_SOCKET)
+			modbus_UringTake(conn, modbus_UringBuffer(&engine->poller.ring, bid), ev->res);
+		modbus_UringRecycle(&engine->poller.ring, bid);
+	}
+	if(conn->sock == INVALID_SOCKET)
+		return;
+	/* Out of buffers just means the engine fell behind. It's started again below once they've been handed back */
+	if(ev->res <= 0 && ev->res != -ENOBUFS)
+	{
+		if(ev->res == 0)
+			LOG_ERROR("While receiving block from device: connection closed by peer!");
+		else
+			LOG_ERROR_FORMATTED("While receiving block from device: %s", strerror(-ev->res));
+		modbus_CloseConnection(conn);
+		return;
+	}
+	/* Reads held back by a full window can go out now */
+	if(conn->reads_head || conn->queued_head || (conn->writes_head && !conn->write_busy))
+		modbus_EngineNotify(conn);
+	if(!(conn->uring_armed & (1 << MODBUS_OP_RECV)))
+		modbus_UringArmRecv(engine, conn);
+}
+
+static void modbus_UringSent(modbus_engine_t* engine, modbus_conn_t* conn, modbus_pollev_t* ev)
+{
+	conn->uring_armed &= ~(1 << MODBUS_OP_SEND);
+	/* Closed while it was in flight, and its requests have already failed */
+	if(conn->sock == INVALID_SOCKET)
+		return;
+	if(ev->res < 0)
+	{
+		LOG_ERROR_FORMATTED("While sending block to device: %s", strerror(-ev->res));
+		modbus_CloseConnection(conn);
+		return;
+	}
+	modbus_EngineSent(conn, ev->res);
+	modbus_UringFlush(engine, conn);
+}
+
+static void modbus_UringPolled(modbus_engine_t* engine, modbus_conn_t* conn, modbus_pollev_t* ev)
+{
+	if(!(ev->flags & IORING_CQE_F_MORE))
+	{
+		conn->uring_armed &= ~(1 << MODBUS_OP_POLL);
+		/* A serial line's poll only ends early if the kernel gave up on it, so it's put straight back */
+		if(conn->rtu && conn->sock != INVALID_SOCKET && conn->poll_events &&
+			modbus_PollerAdd(&engine->poller, conn->sock, conn, conn->poll_events) < 0)
+		{
+			LOG_ERROR("Failed to add serial port to the poller.");
+			modbus_CloseConnection(conn);
+			return;
+		}
+		if(!conn->rtu)
+			conn->poll_events = 0;
+	}
+	if(ev->res > 0)
+		modbus_EngineHandle(engine, conn, ev->events);
+}
+
+/* Counts off an op the ring is done with. A closed connection can be reopened once the last one's done, or */
+/* let go of if it's being detached. Nothing can touch the connection after that */
+static void modbus_EngineRetire(modbus_conn_t* conn)
+{
+	if(--conn->uring_ops > 0 || conn->sock != INVALID_SOCKET)
+		return;
+	if(conn->uring_detached)
+		epicsEventSignal(conn->detach_event);
+	else
+		modbus_EngineNotify(conn);
+}
+
+/* Handles a completion from the ring */
+static void modbus_EngineComplete(modbus_engine_t* engine, modbus_pollev_t* ev)
+{
+	modbus_conn_t* conn = ev->conn;
+	if(!conn)
+	{
+		modbus_EngineDrainWake(engine);
+		if(!(ev->flags & IORING_CQE_F_MORE))
+			modbus_PollerAdd(&engine->poller, engine->wake_fds[0], NULL, MODBUS_EV_IN);
+		return;
+	}
+	if(ev->op == MODBUS_OP_RECV)
+		modbus_UringReceived(engine, conn, ev);
+	else if(ev->op == MODBUS_OP_SEND)
+		modbus_UringSent(engine, conn, ev);
+	else
+		modbus_UringPolled(engine, conn, ev);
+	if(!(ev->flags & IORING_CQE_F_MORE))
+		modbus_EngineRetire(conn);
+}
+
+#endif
+
+static void modbus_EngineThread(void* pArg)
+{
+	modbus_engine_t* engine = pArg;
+	engine->thread = epicsThreadGetIdSelf();
+	if(engine->cpu >= 0)
+	{
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(engine->cpu, &set);
+		if(sched_setaffinity(0, sizeof(set), &set) != 0)
+			epicsPrintf("%s:%u Failed to pin Modbus engine %s to CPU %d\n", __FILE__, __LINE__, engine->name, engine->cpu);
+#else
+		epicsPrintf("%s:%u CPU pinning isn't supported here, Modbus engine %s runs unpinned\n", __FILE__, __LINE__,
+			engine->name);
+#endif
+	}
+	while(!epicsAtomicGetIntT(&engine->stop))
+	{
+		int n = modbus_PollerWait(&engine->poller, engine->events, MODBUS_ENGINE_EVENTS, modbus_EngineSleep(engine));
+		for(int i = 0; i < n; i++)
+		{
+			modbus_pollev_t* ev = &engine->events[i];
+#ifdef MODBUS_USE_IO_URING
+			if(ev->op)
+				modbus_EngineComplete(engine, ev);
+			else
+#endif
+			if(!ev->conn)
+				modbus_EngineDrainWake(engine);
+			else
+				modbus_EngineHandle(engine, ev->conn, ev->events);
+		}
+		modbus_EngineRunReady(engine);
+		modbus_EngineRunHeld(engine);
+		modbus_EngineExpire(engine);
+	}
+	epicsEventSignal(engine->exit_event);
+}
+
+/* Puts a connection on its engine's ready list and wakes the engine thread */
+void modbus_EngineNotify(modbus_conn_t* conn)
+{
+	modbus_engine_t* engine = conn->engine;
+	/* Only whoever sets ready gets to push it, so a connection is never on the list twice */
+	if(epicsAtomicCmpAndSwapIntT(&conn->ready, 0, 1) == 0)
+	{
+		modbus_conn_t* head = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&engine->ready);
+		while(1)
+		{
+			conn->ready_next = head;
+			modbus_conn_t* seen = epicsAtomicCmpAndSwapPtrT((EpicsAtomicPtrT*)&engine->ready, head, conn);
+			if(seen == head)
+				break;
+			head = seen;
+		}
+	}
+
+	/* Only the first notification since the engine last looked at the list needs to write to the pipe */
+	if(epicsAtomicCmpAndSwapIntT(&engine->wake_pending, 0, 1) == 0)
+	{
+		char c = 0;
+		if(write(engine->wake_fds[1], &c, 1) < 0)
+			LOG_ERROR("Failed to wake the modbus engine.");
+	}
+}
+
+/* Appends claimed and filled in transactions to the connection's pending list, without waking the engine */
+void modbus_AppendPending(modbus_conn_t* conn, modbus_txn_t** pTxns, int nTxns)
+{
+	/* This stays under tx_lock rather than going on an MPSC list like engine->ready: a batch has to land in order, */
+	/* and the engine takes the same lock to move it into the in-flight table. It's one lock per connection, so */
+	/* only submitters on the same connection ever wait on each other */
+	epicsMutexMustLock(conn->tx_lock);
+	for(int i = 0; i < nTxns; i++)
+	{
+		modbus_txn_t* txn = pTxns[i];
+		txn->next = NULL;
+		epicsAtomicSetIntT(&txn->busy, MODBUS_TXN_QUEUED);
+		if(conn->pending_tail)
+			conn->pending_tail->next = txn;
+		else
+			conn->pending_head = txn;
+		conn->pending_tail = txn;
+	}
+	epicsMutexUnlock(conn->tx_lock);
+}
+
+/* Hands claimed and filled in transactions to the engine, to be sent in order */
+void modbus_QueueTransactions(modbus_conn_t* conn, modbus_txn_t** pTxns, int nTxns)
+{
+	modbus_AppendPending(conn, pTxns, nTxns);
+	modbus_EngineNotify(conn);
+}
+
+void modbus_QueueTransaction(modbus_conn_t* conn, modbus_txn_t* txn)
+{
+	modbus_QueueTransactions(conn, &txn, 1);
+}
+
+/* Returns nonzero if the caller is the connection's engine thread, which must never block on a request */
+int modbus_OnEngineThread(modbus_conn_t* conn)
+{
+	return conn->engine && conn->engine->thread == epicsThreadGetIdSelf();
+}
+
+/* Creates an engine with its thread pinned to cpu, or not pinned if it's -1 */
+static modbus_engine_t* modbus_StartEngine(const char* pName, int cpu)
+{
+	modbus_engine_t* engine = calloc(1, sizeof(modbus_engine_t));
+	if(!engine)
+		return NULL;
+	strncpy(engine->name, pName ? pName : "modbusIO", sizeof(engine->name) - 1);
+	engine->cpu = cpu;
+
+	int uring = g_EngineBackend == MODBUS_BACKEND_URING;
+	if(modbus_PollerInit(&engine->poller, uring) < 0)
+	{
+		epicsPrintf("%s:%u Failed to create poller for Modbus engine %s\n", __FILE__, __LINE__, engine->name);
+		free(engine);
+		return NULL;
+	}
+#ifdef MODBUS_USE_IO_URING
+	if(uring && !engine->poller.uring)
+		epicsPrintf("%s:%u io_uring isn't available, Modbus engine %s falls back to epoll\n", __FILE__, __LINE__,
+			engine->name);
+#endif
+	if(pipe(engine->wake_fds) < 0)
+	{
+		epicsPrintf("%s:%u Failed to create wakeup pipe for Modbus engine %s\n", __FILE__, __LINE__, engine->name);
+		modbus_PollerDestroy(&engine->poller);
+		free(engine);
+		return NULL;
+	}
+	fcntl(engine->wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(engine->wake_fds[1], F_SETFL, O_NONBLOCK);
+	modbus_PollerAdd(&engine->poller, engine->wake_fds[0], NULL, MODBUS_EV_IN);
+
+	engine->exit_event = epicsEventMustCreate(epicsEventEmpty);
+	engine->thread = epicsThreadCreate(engine->name, epicsThreadPriorityHigh,
+		epicsThreadGetStackSize(epicsThreadStackMedium), modbus_EngineThread, engine);
+	if(!engine->thread)
+	{
+		epicsPrintf("%s:%u Failed to start thread for Modbus engine %s\n", __FILE__, __LINE__, engine->name);
+		close(engine->wake_fds[0]);
+		close(engine->wake_fds[1]);
+		modbus_PollerDestroy(&engine->poller);
+		epicsEventDestroy(engine->exit_event);
+		free(engine);
+		return NULL;
+	}
+	return engine;
+}
+
+//======================================================//
+// Name: modbus_CreateEngine
+// Purpose: Create an I/O engine and start its thread
+//======================================================//
+modbus_engine_t* modbus_CreateEngine(const char* pName)
+{
+	return modbus_StartEngine(pName, -1);
+}
+
+//======================================================//
+// Name: modbus_DestroyEngine
+// Purpose: Stop an engine
+//======================================================//
+void modbus_DestroyEngine(modbus_engine_t* engine)
+{
+	if(!engine)
+		return;
+	epicsAtomicSetIntT(&engine->stop, 1);
+	char c = 0;
+	if(write(engine->wake_fds[1], &c, 1) < 0)
+		LOG_ERROR("Failed to wake the modbus engine.");
+	epicsEventMustWait(engine->exit_event);
+
+	close(engine->wake_fds[0]);
+	close(engine->wake_fds[1]);
+	modbus_PollerDestroy(&engine->poller);
+	epicsEventDestroy(engine->exit_event);
+	free(engine->timers);
+	if(engine == g_DefaultEngine)
+		g_DefaultEngine = NULL;
+	for(int i = 0; i < g_EngineCount; i++)
+		if(g_Engines[i] == engine)
+			g_Engines[i] = NULL;
+	free(engine);
+}
+
+//======================================================//
+// Name: modbus_SetEngineThreads
+// Purpose: Set how many engines new devices are spread
+// over
+//======================================================//
+int modbus_SetEngineThreads(int nThreads, const int* pCpus)
+{
+	if(nThreads < 1 || nThreads > MODBUS_MAX_ENGINES)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(g_EnginesStarted)
+	{
+		LOG_ERROR("The engines have already been started.");
+		return -1;
+	}
+	g_EngineCount = nThreads;
+	for(int i = 0; i < nThreads; i++)
+		g_EngineCpus[i] = pCpus ? pCpus[i] : -1;
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_SetEngineBackend
+// Purpose: Choose how new engines do their I/O
+//======================================================//
+int modbus_SetEngineBackend(int backend)
+{
+	if(backend != MODBUS_BACKEND_POLL && backend != MODBUS_BACKEND_URING)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+#ifndef MODBUS_USE_IO_URING
+	if(backend == MODBUS_BACKEND_URING)
+	{
+		LOG_ERROR("io_uring support isn't built in.");
+		return -1;
+	}
+#endif
+	g_EngineBackend = backend;
+	return 0;
+}
+
+static void modbus_CreateDefaultEngine(void* pArg)
+{
+	(void)pArg;
+	g_EnginesStarted = 1;
+	for(int i = 0; i < g_EngineCount; i++)
+	{
+		char name[32];
+		if(g_EngineCount == 1)
+			strcpy(name, "modbusIO");
+		else
+			sprintf(name, "modbusIO%d", i);
+		g_Engines[i] = modbus_StartEngine(name, g_EngineCpus[i]);
+		if(g_Engines[i])
+			continue;
+		/* All or nothing, so devices never hash to a missing engine */
+		while(i-- > 0)
+			modbus_DestroyEngine(g_Engines[i]);
+		return;
+	}
+	g_DefaultEngine = g_Engines[0];
+}
+
+//======================================================//
+// Name: modbus_DefaultEngine
+// Purpose: Get the engine new devices go on
+//======================================================//
+modbus_engine_t* modbus_DefaultEngine()
+{
+	epicsThreadOnce(&g_DefaultEngineOnce, modbus_CreateDefaultEngine, NULL);
+	return g_DefaultEngine;
+}
+
+/* Returns the engine a new gateway goes on, picked by hashing nLen bytes of pKey (its address, or port name) */
+/* Returns NULL if the engines couldn't be started */
+modbus_engine_t* modbus_PickEngine(const void* pKey, size_t nLen)
+{
+	if(!modbus_DefaultEngine())
+		return NULL;
+	/* FNV-1a. Stable from one run to the next, so a gateway always ends up on the same engine */
+	const uint8_t* p = pKey;
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < nLen; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	modbus_engine_t* engine = g_Engines[hash % g_EngineCount];
+	return engine ? engine : g_DefaultEngine;
+}
+
+//======================================================//
+// Name: modbus_AttachDevice
+// Purpose: Move a device to an engine
+//======================================================//
+int modbus_AttachDevice(modbus_engine_t* engine, modbus_device_t* device)
+{
+	if(!engine || !device)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	/* Every connection to the gateway has to move together */
+	modbus_gateway_t* gateway = device->gateway;
+	epicsMutexMustLock(gateway->lock);
+	int nConns = gateway->nconns;
+	for(int i = 0; i < nConns; i++)
+	{
+		modbus_conn_t* conn = gateway->conns[i];
+		/* A warm connection waiting to try again is still on its engine's list */
+		if(conn->engine != engine &&
+			(conn->state != MODBUS_CONN_CLOSED || epicsAtomicGetIntT(&conn->inflight) > 0 || conn->dialing))
+		{
+			epicsMutexUnlock(gateway->lock);
+			LOG_ERROR("Device can't change engines while it's busy.");
+			return -1;
+		}
+	}
+	for(int i = 0; i < nConns; i++)
+		gateway->conns[i]->engine = engine;
+	epicsMutexUnlock(gateway->lock);
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_ConnectDevices
+// Purpose: Connect to many devices at once
+//======================================================//
+int modbus_ConnectDevices(modbus_device_t** pDevices, int nDevices, double timeout)
+{
+	if(!pDevices || nDevices < 0 || timeout <= 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	struct modbus_warmup warmup;
+	/* Our own count, so it can't reach 0 until every connection has been handed to its engine */
+	warmup.pending = 1;
+	warmup.event = epicsEventMustCreate(epicsEventEmpty);
+	for(int i = 0; i < nDevices; i++)
+	{
+		modbus_gateway_t* gateway = pDevices[i] ? pDevices[i]->gateway : NULL;
+		if(!gateway || gateway->port[0])
+			continue;
+		int nConns = epicsAtomicGetIntT(&gateway->nconns);
+		for(int j = 0; j < nConns; j++)
+		{
+			modbus_conn_t* conn = gateway->conns[j];
+			epicsMutexMustLock(conn->tx_lock);
+			conn->warm = 1;
+			conn->connect_timeout = (epicsUInt64)(timeout * 1e9);
+			/* Devices behind the same gateway share connections. Someone else may be waiting on it too */
+			int add = !conn->warmup;
+			if(add)
+			{
+				conn->warmup = &warmup;
+				epicsAtomicIncrIntT(&warmup.pending);
+			}
+			epicsMutexUnlock(conn->tx_lock);
+			if(add)
+				modbus_EngineNotify(conn);
+		}
+	}
+	/* Each connect gives up within timeout, so this only runs over if an engine is slow to notice */
+	if(epicsAtomicDecrIntT(&warmup.pending) > 0)
+		epicsEventWaitWithTimeout(warmup.event, timeout + 0.1);
+
+	/* Connects still going carry on without us */
+	int nOpen = 0;
+	for(int i = 0; i < nDevices; i++)
+	{
+		modbus_gateway_t* gateway = pDevices[i] ? pDevices[i]->gateway : NULL;
+		if(!gateway || gateway->port[0])
+			continue;
+		int nConns = epicsAtomicGetIntT(&gateway->nconns);
+		for(int j = 0; j < nConns; j++)
+		{
+			modbus_conn_t* conn = gateway->conns[j];
+			epicsMutexMustLock(conn->tx_lock);
+			if(conn->warmup == &warmup)
+				conn->warmup = NULL;
+			epicsMutexUnlock(conn->tx_lock);
+		}
+		/* The engine owns the state, so go by what it last reported */
+		modbus_conn_t* conn = pDevices[i]->conn;
+		epicsMutexMustLock(conn->tx_lock);
+		if(conn->connected)
+			nOpen++;
+		epicsMutexUnlock(conn->tx_lock);
+	}
+	epicsEventDestroy(warmup.event);
+	return nOpen;
+}
+
+/* Has the engine drop the connection, and waits until it has */
+void modbus_DetachConnection(modbus_conn_t* conn)
+{
+	if(!conn->engine)
+		return;
+	conn->detach = 1;
+	modbus_EngineNotify(conn);
+	epicsEventMustWait(conn->detach_event);
+	conn->engine = NULL;
+}
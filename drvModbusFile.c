@@ -0,0 +1,264 @@
+//======================================================//
+// Name: drvModbusFile.c
+// Purpose: File record transfers (function codes 0x14 and
+// 0x15), split into pieces that are sent back to back
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* EPICS includes */
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+/* The only reference type there is */
+#define MODBUS_FILE_REF_TYPE 6
+
+/* Used by modbus_ReadFile and modbus_WriteFile to wait on their transfer */
+typedef struct
+{
+	modbus_file_sink sink;
+	void* pUser;
+	int status;
+	epicsEventId event;
+} modbus_file_wait_t;
+
+static int modbus_StartFile(modbus_file_xfer_t* xfer, modbus_device_t* device, uint16_t file, uint16_t record,
+	uint32_t nRegs, modbus_file_cb done, void* pUser);
+static int modbus_WaitFile(modbus_device_t* device, uint16_t file, uint16_t record, const uint16_t* pValues,
+	uint32_t nRegs, modbus_file_sink sink, void* pUser);
+
+//======================================================//
+// Name: modbus_ReadFileAsync
+// Purpose: Read registers of a file, as many requests as
+// it takes
+//======================================================//
+int modbus_ReadFileAsync(modbus_device_t* device, modbus_file_xfer_t* xfer, uint16_t file, uint16_t record, uint32_t nRegs,
+	modbus_file_sink sink, modbus_file_cb done, void* pUser)
+{
+	if(!device || !xfer || !sink || file == 0 || nRegs == 0 || (uint32_t)record + nRegs > MODBUS_MAX_FILE_RECORDS)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	xfer->func = MB_RD_FILE_REC_CODE;
+	xfer->pValues = NULL;
+	xfer->sink = sink;
+	return modbus_StartFile(xfer, device, file, record, nRegs, done, pUser);
+}
+
+//======================================================//
+// Name: modbus_WriteFileAsync
+// Purpose: Write registers of a file, as many requests as
+// it takes
+//======================================================//
+int modbus_WriteFileAsync(modbus_device_t* device, modbus_file_xfer_t* xfer, uint16_t file, uint16_t record,
+	const uint16_t* pValues, uint32_t nRegs, modbus_file_cb done, void* pUser)
+{
+	if(!device || !xfer || !pValues || file == 0 || nRegs == 0 || (uint32_t)record + nRegs > MODBUS_MAX_FILE_RECORDS)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	xfer->func = MB_WR_FILE_REC_CODE;
+	xfer->pValues = pValues;
+	xfer->sink = NULL;
+	return modbus_StartFile(xfer, device, file, record, nRegs, done, pUser);
+}
+
+//======================================================//
+// Name: modbus_ReadFile
+// Purpose: Read registers of a file, and wait for all of
+// them
+//======================================================//
+int modbus_ReadFile(modbus_device_t* device, uint16_t file, uint16_t record, uint32_t nRegs, modbus_file_sink sink,
+	void* pUser)
+{
+	if(!device || !sink)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	return modbus_WaitFile(device, file, record, NULL, nRegs, sink, pUser);
+}
+
+//======================================================//
+// Name: modbus_WriteFile
+// Purpose: Write registers of a file, and wait for all of
+// them to land
+//======================================================//
+int modbus_WriteFile(modbus_device_t* device, uint16_t file, uint16_t record, const uint16_t* pValues, uint32_t nRegs)
+{
+	if(!device || !pValues)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	return modbus_WaitFile(device, file, record, pValues, nRegs, NULL, NULL);
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+static void modbus_FileCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen);
+
+/* Takes the next piece of the transfer, and builds its request in slot */
+static void modbus_NextPiece(modbus_file_xfer_t* xfer, modbus_file_slot_t* slot)
+{
+	int write = xfer->func == MB_WR_FILE_REC_CODE;
+	uint32_t max = write ? MODBUS_MAX_FILE_WRITE_REGS : MODBUS_MAX_FILE_READ_REGS;
+	uint16_t count = (uint16_t)(xfer->remaining < max ? xfer->remaining : max);
+	slot->xfer = xfer;
+	slot->record = xfer->next;
+	slot->count = count;
+	xfer->next += count;
+	xfer->remaining -= count;
+
+	/* One sub-request per request. More wouldn't fit any more registers in */
+	uint8_t* p = slot->pdu;
+	p[0] = xfer->func;
+	p[1] = (uint8_t)(7 + (write ? 2 * count : 0));
+	p[2] = MODBUS_FILE_REF_TYPE;
+	p[3] = xfer->file >> 8;
+	p[4] = xfer->file & 0xFF;
+	p[5] = slot->record >> 8;
+	p[6] = slot->record & 0xFF;
+	p[7] = count >> 8;
+	p[8] = count & 0xFF;
+	if(write)
+		modbus_RegistersToWire(xfer->pValues + (slot->record - xfer->first), p + 9, count);
+
+	slot->req.pPdu = p;
+	slot->req.nLen = 9 + (write ? 2 * count : 0);
+	slot->req.callback = modbus_FileCompletion;
+	slot->req.pUser = slot;
+	slot->req.timeout = 0;
+}
+
+/* Hands the registers in a read file record response to the sink */
+/* Returns 0 if OK, or -1 if the response is malformed */
+static int modbus_SinkPiece(modbus_file_xfer_t* xfer, modbus_file_slot_t* slot, const uint8_t* pPdu, size_t nLen)
+{
+	/* Function code and byte count, then the sub-response: its length, the reference type, and the registers */
+	size_t nBytes = 2 * slot->count;
+	if(nLen != 4 + nBytes || pPdu[1] != 2 + nBytes || pPdu[2] != 1 + nBytes || pPdu[3] != MODBUS_FILE_REF_TYPE)
+	{
+		LOG_ERROR("Response to read file record is malformed.");
+		return -1;
+	}
+	uint16_t regs[MODBUS_MAX_FILE_READ_REGS];
+	modbus_RegistersFromWire(pPdu + 4, regs, slot->count);
+	xfer->sink(xfer->pUser, slot->record, regs, slot->count);
+	return 0;
+}
+
+/* Called from the engine thread with the response to a piece. Sends the next piece in the same slot */
+static void modbus_FileCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+{
+	modbus_file_slot_t* slot = pUser;
+	modbus_file_xfer_t* xfer = slot->xfer;
+	if(status == 0 && xfer->func == MB_RD_FILE_REC_CODE)
+		status = modbus_SinkPiece(xfer, slot, pPdu, nLen);
+	else if(status == 0 && (nLen != slot->req.nLen || memcmp(pPdu, slot->pdu, nLen) != 0))
+	{
+		/* Writes echo the request */
+		LOG_ERROR("Response to write file record doesn't match the request.");
+		status = -1;
+	}
+	if(status != 0)
+		epicsAtomicCmpAndSwapIntT(&xfer->status, 0, status);
+
+	/* Once the first pieces are out, only the engine thread hands out the rest, so next and remaining */
+	/* don't need a lock */
+	if(epicsAtomicGetIntT(&xfer->status) == 0 && xfer->remaining)
+	{
+		modbus_NextPiece(xfer, slot);
+		if(modbus_SubmitQueued(xfer->device, &slot->req) == 0)
+			return;
+		epicsAtomicCmpAndSwapIntT(&xfer->status, 0, -1);
+	}
+	/* The transfer is the caller's again once done is called, so nothing can touch it after */
+	if(epicsAtomicDecrIntT(&xfer->outstanding) == 0 && xfer->done)
+		xfer->done(xfer->pUser, epicsAtomicGetIntT(&xfer->status));
+}
+
+/* Sends the first pieces of a transfer. Their completions send the rest */
+/* Returns 0 if started, or -1 if nothing could be sent */
+static int modbus_StartFile(modbus_file_xfer_t* xfer, modbus_device_t* device, uint16_t file, uint16_t record,
+	uint32_t nRegs, modbus_file_cb done, void* pUser)
+{
+	xfer->device = device;
+	xfer->file = file;
+	xfer->first = record;
+	xfer->next = record;
+	xfer->remaining = nRegs;
+	xfer->done = done;
+	xfer->pUser = pUser;
+	xfer->status = 0;
+
+	/* Hand out every first piece before sending any, since a completion can hand out the next one */
+	int n = 0;
+	while(n < MODBUS_FILE_DEPTH && xfer->remaining)
+		modbus_NextPiece(xfer, &xfer->slots[n++]);
+	xfer->outstanding = n;
+	for(int i = 0; i < n; i++)
+	{
+		if(modbus_SubmitQueued(device, &xfer->slots[i].req) == 0)
+			continue;
+		if(i == 0)
+			return -1;
+		/* Stop the pieces already out from sending more, and finish once they're done */
+		epicsAtomicCmpAndSwapIntT(&xfer->status, 0, -1);
+		if(epicsAtomicAddIntT(&xfer->outstanding, -(n - i)) == 0 && done)
+			done(pUser, -1);
+		break;
+	}
+	return 0;
+}
+
+static void modbus_WaitSink(void* pUser, uint16_t record, const uint16_t* pRegs, uint16_t nRegs)
+{
+	modbus_file_wait_t* wait = pUser;
+	wait->sink(wait->pUser, record, pRegs, nRegs);
+}
+
+static void modbus_WaitDone(void* pUser, int status)
+{
+	modbus_file_wait_t* wait = pUser;
+	wait->status = status;
+	epicsEventSignal(wait->event);
+}
+
+/* Runs a transfer and waits for it to finish. Reads if pValues is NULL */
+static int modbus_WaitFile(modbus_device_t* device, uint16_t file, uint16_t record, const uint16_t* pValues,
+	uint32_t nRegs, modbus_file_sink sink, void* pUser)
+{
+	if(modbus_OnEngineThread(device->conn))
+	{
+		LOG_ERROR("Synchronous requests can't be made from the engine thread.");
+		return -1;
+	}
+	modbus_file_wait_t wait;
+	wait.sink = sink;
+	wait.pUser = pUser;
+	wait.status = -1;
+	wait.event = modbus_ThreadEvent();
+
+	modbus_file_xfer_t xfer;
+	int result;
+	if(pValues)
+		result = modbus_WriteFileAsync(device, &xfer, file, record, pValues, nRegs, modbus_WaitDone, &wait);
+	else
+		result = modbus_ReadFileAsync(device, &xfer, file, record, nRegs, modbus_WaitSink, modbus_WaitDone, &wait);
+	if(result != 0)
+		return -1;
+	epicsEventMustWait(wait.event);
+	if(wait.status > 0)
+		LOG_ERROR("Modbus error during file transfer.");
+	return wait.status;
+}
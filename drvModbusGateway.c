@@ -0,0 +1,273 @@
+//======================================================//
+// Name: drvModbusGateway.c
+// Purpose: Pools of connections to a gateway (or a serial
+// line), shared by every device behind it
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* EPICS includes */
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+/* Every gateway with a device at it */
+static epicsThreadOnceId g_GatewayOnce = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId g_GatewayLock;
+static modbus_gateway_t* g_Gateways = NULL;
+
+static modbus_conn_t* modbus_NewConnection(modbus_gateway_t* gateway, const struct sockaddr_in* addr,
+	modbus_engine_t* engine);
+
+//======================================================//
+// Name: modbus_SetGatewayConnections
+// Purpose: Open more connections to a gateway
+//======================================================//
+int modbus_SetGatewayConnections(modbus_device_t* device, int nConns)
+{
+	if(!device || nConns < 1 || nConns > MODBUS_MAX_GATEWAY_CONNS)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_gateway_t* gateway = device->gateway;
+	if(gateway->port[0] && nConns > 1)
+	{
+		LOG_ERROR("A serial line can only have one connection.");
+		return -1;
+	}
+	int result = 0;
+	epicsMutexMustLock(gateway->lock);
+	modbus_conn_t* first = gateway->conns[0];
+	while(gateway->nconns < nConns)
+	{
+		modbus_conn_t* conn = modbus_NewConnection(gateway, &gateway->addr, first->engine);
+		if(!conn)
+		{
+			result = -1;
+			break;
+		}
+		/* Same settings as the rest of the pool */
+		epicsMutexMustLock(first->tx_lock);
+		conn->window = epicsAtomicGetIntT(&first->window);
+		conn->timeout = first->timeout;
+		conn->coalesce_gap = first->coalesce_gap;
+		conn->adapt = first->adapt;
+		conn->adapt_min = first->adapt_min;
+		conn->adapt_max = first->adapt_max;
+		conn->cwnd = conn->window;
+		epicsMutexUnlock(first->tx_lock);
+		gateway->conns[gateway->nconns] = conn;
+		/* Readers go by nconns without the lock, so the slot has to be visible first */
+		epicsAtomicWriteMemoryBarrier();
+		epicsAtomicSetIntT(&gateway->nconns, gateway->nconns + 1);
+	}
+	epicsMutexUnlock(gateway->lock);
+	return result;
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+static void modbus_InitGateways(void* pArg)
+{
+	(void)pArg;
+	g_GatewayLock = epicsMutexMustCreate();
+}
+
+static modbus_conn_t* modbus_NewConnection(modbus_gateway_t* gateway, const struct sockaddr_in* addr,
+	modbus_engine_t* engine)
+{
+	modbus_conn_t* conn = malloc(sizeof(modbus_conn_t));
+	if(!conn)
+		return NULL;
+	modbus_InitConnection(conn, addr);
+	conn->engine = engine;
+	conn->units = gateway->units;
+	return conn;
+}
+
+/* Closes the socket, fails anything still outstanding, and frees the connection */
+static void modbus_FreeConnection(modbus_conn_t* conn)
+{
+	modbus_DetachConnection(conn);
+	modbus_DestroyConnection(conn);
+	free(conn);
+}
+
+/* Calls fn on every gateway in use. Gateways can't be created or destroyed until it returns */
+void modbus_ForEachGateway(void (*fn)(modbus_gateway_t* gateway, void* pArg), void* pArg)
+{
+	epicsThreadOnce(&g_GatewayOnce, modbus_InitGateways, NULL);
+	epicsMutexMustLock(g_GatewayLock);
+	for(modbus_gateway_t* gateway = g_Gateways; gateway; gateway = gateway->next)
+		fn(gateway, pArg);
+	epicsMutexUnlock(g_GatewayLock);
+}
+
+/* Returns the gateway at addr, with a reference taken for the caller. It's created with one connection */
+/* on engine if no device is using it yet. Returns NULL on error */
+modbus_gateway_t* modbus_AcquireGateway(const struct sockaddr_in* addr, modbus_engine_t* engine)
+{
+	epicsThreadOnce(&g_GatewayOnce, modbus_InitGateways, NULL);
+	epicsMutexMustLock(g_GatewayLock);
+	modbus_gateway_t* gateway = g_Gateways;
+	while(gateway && (gateway->port[0] || gateway->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+		gateway->addr.sin_port != addr->sin_port))
+		gateway = gateway->next;
+	if(gateway)
+	{
+		gateway->refs++;
+		epicsMutexUnlock(g_GatewayLock);
+		return gateway;
+	}
+
+	gateway = calloc(1, sizeof(modbus_gateway_t));
+	if(gateway)
+		gateway->conns[0] = modbus_NewConnection(gateway, addr, engine);
+	if(!gateway || !gateway->conns[0])
+	{
+		epicsMutexUnlock(g_GatewayLock);
+		free(gateway);
+		return NULL;
+	}
+	gateway->addr = *addr;
+	gateway->refs = 1;
+	gateway->nconns = 1;
+	gateway->lock = epicsMutexMustCreate();
+	gateway->next = g_Gateways;
+	g_Gateways = gateway;
+	epicsMutexUnlock(g_GatewayLock);
+	return gateway;
+}
+
+/* Same as modbus_AcquireGateway, for the serial line on pPort. Returns NULL if the line is already in use */
+/* with different settings */
+modbus_gateway_t* modbus_AcquireLine(const char* pPort, int baud, char parity, modbus_engine_t* engine)
+{
+	epicsThreadOnce(&g_GatewayOnce, modbus_InitGateways, NULL);
+	epicsMutexMustLock(g_GatewayLock);
+	modbus_gateway_t* gateway = g_Gateways;
+	while(gateway && strcmp(gateway->port, pPort) != 0)
+		gateway = gateway->next;
+	if(gateway)
+	{
+		modbus_conn_t* conn = gateway->conns[0];
+		if(conn->baud != baud || conn->parity != parity)
+		{
+			epicsMutexUnlock(g_GatewayLock);
+			LOG_ERROR_FORMATTED("Serial port %s is already open with different settings", pPort);
+			return NULL;
+		}
+		gateway->refs++;
+		epicsMutexUnlock(g_GatewayLock);
+		return gateway;
+	}
+
+	struct sockaddr_in none;
+	memset(&none, 0, sizeof(none));
+	gateway = calloc(1, sizeof(modbus_gateway_t));
+	if(gateway)
+		gateway->conns[0] = modbus_NewConnection(gateway, &none, engine);
+	if(gateway && gateway->conns[0] && modbus_InitLine(gateway->conns[0], pPort, baud, parity) != 0)
+	{
+		modbus_FreeConnection(gateway->conns[0]);
+		gateway->conns[0] = NULL;
+	}
+	if(!gateway || !gateway->conns[0])
+	{
+		epicsMutexUnlock(g_GatewayLock);
+		free(gateway);
+		return NULL;
+	}
+	strncpy(gateway->port, pPort, MODBUS_MAX_PORT_NAME - 1);
+	gateway->refs = 1;
+	gateway->nconns = 1;
+	gateway->lock = epicsMutexMustCreate();
+	gateway->next = g_Gateways;
+	g_Gateways = gateway;
+	epicsMutexUnlock(g_GatewayLock);
+	return gateway;
+}
+
+/* Drops a reference to the gateway. The last one closes its connections and frees it */
+void modbus_ReleaseGateway(modbus_gateway_t* gateway)
+{
+	epicsMutexMustLock(g_GatewayLock);
+	int last = --gateway->refs == 0;
+	if(last)
+	{
+		modbus_gateway_t** pp = &g_Gateways;
+		while(*pp != gateway)
+			pp = &(*pp)->next;
+		*pp = gateway->next;
+	}
+	epicsMutexUnlock(g_GatewayLock);
+	if(!last)
+		return;
+
+	for(int i = 0; i < gateway->nconns; i++)
+		modbus_FreeConnection(gateway->conns[i]);
+	for(int i = 0; i < 256; i++)
+		free(gateway->units[i]);
+	epicsMutexDestroy(gateway->lock);
+	free(gateway);
+}
+
+/* Makes sure the gateway has stats for unit, for a device that's just been created with it */
+/* Returns 0 if OK, -1 on error */
+int modbus_AddUnit(modbus_gateway_t* gateway, uint8_t unit)
+{
+	int result = 0;
+	epicsMutexMustLock(gateway->lock);
+	if(!gateway->units[unit])
+	{
+		modbus_stats_t* stats = calloc(1, sizeof(modbus_stats_t));
+		if(stats)
+			epicsAtomicSetPtrT((EpicsAtomicPtrT*)&gateway->units[unit], stats);
+		else
+			result = -1;
+	}
+	epicsMutexUnlock(gateway->lock);
+	return result;
+}
+
+/* Picks the connection a new device's queued reads and writes go through, round robin */
+modbus_conn_t* modbus_HomeConnection(modbus_gateway_t* gateway)
+{
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	epicsAtomicReadMemoryBarrier();
+	int i = (epicsAtomicIncrIntT(&gateway->homes) - 1) % nConns;
+	return gateway->conns[i];
+}
+
+/* Returns the connection to the device's gateway with the fewest requests outstanding */
+/* Ties go to the device's own connection */
+modbus_conn_t* modbus_PickConnection(modbus_device_t* device)
+{
+	modbus_gateway_t* gateway = device->gateway;
+	modbus_conn_t* best = device->conn;
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	if(nConns == 1)
+		return best;
+	epicsAtomicReadMemoryBarrier();
+	int least = epicsAtomicGetIntT(&best->inflight);
+	for(int i = 0; i < nConns && least > 0; i++)
+	{
+		modbus_conn_t* conn = gateway->conns[i];
+		int n = epicsAtomicGetIntT(&conn->inflight);
+		if(n < least)
+		{
+			least = n;
+			best = conn;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,575 @@
+//======================================================//
+// Name: drvModbusImage.c
+// Purpose: Process image of each device. Holds the latest
+// scanned values, readable from any thread without locks
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* EPICS includes */
+#include <epicsMutex.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
+
+/* See modbus_Subscribe */
+struct modbus_subscription
+{
+	modbus_image_t* image;
+	modbus_segment_t* seg;
+	uint16_t addr;
+	uint16_t count;
+	uint32_t offset; /* Of addr in the segment */
+	int flags;
+	uint16_t* deadbands; /* NULL if there aren't any */
+	void* last; /* Values as of the last call, in the modbus_read_cb layout */
+	epicsUInt32* mask;
+	int status; /* As of the last call */
+	int primed; /* Set once the first values have gone out */
+	modbus_change_cb callback;
+	void* pUser;
+	struct modbus_subscription* next;
+};
+
+//======================================================//
+// Name: modbus_ReadImage
+// Purpose: Take a snapshot of a range of the image
+//======================================================//
+int modbus_ReadImage(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, void* pOut,
+	epicsTimeStamp* pTime, epicsUInt32* pGeneration)
+{
+	if(!device || !pOut || count == 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_image_t* image = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&device->image);
+	if(!image)
+		return -1;
+	/* Counted as a reader, so a segment the cache evicts isn't freed under us */
+	epicsAtomicIncrIntT(&image->readers);
+	modbus_segment_t* seg = modbus_FindSegment(image, func, addr, count);
+	int status = seg ? modbus_ReadSegment(seg, addr - seg->addr, count, pOut, pTime, pGeneration) : -1;
+	epicsAtomicDecrIntT(&image->readers);
+	return status;
+}
+
+//======================================================//
+// Name: modbus_ImageGeneration
+// Purpose: Get the number of times anything in the image
+// has changed
+//======================================================//
+epicsUInt32 modbus_ImageGeneration(modbus_device_t* device)
+{
+	if(!device)
+		return 0;
+	modbus_image_t* image = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&device->image);
+	return image ? (epicsUInt32)epicsAtomicGetIntT(&image->generation) : 0;
+}
+
+//======================================================//
+// Name: modbus_Subscribe
+// Purpose: Get told when points in a range of the image
+// change
+//======================================================//
+modbus_subscription_t* modbus_Subscribe(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count,
+	const uint16_t* pDeadbands, int flags, modbus_change_cb callback, void* pUser)
+{
+	if(!device || !callback || count == 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return NULL;
+	}
+	modbus_image_t* image = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&device->image);
+	if(!image)
+	{
+		LOG_ERROR("Range isn't in a scan block.");
+		return NULL;
+	}
+
+	int bits = func == MB_RD_COILS_CODE || func == MB_RD_DISC_INPUTS_CODE;
+	modbus_subscription_t* sub = calloc(1, sizeof(modbus_subscription_t));
+	if(!sub)
+		return NULL;
+	sub->last = calloc(1, bits ? (size_t)(count + 7) / 8 : count * sizeof(uint16_t));
+	sub->mask = calloc((count + 31) / 32, sizeof(epicsUInt32));
+	if(pDeadbands && !bits)
+	{
+		sub->deadbands = malloc(count * sizeof(uint16_t));
+		if(sub->deadbands)
+			memcpy(sub->deadbands, pDeadbands, count * sizeof(uint16_t));
+	}
+	if(!sub->last || !sub->mask || (pDeadbands && !bits && !sub->deadbands))
+	{
+		modbus_Unsubscribe(sub);
+		return NULL;
+	}
+
+	/* The cache only evicts segments nobody's subscribed to, and checks with sub_lock held */
+	epicsMutexMustLock(image->sub_lock);
+	modbus_segment_t* seg = modbus_FindSegment(image, func, addr, count);
+	if(!seg)
+	{
+		epicsMutexUnlock(image->sub_lock);
+		LOG_ERROR("Range isn't in a scan block.");
+		modbus_Unsubscribe(sub);
+		return NULL;
+	}
+	sub->image = image;
+	sub->seg = seg;
+	sub->addr = addr;
+	sub->count = count;
+	sub->offset = addr - seg->addr;
+	sub->flags = flags;
+	sub->status = -1;
+	sub->callback = callback;
+	sub->pUser = pUser;
+	sub->next = seg->subs;
+	epicsAtomicSetPtrT((EpicsAtomicPtrT*)&seg->subs, sub);
+	epicsMutexUnlock(image->sub_lock);
+	return sub;
+}
+
+//======================================================//
+// Name: modbus_Unsubscribe
+// Purpose: Stop change callbacks
+//======================================================//
+void modbus_Unsubscribe(modbus_subscription_t* sub)
+{
+	if(!sub)
+		return;
+	if(sub->image)
+	{
+		epicsMutexMustLock(sub->image->sub_lock);
+		modbus_subscription_t** pp = &sub->seg->subs;
+		while(*pp && *pp != sub)
+			pp = &(*pp)->next;
+		if(*pp)
+			*pp = sub->next;
+		epicsMutexUnlock(sub->image->sub_lock);
+	}
+	free(sub->deadbands);
+	free(sub->last);
+	free(sub->mask);
+	free(sub);
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Bytes of values a segment holds */
+static size_t modbus_SegmentSize(const modbus_segment_t* seg)
+{
+	int bits = seg->func == MB_RD_COILS_CODE || seg->func == MB_RD_DISC_INPUTS_CODE;
+	return bits ? (size_t)(seg->count + 7) / 8 : seg->count * sizeof(uint16_t);
+}
+
+/* Sets the first count bits of a change mask */
+static void modbus_SetMask(epicsUInt32* pMask, uint16_t count)
+{
+	uint32_t words = (count + 31) / 32;
+	for(uint32_t w = 0; w < words; w++)
+		pMask[w] = 0xFFFFFFFF;
+	if(count % 32)
+		pMask[words - 1] = (1u << (count % 32)) - 1;
+}
+
+/* Same as modbus_DiffRegisters, for packed coils. The mask is just the two XORed together */
+int modbus_DiffBits(const uint8_t* pOld, const uint8_t* pNew, uint16_t count, epicsUInt32* pMask)
+{
+	uint32_t bytes = (count + 7) / 8;
+	int n = 0;
+	for(uint32_t w = 0; w < (count + 31u) / 32; w++)
+	{
+		epicsUInt32 m = 0;
+		for(uint32_t k = 0; k < 4 && w * 4 + k < bytes; k++)
+			m |= (epicsUInt32)(pOld[w * 4 + k] ^ pNew[w * 4 + k]) << (8 * k);
+		pMask[w] = m;
+		n += __builtin_popcount(m);
+	}
+	return n;
+}
+
+/* Works out which of a subscription's points changed in the segment's last update, and calls it back */
+/* Registers with a deadband only count as changed once they've moved more than that since they were last passed on */
+static void modbus_NotifySubscription(modbus_subscription_t* sub, int status)
+{
+	modbus_segment_t* seg = sub->seg;
+	int bits = seg->func == MB_RD_COILS_CODE || seg->func == MB_RD_DISC_INPUTS_CODE;
+	uint32_t words = (sub->count + 31) / 32;
+	memset(sub->mask, 0, words * sizeof(epicsUInt32));
+	if(status != 0)
+	{
+		/* Only pass errors on when they start, or turn into a different one */
+		if(status != sub->status)
+		{
+			sub->status = status;
+			sub->callback(sub->pUser, status, sub->addr, sub->count, NULL, sub->mask);
+		}
+		return;
+	}
+
+	int n = 0;
+	if(!sub->primed)
+	{
+		modbus_SetMask(sub->mask, sub->count);
+		if(bits)
+			modbus_ExtractRead(seg->func, seg->data, sub->offset, sub->count, sub->last);
+		else
+			memcpy(sub->last, (const uint16_t*)seg->data + sub->offset, sub->count * sizeof(uint16_t));
+		sub->primed = 1;
+		n = sub->count;
+	}
+	else
+	{
+		/* Only look at the points the segment says changed */
+		uint32_t begin = sub->offset;
+		uint32_t end = sub->offset + sub->count;
+		for(uint32_t w = begin / 32; w <= (end - 1) / 32; w++)
+		{
+			epicsUInt32 m = seg->changed[w];
+			while(m)
+			{
+				uint32_t p = w * 32 + __builtin_ctz(m);
+				m &= m - 1;
+				if(p < begin || p >= end)
+					continue;
+				uint32_t i = p - begin;
+				if(bits)
+				{
+					((uint8_t*)sub->last)[i / 8] ^= 1 << (i % 8);
+				}
+				else
+				{
+					uint16_t* last = sub->last;
+					uint16_t value = ((const uint16_t*)seg->data)[p];
+					if(sub->deadbands && sub->deadbands[i])
+					{
+						int32_t diff = (sub->flags & MODBUS_SUB_SIGNED) ?
+							(int32_t)(int16_t)value - (int16_t)last[i] : (int32_t)value - last[i];
+						if(diff < 0)
+							diff = -diff;
+						if(diff <= sub->deadbands[i])
+							continue;
+					}
+					last[i] = value;
+				}
+				sub->mask[i / 32] |= 1u << (i % 32);
+				n++;
+			}
+		}
+	}
+	int recovered = sub->status != 0;
+	sub->status = 0;
+	if(n || recovered)
+		sub->callback(sub->pUser, 0, sub->addr, sub->count, bits ? sub->last : (const uint16_t*)seg->data + sub->offset,
+			sub->mask);
+}
+
+/* Calls back everything subscribed to the segment. Only called by the segment's writer */
+static void modbus_NotifySubscribers(modbus_image_t* image, modbus_segment_t* seg, int status)
+{
+	epicsMutexMustLock(image->sub_lock);
+	for(modbus_subscription_t* sub = seg->subs; sub; sub = sub->next)
+		modbus_NotifySubscription(sub, status);
+	epicsMutexUnlock(image->sub_lock);
+}
+
+/* Frees a segment and anything still subscribed to it */
+static void modbus_FreeSegment(modbus_segment_t* seg)
+{
+	while(seg->subs)
+	{
+		modbus_subscription_t* next = seg->subs->next;
+		seg->subs->image = NULL;
+		modbus_Unsubscribe(seg->subs);
+		seg->subs = next;
+	}
+	free(seg->changed);
+	free(seg->data);
+	free(seg);
+}
+
+/* Orders segments by function code, then address */
+static int modbus_SegmentBefore(const modbus_segment_t* a, uint8_t func, uint16_t addr)
+{
+	if(a->func != func)
+		return a->func < func;
+	return a->addr <= addr;
+}
+
+/* Returns the device's image, creating it if it doesn't have one yet */
+modbus_image_t* modbus_GetImage(modbus_device_t* device)
+{
+	modbus_image_t* image = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&device->image);
+	if(image)
+		return image;
+	image = calloc(1, sizeof(modbus_image_t));
+	if(!image)
+		return NULL;
+	image->lock = epicsMutexMustCreate();
+	image->sub_lock = epicsMutexMustCreate();
+	image->cache_lock = epicsMutexMustCreate();
+	/* Someone else may have got there first */
+	modbus_image_t* prev = epicsAtomicCmpAndSwapPtrT((EpicsAtomicPtrT*)&device->image, NULL, image);
+	if(prev)
+	{
+		epicsMutexDestroy(image->cache_lock);
+		epicsMutexDestroy(image->sub_lock);
+		epicsMutexDestroy(image->lock);
+		free(image);
+		return prev;
+	}
+	return image;
+}
+
+/* Publishes a copy of the segment table with seg added (if add is set) or removed */
+/* Readers may still be looking at the old table, so it's kept until the image is destroyed */
+/* Returns 0 if OK, -1 on error */
+static int modbus_ReplaceTable(modbus_image_t* image, modbus_segment_t* seg, int add)
+{
+	epicsMutexMustLock(image->lock);
+	modbus_segtable_t* old = image->table;
+	int nOld = old ? old->nsegs : 0;
+	modbus_segtable_t* table = malloc(sizeof(modbus_segtable_t) + (nOld + 1) * sizeof(modbus_segment_t*));
+	if(!table)
+	{
+		epicsMutexUnlock(image->lock);
+		return -1;
+	}
+	int n = 0;
+	int placed = !add;
+	for(int i = 0; i < nOld; i++)
+	{
+		if(old->segs[i] == seg)
+			continue;
+		if(!placed && !modbus_SegmentBefore(old->segs[i], seg->func, seg->addr))
+		{
+			table->segs[n++] = seg;
+			placed = 1;
+		}
+		table->segs[n++] = old->segs[i];
+	}
+	if(!placed)
+		table->segs[n++] = seg;
+	table->nsegs = n;
+	table->retired = old;
+	epicsAtomicSetPtrT((EpicsAtomicPtrT*)&image->table, table);
+	epicsMutexUnlock(image->lock);
+	return 0;
+}
+
+/* Adds a range to the device's image. Returns NULL on error */
+modbus_segment_t* modbus_AddSegment(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count)
+{
+	modbus_image_t* image = modbus_GetImage(device);
+	if(!image)
+		return NULL;
+	modbus_segment_t* seg = calloc(1, sizeof(modbus_segment_t));
+	if(!seg)
+		return NULL;
+	seg->func = func;
+	seg->addr = addr;
+	seg->count = count;
+	seg->status = -1;
+	seg->data = calloc(1, modbus_SegmentSize(seg));
+	seg->changed = calloc((count + 31) / 32, sizeof(epicsUInt32));
+	if(!seg->data || !seg->changed || modbus_ReplaceTable(image, seg, 1) != 0)
+	{
+		modbus_FreeSegment(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+/* Takes a range back out of the image. Readers may still be using it, so it's freed with the image, except */
+/* for cache segments. Those are only removed once nobody's subscribed to them, and modbus_ReclaimImage frees */
+/* them as soon as nothing could still be reading them */
+void modbus_RemoveSegment(modbus_device_t* device, modbus_segment_t* seg)
+{
+	modbus_image_t* image = device->image;
+	if(modbus_ReplaceTable(image, seg, 0) != 0)
+		return;
+	epicsMutexMustLock(image->lock);
+	modbus_segment_t** list = seg->cached ? &image->evicted : &image->removed;
+	seg->next = *list;
+	*list = seg;
+	epicsMutexUnlock(image->lock);
+}
+
+/* Frees the evicted cache segments and the tables the current one replaced, if no reader is in the middle of */
+/* a lookup. Readers that start later only see the current table, so none of it can be reached any more */
+/* Called with sub_lock held, since modbus_Subscribe looks segments up under it instead of counting itself */
+void modbus_ReclaimImage(modbus_image_t* image)
+{
+	epicsMutexMustLock(image->lock);
+	/* Not a plain read, so it's ordered after the table was last published */
+	if(epicsAtomicCmpAndSwapIntT(&image->readers, 0, 0) == 0 && image->table)
+	{
+		modbus_segtable_t* table = image->table->retired;
+		image->table->retired = NULL;
+		while(table)
+		{
+			modbus_segtable_t* retired = table->retired;
+			free(table);
+			table = retired;
+		}
+		while(image->evicted)
+		{
+			modbus_segment_t* next = image->evicted->next;
+			modbus_FreeSegment(image->evicted);
+			image->evicted = next;
+		}
+	}
+	epicsMutexUnlock(image->lock);
+}
+
+/* Frees the image and everything that was ever in it */
+void modbus_DestroyImage(modbus_image_t* image)
+{
+	if(!image)
+		return;
+	modbus_segtable_t* table = image->table;
+	for(int i = 0; table && i < table->nsegs; i++)
+		modbus_FreeSegment(table->segs[i]);
+	while(table)
+	{
+		modbus_segtable_t* retired = table->retired;
+		free(table);
+		table = retired;
+	}
+	while(image->removed)
+	{
+		modbus_segment_t* next = image->removed->next;
+		modbus_FreeSegment(image->removed);
+		image->removed = next;
+	}
+	while(image->evicted)
+	{
+		modbus_segment_t* next = image->evicted->next;
+		modbus_FreeSegment(image->evicted);
+		image->evicted = next;
+	}
+	epicsMutexDestroy(image->cache_lock);
+	epicsMutexDestroy(image->sub_lock);
+	epicsMutexDestroy(image->lock);
+	free(image);
+}
+
+/* Finds a segment holding all of addr to addr + count. Lock-free */
+modbus_segment_t* modbus_FindSegment(modbus_image_t* image, uint8_t func, uint16_t addr, uint16_t count)
+{
+	modbus_segtable_t* table = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&image->table);
+	if(!table)
+		return NULL;
+	/* Last segment starting at or below addr */
+	int lo = 0;
+	int hi = table->nsegs;
+	while(lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(modbus_SegmentBefore(table->segs[mid], func, addr))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* Segments can overlap, so one that starts further down might be the one that covers the range */
+	for(int i = lo - 1; i >= 0 && table->segs[i]->func == func; i--)
+	{
+		modbus_segment_t* seg = table->segs[i];
+		if((uint32_t)seg->addr + seg->count >= (uint32_t)addr + count)
+			return seg;
+	}
+	return NULL;
+}
+
+/* Publishes new values for a segment. pValues is in the modbus_read_cb layout, and ignored unless status is 0 */
+/* Only one thread may write to a segment at a time. Subscribers are called back from that thread */
+void modbus_WriteSegment(modbus_image_t* image, modbus_segment_t* seg, int status, const void* pValues,
+	const epicsTimeStamp* pTime)
+{
+	size_t size = modbus_SegmentSize(seg);
+	int changed = 0;
+	if(status == 0)
+	{
+		/* Only the writer changes data, so it's safe to compare against outside the sequence */
+		if(seg->updates == 0)
+		{
+			modbus_SetMask(seg->changed, seg->count);
+			changed = 1;
+		}
+		else if(seg->func == MB_RD_COILS_CODE || seg->func == MB_RD_DISC_INPUTS_CODE)
+			changed = modbus_DiffBits(seg->data, pValues, seg->count, seg->changed) > 0;
+		else
+			changed = modbus_DiffRegisters(seg->data, pValues, seg->count, seg->changed) > 0;
+	}
+
+	/* Odd while the values are being changed, so readers know to try again */
+	epicsAtomicSetIntT(&seg->seq, seg->seq + 1);
+	epicsAtomicWriteMemoryBarrier();
+	seg->status = status;
+	if(status == 0)
+	{
+		if(changed)
+		{
+			memcpy(seg->data, pValues, size);
+			seg->generation++;
+		}
+		seg->time = *pTime;
+		seg->updates++;
+	}
+	epicsAtomicWriteMemoryBarrier();
+	epicsAtomicSetIntT(&seg->seq, seg->seq + 1);
+
+	if(changed)
+		epicsAtomicIncrIntT(&image->generation);
+	if(epicsAtomicGetPtrT((EpicsAtomicPtrT*)&seg->subs))
+		modbus_NotifySubscribers(image, seg, status);
+}
+
+/* Copies count values starting offset values into the segment out to pOut, along with its time and generation */
+/* Returns the status of its last update the same as modbus_ReadImage. Lock-free */
+int modbus_ReadSegment(modbus_segment_t* seg, uint32_t offset, uint16_t count, void* pOut, epicsTimeStamp* pTime,
+	epicsUInt32* pGeneration)
+{
+	int bits = seg->func == MB_RD_COILS_CODE || seg->func == MB_RD_DISC_INPUTS_CODE;
+	while(1)
+	{
+		int seq = epicsAtomicGetIntT(&seg->seq);
+		if(seq & 1)
+		{
+			/* The writer only holds it for a memcpy */
+			continue;
+		}
+		epicsAtomicReadMemoryBarrier();
+		int status = seg->status;
+		epicsUInt32 updates = seg->updates;
+		epicsUInt32 generation = seg->generation;
+		epicsTimeStamp time = seg->time;
+		if(updates)
+		{
+			if(bits)
+				modbus_ExtractRead(seg->func, seg->data, offset, count, pOut);
+			else
+				memcpy(pOut, (const uint16_t*)seg->data + offset, count * sizeof(uint16_t));
+		}
+		epicsAtomicReadMemoryBarrier();
+		if(epicsAtomicGetIntT(&seg->seq) != seq)
+			continue;
+
+		if(updates)
+		{
+			if(pTime)
+				*pTime = time;
+			if(pGeneration)
+				*pGeneration = generation;
+		}
+		return status;
+	}
+}
@@ -0,0 +1,499 @@
+//======================================================//
+// Name: drvModbusInt.h
+// Purpose: Internals shared between the modbus driver files
+//======================================================//
+#ifndef _DRV_MODBUS_INT_H_
+#define _DRV_MODBUS_INT_H_
+
+#include "drvModbus.h"
+
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#else
+struct iovec
+{
+	void* iov_base;
+	size_t iov_len;
+};
+#endif
+
+#include <epicsPrint.h>
+
+/* io_uring engines, see modbus_SetEngineBackend. Needs kernel headers new enough for multishot receives */
+#if defined(__linux__) && !defined(MODBUS_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define MODBUS_USE_IO_URING
+#endif
+#endif
+#endif
+
+/* Some util macros */
+#if defined(__VERBOSE) || defined(__DEBUG)
+#define __LOG_ERROR(str) epicsPrintf("%s:%u %s\n", __FILE__,__LINE__,str)
+#define LOG_ERROR(str) __LOG_ERROR(str)
+#define LOG_ERROR_FORMATTED(str, ...) {char s[512]; sprintf(s,str, __VA_ARGS__); __LOG_ERROR(s); }
+#define PRINT_LOG(str) epicsPrintf("%s:%u %s\n", __FILE__, __LINE__, str)
+#define PRINT_LOG_FORMATTED(str, ...) {char s[512]; sprintf(s,str,__VA_ARGS__); PRINT_LOG(s); }
+#else
+#define LOG_ERROR(str)
+#define LOG_ERROR_FORMATTED(str,...)
+#define PRINT_LOG(str)
+#define PRINT_LOG_FORMATTED(str,...)
+#endif
+
+#define BIG_TO_LITTLE_ENDIAN(_short) _short = (((_short) >> 8) & 0x00FF) | (((_short) << 8) & 0xFF00)
+#define LITTLE_TO_BIG_ENDIAN(_short) _short = (((_short) << 8) & 0xFF00) | (((_short) >> 8) & 0x00FF)
+
+#define CHECK_RESULT(x, str) if(x) { LOG_ERROR(str); }
+#define CHECK_RESULT_FORMATTED(x, str, ...) if(x) { LOG_ERROR_FORATTED(str, __VA_ARGS__); }
+
+#define MALLOC_MUST_SUCCEED(var, size) { var = malloc(size); assert(var != NULL); if(!var) return -1; }
+#define CALLOC_MUST_SUCCEED(var, num, size) { var = calloc(num, size); assert(var != NULL); if(!var) return -1; }
+
+/* Number of ADU sized buffers preallocated for each connection */
+/* Every queued request holds one until it's been sent, so this has to cover the whole window plus some */
+#define MODBUS_POOL_BUFFERS (MODBUS_MAX_INFLIGHT + 8)
+
+/* Size of the receive ring of each connection. Must be a power of 2 */
+#define MODBUS_RX_RING_SIZE 4096
+
+/* Number of queued reads preallocated for each connection */
+#define MODBUS_READ_POOL 64
+
+/* Number of queued writes preallocated for each connection */
+#define MODBUS_WRITE_POOL 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ADU sized buffer handed out by modbus_GetBuffer */
+typedef struct modbus_buf
+{
+	struct modbus_buf* next;
+	int pooled; /* 0 if this came off the heap because the pool ran dry */
+	uint8_t data[MODBUS_MAX_ADU];
+} modbus_buf_t;
+
+/* States of modbus_txn_t::busy */
+#define MODBUS_TXN_FREE		0
+#define MODBUS_TXN_CLAIMED	1 /* Being filled in by the submitting thread */
+#define MODBUS_TXN_QUEUED	2 /* Handed to the I/O engine. Waiting to be sent, or waiting on the response */
+
+/* Outstanding request. Lives at txns[trans_id % MODBUS_MAX_INFLIGHT] in its connection */
+typedef struct modbus_txn
+{
+	int busy; /* Claimed atomically by modbus_AllocTransaction */
+	uint16_t trans_id;
+	modbus_completion_t callback;
+	void* pUser;
+	modbus_buf_t* frame; /* The ADU, until it's been sent */
+	size_t len;
+	struct modbus_txn* next; /* Send queue link */
+	epicsUInt64 deadline; /* epicsMonotonicGet() time it expires at, 0 if it never does */
+	int timer_index; /* Position in the engine's deadline heap, -1 if not in it */
+	uint8_t unit; /* Unit ID the request went to */
+	uint8_t func; /* Function code, to match an exception against, and for the stats */
+	uint16_t resp_len; /* Length a normal response PDU has to have, 0 if it isn't checked */
+	epicsUInt64 sent_at; /* epicsMonotonicGet() time the last of the request went out */
+	struct modbus_conn* conn; /* Connection the slot belongs to */
+} modbus_txn_t;
+
+/* Fixed set of buffers so the request path doesn't have to malloc */
+typedef struct
+{
+	epicsSpinId lock;
+	modbus_buf_t* free;
+	modbus_buf_t bufs[MODBUS_POOL_BUFFERS];
+} modbus_bufpool_t;
+
+/* Receive buffer. Bytes from the socket go in at head, complete frames are parsed off at tail */
+/* Frames are handed out in place, so space isn't reclaimed until the callbacks using them are done */
+/* head, tail and reclaim only ever count up, the position in data is the count % MODBUS_RX_RING_SIZE */
+typedef struct
+{
+	size_t head;
+	size_t tail;
+	size_t reclaim;
+	int hold; /* Number of callbacks currently using frames in the ring */
+	uint8_t data[MODBUS_RX_RING_SIZE];
+} modbus_rxring_t;
+
+/* Read waiting to be merged with its neighbours, see modbus_ReadAsync */
+typedef struct modbus_read
+{
+	uint8_t func;
+	uint8_t unit;
+	uint8_t pooled;
+	uint8_t solo; /* Has to go out on its own, after a merged read it was part of was rejected */
+	uint16_t addr;
+	uint16_t count;
+	modbus_read_cb callback;
+	void* pUser;
+	struct modbus_conn* conn;
+	struct modbus_read* next;
+} modbus_read_t;
+
+/* Register write waiting to be merged with the ones queued right after it, see modbus_WriteRegisterAsync */
+typedef struct modbus_write
+{
+	uint8_t unit;
+	uint8_t pooled;
+	uint8_t solo; /* Has to go out on its own, after a merged write it was part of was rejected */
+	uint16_t addr;
+	uint16_t value;
+	modbus_write_cb callback;
+	void* pUser;
+	struct modbus_conn* conn;
+	struct modbus_write* next;
+} modbus_write_t;
+
+/* States of modbus_conn_t::state. Serial lines go straight from closed to open */
+#define MODBUS_CONN_CLOSED		0
+#define MODBUS_CONN_CONNECTING	1
+#define MODBUS_CONN_OPEN		2
+
+/* Thread blocked on a connection. Lives on the waiting thread's stack */
+typedef struct modbus_waiter
+{
+	epicsEventId event;
+	int granted; /* 1 if handed a freed slot, -1 if woken to check the window again */
+	struct modbus_waiter* next;
+} modbus_waiter_t;
+
+/* A TCP connection and the requests outstanding on it */
+/* The socket, the send queue and the receive ring belong to the engine thread. Other threads */
+/* only claim slots in txns and append to pending */
+typedef struct modbus_conn
+{
+	SOCKET sock;
+	int state;
+	struct sockaddr_in addr;
+	modbus_engine_t* engine;
+	int window;
+	double timeout;
+	int inflight;
+	int completing; /* Freed transactions whose callbacks haven't returned yet */
+	int next_id; /* Transaction ID counter, only touched atomically */
+	modbus_txn_t txns[MODBUS_MAX_INFLIGHT];
+
+	/* Adaptive window, see modbus_SetAdaptiveWindow. Guarded by tx_lock */
+	int adapt; /* 0 if the window is only ever set by hand */
+	int adapt_min;
+	int adapt_max;
+	double cwnd; /* The window before it's rounded down */
+	epicsUInt64 rtt_min; /* Lowest round trip seen since rtt_epoch, in ns */
+	epicsUInt64 rtt_prev; /* Lowest one in the epoch before that */
+	epicsUInt64 rtt_epoch;
+	epicsUInt64 cut_at; /* When the window was last cut */
+
+	/* Threads waiting for room in the window, oldest first. Each freed slot is handed to the one at the front, */
+	/* and a change to the window wakes them all. Guarded by tx_lock */
+	int waiters;
+	struct modbus_waiter* waitq;
+	struct modbus_waiter* waitq_tail;
+
+	/* Threads waiting for the connection to go idle, woken all at once when it does. Guarded by tx_lock */
+	int idlers;
+	struct modbus_waiter* idleq;
+
+	/* Requests waiting for the engine to pick them up */
+	epicsMutexId tx_lock;
+	modbus_txn_t* pending_head;
+	modbus_txn_t* pending_tail;
+
+	/* Reads waiting to be merged. Guarded by tx_lock */
+	int coalesce_gap;
+	modbus_read_t* reads_head;
+	modbus_read_t* reads_tail;
+	modbus_read_t* read_free;
+	/* Where the last flush stopped when the window filled up. The next one starts there. Engine thread only */
+	uint32_t read_resume;
+	modbus_read_t read_nodes[MODBUS_READ_POOL];
+
+	/* Register writes waiting to be merged. Guarded by tx_lock */
+	/* Only one merged write is outstanding at a time, so they're done in order */
+	int write_busy; /* Only touched by the engine thread */
+	modbus_write_t* writes_head;
+	modbus_write_t* writes_tail;
+	modbus_write_t* write_free;
+	modbus_write_t write_nodes[MODBUS_WRITE_POOL];
+
+	/* Requests from modbus_SubmitQueued waiting for room in the window. Guarded by tx_lock */
+	modbus_queued_t* queued_head;
+	modbus_queued_t* queued_tail;
+
+	/* Engine bookkeeping */
+	int ready; /* On the engine's ready list. Only touched atomically */
+	struct modbus_conn* ready_next;
+	int detach;
+	epicsEventId detach_event;
+	modbus_txn_t* sendq_head;
+	modbus_txn_t* sendq_tail;
+	size_t send_offset; /* Bytes of sendq_head already written */
+	int poll_events;
+	int poll_index;
+	/* Ops the engine's io_uring has outstanding on the socket, and which ones (1 bit each). A closed */
+	/* connection isn't reopened or let go of until they're all done. Engine thread only */
+	int uring_ops;
+	int uring_armed;
+	int uring_detached; /* The detach is waiting on uring_ops */
+	struct modbus_usend* uring_send; /* Where its sendmsg lives while in flight */
+
+	/* Connecting, see modbus_ConnectDevices. Engine thread only, except warmup (guarded by tx_lock) */
+	epicsUInt64 connect_timeout; /* ns */
+	epicsUInt64 backoff; /* ns to wait after the next failed connect. 0 once one succeeds */
+	epicsUInt64 retry_at; /* Requests fail straight away until then, rather than wait on a connect */
+	epicsUInt64 dial_at; /* When the connect times out, or a warm connection is tried again */
+	int dialing; /* On the engine's list of connections with a dial_at */
+	struct modbus_conn* dial_next;
+	int warm; /* Kept connected even with nothing to send */
+	struct modbus_warmup* warmup; /* Waiting to hear how the next connect goes */
+	int connected; /* Whether the last connect worked and the connection's still up. Guarded by tx_lock */
+
+	/* Serial line settings, see modbus_CreateRtuUnit. sock is the fd of the port */
+	/* The bus is half-duplex, so the engine only ever has one request on the wire. The rest wait in sendq */
+	int rtu;
+	char port[MODBUS_MAX_PORT_NAME];
+	int baud;
+	char parity;
+	epicsUInt64 char_time; /* ns it takes to send one character */
+	epicsUInt64 frame_gap; /* ns of silence needed between frames (3.5 characters) */
+	epicsUInt64 quiet_at; /* epicsMonotonicGet() time the next frame can go out at */
+	modbus_txn_t* wire; /* Request whose response is being waited on */
+	int held; /* On the engine's list of lines waiting out frame_gap */
+	struct modbus_conn* held_next;
+
+	/* Engine thread only */
+	epicsUInt64 rx_at; /* epicsMonotonicGet() time of the last read */
+	modbus_stats_t stats;
+	modbus_stats_t** units; /* The gateway's stats for each unit ID, NULL where no device has it */
+
+	modbus_bufpool_t pool;
+	modbus_rxring_t rx;
+} modbus_conn_t;
+
+/* What a modbus_device_t handle points to */
+struct modbus_device
+{
+	struct sockaddr_in addr;
+	uint8_t unit_id;
+	modbus_gateway_t* gateway;
+	modbus_conn_t* conn; /* The gateway connection this device's queued reads and writes go through */
+	modbus_image_t* image; /* Created when the first scan block on the device is added */
+};
+
+/* Range of the process image. Written by one thread, read by any number without locking */
+/* Readers go by seq, which is odd while the writer is part way through an update */
+typedef struct modbus_segment
+{
+	uint8_t func;
+	uint16_t addr;
+	uint16_t count;
+	int seq;
+	int status; /* Of the last update */
+	epicsUInt32 updates;
+	epicsUInt32 generation; /* Bumped each time the values change */
+	epicsTimeStamp time; /* Of the last good update */
+	void* data; /* Same layout as modbus_read_cb's pData */
+	epicsUInt32* changed; /* Points that changed in the last update, 1 bit each. Only used by the writer */
+	struct modbus_subscription* subs; /* Guarded by the image's sub_lock */
+	int cached; /* Added by modbus_ReadCached rather than a scan list */
+	int used; /* The image's cache_clock when modbus_ReadCached last used it */
+	struct modbus_segment* next; /* Removed list link */
+} modbus_segment_t;
+
+/* Segments sorted by function code and address. Never changed once it's been published */
+typedef struct modbus_segtable
+{
+	int nsegs;
+	struct modbus_segtable* retired; /* The table this one replaced */
+	modbus_segment_t* segs[];
+} modbus_segtable_t;
+
+struct modbus_image
+{
+	epicsMutexId lock; /* Only taken when segments are added or removed */
+	epicsMutexId sub_lock; /* Held while change callbacks run */
+	modbus_segtable_t* table;
+	modbus_segment_t* removed;
+	modbus_segment_t* evicted; /* Removed cache segments, freed by modbus_ReclaimImage */
+	int readers; /* Threads looking things up in the table without a lock */
+	int generation; /* Bumped each time any segment changes */
+
+	/* Read-through cache, see modbus_ReadCached. Guarded by cache_lock */
+	epicsMutexId cache_lock;
+	struct modbus_flight* flights; /* Reads on their way to the device */
+	int cache_max; /* Segments the cache may add, see modbus_SetCacheSize */
+	int cache_segs;
+	int cache_clock; /* Counts uses of cache segments, so the least recently used one can be evicted */
+};
+
+/* Connections to one IP, or a serial line. Connections are only ever added, so nconns and conns can be read */
+/* without locking */
+struct modbus_gateway
+{
+	struct sockaddr_in addr;
+	char port[MODBUS_MAX_PORT_NAME]; /* Empty unless it's a serial line */
+	int refs; /* Devices using it. Guarded by the list lock in drvModbusGateway.c */
+	int homes; /* Hands out each new device's connection, round robin */
+	epicsMutexId lock; /* Held while adding connections */
+	int nconns;
+	modbus_conn_t* conns[MODBUS_MAX_GATEWAY_CONNS];
+	/* Stats of each unit ID, created with the first device that has it. Written by the engine thread */
+	modbus_stats_t* units[256];
+	struct modbus_gateway* next;
+};
+
+#ifdef MODBUS_USE_IO_URING
+/* An io_uring and the buffers it receives into. Only touched by the thread that owns it */
+typedef struct
+{
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_next; /* Tail once everything filled in since the last modbus_UringEnter is published */
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_map;
+	size_t sq_map_len;
+	void* cq_map;
+	size_t cq_map_len;
+	size_t sqes_len;
+
+	/* Receive buffers. The kernel picks one for each receive, and it's handed back with modbus_UringRecycle */
+	struct io_uring_buf_ring* bufs;
+	size_t bufs_len;
+	uint8_t* buf_data;
+	unsigned short buf_tail;
+} modbus_uring_t;
+#endif
+
+/* drvModbus.c */
+void modbus_InitPool(modbus_bufpool_t* pool);
+void modbus_DestroyPool(modbus_bufpool_t* pool);
+modbus_buf_t* modbus_GetBuffer(modbus_bufpool_t* pool);
+void modbus_ReleaseBuffer(modbus_bufpool_t* pool, modbus_buf_t* buf);
+modbus_txn_t* modbus_AllocTransaction(modbus_conn_t* conn);
+modbus_txn_t* modbus_ClaimTransaction(modbus_conn_t* conn);
+void modbus_FreeTransaction(modbus_conn_t* conn, modbus_txn_t* txn);
+int modbus_PrepareTransaction(modbus_conn_t* conn, modbus_txn_t* txn, uint8_t unit, const void* pPdu, size_t nLen,
+	modbus_completion_t callback, void* pUser, double timeout);
+int modbus_PrepareFrame(modbus_conn_t* conn, modbus_txn_t* txn, const modbus_prepared_t* req, modbus_completion_t callback,
+	void* pUser, double timeout);
+void modbus_WakeWaiters(modbus_conn_t* conn);
+epicsEventId modbus_ThreadEvent();
+modbus_txn_t* modbus_FindTransaction(modbus_conn_t* conn, uint16_t tID);
+void modbus_FailInflight(modbus_conn_t* conn, int status);
+void modbus_FailTransaction(modbus_conn_t* conn, modbus_txn_t* txn, int status);
+int modbus_DispatchPdu(modbus_conn_t* conn, uint16_t tID, const uint8_t* pPdu, size_t nLen, size_t nFrame);
+void modbus_ConstructHeader(modbus_mbap_header_t* pHeader, size_t nLen, uint16_t transactionID, uint8_t unit);
+int modbus_ConstructPacket(const void* pBuf, size_t nLen, void* pOutBuf, size_t* pOutLen, uint16_t transactionID,
+	uint8_t unit);
+int modbus_RingPeekFrame(modbus_conn_t* conn, const uint8_t** ppAdu, size_t* pLen, modbus_buf_t** ppBuf);
+int modbus_NextFrame(modbus_conn_t* conn);
+void modbus_FlushQueued(modbus_conn_t* conn);
+void modbus_FailQueued(modbus_conn_t* conn, int status);
+
+/* drvModbusCoalesce.c */
+uint32_t modbus_ReadLimit(uint8_t func);
+int modbus_ReadPayload(uint8_t func, uint32_t count, const uint8_t* pPdu, size_t nLen, const uint8_t** ppData);
+void modbus_ExtractRead(uint8_t func, const uint8_t* pData, uint32_t offset, uint16_t n, void* pOut);
+void modbus_InitReads(modbus_conn_t* conn);
+void modbus_FlushReads(modbus_conn_t* conn);
+void modbus_FailReads(modbus_conn_t* conn, int status);
+void modbus_InitWrites(modbus_conn_t* conn);
+void modbus_FlushWrites(modbus_conn_t* conn);
+void modbus_FailWrites(modbus_conn_t* conn, int status);
+int modbus_ReadSync(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count, void* pOut);
+
+/* drvModbusKernels.c */
+void modbus_InitKernels();
+void modbus_ShiftBits(const uint8_t* pIn, uint32_t offset, uint8_t* pOut, uint16_t n);
+int modbus_DiffRegisters(const uint16_t* pOld, const uint16_t* pNew, uint16_t count, epicsUInt32* pMask);
+
+/* drvModbusImage.c */
+modbus_image_t* modbus_GetImage(modbus_device_t* device);
+modbus_segment_t* modbus_AddSegment(modbus_device_t* device, uint8_t func, uint16_t addr, uint16_t count);
+void modbus_RemoveSegment(modbus_device_t* device, modbus_segment_t* seg);
+void modbus_ReclaimImage(modbus_image_t* image);
+void modbus_DestroyImage(modbus_image_t* image);
+modbus_segment_t* modbus_FindSegment(modbus_image_t* image, uint8_t func, uint16_t addr, uint16_t count);
+void modbus_WriteSegment(modbus_image_t* image, modbus_segment_t* seg, int status, const void* pValues,
+	const epicsTimeStamp* pTime);
+int modbus_ReadSegment(modbus_segment_t* seg, uint32_t offset, uint16_t count, void* pOut, epicsTimeStamp* pTime,
+	epicsUInt32* pGeneration);
+int modbus_DiffBits(const uint8_t* pOld, const uint8_t* pNew, uint16_t count, epicsUInt32* pMask);
+
+/* drvModbusRtu.c */
+uint16_t modbus_Crc16(const uint8_t* pData, size_t nLen);
+int modbus_InitLine(modbus_conn_t* conn, const char* pPort, int baud, char parity);
+int modbus_OpenLine(modbus_conn_t* conn);
+void modbus_FlushLine(modbus_conn_t* conn);
+int modbus_ConstructRtuFrame(const void* pPdu, size_t nLen, void* pOutBuf, size_t* pOutLen, uint8_t unit);
+int modbus_NextRtuFrame(modbus_conn_t* conn);
+
+/* drvModbusStats.c */
+void modbus_StatSent(modbus_conn_t* conn, modbus_txn_t* txn, epicsUInt64 now);
+void modbus_StatResponse(modbus_conn_t* conn, modbus_txn_t* txn, const uint8_t* pPdu, size_t nLen);
+void modbus_StatFailed(modbus_conn_t* conn, modbus_txn_t* txn, int status);
+
+/* drvModbusWindow.c */
+void modbus_AdaptResponse(modbus_conn_t* conn, modbus_txn_t* txn, const uint8_t* pPdu, size_t nLen);
+void modbus_AdaptFailed(modbus_conn_t* conn, modbus_txn_t* txn, int status);
+
+/* drvModbusGateway.c */
+void modbus_ForEachGateway(void (*fn)(modbus_gateway_t* gateway, void* pArg), void* pArg);
+modbus_gateway_t* modbus_AcquireGateway(const struct sockaddr_in* addr, modbus_engine_t* engine);
+modbus_gateway_t* modbus_AcquireLine(const char* pPort, int baud, char parity, modbus_engine_t* engine);
+int modbus_AddUnit(modbus_gateway_t* gateway, uint8_t unit);
+void modbus_ReleaseGateway(modbus_gateway_t* gateway);
+modbus_conn_t* modbus_HomeConnection(modbus_gateway_t* gateway);
+modbus_conn_t* modbus_PickConnection(modbus_device_t* device);
+
+#ifdef MODBUS_USE_IO_URING
+/* drvModbusUring.c */
+int modbus_UringInit(modbus_uring_t* ring, unsigned entries);
+void modbus_UringDestroy(modbus_uring_t* ring);
+int modbus_UringEnter(modbus_uring_t* ring, int timeout_ms);
+struct io_uring_cqe* modbus_UringPeek(modbus_uring_t* ring);
+void modbus_UringAdvance(modbus_uring_t* ring);
+const uint8_t* modbus_UringBuffer(modbus_uring_t* ring, unsigned bid);
+void modbus_UringRecycle(modbus_uring_t* ring, unsigned bid);
+int modbus_UringPoll(modbus_uring_t* ring, int fd, uint32_t mask, int multishot, uint64_t tag);
+int modbus_UringPollUpdate(modbus_uring_t* ring, uint32_t mask, uint64_t tag);
+int modbus_UringPollRemove(modbus_uring_t* ring, uint64_t tag);
+int modbus_UringCancel(modbus_uring_t* ring, uint64_t tag);
+int modbus_UringRecv(modbus_uring_t* ring, int fd, uint64_t tag);
+int modbus_UringSendmsg(modbus_uring_t* ring, int fd, const struct msghdr* msg, uint64_t tag);
+#endif
+
+/* drvModbusEngine.c */
+void modbus_InitConnection(modbus_conn_t* conn, const struct sockaddr_in* addr);
+void modbus_DestroyConnection(modbus_conn_t* conn);
+void modbus_DetachConnection(modbus_conn_t* conn);
+void modbus_CloseConnection(modbus_conn_t* conn);
+void modbus_ResetConnection(modbus_conn_t* conn, int status);
+void modbus_CancelDeadline(modbus_conn_t* conn, modbus_txn_t* txn);
+ssize_t modbus_RecvBlock(modbus_conn_t* conn);
+void modbus_QueueTransaction(modbus_conn_t* conn, modbus_txn_t* txn);
+void modbus_QueueTransactions(modbus_conn_t* conn, modbus_txn_t** pTxns, int nTxns);
+void modbus_AppendPending(modbus_conn_t* conn, modbus_txn_t** pTxns, int nTxns);
+void modbus_EngineNotify(modbus_conn_t* conn);
+int modbus_OnEngineThread(modbus_conn_t* conn);
+modbus_engine_t* modbus_PickEngine(const void* pKey, size_t nLen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_DRV_MODBUS_INT_H_
@@ -0,0 +1,443 @@
+//======================================================//
+// Name: drvModbusKernels.c
+// Purpose: Conversions between the wire format and host
+// values: register byte swaps, coil packing, and the
+// change masks the process image compares scans with
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* EPICS includes */
+#include <epicsThread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MODBUS_KERNELS_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MODBUS_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*modbus_swap_fn)(const uint8_t* pIn, uint8_t* pOut, size_t nRegs);
+typedef void (*modbus_unpack_fn)(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils);
+typedef void (*modbus_pack_fn)(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils);
+typedef int (*modbus_diff_fn)(const uint16_t* pOld, const uint16_t* pNew, size_t nRegs, epicsUInt32* pMask);
+
+static void modbus_SwapResolve(const uint8_t* pIn, uint8_t* pOut, size_t nRegs);
+static void modbus_UnpackResolve(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils);
+static void modbus_PackResolve(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils);
+static int modbus_DiffResolve(const uint16_t* pOld, const uint16_t* pNew, size_t nRegs, epicsUInt32* pMask);
+
+/* Picked once, by the first call to any of them. See modbus_InitKernels */
+static epicsThreadOnceId g_KernelOnce = EPICS_THREAD_ONCE_INIT;
+static modbus_swap_fn g_Swap = modbus_SwapResolve;
+static modbus_unpack_fn g_Unpack = modbus_UnpackResolve;
+static modbus_pack_fn g_Pack = modbus_PackResolve;
+static modbus_diff_fn g_Diff = modbus_DiffResolve;
+
+//======================================================//
+// Name: modbus_RegistersFromWire
+// Purpose: Convert big-endian registers to host order
+//======================================================//
+void modbus_RegistersFromWire(const uint8_t* pWire, uint16_t* pOut, size_t nRegs)
+{
+	g_Swap(pWire, (uint8_t*)pOut, nRegs);
+}
+
+//======================================================//
+// Name: modbus_RegistersToWire
+// Purpose: Convert host order registers to big-endian
+//======================================================//
+void modbus_RegistersToWire(const uint16_t* pIn, uint8_t* pWire, size_t nRegs)
+{
+	/* Swapping is its own inverse */
+	g_Swap((const uint8_t*)pIn, pWire, nRegs);
+}
+
+//======================================================//
+// Name: modbus_UnpackCoils
+// Purpose: Expand packed coils to one byte each
+//======================================================//
+void modbus_UnpackCoils(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils)
+{
+	g_Unpack(pPacked, pOut, nCoils);
+}
+
+//======================================================//
+// Name: modbus_PackCoils
+// Purpose: Pack one byte per coil down to 8 to a byte
+//======================================================//
+void modbus_PackCoils(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils)
+{
+	g_Pack(pIn, pPacked, nCoils);
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Plain C versions. Used for the tail of every vector loop too */
+static void modbus_SwapScalar(const uint8_t* pIn, uint8_t* pOut, size_t nRegs)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* Already in host order */
+	memmove(pOut, pIn, nRegs * 2);
+#else
+	for(size_t i = 0; i < nRegs; i++)
+	{
+		uint8_t hi = pIn[2*i];
+		pOut[2*i] = pIn[2*i + 1];
+		pOut[2*i + 1] = hi;
+	}
+#endif
+}
+
+/* Eight coils at a time: spread the byte over 8 lanes, mask a different bit in each, then turn set lanes into 1 */
+static void modbus_UnpackScalar(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils)
+{
+	size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for(; i + 8 <= nCoils; i += 8)
+	{
+		uint64_t x = (pPacked[i / 8] * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+		x = ((x + 0x7F7F7F7F7F7F7F7FULL) & 0x8080808080808080ULL) >> 7;
+		memcpy(pOut + i, &x, 8);
+	}
+#endif
+	for(; i < nCoils; i++)
+		pOut[i] = (pPacked[i / 8] >> (i % 8)) & 1;
+}
+
+/* Eight coils at a time: squash each lane to 0 or 1, then one multiply gathers the lanes into a byte */
+static void modbus_PackScalar(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils)
+{
+	size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for(; i + 8 <= nCoils; i += 8)
+	{
+		uint64_t x;
+		memcpy(&x, pIn + i, 8);
+		x = ((((x & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | x) & 0x8080808080808080ULL) >> 7;
+		pPacked[i / 8] = (uint8_t)((x * 0x0102040810204080ULL) >> 56);
+	}
+#endif
+	if(i < nCoils)
+		memset(pPacked + i / 8, 0, (nCoils - i + 7) / 8);
+	for(; i < nCoils; i++)
+		if(pIn[i])
+			pPacked[i / 8] |= 1 << (i % 8);
+}
+
+/* Compares one register at a time, from register i on. The mask starts at register 0 */
+static int modbus_DiffTail(const uint16_t* pOld, const uint16_t* pNew, size_t i, size_t nRegs, epicsUInt32* pMask)
+{
+	int n = 0;
+	for(; i < nRegs; i++)
+	{
+		if(pOld[i] != pNew[i])
+		{
+			pMask[i / 32] |= 1u << (i % 32);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Almost nothing changes from one scan to the next, so whole runs of 16 registers are compared at once */
+static int modbus_DiffScalar(const uint16_t* pOld, const uint16_t* pNew, size_t nRegs, epicsUInt32* pMask)
+{
+	int n = 0;
+	size_t i = 0;
+	for(; i + 16 <= nRegs; i += 16)
+	{
+		uint64_t a[4], b[4];
+		memcpy(a, pOld + i, sizeof(a));
+		memcpy(b, pNew + i, sizeof(b));
+		if(((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3])) == 0)
+			continue;
+		n += modbus_DiffTail(pOld, pNew, i, i + 16, pMask);
+	}
+	return n + modbus_DiffTail(pOld, pNew, i, nRegs, pMask);
+}
+
+#ifdef MODBUS_KERNELS_X86
+
+__attribute__((target("ssse3")))
+static void modbus_SwapSSSE3(const uint8_t* pIn, uint8_t* pOut, size_t nRegs)
+{
+	const __m128i shuf = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+	for(; i + 8 <= nRegs; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pIn + 2*i));
+		_mm_storeu_si128((__m128i*)(pOut + 2*i), _mm_shuffle_epi8(v, shuf));
+	}
+	modbus_SwapScalar(pIn + 2*i, pOut + 2*i, nRegs - i);
+}
+
+__attribute__((target("avx2")))
+static void modbus_SwapAVX2(const uint8_t* pIn, uint8_t* pOut, size_t nRegs)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+	for(; i + 16 <= nRegs; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(pIn + 2*i));
+		_mm256_storeu_si256((__m256i*)(pOut + 2*i), _mm256_shuffle_epi8(v, shuf));
+	}
+	/* The tail is done with legacy SSE code, which stalls if the upper halves are dirty */
+	_mm256_zeroupper();
+	modbus_SwapSSSE3(pIn + 2*i, pOut + 2*i, nRegs - i);
+}
+
+/* 16 coils at a time. Copy each packed byte to 8 lanes, then test a different bit in each */
+__attribute__((target("ssse3")))
+static void modbus_UnpackSSSE3(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils)
+{
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+	const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	const __m128i one = _mm_set1_epi8(1);
+	size_t i = 0;
+	for(; i + 16 <= nCoils; i += 16)
+	{
+		uint16_t w;
+		memcpy(&w, pPacked + i / 8, sizeof(w));
+		__m128i v = _mm_shuffle_epi8(_mm_cvtsi32_si128(w), spread);
+		v = _mm_cmpeq_epi8(_mm_and_si128(v, bit), bit);
+		_mm_storeu_si128((__m128i*)(pOut + i), _mm_and_si128(v, one));
+	}
+	modbus_UnpackScalar(pPacked + i / 8, pOut + i, nCoils - i);
+}
+
+/* 32 coils at a time. The shuffle works within each 128-bit lane, so all 4 bytes are copied to both */
+__attribute__((target("avx2")))
+static void modbus_UnpackAVX2(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils)
+{
+	const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+		1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	const __m256i one = _mm256_set1_epi8(1);
+	size_t i = 0;
+	for(; i + 32 <= nCoils; i += 32)
+	{
+		uint32_t w;
+		memcpy(&w, pPacked + i / 8, sizeof(w));
+		__m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int)w), spread);
+		v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bit), bit);
+		_mm256_storeu_si256((__m256i*)(pOut + i), _mm256_and_si256(v, one));
+	}
+	/* The tail is done with legacy SSE code, which stalls if the upper halves are dirty */
+	_mm256_zeroupper();
+	modbus_UnpackSSSE3(pPacked + i / 8, pOut + i, nCoils - i);
+}
+
+/* The byte mask is exactly the packed coils, LSB first */
+__attribute__((target("sse2")))
+static void modbus_PackSSE2(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i + 16 <= nCoils; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pIn + i));
+		uint16_t m = (uint16_t)~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		memcpy(pPacked + i / 8, &m, sizeof(m));
+	}
+	modbus_PackScalar(pIn + i, pPacked + i / 8, nCoils - i);
+}
+
+__attribute__((target("avx2")))
+static void modbus_PackAVX2(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for(; i + 32 <= nCoils; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(pIn + i));
+		uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		memcpy(pPacked + i / 8, &m, sizeof(m));
+	}
+	/* The tail is done with legacy SSE code, which stalls if the upper halves are dirty */
+	_mm256_zeroupper();
+	modbus_PackSSE2(pIn + i, pPacked + i / 8, nCoils - i);
+}
+
+/* 16 registers at a time. Packing the two compares down to bytes puts one register in each bit of the byte mask */
+__attribute__((target("sse2")))
+static int modbus_DiffSSE2(const uint16_t* pOld, const uint16_t* pNew, size_t nRegs, epicsUInt32* pMask)
+{
+	int n = 0;
+	size_t i = 0;
+	for(; i + 16 <= nRegs; i += 16)
+	{
+		__m128i lo = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(pOld + i)),
+			_mm_loadu_si128((const __m128i*)(pNew + i)));
+		__m128i hi = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(pOld + i + 8)),
+			_mm_loadu_si128((const __m128i*)(pNew + i + 8)));
+		uint32_t m = ~(uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) & 0xFFFF;
+		if(m == 0)
+			continue;
+		pMask[i / 32] |= m << (i % 32);
+		n += __builtin_popcount(m);
+	}
+	return n + modbus_DiffTail(pOld, pNew, i, nRegs, pMask);
+}
+
+/* 32 registers at a time, which is one whole mask word */
+/* The pack works within each 128-bit lane, so the middle two quarters come out swapped and are put back */
+__attribute__((target("avx2")))
+static int modbus_DiffAVX2(const uint16_t* pOld, const uint16_t* pNew, size_t nRegs, epicsUInt32* pMask)
+{
+	int n = 0;
+	size_t i = 0;
+	for(; i + 32 <= nRegs; i += 32)
+	{
+		__m256i lo = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(pOld + i)),
+			_mm256_loadu_si256((const __m256i*)(pNew + i)));
+		__m256i hi = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(pOld + i + 16)),
+			_mm256_loadu_si256((const __m256i*)(pNew + i + 16)));
+		__m256i eq = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+		uint32_t m = ~(uint32_t)_mm256_movemask_epi8(eq);
+		if(m == 0)
+			continue;
+		pMask[i / 32] = m;
+		n += __builtin_popcount(m);
+	}
+	/* The tail is done with legacy SSE code, which stalls if the upper halves are dirty */
+	_mm256_zeroupper();
+	return n + modbus_DiffSSE2(pOld + i, pNew + i, nRegs - i, pMask + i / 32);
+}
+
+#endif /* MODBUS_KERNELS_X86 */
+
+#ifdef MODBUS_KERNELS_NEON
+
+static void modbus_SwapNEON(const uint8_t* pIn, uint8_t* pOut, size_t nRegs)
+{
+	size_t i = 0;
+	for(; i + 8 <= nRegs; i += 8)
+		vst1q_u8(pOut + 2*i, vrev16q_u8(vld1q_u8(pIn + 2*i)));
+	modbus_SwapScalar(pIn + 2*i, pOut + 2*i, nRegs - i);
+}
+
+static void modbus_UnpackNEON(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils)
+{
+	static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	const uint8x16_t bit = vld1q_u8(bits);
+	const uint8x16_t one = vdupq_n_u8(1);
+	size_t i = 0;
+	for(; i + 16 <= nCoils; i += 16)
+	{
+		uint8x16_t v = vcombine_u8(vdup_n_u8(pPacked[i / 8]), vdup_n_u8(pPacked[i / 8 + 1]));
+		vst1q_u8(pOut + i, vandq_u8(vtstq_u8(v, bit), one));
+	}
+	modbus_UnpackScalar(pPacked + i / 8, pOut + i, nCoils - i);
+}
+
+#endif /* MODBUS_KERNELS_NEON */
+
+/* Picks the fastest version of each kernel the CPU can run */
+static void modbus_SelectKernels(void* pArg)
+{
+	(void)pArg;
+	g_Swap = modbus_SwapScalar;
+	g_Unpack = modbus_UnpackScalar;
+	g_Pack = modbus_PackScalar;
+	g_Diff = modbus_DiffScalar;
+#if defined(MODBUS_KERNELS_X86)
+	__builtin_cpu_init();
+#if defined(__x86_64__)
+	/* SSE2 is always there on x86_64 */
+	g_Pack = modbus_PackSSE2;
+	g_Diff = modbus_DiffSSE2;
+#endif
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		g_Swap = modbus_SwapSSSE3;
+		g_Unpack = modbus_UnpackSSSE3;
+	}
+	if(__builtin_cpu_supports("avx2"))
+	{
+		g_Swap = modbus_SwapAVX2;
+		g_Unpack = modbus_UnpackAVX2;
+		g_Pack = modbus_PackAVX2;
+		g_Diff = modbus_DiffAVX2;
+	}
+#elif defined(MODBUS_KERNELS_NEON)
+	g_Swap = modbus_SwapNEON;
+	g_Unpack = modbus_UnpackNEON;
+#endif
+}
+
+/* Safe to call from anywhere, any number of times */
+void modbus_InitKernels()
+{
+	epicsThreadOnce(&g_KernelOnce, modbus_SelectKernels, NULL);
+}
+
+/* Where the kernel pointers start out. epicsThreadOnce takes a lock, so it's only called until they've been picked */
+static void modbus_SwapResolve(const uint8_t* pIn, uint8_t* pOut, size_t nRegs)
+{
+	modbus_InitKernels();
+	g_Swap(pIn, pOut, nRegs);
+}
+
+static void modbus_UnpackResolve(const uint8_t* pPacked, uint8_t* pOut, size_t nCoils)
+{
+	modbus_InitKernels();
+	g_Unpack(pPacked, pOut, nCoils);
+}
+
+static void modbus_PackResolve(const uint8_t* pIn, uint8_t* pPacked, size_t nCoils)
+{
+	modbus_InitKernels();
+	g_Pack(pIn, pPacked, nCoils);
+}
+
+static int modbus_DiffResolve(const uint16_t* pOld, const uint16_t* pNew, size_t nRegs, epicsUInt32* pMask)
+{
+	modbus_InitKernels();
+	return g_Diff(pOld, pNew, nRegs, pMask);
+}
+
+/* Shifts n packed bits starting at bit offset of pIn down so they start at bit 0 of pOut */
+/* Works a byte at a time, since the shift is the same for every byte */
+void modbus_ShiftBits(const uint8_t* pIn, uint32_t offset, uint8_t* pOut, uint16_t n)
+{
+	const uint8_t* p = pIn + offset / 8;
+	unsigned shift = offset % 8;
+	uint32_t bytes = (n + 7) / 8;
+	if(shift == 0)
+	{
+		memcpy(pOut, p, bytes);
+	}
+	else
+	{
+		/* The last output byte might only need bits from one input byte, and the next one may not be there */
+		uint32_t lastbit = shift + n - 1;
+		for(uint32_t i = 0; i < bytes; i++)
+		{
+			uint8_t b = p[i] >> shift;
+			if(i + 1 <= lastbit / 8)
+				b |= p[i + 1] << (8 - shift);
+			pOut[i] = b;
+		}
+	}
+	if(n % 8)
+		pOut[bytes - 1] &= (1 << (n % 8)) - 1;
+}
+
+/* Sets a bit in pMask for each register that differs, and returns how many do */
+int modbus_DiffRegisters(const uint16_t* pOld, const uint16_t* pNew, uint16_t count, epicsUInt32* pMask)
+{
+	/* The kernels only set bits */
+	memset(pMask, 0, ((count + 31u) / 32) * sizeof(epicsUInt32));
+	return g_Diff(pOld, pNew, count, pMask);
+}
@@ -0,0 +1,346 @@
+//======================================================//
+// Name: drvModbusRtu.c
+// Purpose: Modbus RTU over serial lines. Framing, CRC and
+// port setup. The engine schedules the bus itself
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <termios.h>
+#endif
+
+/* EPICS includes */
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+/* CRC-16/MODBUS, reflected polynomial */
+#define MODBUS_CRC_POLY 0xA001
+
+/* Slicing-by-8 tables. g_Crc[0] is the usual byte at a time table, g_Crc[k] is a byte followed by k zero bytes */
+static epicsThreadOnceId g_CrcOnce = EPICS_THREAD_ONCE_INIT;
+static uint16_t g_Crc[8][256];
+
+static void modbus_InitCrc(void* pArg);
+
+//======================================================//
+// Name: modbus_CreateRtuUnit
+// Purpose: Initialize a device on a serial line
+//======================================================//
+modbus_device_t* modbus_CreateRtuUnit(const char* pPort, int baud, char parity, uint8_t unit)
+{
+	if(!pPort || strlen(pPort) >= MODBUS_MAX_PORT_NAME || baud <= 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return NULL;
+	}
+	epicsThreadOnce(&g_CrcOnce, modbus_InitCrc, NULL);
+	modbus_engine_t* engine = modbus_PickEngine(pPort, strlen(pPort));
+	modbus_device_t* device = calloc(1, sizeof(modbus_device_t));
+	if(device)
+		device->gateway = engine ? modbus_AcquireLine(pPort, baud, parity, engine) : NULL;
+	if(device && device->gateway && modbus_AddUnit(device->gateway, unit) != 0)
+	{
+		modbus_ReleaseGateway(device->gateway);
+		device->gateway = NULL;
+	}
+	if(!device || !device->gateway)
+	{
+		LOG_ERROR_FORMATTED("Failed to create device on serial port %s", pPort);
+		free(device);
+		return NULL;
+	}
+	device->unit_id = unit;
+	device->image = NULL;
+	/* The port is opened by the engine once there's something to send */
+	device->conn = device->gateway->conns[0];
+	return device;
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+static void modbus_InitCrc(void* pArg)
+{
+	(void)pArg;
+	for(int b = 0; b < 256; b++)
+	{
+		uint16_t crc = (uint16_t)b;
+		for(int i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ MODBUS_CRC_POLY : crc >> 1;
+		g_Crc[0][b] = crc;
+	}
+	for(int k = 1; k < 8; k++)
+		for(int b = 0; b < 256; b++)
+			g_Crc[k][b] = (g_Crc[k - 1][b] >> 8) ^ g_Crc[0][g_Crc[k - 1][b] & 0xFF];
+}
+
+/* CRC of an RTU frame. It goes on the wire low byte first */
+/* Eight bytes per step, so it keeps up with any baud rate without a 64K table */
+uint16_t modbus_Crc16(const uint8_t* pData, size_t nLen)
+{
+	uint16_t crc = 0xFFFF;
+	while(nLen >= 8)
+	{
+		crc = g_Crc[7][(pData[0] ^ crc) & 0xFF] ^ g_Crc[6][pData[1] ^ (crc >> 8)] ^
+			g_Crc[5][pData[2]] ^ g_Crc[4][pData[3]] ^ g_Crc[3][pData[4]] ^
+			g_Crc[2][pData[5]] ^ g_Crc[1][pData[6]] ^ g_Crc[0][pData[7]];
+		pData += 8;
+		nLen -= 8;
+	}
+	while(nLen--)
+		crc = (crc >> 8) ^ g_Crc[0][(crc ^ *pData++) & 0xFF];
+	return crc;
+}
+
+#ifndef _WIN32
+/* Returns the termios speed for a baud rate, or B0 if it isn't supported */
+static speed_t modbus_BaudSpeed(int baud)
+{
+	switch(baud)
+	{
+		case 1200: return B1200;
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+#ifdef B460800
+		case 460800: return B460800;
+#endif
+#ifdef B921600
+		case 921600: return B921600;
+#endif
+		default: return B0;
+	}
+}
+#endif
+
+/* Sets up a connection to a serial line. Call after modbus_InitConnection */
+/* Returns 0 if OK, -1 if the settings aren't supported */
+int modbus_InitLine(modbus_conn_t* conn, const char* pPort, int baud, char parity)
+{
+#ifdef _WIN32
+	LOG_ERROR("Modbus RTU is not supported on this platform.");
+	return -1;
+#else
+	if(modbus_BaudSpeed(baud) == B0 || (parity != 'E' && parity != 'O' && parity != 'N'))
+	{
+		LOG_ERROR_FORMATTED("Unsupported serial settings %d baud, parity %c", baud, parity);
+		return -1;
+	}
+	conn->rtu = 1;
+	strncpy(conn->port, pPort, MODBUS_MAX_PORT_NAME - 1);
+	conn->baud = baud;
+	conn->parity = parity;
+	/* Every character is 11 bits: start, 8 data, parity (or a second stop bit), stop */
+	conn->char_time = 11000000000ULL / baud;
+	/* Above 19200 baud the spec fixes the gap, since it'd be too short to time otherwise */
+	conn->frame_gap = baud > 19200 ? 1750000 : conn->char_time * 7 / 2;
+	return 0;
+#endif
+}
+
+/* Opens and configures the port. Returns the fd, or -1 on error */
+int modbus_OpenLine(modbus_conn_t* conn)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	int fd = open(conn->port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0)
+	{
+		LOG_ERROR_FORMATTED("Failed to open serial port %s", conn->port);
+		return -1;
+	}
+	struct termios tio;
+	if(tcgetattr(fd, &tio) < 0)
+	{
+		LOG_ERROR_FORMATTED("%s is not a serial port", conn->port);
+		close(fd);
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(PARENB | PARODD | CSTOPB | CRTSCTS);
+	if(conn->parity == 'E')
+		tio.c_cflag |= PARENB;
+	else if(conn->parity == 'O')
+		tio.c_cflag |= PARENB | PARODD;
+	else
+		tio.c_cflag |= CSTOPB;
+	/* Reads never wait, the engine polls */
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, modbus_BaudSpeed(conn->baud));
+	cfsetospeed(&tio, modbus_BaudSpeed(conn->baud));
+	if(tcsetattr(fd, TCSANOW, &tio) < 0)
+	{
+		LOG_ERROR_FORMATTED("Failed to configure serial port %s", conn->port);
+		close(fd);
+		return -1;
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+#endif
+}
+
+/* Throws away everything received so far, so the next frame starts clean */
+/* Used after a bad frame or a timeout, when a late response may still be on its way in */
+void modbus_FlushLine(modbus_conn_t* conn)
+{
+	modbus_rxring_t* ring = &conn->rx;
+	ring->tail = ring->head;
+	if(ring->hold == 0)
+		ring->reclaim = ring->tail;
+#ifndef _WIN32
+	if(conn->sock != INVALID_SOCKET)
+		tcflush(conn->sock, TCIFLUSH);
+#endif
+}
+
+/* Builds an RTU frame: unit ID, PDU, CRC */
+/* pOutLen is the size of pOutBuf going in, and the length of the frame coming out */
+int modbus_ConstructRtuFrame(const void* pPdu, size_t nLen, void* pOutBuf, size_t* pOutLen, uint8_t unit)
+{
+	if(!pOutBuf || !pPdu)
+		return -1;
+	if(nLen + 3 > MODBUS_RTU_MAX_ADU || *pOutLen < nLen + 3)
+		return -1;
+	uint8_t* p = pOutBuf;
+	p[0] = unit;
+	memcpy(p + 1, pPdu, nLen);
+	uint16_t crc = modbus_Crc16(p, nLen + 1);
+	p[nLen + 1] = crc & 0xFF;
+	p[nLen + 2] = crc >> 8;
+	*pOutLen = nLen + 3;
+	return 0;
+}
+
+static uint8_t modbus_RingByte(const modbus_rxring_t* ring, size_t i)
+{
+	return ring->data[(ring->tail + i) & (MODBUS_RX_RING_SIZE - 1)];
+}
+
+/* RTU frames carry no length, so it's worked out from the function code of the response */
+/* Returns the length of the frame at the read position, 0 if more bytes are needed to tell, */
+/* or -1 if the function code isn't one we know the layout of */
+static int modbus_RtuFrameLength(const modbus_rxring_t* ring, size_t avail)
+{
+	if(avail < 2)
+		return 0;
+	uint8_t func = modbus_RingByte(ring, 1);
+	if(func & MB_ERRCODE_OFFSET)
+		return 5;
+	switch(func)
+	{
+		/* Byte count, then that many bytes */
+		case MB_RD_COILS_CODE:
+		case MB_RD_DISC_INPUTS_CODE:
+		case MB_RD_HOL_REG_CODE:
+		case MB_RD_INP_REG_CODE:
+		case MB_RW_MULT_REG_CODE:
+		case MB_RD_FILE_REC_CODE:
+		case MB_WR_FILE_REC_CODE:
+		case MB_RD_COM_EV_LOG_CODE:
+		case MB_RD_SRV_ID_CODE:
+			if(avail < 3)
+				return 0;
+			return 5 + modbus_RingByte(ring, 2);
+		/* Two byte count */
+		case MB_RD_FIFO_QUEUE_CODE:
+			if(avail < 4)
+				return 0;
+			return 6 + ((modbus_RingByte(ring, 2) << 8) | modbus_RingByte(ring, 3));
+		/* Echo of the address and value or count */
+		case MB_WR_SIN_COIL_CODE:
+		case MB_WR_SIN_REG_CODE:
+		case MB_WR_MUL_COIL_CODE:
+		case MB_WR_MULT_REG_CODE:
+		case MB_DIAGNOSTIC_CODE:
+		case MB_RD_COM_EV_CNT_CODE:
+			return 8;
+		case MB_MSK_WRT_REG_CODE:
+			return 10;
+		case MB_RD_ERR_STAT_CODE:
+			return 5;
+		default:
+			return -1;
+	}
+}
+
+/* Handles the response to the request on the wire, if all of it has come in */
+/* Returns 1 if the request was completed, 0 if the frame was bad (the request fails), */
+/* 2 if there's no complete frame yet, or -1 on error */
+int modbus_NextRtuFrame(modbus_conn_t* conn)
+{
+	modbus_rxring_t* ring = &conn->rx;
+	size_t avail = ring->head - ring->tail;
+	if(avail == 0)
+		return 2;
+	modbus_txn_t* txn = conn->wire;
+	if(!txn)
+	{
+		/* Nothing asked for it. Line noise, or another master on the bus */
+		modbus_FlushLine(conn);
+		return 2;
+	}
+
+	int len = modbus_RtuFrameLength(ring, avail);
+	if(len == 0 || (len > 0 && avail < (size_t)len))
+		return 2;
+	if(len < 0 || len > MODBUS_RTU_MAX_ADU)
+	{
+		LOG_ERROR_FORMATTED("Can't frame RTU response with function code %u", modbus_RingByte(ring, 1));
+		conn->wire = NULL;
+		modbus_FlushLine(conn);
+		modbus_FailTransaction(conn, txn, -1);
+		return 0;
+	}
+
+	/* Handed out in place unless it wraps around the end of the ring */
+	modbus_buf_t* buf = NULL;
+	const uint8_t* frame;
+	size_t start = ring->tail & (MODBUS_RX_RING_SIZE - 1);
+	if(start + len <= MODBUS_RX_RING_SIZE)
+		frame = ring->data + start;
+	else
+	{
+		buf = modbus_GetBuffer(&conn->pool);
+		if(!buf)
+		{
+			modbus_CloseConnection(conn);
+			return -1;
+		}
+		size_t first = MODBUS_RX_RING_SIZE - start;
+		memcpy(buf->data, ring->data + start, first);
+		memcpy(buf->data + first, ring->data, len - first);
+		frame = buf->data;
+	}
+
+	conn->wire = NULL;
+	conn->quiet_at = epicsMonotonicGet() + conn->frame_gap;
+	uint16_t crc = modbus_Crc16(frame, len - 2);
+	if(frame[len - 2] != (crc & 0xFF) || frame[len - 1] != (crc >> 8) || frame[0] != txn->unit)
+	{
+		LOG_ERROR_FORMATTED("Discarding RTU response from unit %u with a bad CRC or unit ID", frame[0]);
+		modbus_ReleaseBuffer(&conn->pool, buf);
+		modbus_FlushLine(conn);
+		modbus_FailTransaction(conn, txn, -1);
+		return 0;
+	}
+	int result = modbus_DispatchPdu(conn, txn->trans_id, frame + 1, len - 3, len);
+	modbus_ReleaseBuffer(&conn->pool, buf);
+	return result;
+}
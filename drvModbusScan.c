@@ -0,0 +1,507 @@
+//======================================================//
+// Name: drvModbusScan.c
+// Purpose: Scan lists. Reads blocks of points at fixed
+// rates into the process image of each device
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* EPICS includes */
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
+
+/* Longest the scan thread sleeps for, in seconds */
+#define MODBUS_SCAN_MAX_SLEEP 1.0
+
+struct modbus_scanblock;
+
+/* Request sent every period. Covers one or more neighbouring blocks of the same kind on one device */
+typedef struct modbus_scanspan
+{
+	struct modbus_scanlist* list;
+	modbus_device_t* device;
+	modbus_prepared_t req; /* Framed once, when the list is first started */
+	uint16_t addr;
+	uint16_t count;
+	struct modbus_scanblock** blocks; /* The blocks it covers, lowest address first */
+	int nblocks;
+	int busy; /* The last request hasn't completed yet */
+	int split; /* The device rejected the merged read, so each block goes out on its own */
+} modbus_scanspan_t;
+
+/* Block of points, see modbus_AddScanBlock */
+typedef struct modbus_scanblock
+{
+	int index;
+	modbus_device_t* device;
+	uint8_t func;
+	uint16_t addr;
+	uint16_t count;
+	epicsUInt64 period; /* Nanoseconds */
+	struct modbus_scanblock* self; /* So solo can point at it */
+	modbus_scanspan_t solo; /* Sent instead of the merged span once that's been split */
+	modbus_segment_t* seg; /* Where its values go in the device's image */
+} modbus_scanblock_t;
+
+/* Blocks scanned at the same rate. The spans go out one after the other, spread evenly over the period */
+typedef struct
+{
+	epicsUInt64 period;
+	epicsUInt64 step;
+	epicsUInt64 due; /* When spans[next] goes out */
+	int next;
+	modbus_scanspan_t* spans;
+	int nspans;
+} modbus_scangroup_t;
+
+struct modbus_scanlist
+{
+	char name[32];
+	epicsEventId wake;
+	epicsEventId exit_event;
+	epicsEventId idle_event;
+	epicsMutexId idle_lock; /* Held while the last completion signals idle_event */
+	epicsThreadId thread;
+	int running;
+	int stop;
+	int outstanding; /* Requests sent that haven't completed */
+	int overruns; /* Scans skipped because the last one hadn't finished, or the window was full */
+
+	modbus_scanblock_t** blocks;
+	int nblocks;
+	int blocks_cap;
+
+	/* Built when the list is first started */
+	int built;
+	modbus_scanblock_t** order;
+	modbus_scanspan_t* spans;
+	modbus_scangroup_t* groups;
+	int ngroups;
+};
+
+//======================================================//
+// Name: modbus_CreateScanList
+// Purpose: Create an empty scan list
+//======================================================//
+modbus_scanlist_t* modbus_CreateScanList(const char* pName)
+{
+	modbus_scanlist_t* list = calloc(1, sizeof(modbus_scanlist_t));
+	if(!list)
+		return NULL;
+	strncpy(list->name, pName ? pName : "modbusScan", sizeof(list->name) - 1);
+	list->wake = epicsEventMustCreate(epicsEventEmpty);
+	list->exit_event = epicsEventMustCreate(epicsEventEmpty);
+	list->idle_event = epicsEventMustCreate(epicsEventEmpty);
+	list->idle_lock = epicsMutexMustCreate();
+	return list;
+}
+
+//======================================================//
+// Name: modbus_DestroyScanList
+// Purpose: Stop a scan list and free it
+//======================================================//
+void modbus_DestroyScanList(modbus_scanlist_t* list)
+{
+	if(!list)
+		return;
+	modbus_StopScanList(list);
+	for(int i = 0; i < list->nblocks; i++)
+	{
+		modbus_RemoveSegment(list->blocks[i]->device, list->blocks[i]->seg);
+		free(list->blocks[i]);
+	}
+	free(list->blocks);
+	free(list->order);
+	free(list->spans);
+	free(list->groups);
+	epicsMutexDestroy(list->idle_lock);
+	epicsEventDestroy(list->idle_event);
+	epicsEventDestroy(list->exit_event);
+	epicsEventDestroy(list->wake);
+	free(list);
+}
+
+//======================================================//
+// Name: modbus_AddScanBlock
+// Purpose: Add a block of points to a scan list
+//======================================================//
+int modbus_AddScanBlock(modbus_scanlist_t* list, modbus_device_t* device, double period, uint8_t func,
+	uint16_t addr, uint16_t count)
+{
+	if(!list || !device || period <= 0 || count == 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	uint32_t limit = modbus_ReadLimit(func);
+	if(limit == 0 || count > limit || (uint32_t)addr + count > 0x10000)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(list->built)
+	{
+		LOG_ERROR("Blocks can't be added once the scan list has been started.");
+		return -1;
+	}
+
+	if(list->nblocks == list->blocks_cap)
+	{
+		int cap = list->blocks_cap ? list->blocks_cap * 2 : 16;
+		modbus_scanblock_t** blocks = realloc(list->blocks, cap * sizeof(modbus_scanblock_t*));
+		if(!blocks)
+			return -1;
+		list->blocks = blocks;
+		list->blocks_cap = cap;
+	}
+	modbus_scanblock_t* block = calloc(1, sizeof(modbus_scanblock_t));
+	if(!block)
+		return -1;
+	block->seg = modbus_AddSegment(device, func, addr, count);
+	if(!block->seg)
+	{
+		free(block);
+		return -1;
+	}
+	block->index = list->nblocks;
+	block->device = device;
+	block->func = func;
+	block->addr = addr;
+	block->count = count;
+	block->period = (epicsUInt64)(period * 1e9);
+	if(block->period == 0)
+		block->period = 1;
+	list->blocks[list->nblocks] = block;
+	return list->nblocks++;
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Orders blocks by rate, then device, function code and address, so mergeable blocks end up next to each other */
+static int modbus_CompareBlocks(const void* pA, const void* pB)
+{
+	const modbus_scanblock_t* a = *(modbus_scanblock_t* const*)pA;
+	const modbus_scanblock_t* b = *(modbus_scanblock_t* const*)pB;
+	if(a->period != b->period)
+		return a->period < b->period ? -1 : 1;
+	if(a->device != b->device)
+		return (uintptr_t)a->device < (uintptr_t)b->device ? -1 : 1;
+	if(a->func != b->func)
+		return a->func < b->func ? -1 : 1;
+	if(a->addr != b->addr)
+		return a->addr < b->addr ? -1 : 1;
+	return a->index - b->index;
+}
+
+/* Fills in a span and frames its request. Returns 0 if OK, -1 on error */
+static int modbus_InitSpan(modbus_scanlist_t* list, modbus_scanspan_t* span, modbus_scanblock_t** blocks, int nBlocks,
+	uint32_t start, uint32_t count)
+{
+	span->list = list;
+	span->device = blocks[0]->device;
+	span->addr = (uint16_t)start;
+	span->count = (uint16_t)count;
+	span->blocks = blocks;
+	span->nblocks = nBlocks;
+	span->busy = 0;
+	span->split = 0;
+	uint8_t pdu[5];
+	pdu[0] = blocks[0]->func;
+	pdu[1] = (start >> 8) & 0xFF;
+	pdu[2] = start & 0xFF;
+	pdu[3] = (count >> 8) & 0xFF;
+	pdu[4] = count & 0xFF;
+	return modbus_PrepareRequest(span->device, pdu, sizeof(pdu), &span->req);
+}
+
+/* Frees what modbus_BuildScanList made */
+static void modbus_FreeBuild(modbus_scanlist_t* list)
+{
+	free(list->order);
+	free(list->spans);
+	free(list->groups);
+	list->order = NULL;
+	list->spans = NULL;
+	list->groups = NULL;
+}
+
+/* Sorts the blocks into groups by rate, and merges neighbouring blocks into spans */
+/* Blocks within a device's coalesce gap of each other are merged, the same as modbus_ReadAsync would */
+/* Returns 0 if OK, -1 on error */
+static int modbus_BuildScanList(modbus_scanlist_t* list)
+{
+	int n = list->nblocks;
+	list->order = malloc(n * sizeof(modbus_scanblock_t*));
+	list->spans = malloc(n * sizeof(modbus_scanspan_t));
+	list->groups = malloc(n * sizeof(modbus_scangroup_t));
+	if(!list->order || !list->spans || !list->groups)
+	{
+		modbus_FreeBuild(list);
+		return -1;
+	}
+	memcpy(list->order, list->blocks, n * sizeof(modbus_scanblock_t*));
+	qsort(list->order, n, sizeof(modbus_scanblock_t*), modbus_CompareBlocks);
+
+	int result = 0;
+	int nspans = 0;
+	list->ngroups = 0;
+	for(int i = 0; i < n;)
+	{
+		modbus_scangroup_t* group = &list->groups[list->ngroups++];
+		group->period = list->order[i]->period;
+		group->spans = &list->spans[nspans];
+		group->nspans = 0;
+		while(i < n && list->order[i]->period == group->period)
+		{
+			/* Grow a span from this block for as long as the next one is close enough and still fits */
+			modbus_scanblock_t* first = list->order[i];
+			uint32_t start = first->addr;
+			uint32_t end = start + first->count;
+			uint32_t limit = modbus_ReadLimit(first->func);
+			int gap = epicsAtomicGetIntT(&first->device->conn->coalesce_gap);
+			int j = i + 1;
+			while(gap >= 0 && j < n)
+			{
+				modbus_scanblock_t* b = list->order[j];
+				uint32_t bend = b->addr + b->count;
+				uint32_t newend = bend > end ? bend : end;
+				if(b->period != first->period || b->device != first->device || b->func != first->func ||
+					b->addr > end + gap || newend - start > limit)
+					break;
+				end = newend;
+				j++;
+			}
+			result |= modbus_InitSpan(list, &list->spans[nspans++], &list->order[i], j - i, start, end - start);
+			group->nspans++;
+			i = j;
+		}
+		group->step = group->period / group->nspans;
+		if(group->step == 0)
+			group->step = 1;
+	}
+
+	/* Each block can also be sent on its own, in case the span it's in gets split */
+	for(int i = 0; i < n; i++)
+	{
+		modbus_scanblock_t* block = list->blocks[i];
+		block->self = block;
+		result |= modbus_InitSpan(list, &block->solo, &block->self, 1, block->addr, block->count);
+	}
+	if(result != 0)
+	{
+		modbus_FreeBuild(list);
+		return -1;
+	}
+	list->built = 1;
+	return 0;
+}
+
+/* Posts the response to a span into the image */
+/* Called from the engine thread */
+static void modbus_ScanCompletion(void* pUser, int status, const uint8_t* pPdu, size_t nLen)
+{
+	modbus_scanspan_t* span = pUser;
+	modbus_scanlist_t* list = span->list;
+	uint8_t func = span->req.func;
+
+	/* An address between the blocks may not exist on the device, so send them on their own from now on */
+	if(status == MODBUS_ERR_ILLEGAL_ADDR && span->nblocks > 1)
+	{
+		epicsAtomicSetIntT(&span->split, 1);
+	}
+	else
+	{
+		const uint8_t* pData = NULL;
+		if(status == 0 && modbus_ReadPayload(func, span->count, pPdu, nLen, &pData) != 0)
+		{
+			LOG_ERROR("Response to scan is malformed.");
+			status = -1;
+		}
+		epicsTimeStamp now;
+		epicsTimeGetCurrent(&now);
+		uint16_t values[MODBUS_MAX_READ_REGS];
+		for(int i = 0; i < span->nblocks; i++)
+		{
+			modbus_scanblock_t* block = span->blocks[i];
+			if(status == 0)
+				modbus_ExtractRead(func, pData, block->addr - span->addr, block->count, values);
+			modbus_WriteSegment(block->device->image, block->seg, status, values, &now);
+		}
+	}
+
+	epicsAtomicSetIntT(&span->busy, 0);
+	/* Signalled with the lock held, so modbus_StopScanList can't see the count hit zero and free the list under us */
+	epicsMutexMustLock(list->idle_lock);
+	if(epicsAtomicDecrIntT(&list->outstanding) == 0)
+		epicsEventSignal(list->idle_event);
+	epicsMutexUnlock(list->idle_lock);
+}
+
+/* Sends a span's request, unless the last one is still outstanding */
+static void modbus_SendSpan(modbus_scanspan_t* span)
+{
+	modbus_scanlist_t* list = span->list;
+	/* Don't pile requests up on a device that's slower than the scan rate */
+	if(epicsAtomicCmpAndSwapIntT(&span->busy, 0, 1) != 0)
+	{
+		epicsAtomicIncrIntT(&list->overruns);
+		return;
+	}
+	modbus_conn_t* conn = modbus_PickConnection(span->device);
+	modbus_txn_t* txn = modbus_AllocTransaction(conn);
+	if(!txn)
+	{
+		epicsAtomicSetIntT(&span->busy, 0);
+		epicsAtomicIncrIntT(&list->overruns);
+		return;
+	}
+	epicsAtomicIncrIntT(&list->outstanding);
+	if(modbus_PrepareFrame(conn, txn, &span->req, modbus_ScanCompletion, span, 0) != 0)
+	{
+		epicsAtomicSetIntT(&span->busy, 0);
+		epicsAtomicDecrIntT(&list->outstanding);
+		return;
+	}
+	modbus_QueueTransaction(conn, txn);
+}
+
+/* Sends the requests for a span, or for each of its blocks if it's been split */
+static void modbus_ScanSpan(modbus_scanspan_t* span)
+{
+	if(!epicsAtomicGetIntT(&span->split))
+	{
+		modbus_SendSpan(span);
+		return;
+	}
+	for(int i = 0; i < span->nblocks; i++)
+		modbus_SendSpan(&span->blocks[i]->solo);
+}
+
+static void modbus_ScanThread(void* pArg)
+{
+	modbus_scanlist_t* list = pArg;
+	while(!epicsAtomicGetIntT(&list->stop))
+	{
+		epicsUInt64 now = epicsMonotonicGet();
+		epicsUInt64 wake = now + (epicsUInt64)(MODBUS_SCAN_MAX_SLEEP * 1e9);
+		for(int i = 0; i < list->ngroups; i++)
+		{
+			modbus_scangroup_t* group = &list->groups[i];
+			/* Fell more than a period behind, so skip ahead instead of sending everything at once */
+			if(now > group->due + group->period)
+				group->due = now;
+			while(group->due <= now)
+			{
+				modbus_ScanSpan(&group->spans[group->next]);
+				group->next = (group->next + 1) % group->nspans;
+				group->due += group->step;
+			}
+			if(group->due < wake)
+				wake = group->due;
+		}
+		now = epicsMonotonicGet();
+		if(wake > now)
+			epicsEventWaitWithTimeout(list->wake, (wake - now) / 1e9);
+	}
+	epicsEventSignal(list->exit_event);
+}
+
+//======================================================//
+// Name: modbus_StartScanList
+// Purpose: Start scanning
+//======================================================//
+int modbus_StartScanList(modbus_scanlist_t* list)
+{
+	if(!list || list->nblocks == 0)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(list->running)
+		return 0;
+	if(!list->built && modbus_BuildScanList(list) != 0)
+		return -1;
+
+	epicsUInt64 now = epicsMonotonicGet();
+	for(int i = 0; i < list->ngroups; i++)
+	{
+		list->groups[i].due = now;
+		list->groups[i].next = 0;
+	}
+	epicsAtomicSetIntT(&list->stop, 0);
+	list->thread = epicsThreadCreate(list->name, epicsThreadPriorityHigh,
+		epicsThreadGetStackSize(epicsThreadStackMedium), modbus_ScanThread, list);
+	if(!list->thread)
+	{
+		epicsPrintf("%s:%u Failed to start thread for Modbus scan list %s\n", __FILE__, __LINE__, list->name);
+		return -1;
+	}
+	list->running = 1;
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_StopScanList
+// Purpose: Stop scanning, and wait for the last scans to
+// complete
+//======================================================//
+int modbus_StopScanList(modbus_scanlist_t* list)
+{
+	if(!list)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(!list->running)
+		return 0;
+	epicsAtomicSetIntT(&list->stop, 1);
+	epicsEventSignal(list->wake);
+	epicsEventMustWait(list->exit_event);
+	list->running = 0;
+	while(1)
+	{
+		epicsMutexMustLock(list->idle_lock);
+		int outstanding = epicsAtomicGetIntT(&list->outstanding);
+		epicsMutexUnlock(list->idle_lock);
+		if(outstanding == 0)
+			break;
+		epicsEventMustWait(list->idle_event);
+	}
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_GetScanBlock
+// Purpose: Copy the latest values of a block out of the
+// device's image
+//======================================================//
+int modbus_GetScanBlock(modbus_scanlist_t* list, int block, void* pOut, epicsTimeStamp* pTime)
+{
+	if(!list || block < 0 || block >= list->nblocks || !pOut)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_scanblock_t* b = list->blocks[block];
+	return modbus_ReadSegment(b->seg, 0, b->count, pOut, pTime, NULL);
+}
+
+//======================================================//
+// Name: modbus_ScanListOverruns
+// Purpose: Get the number of scans that were skipped
+//======================================================//
+int modbus_ScanListOverruns(modbus_scanlist_t* list)
+{
+	return list ? epicsAtomicGetIntT(&list->overruns) : -1;
+}
@@ -0,0 +1,368 @@
+//======================================================//
+// Name: drvModbusStats.c
+// Purpose: Always-on counters and latency histograms,
+// and the report that prints them
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* EPICS includes */
+#include <epicsStdio.h>
+#include <epicsAtomic.h>
+#include <iocsh.h>
+#include <epicsExport.h>
+
+static void modbus_SumStats(modbus_gateway_t* gateway, modbus_stats_t* pOut);
+static double modbus_SlotPercentile(const modbus_stats_t* pStats, int first, int last, double pct);
+static void modbus_ReportGateway(modbus_gateway_t* gateway, void* pArg);
+
+//======================================================//
+// Name: modbus_StatFunc
+// Purpose: Get the histogram slot of a function code
+//======================================================//
+int modbus_StatFunc(uint8_t func)
+{
+	switch(func & ~MB_ERRCODE_OFFSET)
+	{
+		case MB_RD_COILS_CODE: return 1;
+		case MB_RD_DISC_INPUTS_CODE: return 2;
+		case MB_RD_HOL_REG_CODE: return 3;
+		case MB_RD_INP_REG_CODE: return 4;
+		case MB_WR_SIN_COIL_CODE: return 5;
+		case MB_WR_SIN_REG_CODE: return 6;
+		case MB_WR_MUL_COIL_CODE: return 7;
+		case MB_WR_MULT_REG_CODE: return 8;
+		case MB_MSK_WRT_REG_CODE: return 9;
+		case MB_RW_MULT_REG_CODE: return 10;
+		default: return 0;
+	}
+}
+
+/* Lowest time in a histogram bucket, in microseconds */
+static double modbus_BucketStart(int bucket)
+{
+	if(bucket < 8)
+		return bucket;
+	int shift = bucket / 8 - 1;
+	return (double)((uint64_t)(8 + bucket % 8) << shift);
+}
+
+//======================================================//
+// Name: modbus_GetStats
+// Purpose: Get the stats of a device
+//======================================================//
+int modbus_GetStats(modbus_device_t* device, modbus_stats_t* pOut)
+{
+	if(!device || !pOut)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	/* What belongs to the connections rather than to any one unit comes from the gateway */
+	modbus_SumStats(device->gateway, pOut);
+	const modbus_stats_t* unit = device->gateway->units[device->unit_id];
+	pOut->requests = unit->requests;
+	pOut->responses = unit->responses;
+	pOut->timeouts = unit->timeouts;
+	pOut->errors = unit->errors;
+	pOut->bytes_out = unit->bytes_out;
+	memcpy(pOut->exceptions, unit->exceptions, sizeof(pOut->exceptions));
+	memcpy(pOut->latency, unit->latency, sizeof(pOut->latency));
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_GetGatewayStats
+// Purpose: Sum the stats of a device's gateway
+//======================================================//
+int modbus_GetGatewayStats(modbus_device_t* device, modbus_stats_t* pOut)
+{
+	if(!device || !pOut)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_SumStats(device->gateway, pOut);
+	return 0;
+}
+
+//======================================================//
+// Name: modbus_StatsPercentile
+// Purpose: Get a percentile of the round trip times
+//======================================================//
+double modbus_StatsPercentile(const modbus_stats_t* pStats, uint8_t func, double pct)
+{
+	if(!pStats || pct < 0 || pct > 100)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	if(func)
+		return modbus_SlotPercentile(pStats, modbus_StatFunc(func), modbus_StatFunc(func), pct);
+	return modbus_SlotPercentile(pStats, 0, MODBUS_STAT_FUNCS - 1, pct);
+}
+
+//======================================================//
+// Name: modbus_Report
+// Purpose: Print the stats of every gateway
+//======================================================//
+void modbus_Report(int level)
+{
+	epicsPrintf("%-24s %4s %10s %10s %8s %8s %8s %6s %9s %9s %9s %9s\n", "gateway", "devs", "requests", "responses",
+		"timeouts", "errors", "excepts", "conns", "inflight", "p50 ms", "p99 ms", "max ms");
+	modbus_ForEachGateway(modbus_ReportGateway, &level);
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+static void modbus_SumStats(modbus_gateway_t* gateway, modbus_stats_t* pOut)
+{
+	memset(pOut, 0, sizeof(modbus_stats_t));
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	epicsAtomicReadMemoryBarrier();
+	for(int i = 0; i < nConns; i++)
+	{
+		modbus_conn_t* conn = gateway->conns[i];
+		const modbus_stats_t* s = &conn->stats;
+		pOut->requests += s->requests;
+		pOut->responses += s->responses;
+		pOut->timeouts += s->timeouts;
+		pOut->errors += s->errors;
+		pOut->unmatched += s->unmatched;
+		for(int e = 0; e < 16; e++)
+			pOut->exceptions[e] += s->exceptions[e];
+		pOut->connects += s->connects;
+		pOut->bytes_out += s->bytes_out;
+		pOut->bytes_in += s->bytes_in;
+		pOut->inflight += epicsAtomicGetIntT(&conn->inflight);
+		pOut->peak_inflight += s->peak_inflight;
+		for(int f = 0; f < MODBUS_STAT_FUNCS; f++)
+			for(int b = 0; b < MODBUS_STAT_BUCKETS; b++)
+				pOut->latency[f][b] += s->latency[f][b];
+	}
+}
+
+/* Percentile over the histograms of slots first to last */
+static double modbus_SlotPercentile(const modbus_stats_t* pStats, int first, int last, double pct)
+{
+	epicsUInt64 total = 0;
+	for(int f = first; f <= last; f++)
+		for(int b = 0; b < MODBUS_STAT_BUCKETS; b++)
+			total += pStats->latency[f][b];
+	if(total == 0)
+		return -1;
+
+	/* The sample the percentile falls on, counting from 1 */
+	epicsUInt64 rank = (epicsUInt64)(pct / 100.0 * total + 0.999999);
+	if(rank < 1)
+		rank = 1;
+	epicsUInt64 seen = 0;
+	for(int b = 0; b < MODBUS_STAT_BUCKETS; b++)
+	{
+		for(int f = first; f <= last; f++)
+			seen += pStats->latency[f][b];
+		if(seen >= rank)
+			return (modbus_BucketStart(b) + modbus_BucketStart(b + 1)) / 2 * 1e-6;
+	}
+	return modbus_BucketStart(MODBUS_STAT_BUCKETS) * 1e-6;
+}
+
+/* Bucket a round trip time in ns goes in */
+static int modbus_StatBucket(epicsUInt64 ns)
+{
+	epicsUInt64 us = ns / 1000;
+	if(us < 8)
+		return (int)us;
+	int msb = 63 - __builtin_clzll(us);
+	int bucket = (msb - 2) * 8 + (int)((us >> (msb - 3)) & 7);
+	return bucket < MODBUS_STAT_BUCKETS ? bucket : MODBUS_STAT_BUCKETS - 1;
+}
+
+/* Counts a request going out in full. Engine thread only */
+void modbus_StatSent(modbus_conn_t* conn, modbus_txn_t* txn, epicsUInt64 now)
+{
+	txn->sent_at = now;
+	conn->stats.requests++;
+	conn->stats.bytes_out += txn->len;
+	int inflight = epicsAtomicGetIntT(&conn->inflight);
+	if(inflight > conn->stats.peak_inflight)
+		conn->stats.peak_inflight = inflight;
+	modbus_stats_t* unit = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&conn->units[txn->unit]);
+	if(unit)
+	{
+		unit->requests++;
+		unit->bytes_out += txn->len;
+	}
+}
+
+/* Counts one response in stats */
+static void modbus_CountResponse(modbus_stats_t* stats, int func, int bucket, int exception)
+{
+	stats->responses++;
+	if(exception >= 0)
+		stats->exceptions[exception]++;
+	stats->latency[func][bucket]++;
+}
+
+/* Counts the response to a request, before its slot is freed. Engine thread only */
+void modbus_StatResponse(modbus_conn_t* conn, modbus_txn_t* txn, const uint8_t* pPdu, size_t nLen)
+{
+	/* rx_at was taken when the bytes were read, which is as close as we can get */
+	epicsUInt64 ns = conn->rx_at > txn->sent_at ? conn->rx_at - txn->sent_at : 0;
+	int func = modbus_StatFunc(txn->func);
+	int bucket = modbus_StatBucket(ns);
+	int exception = -1;
+	if(pPdu[0] & MB_ERRCODE_OFFSET)
+		exception = nLen > 1 && pPdu[1] < 16 ? pPdu[1] : 0;
+	modbus_CountResponse(&conn->stats, func, bucket, exception);
+	modbus_stats_t* unit = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&conn->units[txn->unit]);
+	if(unit)
+		modbus_CountResponse(unit, func, bucket, exception);
+}
+
+/* Counts a request that failed without a response. Engine thread only */
+void modbus_StatFailed(modbus_conn_t* conn, modbus_txn_t* txn, int status)
+{
+	modbus_stats_t* unit = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&conn->units[txn->unit]);
+	if(status == MODBUS_STATUS_TIMEOUT)
+	{
+		conn->stats.timeouts++;
+		if(unit)
+			unit->timeouts++;
+	}
+	else
+	{
+		conn->stats.errors++;
+		if(unit)
+			unit->errors++;
+	}
+}
+
+/* Seconds as ms for the report, or - if there's nothing to go by */
+static void modbus_FormatMs(char* pBuf, double seconds)
+{
+	if(seconds < 0)
+		strcpy(pBuf, "-");
+	else
+		sprintf(pBuf, "%.3f", seconds * 1e3);
+}
+
+static void modbus_ReportGateway(modbus_gateway_t* gateway, void* pArg)
+{
+	int level = *(int*)pArg;
+	char name[MODBUS_MAX_PORT_NAME];
+	if(gateway->port[0])
+		strcpy(name, gateway->port);
+	else
+		ipAddrToDottedIP(&gateway->addr, name, sizeof(name));
+
+	modbus_stats_t* stats = malloc(sizeof(modbus_stats_t));
+	if(!stats)
+		return;
+	modbus_SumStats(gateway, stats);
+
+	epicsUInt64 excepts = 0;
+	for(int e = 0; e < 16; e++)
+		excepts += stats->exceptions[e];
+	char p50[16], p99[16], max[16];
+	modbus_FormatMs(p50, modbus_SlotPercentile(stats, 0, MODBUS_STAT_FUNCS - 1, 50));
+	modbus_FormatMs(p99, modbus_SlotPercentile(stats, 0, MODBUS_STAT_FUNCS - 1, 99));
+	modbus_FormatMs(max, modbus_SlotPercentile(stats, 0, MODBUS_STAT_FUNCS - 1, 100));
+	epicsPrintf("%-24s %4d %10llu %10llu %8llu %8llu %8llu %6llu %4d/%-4d %9s %9s %9s\n", name, gateway->refs,
+		(unsigned long long)stats->requests, (unsigned long long)stats->responses,
+		(unsigned long long)stats->timeouts, (unsigned long long)stats->errors, (unsigned long long)excepts,
+		(unsigned long long)stats->connects, stats->inflight, stats->peak_inflight, p50, p99, max);
+
+	if(level >= 1)
+	{
+		/* Same columns as the gateway, for the units sharing its connections */
+		for(int u = 0; u < 256; u++)
+		{
+			const modbus_stats_t* unit = epicsAtomicGetPtrT((EpicsAtomicPtrT*)&gateway->units[u]);
+			if(!unit)
+				continue;
+			epicsUInt64 unitExcepts = 0;
+			for(int e = 0; e < 16; e++)
+				unitExcepts += unit->exceptions[e];
+			char label[16];
+			sprintf(label, "unit %d", u);
+			modbus_FormatMs(p50, modbus_SlotPercentile(unit, 0, MODBUS_STAT_FUNCS - 1, 50));
+			modbus_FormatMs(p99, modbus_SlotPercentile(unit, 0, MODBUS_STAT_FUNCS - 1, 99));
+			modbus_FormatMs(max, modbus_SlotPercentile(unit, 0, MODBUS_STAT_FUNCS - 1, 100));
+			epicsPrintf("  %-22s %4s %10llu %10llu %8llu %8llu %8llu %6s %9s %9s %9s %9s\n", label, "",
+				(unsigned long long)unit->requests, (unsigned long long)unit->responses,
+				(unsigned long long)unit->timeouts, (unsigned long long)unit->errors,
+				(unsigned long long)unitExcepts, "", "", p50, p99, max);
+		}
+		epicsPrintf("    bytes out %llu, in %llu, unmatched responses %llu\n", (unsigned long long)stats->bytes_out,
+			(unsigned long long)stats->bytes_in, (unsigned long long)stats->unmatched);
+		int nConns = epicsAtomicGetIntT(&gateway->nconns);
+		epicsPrintf("    window");
+		for(int i = 0; i < nConns; i++)
+		{
+			modbus_conn_t* conn = gateway->conns[i];
+			epicsPrintf(" %d", epicsAtomicGetIntT(&conn->window));
+			/* The bounds an adaptive window moves between */
+			if(conn->adapt)
+				epicsPrintf(" (%d-%d)", conn->adapt_min, conn->adapt_max);
+		}
+		epicsPrintf("\n");
+		/* Slot 0 is every function code without a slot of its own */
+		static const uint8_t funcs[MODBUS_STAT_FUNCS] = {0, MB_RD_COILS_CODE, MB_RD_DISC_INPUTS_CODE,
+			MB_RD_HOL_REG_CODE, MB_RD_INP_REG_CODE, MB_WR_SIN_COIL_CODE, MB_WR_SIN_REG_CODE, MB_WR_MUL_COIL_CODE,
+			MB_WR_MULT_REG_CODE, MB_MSK_WRT_REG_CODE, MB_RW_MULT_REG_CODE};
+		for(int f = 0; f < MODBUS_STAT_FUNCS; f++)
+		{
+			epicsUInt64 n = 0;
+			for(int b = 0; b < MODBUS_STAT_BUCKETS; b++)
+				n += stats->latency[f][b];
+			if(n == 0)
+				continue;
+			char label[16];
+			if(f)
+				sprintf(label, "fc 0x%02X", funcs[f]);
+			else
+				strcpy(label, "other");
+			epicsPrintf("    %-8s %10llu responses, p50 %.3f p90 %.3f p99 %.3f max %.3f ms\n", label,
+				(unsigned long long)n, modbus_SlotPercentile(stats, f, f, 50) * 1e3,
+				modbus_SlotPercentile(stats, f, f, 90) * 1e3, modbus_SlotPercentile(stats, f, f, 99) * 1e3,
+				modbus_SlotPercentile(stats, f, f, 100) * 1e3);
+		}
+	}
+	if(level >= 2 && excepts)
+	{
+		epicsPrintf("    exceptions:");
+		for(int e = 1; e < 16; e++)
+			if(stats->exceptions[e])
+				epicsPrintf(" 0x%02X x%llu", e, (unsigned long long)stats->exceptions[e]);
+		if(stats->exceptions[0])
+			epicsPrintf(" other x%llu", (unsigned long long)stats->exceptions[0]);
+		epicsPrintf("\n");
+	}
+	free(stats);
+}
+
+/* IOC shell command */
+static const iocshArg g_ReportArg0 = {"level", iocshArgInt};
+static const iocshArg* const g_ReportArgs[] = {&g_ReportArg0};
+static const iocshFuncDef g_ReportDef = {"modbusReport", 1, g_ReportArgs};
+
+static void modbus_ReportCall(const iocshArgBuf* args)
+{
+	modbus_Report(args[0].ival);
+}
+
+/* Registers modbusReport with the IOC shell. The IOC's dbd has to include modbusSupport.dbd for this to run */
+static void modbusRegister(void)
+{
+	iocshRegister(&g_ReportDef, modbus_ReportCall);
+}
+epicsExportRegistrar(modbusRegister);
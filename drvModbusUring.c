@@ -0,0 +1,326 @@
+//======================================================//
+// Name: drvModbusUring.c
+// Purpose: io_uring for the engine, straight on top of
+// the system calls
+//======================================================//
+#include "drvModbusInt.h"
+
+#ifdef MODBUS_USE_IO_URING
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* Receive buffers per ring, and the size of each. A receive never fills more than one */
+#define MODBUS_URING_BUFS 128
+#define MODBUS_URING_BUF_SIZE 1024
+/* Group the receive buffers are registered as */
+#define MODBUS_URING_GROUP 0
+
+static int modbus_UringProbe(int fd);
+static struct io_uring_sqe* modbus_UringSqe(modbus_uring_t* ring);
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Sets up a ring with room for entries submissions, and registers its receive buffers */
+/* Returns 0 if OK, or -1 if the kernel can't do everything the engine needs */
+int modbus_UringInit(modbus_uring_t* ring, unsigned entries)
+{
+	memset(ring, 0, sizeof(modbus_uring_t));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(struct io_uring_params));
+	/* Every connection can have a receive and a send outstanding, so completions outnumber submissions */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * entries;
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if(ring->fd < 0)
+		return -1;
+	/* Waits need a timeout (EXT_ARG), and completions must never be dropped when the ring is full (NODROP) */
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) || modbus_UringProbe(ring->fd) < 0)
+		goto fail;
+
+	ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(ring->cq_map_len > ring->sq_map_len)
+			ring->sq_map_len = ring->cq_map_len;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQ_RING);
+	if(ring->sq_map == MAP_FAILED)
+	{
+		ring->sq_map = NULL;
+		goto fail;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_map = ring->sq_map;
+	else
+	{
+		ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+		if(ring->cq_map == MAP_FAILED)
+		{
+			ring->cq_map = NULL;
+			goto fail;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	uint8_t* sq = ring->sq_map;
+	ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_next = *ring->sq_tail;
+	/* Submission i always sits in slot i, so the index array never changes */
+	for(unsigned i = 0; i < p.sq_entries; i++)
+		ring->sq_array[i] = i;
+	uint8_t* cq = ring->cq_map;
+	ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	/* The buffer ring has to be page aligned, which mmap takes care of */
+	ring->bufs_len = MODBUS_URING_BUFS * sizeof(struct io_uring_buf);
+	ring->bufs = mmap(NULL, ring->bufs_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring->bufs == MAP_FAILED)
+	{
+		ring->bufs = NULL;
+		goto fail;
+	}
+	ring->buf_data = malloc(MODBUS_URING_BUFS * MODBUS_URING_BUF_SIZE);
+	if(!ring->buf_data)
+		goto fail;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->bufs;
+	reg.ring_entries = MODBUS_URING_BUFS;
+	reg.bgid = MODBUS_URING_GROUP;
+	if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for(unsigned i = 0; i < MODBUS_URING_BUFS; i++)
+		modbus_UringRecycle(ring, i);
+	return 0;
+
+fail:
+	modbus_UringDestroy(ring);
+	return -1;
+}
+
+void modbus_UringDestroy(modbus_uring_t* ring)
+{
+	if(ring->fd >= 0)
+		close(ring->fd);
+	if(ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if(ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+	if(ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_len);
+	if(ring->bufs)
+		munmap(ring->bufs, ring->bufs_len);
+	free(ring->buf_data);
+	memset(ring, 0, sizeof(modbus_uring_t));
+	ring->fd = -1;
+}
+
+/* Hands everything filled in since the last call to the kernel in one go, then waits up to timeout_ms */
+/* (-1 for forever) for a completion, unless one's already waiting */
+/* Returns 0 if OK (including if it timed out), or -1 on error */
+int modbus_UringEnter(modbus_uring_t* ring, int timeout_ms)
+{
+	__atomic_store_n(ring->sq_tail, ring->sq_next, __ATOMIC_RELEASE);
+	unsigned submit = ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned wait = timeout_ms != 0 && !modbus_UringPeek(ring);
+
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+	if(wait && timeout_ms > 0)
+	{
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	/* GETEVENTS even without waiting, so completions that overflowed the ring get moved onto it */
+	int result = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg));
+	if(result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+/* Returns the oldest completion, or NULL if there are none. It stays put until modbus_UringAdvance */
+struct io_uring_cqe* modbus_UringPeek(modbus_uring_t* ring)
+{
+	unsigned head = *ring->cq_head;
+	if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void modbus_UringAdvance(modbus_uring_t* ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the receive buffer a completion says it filled */
+const uint8_t* modbus_UringBuffer(modbus_uring_t* ring, unsigned bid)
+{
+	return ring->buf_data + (size_t)bid * MODBUS_URING_BUF_SIZE;
+}
+
+/* Gives a receive buffer back to the kernel */
+void modbus_UringRecycle(modbus_uring_t* ring, unsigned bid)
+{
+	struct io_uring_buf* buf = &ring->bufs->bufs[ring->buf_tail & (MODBUS_URING_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ring->buf_data + (size_t)bid * MODBUS_URING_BUF_SIZE);
+	buf->len = MODBUS_URING_BUF_SIZE;
+	buf->bid = (uint16_t)bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* The rest fill in one submission each, and return 0 if OK or -1 if the ring couldn't take it */
+
+/* Waits for fd to be ready for mask (poll(2) bits). A multishot poll keeps reporting until it's removed */
+int modbus_UringPoll(modbus_uring_t* ring, int fd, uint32_t mask, int multishot, uint64_t tag)
+{
+	struct io_uring_sqe* sqe = modbus_UringSqe(ring);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = tag;
+	return 0;
+}
+
+/* Changes what a multishot poll waits for. Its own completion carries a tag of 0 */
+int modbus_UringPollUpdate(modbus_uring_t* ring, uint32_t mask, uint64_t tag)
+{
+	struct io_uring_sqe* sqe = modbus_UringSqe(ring);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = tag;
+	sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = mask;
+	sqe->user_data = 0;
+	return 0;
+}
+
+/* Stops a poll. The poll itself completes with -ECANCELED */
+int modbus_UringPollRemove(modbus_uring_t* ring, uint64_t tag)
+{
+	struct io_uring_sqe* sqe = modbus_UringSqe(ring);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = tag;
+	sqe->user_data = 0;
+	return 0;
+}
+
+/* Cancels a receive or send, which then completes with -ECANCELED if it hadn't already finished */
+int modbus_UringCancel(modbus_uring_t* ring, uint64_t tag)
+{
+	struct io_uring_sqe* sqe = modbus_UringSqe(ring);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = tag;
+	sqe->user_data = 0;
+	return 0;
+}
+
+/* Receives into whichever buffer the kernel picks, over and over until it fails or is cancelled */
+int modbus_UringRecv(modbus_uring_t* ring, int fd, uint64_t tag)
+{
+	struct io_uring_sqe* sqe = modbus_UringSqe(ring);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = MODBUS_URING_GROUP;
+	sqe->user_data = tag;
+	return 0;
+}
+
+/* msg has to stay put until the send completes */
+int modbus_UringSendmsg(modbus_uring_t* ring, int fd, const struct msghdr* msg, uint64_t tag)
+{
+	struct io_uring_sqe* sqe = modbus_UringSqe(ring);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = tag;
+	return 0;
+}
+
+/* Checks the kernel knows every op the engine uses */
+static int modbus_UringProbe(int fd)
+{
+	static const int ops[] = {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ASYNC_CANCEL, IORING_OP_RECV,
+		IORING_OP_SENDMSG};
+	size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = calloc(1, len);
+	if(!probe)
+		return -1;
+	int result = (int)syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+	for(size_t i = 0; result >= 0 && i < sizeof(ops) / sizeof(ops[0]); i++)
+	{
+		if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			result = -1;
+	}
+	free(probe);
+	return result < 0 ? -1 : 0;
+}
+
+/* Returns a zeroed submission to fill in, or NULL if the ring is full even after handing it to the kernel */
+static struct io_uring_sqe* modbus_UringSqe(modbus_uring_t* ring)
+{
+	if(ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+	{
+		/* Full. Submit what's there without waiting, and the kernel will have made room */
+		modbus_UringEnter(ring, 0);
+		if(ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+			return NULL;
+	}
+	struct io_uring_sqe* sqe = &ring->sqes[ring->sq_next & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_next++;
+	return sqe;
+}
+
+#endif
@@ -0,0 +1,135 @@
+//======================================================//
+// Name: drvModbusWindow.c
+// Purpose: Adaptive windows. Grows and shrinks the number
+// of requests outstanding on a connection with how the
+// device copes (AIMD)
+//======================================================//
+#include "drvModbusInt.h"
+
+/* Standard includes */
+#include <stdint.h>
+#include <stddef.h>
+
+/* EPICS includes */
+#include <epicsMutex.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
+
+//======================================================//
+// Name: modbus_SetAdaptiveWindow
+// Purpose: Let the window size itself to the device
+//======================================================//
+int modbus_SetAdaptiveWindow(modbus_device_t* device, int minWindow, int maxWindow)
+{
+	if(!device || minWindow < 1 || maxWindow < minWindow || maxWindow > MODBUS_MAX_INFLIGHT)
+	{
+		LOG_ERROR("Invalid parameter passed.");
+		return -1;
+	}
+	modbus_gateway_t* gateway = device->gateway;
+	if(gateway->port[0])
+	{
+		LOG_ERROR("A serial line's window can't adapt.");
+		return -1;
+	}
+	int nConns = epicsAtomicGetIntT(&gateway->nconns);
+	for(int i = 0; i < nConns; i++)
+	{
+		modbus_conn_t* conn = gateway->conns[i];
+		epicsMutexMustLock(conn->tx_lock);
+		int window = epicsAtomicGetIntT(&conn->window);
+		if(window < minWindow)
+			window = minWindow;
+		if(window > maxWindow)
+			window = maxWindow;
+		conn->adapt = 1;
+		conn->adapt_min = minWindow;
+		conn->adapt_max = maxWindow;
+		conn->cwnd = window;
+		conn->rtt_min = conn->rtt_prev = conn->rtt_epoch = 0;
+		conn->cut_at = 0;
+		epicsAtomicSetIntT(&conn->window, window);
+		epicsMutexUnlock(conn->tx_lock);
+		modbus_WakeWaiters(conn);
+	}
+	return 0;
+}
+
+//======================================================//
+// MODBUS INTERNAL FUNCTIONS. NO DOCUMENTATION WILL BE
+// PROVIDED
+//======================================================//
+
+/* Rounds cwnd down into the window everyone else goes by */
+/* Freed slots are only handed on one for one, so submitters waiting on a slot are woken when it grows */
+static void modbus_AdaptApply(modbus_conn_t* conn)
+{
+	if(conn->cwnd < conn->adapt_min)
+		conn->cwnd = conn->adapt_min;
+	if(conn->cwnd > conn->adapt_max)
+		conn->cwnd = conn->adapt_max;
+	int window = (int)conn->cwnd;
+	int grew = window > epicsAtomicGetIntT(&conn->window);
+	epicsAtomicSetIntT(&conn->window, window);
+	if(grew && epicsAtomicGetIntT(&conn->waiters) > 0)
+		modbus_WakeWaiters(conn);
+}
+
+/* Shrinks the window by factor, unless it's already been cut since txn went out */
+/* Only once per round trip, since whatever else is outstanding was sent with the old window */
+static void modbus_AdaptCut(modbus_conn_t* conn, const modbus_txn_t* txn, double factor)
+{
+	if(txn && txn->sent_at <= conn->cut_at)
+		return;
+	conn->cwnd *= factor;
+	conn->cut_at = epicsMonotonicGet();
+	modbus_AdaptApply(conn);
+}
+
+/* Counts a response to txn, before its slot is freed. Engine thread, with tx_lock held */
+void modbus_AdaptResponse(modbus_conn_t* conn, modbus_txn_t* txn, const uint8_t* pPdu, size_t nLen)
+{
+	if(!conn->adapt)
+		return;
+	if((pPdu[0] & MB_ERRCODE_OFFSET) && nLen > 1 &&
+		(pPdu[1] == MODBUS_ERR_DEVICE_BUSY || pPdu[1] == MODBUS_ERR_GATEWAY_UNRESP))
+	{
+		modbus_AdaptCut(conn, txn, MODBUS_ADAPT_BACKOFF);
+		return;
+	}
+
+	/* Lowest round trip over the last epoch or two, so it can come back up if the route to the device changes */
+	epicsUInt64 rtt = conn->rx_at > txn->sent_at ? conn->rx_at - txn->sent_at : 0;
+	if(conn->rx_at - conn->rtt_epoch > (epicsUInt64)(MODBUS_ADAPT_RTT_EPOCH * 1e9))
+	{
+		conn->rtt_prev = conn->rtt_min;
+		conn->rtt_min = rtt;
+		conn->rtt_epoch = conn->rx_at;
+	}
+	else if(rtt < conn->rtt_min)
+		conn->rtt_min = rtt;
+	epicsUInt64 base = conn->rtt_prev && conn->rtt_prev < conn->rtt_min ? conn->rtt_prev : conn->rtt_min;
+
+	/* The device is lining requests up rather than working on them side by side */
+	if(rtt > base * MODBUS_ADAPT_LATENCY_FACTOR + (epicsUInt64)(MODBUS_ADAPT_LATENCY_SLACK * 1e9))
+	{
+		modbus_AdaptCut(conn, txn, MODBUS_ADAPT_EASE);
+		return;
+	}
+
+	/* Only grow while the window is what's holding requests back. This one still counts as in flight */
+	if(epicsAtomicGetIntT(&conn->inflight) < epicsAtomicGetIntT(&conn->window))
+		return;
+	conn->cwnd += 1.0 / conn->cwnd;
+	modbus_AdaptApply(conn);
+}
+
+/* Counts a request that failed without a response, before its slot is freed. txn is NULL if the connection */
+/* dropped. Engine thread, with tx_lock held */
+void modbus_AdaptFailed(modbus_conn_t* conn, modbus_txn_t* txn, int status)
+{
+	if(!conn->adapt)
+		return;
+	if(!txn || status == MODBUS_STATUS_TIMEOUT)
+		modbus_AdaptCut(conn, txn, MODBUS_ADAPT_BACKOFF);
+}